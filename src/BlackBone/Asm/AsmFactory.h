@@ -5,10 +5,20 @@
 #include "AsmHelper64.h"
 #include "AsmHelper32.h"
 
+#include <vector>
+
 namespace blackbone
 {
 
-using AsmHelperPtr = std::unique_ptr<IAsmHelper>;
+/// <summary>
+/// Returns assembler into per-thread pool instead of destroying it
+/// </summary>
+struct AsmHelperRecycler
+{
+    inline void operator()( IAsmHelper* pAsm ) const;
+};
+
+using AsmHelperPtr = std::unique_ptr<IAsmHelper, AsmHelperRecycler>;
 
 /// <summary>
 /// Get suitable asm generator
@@ -29,15 +39,22 @@ public:
     /// <returns>AsmHelperBase interface</returns>
     static AsmHelperPtr GetAssembler( eAsmArch arch )
     {
-        switch (arch)
-        {
-        case asm32:
-            return std::make_unique<AsmHelper32>();
-        case asm64:
-            return std::make_unique<AsmHelper64>();
-        default:
+        if (arch != asm32 && arch != asm64)
             return nullptr;
+
+        // Reuse assembler released by this thread
+        auto& pool = Pool( arch );
+        if (!pool.empty())
+        {
+            AsmHelperPtr pAsm( pool.back().release() );
+            pool.pop_back();
+            return pAsm;
         }
+
+        if (arch == asm32)
+            return AsmHelperPtr( new AsmHelper32() );
+        else
+            return AsmHelperPtr( new AsmHelper64() );
     }
 
     /// <summary>
@@ -79,11 +96,48 @@ public:
     static AsmHelperPtr GetAssembler()
     {
 #ifdef USE64
-        return std::make_unique<AsmHelper64>();
+        return GetAssembler( asm64 );
 #else
-        return std::make_unique<AsmHelper32>();
+        return GetAssembler( asm32 );
 #endif
     }
+
+    /// <summary>
+    /// Reset assembler and keep it for reuse by current thread
+    /// </summary>
+    /// <param name="pAsm">Assembler to release</param>
+    static void Recycle( IAsmHelper* pAsm )
+    {
+        auto& pool = Pool( pAsm->assembler()->getArch() == asmjit::kArchX86 ? asm32 : asm64 );
+        if (pool.size() >= MaxPooled)
+        {
+            delete pAsm;
+            return;
+        }
+
+        pAsm->reset();
+        pool.emplace_back( pAsm );
+    }
+
+private:
+    // Max idle assemblers per thread and architecture
+    static constexpr size_t MaxPooled = 4;
+
+    /// <summary>
+    /// Get idle assemblers of current thread
+    /// </summary>
+    /// <param name="arch">CPU architecture</param>
+    /// <returns>Assembler pool</returns>
+    static std::vector<std::unique_ptr<IAsmHelper>>& Pool( eAsmArch arch )
+    {
+        thread_local std::vector<std::unique_ptr<IAsmHelper>> pools[2];
+        return pools[arch];
+    }
 };
 
+inline void AsmHelperRecycler::operator()( IAsmHelper* pAsm ) const
+{
+    AsmFactory::Recycle( pAsm );
+}
+
 }
\ No newline at end of file
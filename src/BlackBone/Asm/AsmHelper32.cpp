@@ -142,20 +142,12 @@ void AsmHelper32::ExitThreadWithStatus( uint64_t pExitThread, uint64_t resultPtr
 }
 
 /// <summary>
-/// Save return value and signal thread return event
+/// Save return value and last NT status
 /// </summary>
-/// <param name="pSetEvent">NtSetEvent address</param>
 /// <param name="ResultPtr">Result value memory location</param>
-/// <param name="EventPtr">Event memory location</param>
 /// <param name="errPtr">Error code memory location</param>
 /// <param name="rtype">Return type</param>
-void AsmHelper32::SaveRetValAndSignalEvent( 
-    uint64_t pSetEvent,
-    uint64_t ResultPtr,
-    uint64_t EventPtr,
-    uint64_t errPtr,
-    eReturnType rtype /*= rt_int32*/ 
-    )
+void AsmHelper32::SaveRetVal( uint64_t ResultPtr, uint64_t errPtr, eReturnType rtype /*= rt_int32*/ )
 {
     _assembler.mov( asmjit::host::ecx, ResultPtr );
 
@@ -174,6 +166,25 @@ void AsmHelper32::SaveRetValAndSignalEvent(
     _assembler.mov( asmjit::host::edx, asmjit::host::dword_ptr( asmjit::host::edx ) );
     _assembler.mov( asmjit::host::eax, errPtr );
     _assembler.mov( asmjit::host::dword_ptr( asmjit::host::eax ), asmjit::host::edx );
+}
+
+/// <summary>
+/// Save return value and signal thread return event
+/// </summary>
+/// <param name="pSetEvent">NtSetEvent address</param>
+/// <param name="ResultPtr">Result value memory location</param>
+/// <param name="EventPtr">Event memory location</param>
+/// <param name="errPtr">Error code memory location</param>
+/// <param name="rtype">Return type</param>
+void AsmHelper32::SaveRetValAndSignalEvent( 
+    uint64_t pSetEvent,
+    uint64_t ResultPtr,
+    uint64_t EventPtr,
+    uint64_t errPtr,
+    eReturnType rtype /*= rt_int32*/ 
+    )
+{
+    SaveRetVal( ResultPtr, errPtr, rtype );
 
     // SetEvent(hEvent)
     // NtSetEvent(hEvent, NULL)
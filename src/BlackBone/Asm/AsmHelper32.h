@@ -42,6 +42,14 @@ public:
     /// <param name="resultPtr">Memry where eax value will be saved</param>
     virtual void ExitThreadWithStatus( uint64_t pExitThread, uint64_t resultPtr );
 
+    /// <summary>
+    /// Save return value and last NT status
+    /// </summary>
+    /// <param name="ResultPtr">Result value memory location</param>
+    /// <param name="errPtr">Error code memory location</param>
+    /// <param name="rtype">Return type</param>
+    virtual void SaveRetVal( uint64_t ResultPtr, uint64_t errPtr, eReturnType rtype = rt_int32 );
+
     /// <summary>
     /// Save return value and signal thread return event
     /// </summary>
@@ -123,20 +123,12 @@ void AsmHelper64::ExitThreadWithStatus( uint64_t pExitThread, uint64_t resultPtr
 }
 
 /// <summary>
-/// Save return value and signal thread return event
+/// Save return value and last NT status
 /// </summary>
-/// <param name="pSetEvent">NtSetEvent address</param>
 /// <param name="ResultPtr">Result value memory location</param>
-/// <param name="EventPtr">Event memory location</param>
 /// <param name="errPtr">Error code memory location</param>
 /// <param name="rtype">Return type</param>
-void AsmHelper64::SaveRetValAndSignalEvent( 
-    uint64_t pSetEvent,
-    uint64_t ResultPtr,
-    uint64_t EventPtr,
-    uint64_t lastStatusPtr,
-    eReturnType rtype /*= rt_int32*/ 
-    )
+void AsmHelper64::SaveRetVal( uint64_t ResultPtr, uint64_t errPtr, eReturnType rtype /*= rt_int32*/ )
 {
     _assembler.mov( asmjit::host::rcx, ResultPtr );
 
@@ -148,8 +140,27 @@ void AsmHelper64::SaveRetValAndSignalEvent(
     _assembler.mov( asmjit::host::rdx, asmjit::host::dword_ptr_abs( 0x30 ).setSegment( asmjit::host::gs ) );    // TEB ptr
     _assembler.add( asmjit::host::rdx, 0x598 + 0x197 * sizeof( uint64_t ) );
     _assembler.mov( asmjit::host::rdx, asmjit::host::dword_ptr( asmjit::host::rdx ) );
-    _assembler.mov( asmjit::host::rax, lastStatusPtr );
+    _assembler.mov( asmjit::host::rax, errPtr );
     _assembler.mov( asmjit::host::dword_ptr( asmjit::host::rax ), asmjit::host::rdx );
+}
+
+/// <summary>
+/// Save return value and signal thread return event
+/// </summary>
+/// <param name="pSetEvent">NtSetEvent address</param>
+/// <param name="ResultPtr">Result value memory location</param>
+/// <param name="EventPtr">Event memory location</param>
+/// <param name="errPtr">Error code memory location</param>
+/// <param name="rtype">Return type</param>
+void AsmHelper64::SaveRetValAndSignalEvent( 
+    uint64_t pSetEvent,
+    uint64_t ResultPtr,
+    uint64_t EventPtr,
+    uint64_t lastStatusPtr,
+    eReturnType rtype /*= rt_int32*/ 
+    )
+{
+    SaveRetVal( ResultPtr, lastStatusPtr, rtype );
 
     // NtSetEvent(hEvent, NULL)
     _assembler.mov( asmjit::host::rax, EventPtr );
@@ -172,6 +183,15 @@ void AsmHelper64::EnableX64CallStack( bool state )
     _stackEnabled = state;
 }
 
+/// <summary>
+/// Discard generated code and restore default stack policy
+/// </summary>
+void AsmHelper64::reset()
+{
+    IAsmHelper::reset();
+    _stackEnabled = true;
+}
+
 /// <summary>
 /// Push function argument
 /// </summary>
@@ -40,6 +40,14 @@ public:
     /// <param name="resultPtr">Memry where rax value will be saved</param>
     virtual void ExitThreadWithStatus( uint64_t pExitThread, uint64_t resultPtr );
 
+    /// <summary>
+    /// Save return value and last NT status
+    /// </summary>
+    /// <param name="ResultPtr">Result value memory location</param>
+    /// <param name="errPtr">Error code memory location</param>
+    /// <param name="rtype">Return type</param>
+    virtual void SaveRetVal( uint64_t ResultPtr, uint64_t errPtr, eReturnType rtype = rt_int32 );
+
     /// <summary>
     /// Save return value and signal thread return event
     /// </summary>
@@ -65,6 +73,11 @@ public:
     /// </param>
     virtual void EnableX64CallStack( bool state );
 
+    /// <summary>
+    /// Discard generated code and restore default stack policy
+    /// </summary>
+    virtual void reset();
+
 private:
     AsmHelper64( const AsmHelper64& ) = delete;
     AsmHelper64& operator = (const AsmHelper64&) = delete;
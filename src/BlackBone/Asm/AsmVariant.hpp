@@ -28,6 +28,9 @@ struct AsmVariant
     template<typename T>
     static constexpr bool is_void_ptr = (std::is_pointer_v<T> && std::is_void_v<cleanup_t<T>>);
 
+    template<typename T>
+    static constexpr bool is_const_ptr = std::is_const_v<std::remove_pointer_t<T>>;
+
     enum eType
     {
         noarg,          // void
@@ -57,11 +60,13 @@ struct AsmVariant
         else if constexpr(is_string_ptr<RAW_T, char>)
         {
             set( dataPtr, strlen( arg ) + 1, reinterpret_cast<uint64_t>(arg) );
+            readOnly = is_const_ptr<RAW_T>;
         }
         // wchar_t*, const wchar_t*, wchar[], etc.
         else if constexpr(is_string_ptr<RAW_T, wchar_t>)
         {
             set( dataPtr, (wcslen( arg ) + 1) * sizeof( wchar_t ), reinterpret_cast<uint64_t>(arg) );
+            readOnly = is_const_ptr<RAW_T>;
         }
         // void*, const void*, etc.
         else if constexpr(is_void_ptr<RAW_T>)
@@ -82,6 +87,7 @@ struct AsmVariant
         else if constexpr(std::is_pointer_v<RAW_T>)
         {
             set( dataPtr, sizeof( cleanup_t<RAW_T> ), reinterpret_cast<uint64_t>(arg) );
+            readOnly = is_const_ptr<RAW_T>;
         }
         // Arbitrary variable passed by value
         // Can fit into register
@@ -104,7 +110,8 @@ struct AsmVariant
     explicit AsmVariant( T* ptr, size_t size_ )
         : type( dataPtr )
         , size( size_ )
-        , imm_val64( reinterpret_cast<uint64_t>(ptr) ) { }
+        , imm_val64( reinterpret_cast<uint64_t>(ptr) )
+        , readOnly( std::is_const_v<T> ) { }
 
     BLACKBONE_API AsmVariant( float _imm_fpu )
         : type( imm_float )
@@ -136,9 +143,39 @@ struct AsmVariant
     BLACKBONE_API AsmVariant( const asmjit::Mem* _mem )
         : AsmVariant( const_cast<asmjit::Mem*>(_mem) ) { }
 
-    BLACKBONE_API AsmVariant( const AsmVariant& ) = default;
+    // Structure copy must reference its own value buffer
+    BLACKBONE_API AsmVariant( const AsmVariant& other )
+        : type( other.type )
+        , size( other.size )
+        , reg_val( other.reg_val )
+        , mem_val( other.mem_val )
+        , imm_val64( other.imm_val64 )
+        , new_imm_val( other.new_imm_val )
+        , readOnly( other.readOnly )
+        , buf( other.buf )
+    {
+        if (type == dataStruct)
+            imm_val64 = reinterpret_cast<uint64_t>(buf.data());
+    }
+
     BLACKBONE_API AsmVariant( AsmVariant&& ) = default;
-    BLACKBONE_API AsmVariant& operator =( const AsmVariant& ) = default;
+
+    BLACKBONE_API AsmVariant& operator =( const AsmVariant& other )
+    {
+        type = other.type;
+        size = other.size;
+        reg_val = other.reg_val;
+        mem_val = other.mem_val;
+        imm_val64 = other.imm_val64;
+        new_imm_val = other.new_imm_val;
+        readOnly = other.readOnly;
+        buf = other.buf;
+
+        if (type == dataStruct)
+            imm_val64 = reinterpret_cast<uint64_t>(buf.data());
+
+        return *this;
+    }
 
     //
     // Get floating point value as raw data
@@ -183,6 +220,7 @@ struct AsmVariant
     };
 
     uint64_t new_imm_val = 0;       // Replaced immediate value for dataPtr type
+    bool readOnly = false;          // dataPtr points to const data, which is never updated after call
     std::vector<std::byte> buf;     // Value buffer
 };
 
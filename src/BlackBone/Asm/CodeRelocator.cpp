@@ -0,0 +1,208 @@
+#include "CodeRelocator.h"
+#include "LDasm.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Copy instructions until at least minSize bytes are moved and append jump to the rest of original code
+/// </summary>
+/// <param name="code">Original code</param>
+/// <param name="size">Original code buffer size</param>
+/// <param name="src">Original code address</param>
+/// <param name="dst">New code address</param>
+/// <param name="minSize">Minimal number of bytes to move</param>
+/// <param name="x64">64 bit code</param>
+/// <param name="result">Relocated code</param>
+/// <param name="offsets">
+/// Original and relocated offset of each moved instruction.
+/// Last pair maps end of moved code to the jump back
+/// </param>
+/// <returns>Number of original bytes moved</returns>
+call_result_t<size_t> CodeRelocator::Relocate(
+    const uint8_t* code,
+    size_t size,
+    ptr_t src,
+    ptr_t dst,
+    size_t minSize,
+    bool x64,
+    std::vector<uint8_t>& result,
+    std::vector<std::pair<size_t, size_t>>* offsets /*= nullptr*/
+    )
+{
+    size_t moved = 0;
+    result.clear();
+    if (offsets)
+        offsets->clear();
+
+    while (moved < minSize)
+    {
+        ldasm_data ld = { 0 };
+        const uint8_t* pInstr = code + moved;
+        uint32_t len = moved < size ? ldasm( const_cast<uint8_t*>(pInstr), &ld, x64 ) : 0;
+        if (len == 0 || (ld.flags & F_INVALID) || moved + len > size)
+            return STATUS_ILLEGAL_INSTRUCTION;
+
+        uint8_t opcode = pInstr[ld.opcd_offset];
+
+        // Function ends before enough code is moved
+        if (ld.opcd_size == 1 && (opcode == 0xC3 || opcode == 0xC2 || opcode == 0xCC))
+            return STATUS_NOT_SUPPORTED;
+
+        ptr_t srcNext = src + moved + len;
+        ptr_t dstIP = dst + result.size();
+
+        if (offsets)
+            offsets->emplace_back( moved, result.size() );
+
+        if (!(ld.flags & F_RELATIVE))
+        {
+            result.insert( result.end(), pInstr, pInstr + len );
+        }
+        // RIP-relative memory operand
+        else if (ld.flags & F_MODRM && ld.disp_size == sizeof( int32_t ))
+        {
+            int32_t disp = 0;
+            memcpy( &disp, pInstr + ld.disp_offset, sizeof( disp ) );
+
+            ptr_t target = srcNext + disp;
+            if (!InRel32( dstIP + len, target ))
+                return STATUS_NOT_SUPPORTED;
+
+            size_t pos = result.size();
+            result.insert( result.end(), pInstr, pInstr + len );
+
+            disp = static_cast<int32_t>(target - (dstIP + len));
+            memcpy( result.data() + pos + ld.disp_offset, &disp, sizeof( disp ) );
+        }
+        // Relative branch
+        else
+        {
+            int32_t disp = 0;
+            if (ld.imm_size == sizeof( int8_t ))
+                disp = static_cast<int8_t>(pInstr[ld.imm_offset]);
+            else if (ld.imm_size == sizeof( int32_t ))
+                memcpy( &disp, pInstr + ld.imm_offset, sizeof( disp ) );
+            else
+                return STATUS_NOT_SUPPORTED;
+
+            // Branch into moved code would require its target to be relocated as well
+            ptr_t target = srcNext + disp;
+            if (target >= src && target < src + std::max<size_t>( minSize, moved + len ))
+                return STATUS_NOT_SUPPORTED;
+
+            uint8_t cc = (ld.opcd_size == 1 ? opcode : pInstr[ld.opcd_offset + 1]) & 0xF;
+            bool isCall = ld.opcd_size == 1 && opcode == 0xE8;
+            bool isJmp = ld.opcd_size == 1 && (opcode == 0xE9 || opcode == 0xEB);
+            bool isJcc = (ld.opcd_size == 1 && (opcode & 0xF0) == 0x70) ||
+                         (ld.opcd_size == 2 && opcode == 0x0F && (pInstr[ld.opcd_offset + 1] & 0xF0) == 0x80);
+
+            if (isCall && (!x64 || InRel32( dstIP + 5, target )))
+            {
+                int32_t rel = static_cast<int32_t>(target - (dstIP + 5));
+                result.push_back( 0xE8 );
+                result.insert( result.end(), reinterpret_cast<uint8_t*>(&rel), reinterpret_cast<uint8_t*>(&rel) + sizeof( rel ) );
+            }
+            else if (isCall)
+            {
+                // call [rip + 2]; jmp $+8; dq target
+                const uint8_t stub[] = { 0xFF, 0x15, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x08 };
+                result.insert( result.end(), stub, stub + sizeof( stub ) );
+                result.insert( result.end(), reinterpret_cast<uint8_t*>(&target), reinterpret_cast<uint8_t*>(&target) + sizeof( target ) );
+            }
+            else if (isJmp)
+            {
+                EmitJump( result, dstIP, target, x64 );
+            }
+            else if (isJcc && (!x64 || InRel32( dstIP + 6, target )))
+            {
+                int32_t rel = static_cast<int32_t>(target - (dstIP + 6));
+                result.push_back( 0x0F );
+                result.push_back( 0x80 | cc );
+                result.insert( result.end(), reinterpret_cast<uint8_t*>(&rel), reinterpret_cast<uint8_t*>(&rel) + sizeof( rel ) );
+            }
+            else if (isJcc)
+            {
+                // Inverted condition skips absolute jump
+                result.push_back( 0x70 | (cc ^ 1) );
+                result.push_back( 0x0E );
+                EmitAbsJump( result, target );
+            }
+            // loop, jecxz
+            else
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        moved += len;
+    }
+
+    if (offsets)
+        offsets->emplace_back( moved, result.size() );
+
+    EmitJump( result, dst + result.size(), src + moved, x64 );
+    return moved;
+}
+
+/// <summary>
+/// Append jump, rel32 if target is reachable, absolute otherwise
+/// </summary>
+/// <param name="result">Code buffer</param>
+/// <param name="from">Jump address</param>
+/// <param name="to">Jump target</param>
+/// <param name="x64">64 bit code</param>
+void CodeRelocator::EmitJump( std::vector<uint8_t>& result, ptr_t from, ptr_t to, bool x64 )
+{
+    if (JumpSize( from, to, x64 ) == 5)
+    {
+        int32_t rel = static_cast<int32_t>(to - (from + 5));
+        result.push_back( 0xE9 );
+        result.insert( result.end(), reinterpret_cast<uint8_t*>(&rel), reinterpret_cast<uint8_t*>(&rel) + sizeof( rel ) );
+    }
+    else
+    {
+        EmitAbsJump( result, to );
+    }
+}
+
+/// <summary>
+/// Append x64 absolute jump
+/// </summary>
+/// <param name="result">Code buffer</param>
+/// <param name="to">Jump target</param>
+void CodeRelocator::EmitAbsJump( std::vector<uint8_t>& result, ptr_t to )
+{
+    // jmp [rip]; dq target
+    const uint8_t stub[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+    result.insert( result.end(), stub, stub + sizeof( stub ) );
+    result.insert( result.end(), reinterpret_cast<uint8_t*>(&to), reinterpret_cast<uint8_t*>(&to) + sizeof( to ) );
+}
+
+/// <summary>
+/// Get size of jump emitted by EmitJump
+/// </summary>
+/// <param name="from">Jump address</param>
+/// <param name="to">Jump target</param>
+/// <param name="x64">64 bit code</param>
+/// <returns>Jump size</returns>
+size_t CodeRelocator::JumpSize( ptr_t from, ptr_t to, bool x64 )
+{
+    // 32 bit address space wraps around
+    return (!x64 || InRel32( from + 5, to )) ? 5 : 14;
+}
+
+/// <summary>
+/// Check if rel32 displacement can encode jump
+/// </summary>
+/// <param name="from">Address of next instruction</param>
+/// <param name="to">Target</param>
+/// <returns>true if reachable</returns>
+bool CodeRelocator::InRel32( ptr_t from, ptr_t to )
+{
+    int64_t diff = static_cast<int64_t>(to - from);
+    return diff >= (std::numeric_limits<int32_t>::min)() && diff <= (std::numeric_limits<int32_t>::max)();
+}
+
+}
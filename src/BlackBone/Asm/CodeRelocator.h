@@ -0,0 +1,82 @@
+#pragma once
+
+#include "../Include/Winheaders.h"
+#include "../Include/Types.h"
+#include "../Include/CallResult.h"
+#include "../Include/Macro.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Moves whole instructions to new address, fixing relative branches and RIP-relative operands
+/// </summary>
+class CodeRelocator
+{
+public:
+    /// <summary>
+    /// Copy instructions until at least minSize bytes are moved and append jump to the rest of original code
+    /// </summary>
+    /// <param name="code">Original code</param>
+    /// <param name="size">Original code buffer size</param>
+    /// <param name="src">Original code address</param>
+    /// <param name="dst">New code address</param>
+    /// <param name="minSize">Minimal number of bytes to move</param>
+    /// <param name="x64">64 bit code</param>
+    /// <param name="result">Relocated code</param>
+    /// <param name="offsets">
+    /// Original and relocated offset of each moved instruction.
+    /// Last pair maps end of moved code to the jump back
+    /// </param>
+    /// <returns>Number of original bytes moved</returns>
+    BLACKBONE_API static call_result_t<size_t> Relocate(
+        const uint8_t* code,
+        size_t size,
+        ptr_t src,
+        ptr_t dst,
+        size_t minSize,
+        bool x64,
+        std::vector<uint8_t>& result,
+        std::vector<std::pair<size_t, size_t>>* offsets = nullptr
+        );
+
+    /// <summary>
+    /// Append jump, rel32 if target is reachable, absolute otherwise
+    /// </summary>
+    /// <param name="result">Code buffer</param>
+    /// <param name="from">Jump address</param>
+    /// <param name="to">Jump target</param>
+    /// <param name="x64">64 bit code</param>
+    BLACKBONE_API static void EmitJump( std::vector<uint8_t>& result, ptr_t from, ptr_t to, bool x64 );
+
+    /// <summary>
+    /// Get size of jump emitted by EmitJump
+    /// </summary>
+    /// <param name="from">Jump address</param>
+    /// <param name="to">Jump target</param>
+    /// <param name="x64">64 bit code</param>
+    /// <returns>Jump size</returns>
+    BLACKBONE_API static size_t JumpSize( ptr_t from, ptr_t to, bool x64 );
+
+private:
+    /// <summary>
+    /// Append x64 absolute jump
+    /// </summary>
+    /// <param name="result">Code buffer</param>
+    /// <param name="to">Jump target</param>
+    static void EmitAbsJump( std::vector<uint8_t>& result, ptr_t to );
+
+    /// <summary>
+    /// Check if rel32 displacement can encode jump
+    /// </summary>
+    /// <param name="from">Address of next instruction</param>
+    /// <param name="to">Target</param>
+    /// <returns>true if reachable</returns>
+    static bool InRel32( ptr_t from, ptr_t to );
+};
+
+}
@@ -2,6 +2,7 @@
 
 #include "AsmVariant.hpp"
 #include "AsmStack.hpp"
+#include "StubTemplates.h"
 #include "../Include/Macro.h"
 
 #include <initializer_list>
@@ -42,6 +43,36 @@ namespace blackbone
     };
 
 
+    /// <summary>
+    /// JIT runtime that tracks generated code, so it can be released when assembler is reused
+    /// </summary>
+    class AsmRuntime : public asmjit::JitRuntime
+    {
+    public:
+        virtual asmjit::Error add( void** dst, asmjit::Assembler* assembler ) override
+        {
+            auto error = asmjit::JitRuntime::add( dst, assembler );
+            if (error == asmjit::kErrorOk)
+                _code.emplace_back( *dst );
+
+            return error;
+        }
+
+        /// <summary>
+        /// Release all generated code, keeping allocator memory
+        /// </summary>
+        void releaseAll()
+        {
+            for (auto p : _code)
+                release( p );
+
+            _code.clear();
+        }
+
+    private:
+        std::vector<void*> _code;
+    };
+
     /// <summary>
     /// Assembly generation helper
     /// </summary>
@@ -57,20 +88,25 @@ namespace blackbone
         virtual void GenEpilogue( bool switchMode = false, int retSize = -1) = 0;
         virtual void GenCall( const AsmFunctionPtr&, const std::vector<AsmVariant>& args, eCalligConvention cc = cc_stdcall ) = 0;
         virtual void ExitThreadWithStatus( uint64_t pExitThread, uint64_t resultPtr ) = 0;
+        virtual void SaveRetVal( uint64_t ResultPtr, uint64_t errPtr, eReturnType rtype = rt_int32 ) = 0;
         virtual void SaveRetValAndSignalEvent( uint64_t pSetEvent, uint64_t ResultPtr, uint64_t EventPtr, uint64_t errPtr, eReturnType rtype = rt_int32 ) = 0;
         virtual void EnableX64CallStack( bool state ) = 0;
 
+        /// <summary>
+        /// Discard generated code and prepare helper for reuse. Assembler zone memory is retained
+        /// </summary>
+        BLACKBONE_API virtual void reset()
+        {
+            _runtime.releaseAll();
+            _assembler.reset( false );
+        }
+
         /// <summary>
         /// Switch processor into WOW64 emulation mode
         /// </summary>
         BLACKBONE_API void SwitchTo86()
         {
-            asmjit::Label l = _assembler.newLabel();
-
-            _assembler.call( l ); _assembler.bind( l );
-            _assembler.mov( asmjit::host::dword_ptr( asmjit::host::esp, 4 ), 0x23 );
-            _assembler.add( asmjit::host::dword_ptr( asmjit::host::esp ), 0xD );
-            _assembler.db( 0xCB );    // retf
+            _assembler.embed( stubs::SwitchTo86.code.data(), static_cast<uint32_t>(stubs::SwitchTo86.size()) );
         }
 
         /// <summary>
@@ -78,13 +114,7 @@ namespace blackbone
         /// </summary>
         BLACKBONE_API void SwitchTo64()
         {
-            asmjit::Label l = _assembler.newLabel();
-
-            _assembler.push( 0x33 );
-            _assembler.call( l );  _assembler.bind( l );
-            //_assembler.add( asmjit::host::dword_ptr( asmjit::host::esp ), 5 );
-            _assembler.dd( '\x83\x04\x24\x05' );
-            _assembler.db( 0xCB );    // retf
+            _assembler.embed( stubs::SwitchTo64.code.data(), static_cast<uint32_t>(stubs::SwitchTo64.size()) );
         }
 
         BLACKBONE_API inline asmjit::X86Assembler* assembler() { return &_assembler; }
@@ -95,7 +125,7 @@ namespace blackbone
         IAsmHelper& operator =(const IAsmHelper&) = delete;
 
     protected:
-        asmjit::JitRuntime _runtime;
+        AsmRuntime _runtime;
         asmjit::X86Assembler _assembler;
     };
 }
\ No newline at end of file
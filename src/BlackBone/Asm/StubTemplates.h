@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <initializer_list>
+#include <string.h>
+
+namespace blackbone
+{
+    /// <summary>
+    /// Precompiled position-independent code with immediate slots.
+    /// Used for fixed-shape stubs instead of running assembler on each call
+    /// </summary>
+    template<size_t Size, size_t Slots>
+    struct StubTemplate
+    {
+        struct Slot
+        {
+            uint8_t offset;     // Immediate offset in code
+            uint8_t size;       // Immediate size, 4 or 8 bytes
+        };
+
+        std::array<uint8_t, Size> code;
+        std::array<Slot, Slots> slots;
+
+        static constexpr size_t size() { return Size; }
+
+        /// <summary>
+        /// Copy template code and patch immediate slots in order
+        /// </summary>
+        /// <param name="out">Output buffer, at least Size bytes long</param>
+        /// <param name="values">Slot values</param>
+        /// <returns>Stub size</returns>
+        size_t Fill( uint8_t* out, std::initializer_list<uint64_t> values = {} ) const
+        {
+            memcpy( out, code.data(), Size );
+
+            size_t i = 0;
+            for (auto value : values)
+            {
+                if (i >= Slots)
+                    break;
+
+                memcpy( out + slots[i].offset, &value, slots[i].size );
+                i++;
+            }
+
+            return Size;
+        }
+    };
+
+    namespace stubs
+    {
+        //
+        // Far return into 32 bit code segment, emitted in x64 code
+        //  call $+5
+        //  mov dword [rsp + 4], 0x23
+        //  add dword [rsp], 0xD
+        //  retf
+        //
+        constexpr StubTemplate<18, 0> SwitchTo86 =
+        { {
+            0xE8, 0x00, 0x00, 0x00, 0x00,
+            0xC7, 0x44, 0x24, 0x04, 0x23, 0x00, 0x00, 0x00,
+            0x83, 0x04, 0x24, 0x0D,
+            0xCB
+        }, {} };
+
+        //
+        // Far return into 64 bit code segment, emitted in x86 code
+        //  push 0x33
+        //  call $+5
+        //  add dword [esp], 5
+        //  retf
+        //
+        constexpr StubTemplate<12, 0> SwitchTo64 =
+        { {
+            0x6A, 0x33,
+            0xE8, 0x00, 0x00, 0x00, 0x00,
+            0x83, 0x04, 0x24, 0x05,
+            0xCB
+        }, {} };
+
+        //
+        // x64 call with single argument and return
+        // Slots: arg0, function
+        //
+        constexpr StubTemplate<31, 2> Call1_x64 =
+        { {
+            0x48, 0x83, 0xEC, 0x38,                                         // sub rsp, 0x38
+            0x48, 0xB9, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov rcx, arg0
+            0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov rax, function
+            0xFF, 0xD0,                                                     // call rax
+            0x48, 0x83, 0xC4, 0x38,                                         // add rsp, 0x38
+            0xC3                                                            // ret
+        }, { { { 6, 8 }, { 16, 8 } } } };
+
+        //
+        // x64 call with four register arguments and return
+        // Slots: arg0, arg1, arg2, arg3, function
+        //
+        constexpr StubTemplate<61, 5> Call4_x64 =
+        { {
+            0x48, 0x83, 0xEC, 0x38,                                         // sub rsp, 0x38
+            0x48, 0xB9, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov rcx, arg0
+            0x48, 0xBA, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov rdx, arg1
+            0x49, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov r8, arg2
+            0x49, 0xB9, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov r9, arg3
+            0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,                             // mov rax, function
+            0xFF, 0xD0,                                                     // call rax
+            0x48, 0x83, 0xC4, 0x38,                                         // add rsp, 0x38
+            0xC3                                                            // ret
+        }, { { { 6, 8 }, { 16, 8 }, { 26, 8 }, { 36, 8 }, { 46, 8 } } } };
+
+        //
+        // x86 stdcall with single argument and return
+        // Slots: arg0, function
+        //
+        constexpr StubTemplate<13, 2> Call1_x86 =
+        { {
+            0x68, 0, 0, 0, 0,                                               // push arg0
+            0xB8, 0, 0, 0, 0,                                               // mov eax, function
+            0xFF, 0xD0,                                                     // call eax
+            0xC3                                                            // ret
+        }, { { { 1, 4 }, { 6, 4 } } } };
+
+        //
+        // x86 stdcall with four arguments and return
+        // Slots: arg0, arg1, arg2, arg3, function
+        //
+        constexpr StubTemplate<28, 5> Call4_x86 =
+        { {
+            0x68, 0, 0, 0, 0,                                               // push arg3
+            0x68, 0, 0, 0, 0,                                               // push arg2
+            0x68, 0, 0, 0, 0,                                               // push arg1
+            0x68, 0, 0, 0, 0,                                               // push arg0
+            0xB8, 0, 0, 0, 0,                                               // mov eax, function
+            0xFF, 0xD0,                                                     // call eax
+            0xC3                                                            // ret
+        }, { { { 16, 4 }, { 11, 4 }, { 6, 4 }, { 1, 4 }, { 21, 4 } } } };
+    }
+}
@@ -198,6 +198,26 @@ typedef DWORD( NTAPI* fnNtQuerySection )(
     PULONG ReturnLength
     );
 
+// NtMapViewOfSection
+typedef NTSTATUS( NTAPI* fnNtMapViewOfSection )(
+    IN HANDLE           SectionHandle,
+    IN HANDLE           ProcessHandle,
+    IN OUT PVOID*       BaseAddress,
+    IN ULONG_PTR        ZeroBits,
+    IN SIZE_T           CommitSize,
+    IN OUT PLARGE_INTEGER SectionOffset OPTIONAL,
+    IN OUT PSIZE_T      ViewSize,
+    IN ULONG            InheritDisposition,
+    IN ULONG            AllocationType,
+    IN ULONG            Win32Protect
+    );
+
+// NtUnmapViewOfSection
+typedef NTSTATUS( NTAPI* fnNtUnmapViewOfSection )(
+    IN HANDLE ProcessHandle,
+    IN PVOID  BaseAddress
+    );
+
 // NtSuspendProcess
 typedef NTSTATUS( NTAPI* fnNtSuspendProcess )(
     HANDLE ProcessHandle
@@ -0,0 +1,143 @@
+#include "HookRegistry.h"
+
+namespace blackbone
+{
+
+// Initial table capacity
+#define REGISTRY_MIN_SIZE 0x40
+
+/// <summary>
+/// Register or replace hook instance
+/// </summary>
+/// <param name="address">Hooked address</param>
+/// <param name="hook">Hook instance</param>
+void HookRegistry::Insert( void* address, DetourBase* hook )
+{
+    CSLock lck( _lock );
+
+    // Keep load factor below 3/4, so probing always ends
+    auto table = _table.load( std::memory_order_relaxed );
+    if (table == nullptr || (table->used + 1) * 4 > (table->mask + 1) * 3)
+    {
+        Grow();
+        table = _table.load( std::memory_order_relaxed );
+    }
+
+    for (size_t i = Hash( address );; i++)
+    {
+        auto& entry = table->entries[i & table->mask];
+        auto key = entry.key.load( std::memory_order_relaxed );
+
+        if (key == address)
+        {
+            entry.value.store( hook, std::memory_order_release );
+            return;
+        }
+
+        // Instance must be visible before key
+        if (key == nullptr)
+        {
+            entry.value.store( hook, std::memory_order_relaxed );
+            entry.key.store( address, std::memory_order_release );
+            table->used++;
+            return;
+        }
+    }
+}
+
+/// <summary>
+/// Unregister hook. Address stays known until table is rebuilt, so late exceptions can be recognized
+/// </summary>
+/// <param name="address">Hooked address</param>
+void HookRegistry::Remove( void* address )
+{
+    CSLock lck( _lock );
+
+    auto table = _table.load( std::memory_order_relaxed );
+    if (table == nullptr)
+        return;
+
+    for (size_t i = Hash( address );; i++)
+    {
+        auto& entry = table->entries[i & table->mask];
+        auto key = entry.key.load( std::memory_order_relaxed );
+
+        if (key == address)
+        {
+            entry.value.store( nullptr, std::memory_order_release );
+            break;
+        }
+
+        if (key == nullptr)
+            break;
+    }
+
+    // Handlers may have been busy during last rebuild
+    Reclaim();
+}
+
+/// <summary>
+/// Publish larger table without removed hooks
+/// </summary>
+void HookRegistry::Grow()
+{
+    auto current = _table.load( std::memory_order_relaxed );
+
+    size_t active = 0;
+    if (current != nullptr)
+        for (size_t i = 0; i <= current->mask; i++)
+            if (current->entries[i].value.load( std::memory_order_relaxed ) != nullptr)
+                active++;
+
+    size_t size = REGISTRY_MIN_SIZE;
+    while (size < (active + 1) * 4)
+        size *= 2;
+
+    auto table = std::make_unique<Table>();
+    table->mask = size - 1;
+    table->entries.reset( new Entry[size] );
+
+    // Table is not visible yet
+    if (current != nullptr)
+    {
+        for (size_t i = 0; i <= current->mask; i++)
+        {
+            auto key = current->entries[i].key.load( std::memory_order_relaxed );
+            auto value = current->entries[i].value.load( std::memory_order_relaxed );
+            if (value == nullptr)
+                continue;
+
+            for (size_t j = Hash( key );; j++)
+            {
+                auto& entry = table->entries[j & table->mask];
+                if (entry.key.load( std::memory_order_relaxed ) == nullptr)
+                {
+                    entry.key.store( key, std::memory_order_relaxed );
+                    entry.value.store( value, std::memory_order_relaxed );
+                    table->used++;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Readers may still use previous table
+    _table.store( table.get(), std::memory_order_seq_cst );
+    _tables.emplace_back( std::move( table ) );
+
+    Reclaim();
+}
+
+/// <summary>
+/// Free replaced tables if no lookup is in progress.
+/// Lookup started after current table was published can't see replaced ones
+/// </summary>
+void HookRegistry::Reclaim()
+{
+    if (_tables.size() < 2 || _readers.load( std::memory_order_seq_cst ) != 0)
+        return;
+
+    _tables.erase( _tables.begin(), _tables.end() - 1 );
+}
+
+}
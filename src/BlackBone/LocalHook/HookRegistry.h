@@ -0,0 +1,133 @@
+#pragma once
+
+#include "../Config.h"
+#include "../Include/Winheaders.h"
+#include "../Misc/Utils.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace blackbone
+{
+
+class DetourBase;
+
+/// <summary>
+/// Address to hook instance map, read from exception handlers.
+/// Lookups are lock-free, modifications are serialized and never block readers.
+/// Open-addressing table with linear probing. Removed hooks keep their slot with null instance until table is rebuilt.
+/// Replaced tables are freed once no lookup is in progress, so readers never touch freed memory
+/// </summary>
+class HookRegistry
+{
+    struct Entry
+    {
+        std::atomic<void*> key{ nullptr };                  // Hooked address, never changes once set
+        std::atomic<DetourBase*> value{ nullptr };          // Hook instance, null if hook was removed
+    };
+
+    struct Table
+    {
+        size_t mask = 0;                                    // Capacity - 1
+        size_t used = 0;                                    // Slots with key
+        std::unique_ptr<Entry[]> entries;                   // Slots
+    };
+
+public:
+    BLACKBONE_API HookRegistry() = default;
+    BLACKBONE_API ~HookRegistry() = default;
+
+    /// <summary>
+    /// Register or replace hook instance
+    /// </summary>
+    /// <param name="address">Hooked address</param>
+    /// <param name="hook">Hook instance</param>
+    BLACKBONE_API void Insert( void* address, DetourBase* hook );
+
+    /// <summary>
+    /// Unregister hook. Address stays known until table is rebuilt, so late exceptions can be recognized
+    /// </summary>
+    /// <param name="address">Hooked address</param>
+    BLACKBONE_API void Remove( void* address );
+
+    /// <summary>
+    /// Find hook instance. Safe to call from exception handler
+    /// </summary>
+    /// <param name="address">Hooked address</param>
+    /// <param name="hook">Hook instance, null if hook was removed</param>
+    /// <returns>true if address was ever hooked</returns>
+    inline bool Lookup( void* address, DetourBase*& hook ) const
+    {
+        // Pairs with table publication in Grow, retired tables can't be freed until counter drops
+        _readers.fetch_add( 1, std::memory_order_seq_cst );
+        bool found = Find( address, hook );
+        _readers.fetch_sub( 1, std::memory_order_release );
+
+        return found;
+    }
+
+private:
+    /// <summary>
+    /// Find hook instance in current table
+    /// </summary>
+    /// <param name="address">Hooked address</param>
+    /// <param name="hook">Hook instance, null if hook was removed</param>
+    /// <returns>true if address was ever hooked</returns>
+    inline bool Find( void* address, DetourBase*& hook ) const
+    {
+        hook = nullptr;
+
+        auto table = _table.load( std::memory_order_seq_cst );
+        if (table == nullptr)
+            return false;
+
+        for (size_t i = Hash( address );; i++)
+        {
+            auto& entry = table->entries[i & table->mask];
+            auto key = entry.key.load( std::memory_order_acquire );
+
+            if (key == address)
+            {
+                hook = entry.value.load( std::memory_order_acquire );
+                return true;
+            }
+
+            // Table always has free slots
+            if (key == nullptr)
+                return false;
+        }
+    }
+
+    /// <summary>
+    /// Get initial slot index
+    /// </summary>
+    /// <param name="address">Hooked address</param>
+    /// <returns>Slot index, not masked</returns>
+    static inline size_t Hash( void* address )
+    {
+        return static_cast<size_t>((reinterpret_cast<uintptr_t>(address) * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    /// <summary>
+    /// Publish larger table without removed hooks
+    /// </summary>
+    void Grow();
+
+    /// <summary>
+    /// Free replaced tables if no lookup is in progress
+    /// </summary>
+    void Reclaim();
+
+    HookRegistry( const HookRegistry& ) = delete;
+    HookRegistry& operator =( const HookRegistry& ) = delete;
+
+private:
+    std::atomic<Table*> _table{ nullptr };          // Current table
+    std::vector<std::unique_ptr<Table>> _tables;    // Published tables not freed yet, current one is last
+    mutable std::atomic<uint32_t> _readers{ 0 };    // Lookups in progress
+    CriticalSection _lock;                          // Modification lock
+};
+
+}
@@ -134,6 +134,9 @@ public:
                 break;
         }
 
+        if (this->_type == HookType::Int3 || this->_type == HookType::HWBP)
+            this->_breakpoints.Remove( this->_original );
+
         this->_hooked = false;
         return true;
     }
@@ -208,7 +211,7 @@ private:
         if (!this->_vecHandler)
             return false;
 
-        this->_breakpoints.insert( std::make_pair( this->_original, (DetourBase*)this ) );
+        this->_breakpoints.Insert( this->_original, this );
 
         // Save original code
         memcpy( this->_origCode, this->_original, this->_origSize );
@@ -239,7 +242,7 @@ private:
         if (!this->_vecHandler)
             return false;
 
-        this->_breakpoints.insert( std::make_pair( this->_original, (DetourBase*)this ) );
+        this->_breakpoints.Insert( this->_original, this );
 
         // Add breakpoint to every thread
         for (auto& thd : thisProc.threads().getAll())
@@ -1,8 +1,9 @@
 #include "LocalHookBase.h"
+#include "TrampolinePool.h"
 
 namespace blackbone
 {
-std::unordered_map<void*, DetourBase*> DetourBase::_breakpoints;
+HookRegistry DetourBase::_breakpoints;
 void* DetourBase::_vecHandler = nullptr;
 
 DetourBase::DetourBase()
@@ -11,45 +12,32 @@ DetourBase::DetourBase()
 
 DetourBase::~DetourBase()
 {
-    VirtualFree( _buf, 0, MEM_RELEASE );
+    if (_buf != nullptr && !TrampolinePool::Instance().Free( _buf ))
+        VirtualFree( _buf, 0, MEM_RELEASE );
 }
 
 /// <summary>
 /// Allocate detour buffer as close to target as possible
 /// </summary>
-/// <param name="nearest">Target address</param>
+/// <param name="nearest">Target address. If null, whole page is allocated to hold vtable copy after trampoline</param>
 /// <returns>true on success</returns>
 bool DetourBase::AllocateBuffer( uint8_t* nearest )
 {
     if (_buf != nullptr)
         return true;
 
-    MEMORY_BASIC_INFORMATION mbi = { 0 };
-    for (SIZE_T addr = (SIZE_T)nearest; addr > (SIZE_T)nearest - 0x80000000; addr = (SIZE_T)mbi.BaseAddress - 1)
-    {
-        if (!VirtualQuery( (LPCVOID)addr, &mbi, sizeof( mbi ) ))
-            break;
-
-        if (mbi.State == MEM_FREE)
-        {
-            _buf = (uint8_t*)VirtualAlloc(
-                (uint8_t*)mbi.BaseAddress + mbi.RegionSize - 0x1000, 0x1000,
-                MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE
-                );
-
-            if (_buf)
-                break;
-        }
-    }
+    if (nearest != nullptr)
+        _buf = TrampolinePool::Instance().Allocate( nearest );
+    else
+        _buf = (uint8_t*)VirtualAlloc( nullptr, 0x1000, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE );
 
-    // If allocating a memory page failed, allocate first suitable
     if (_buf == nullptr)
-        _buf = (uint8_t*)VirtualAlloc( nullptr, 0x1000, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE );
+        return false;
 
     _origCode = _buf + 0x100;
     _newCode  = _buf + 0x200;
 
-    return _buf != nullptr;
+    return true;
 }
 
 
@@ -207,9 +195,15 @@ LONG NTAPI DetourBase::VectoredHandler( PEXCEPTION_POINTERS excpt )
 /// <returns>Exception disposition</returns>
 LONG NTAPI DetourBase::Int3Handler( PEXCEPTION_POINTERS excpt )
 {
-    if (_breakpoints.count( excpt->ExceptionRecord->ExceptionAddress ))
+    DetourBase* pInst = nullptr;
+    if (_breakpoints.Lookup( excpt->ExceptionRecord->ExceptionAddress, pInst ))
     {
-        DetourBase* pInst = _breakpoints[excpt->ExceptionRecord->ExceptionAddress];
+        // Hook was removed after breakpoint was hit, execute restored code
+        if (pInst == nullptr)
+        {
+            return *reinterpret_cast<uint8_t*>(excpt->ExceptionRecord->ExceptionAddress) != 0xCC ?
+                EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH;
+        }
 
         ((_NT_TIB*)NtCurrentTeb())->ArbitraryUserPointer = (void*)pInst;
         excpt->ContextRecord->NIP = (uintptr_t)pInst->_internalHandler;
@@ -240,13 +234,16 @@ LONG NTAPI DetourBase::StepHandler( PEXCEPTION_POINTERS excpt )
     DWORD index = 0;
     int found = _BitScanForward( &index, static_cast<DWORD>(excpt->ContextRecord->Dr6) );
 
-    if (found != 0 && index < 4 && _breakpoints.count( excpt->ExceptionRecord->ExceptionAddress ))
+    DetourBase* pInst = nullptr;
+    if (found != 0 && index < 4 && _breakpoints.Lookup( excpt->ExceptionRecord->ExceptionAddress, pInst ))
     {
-        DetourBase* pInst = _breakpoints[excpt->ExceptionRecord->ExceptionAddress];
-
         // Disable breakpoint at current index
         BitTestAndResetT( (LONG_PTR*)&excpt->ContextRecord->Dr7, 2 * index );
 
+        // Hook was removed after breakpoint was hit
+        if (pInst == nullptr)
+            return EXCEPTION_CONTINUE_EXECUTION;
+
         ((_NT_TIB*)NtCurrentTeb())->ArbitraryUserPointer = (void*)pInst;
         excpt->ContextRecord->NIP = (uintptr_t)pInst->_internalHandler;
 
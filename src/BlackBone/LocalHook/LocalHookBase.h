@@ -5,6 +5,7 @@
 #include "../Asm/AsmFactory.h"
 #include "../Asm/LDasm.h"
 #include "../Include/Macro.h"
+#include "HookRegistry.h"
 
 #include <tuple>
 #include <unordered_map>
@@ -58,7 +59,7 @@ protected:
     /// <summary>
     /// Allocate detour buffer as close to target as possible
     /// </summary>
-    /// <param name="nearest">Target address</param>
+    /// <param name="nearest">Target address. If null, whole page is allocated to hold vtable copy after trampoline</param>
     /// <returns>true on success</returns>
     BLACKBONE_API bool AllocateBuffer( uint8_t* nearest );
 
@@ -118,7 +119,7 @@ protected:
     ReturnMethod::e _retType = ReturnMethod::UseOriginal;
 
     // Global hook instances relationship
-    BLACKBONE_API static std::unordered_map<void*, DetourBase*> _breakpoints;
+    BLACKBONE_API static HookRegistry _breakpoints;
 
     // Exception handler
     BLACKBONE_API static void* _vecHandler;
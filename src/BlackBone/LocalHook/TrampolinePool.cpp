@@ -0,0 +1,182 @@
+#include "TrampolinePool.h"
+#include "../Include/Macro.h"
+
+#include <algorithm>
+
+namespace blackbone
+{
+
+// Max distance between slab and target, with margin for jump size
+#define REL32_RANGE 0x7FFF0000ull
+
+/// <summary>
+/// Get global pool. Pool is never destroyed, because global detours may outlive it
+/// </summary>
+/// <returns>Pool instance</returns>
+TrampolinePool& TrampolinePool::Instance()
+{
+    static TrampolinePool* instance = new TrampolinePool();
+    return *instance;
+}
+
+/// <summary>
+/// Allocate zeroed slot reachable from target by rel32 jump if possible
+/// </summary>
+/// <param name="nearest">Target address</param>
+/// <returns>Slot address, nullptr on failure</returns>
+uint8_t* TrampolinePool::Allocate( uint8_t* nearest )
+{
+    CSLock lck( _lock );
+
+    // Existing slab in range
+    auto iter = std::find_if( _slabs.begin(), _slabs.end(), [nearest]( const auto& slab ) {
+        return slab.second.freeList != nullptr && InRange( slab.first, nearest );
+    } );
+
+    if (iter == _slabs.end())
+    {
+        // New slab near target, then any slab with free slots, then new slab anywhere
+        uint8_t* base = CreateSlab( nearest );
+        if (base == nullptr)
+        {
+            iter = std::find_if( _slabs.begin(), _slabs.end(), []( const auto& slab ) { return slab.second.freeList != nullptr; } );
+            if (iter == _slabs.end())
+                base = CreateSlab( nullptr );
+        }
+
+        if (base != nullptr)
+        {
+            // Link all slots, first slot on top
+            Slab slab;
+            for (size_t i = SlabSize / SlotSize; i > 0; i--)
+            {
+                uint8_t* slot = base + (i - 1) * SlotSize;
+                *reinterpret_cast<uint8_t**>(slot) = slab.freeList;
+                slab.freeList = slot;
+            }
+
+            iter = _slabs.emplace( base, slab ).first;
+        }
+        else if (iter == _slabs.end())
+        {
+            return nullptr;
+        }
+    }
+
+    auto& slab = iter->second;
+    uint8_t* slot = slab.freeList;
+
+    slab.freeList = *reinterpret_cast<uint8_t**>(slot);
+    slab.used++;
+
+    memset( slot, 0, SlotSize );
+    return slot;
+}
+
+/// <summary>
+/// Release slot
+/// </summary>
+/// <param name="slot">Slot address</param>
+/// <returns>false if address doesn't belong to pool</returns>
+bool TrampolinePool::Free( uint8_t* slot )
+{
+    CSLock lck( _lock );
+
+    auto iter = _slabs.upper_bound( slot );
+    if (slot == nullptr || iter == _slabs.begin())
+        return false;
+
+    --iter;
+    if (slot >= iter->first + SlabSize)
+        return false;
+
+    // Empty slabs are kept for next hooks
+    *reinterpret_cast<uint8_t**>(slot) = iter->second.freeList;
+    iter->second.freeList = slot;
+    iter->second.used--;
+
+    return true;
+}
+
+/// <summary>
+/// Reserve and commit new slab
+/// </summary>
+/// <param name="nearest">Target address, nullptr if slab can be placed anywhere</param>
+/// <returns>Slab base, nullptr on failure</returns>
+uint8_t* TrampolinePool::CreateSlab( uint8_t* nearest )
+{
+    if (nearest == nullptr)
+        return static_cast<uint8_t*>(VirtualAlloc( nullptr, SlabSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE ));
+
+#ifdef USE64
+    MEMORY_BASIC_INFORMATION mbi = { 0 };
+    uintptr_t target = reinterpret_cast<uintptr_t>(nearest);
+    uintptr_t low = target > REL32_RANGE + SlabSize ? target - REL32_RANGE : SlabSize;
+    uintptr_t high = target + REL32_RANGE;
+
+    // Free regions below target, closest first
+    for (uintptr_t addr = target; addr > low; addr = reinterpret_cast<uintptr_t>(mbi.BaseAddress) - 1)
+    {
+        if (!VirtualQuery( reinterpret_cast<LPCVOID>(addr), &mbi, sizeof( mbi ) ))
+            break;
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(mbi.BaseAddress);
+        uintptr_t base = (start + mbi.RegionSize - SlabSize) & ~(SlabSize - 1);
+
+        if (mbi.State == MEM_FREE && mbi.RegionSize >= SlabSize && base >= start && InRange( reinterpret_cast<uint8_t*>(base), nearest ))
+        {
+            auto ptr = VirtualAlloc( reinterpret_cast<LPVOID>(base), SlabSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE );
+            if (ptr)
+                return static_cast<uint8_t*>(ptr);
+        }
+    }
+
+    // Free regions above target
+    for (uintptr_t addr = target; addr < high; addr = reinterpret_cast<uintptr_t>(mbi.BaseAddress) + mbi.RegionSize)
+    {
+        if (!VirtualQuery( reinterpret_cast<LPCVOID>(addr), &mbi, sizeof( mbi ) ))
+            break;
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(mbi.BaseAddress);
+        uintptr_t base = Align( start, SlabSize );
+
+        if (mbi.State == MEM_FREE && base + SlabSize <= start + mbi.RegionSize && InRange( reinterpret_cast<uint8_t*>(base), nearest ))
+        {
+            auto ptr = VirtualAlloc( reinterpret_cast<LPVOID>(base), SlabSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE );
+            if (ptr)
+                return static_cast<uint8_t*>(ptr);
+        }
+    }
+
+    return nullptr;
+#else
+    // Whole address space is reachable
+    return CreateSlab( nullptr );
+#endif
+}
+
+/// <summary>
+/// Check if slab is within rel32 range of target
+/// </summary>
+/// <param name="base">Slab base</param>
+/// <param name="nearest">Target address</param>
+/// <returns>true if whole slab is reachable</returns>
+bool TrampolinePool::InRange( uint8_t* base, uint8_t* nearest )
+{
+#ifdef USE64
+    if (nearest == nullptr)
+        return true;
+
+    uintptr_t target = reinterpret_cast<uintptr_t>(nearest);
+    uintptr_t start = reinterpret_cast<uintptr_t>(base);
+    uintptr_t end = start + SlabSize;
+
+    return (start >= target ? end - target : target - start) < REL32_RANGE;
+#else
+    UNREFERENCED_PARAMETER( base );
+    UNREFERENCED_PARAMETER( nearest );
+    return true;
+#endif
+}
+
+}
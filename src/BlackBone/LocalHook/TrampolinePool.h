@@ -0,0 +1,77 @@
+#pragma once
+
+#include "../Config.h"
+#include "../Include/Winheaders.h"
+#include "../Misc/Utils.h"
+
+#include <stdint.h>
+#include <map>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Shared allocator of local detour trampolines.
+/// Reserves 64 KB slabs as close to hooked code as possible and splits them into fixed-size slots,
+/// so hooks of one module share few slabs instead of taking a page each
+/// </summary>
+class TrampolinePool
+{
+    struct Slab
+    {
+        uint8_t* freeList = nullptr;    // First free slot, each free slot holds pointer to next one
+        size_t   used = 0;              // Allocated slot count
+    };
+
+public:
+    // Slot layout: hook handler jump, original code, patch code
+    static constexpr size_t SlotSize = 0x300;
+    static constexpr size_t SlabSize = 0x10000;
+
+    /// <summary>
+    /// Get global pool. Pool is never destroyed, because global detours may outlive it
+    /// </summary>
+    /// <returns>Pool instance</returns>
+    BLACKBONE_API static TrampolinePool& Instance();
+
+    /// <summary>
+    /// Allocate zeroed slot reachable from target by rel32 jump if possible
+    /// </summary>
+    /// <param name="nearest">Target address</param>
+    /// <returns>Slot address, nullptr on failure</returns>
+    BLACKBONE_API uint8_t* Allocate( uint8_t* nearest );
+
+    /// <summary>
+    /// Release slot
+    /// </summary>
+    /// <param name="slot">Slot address</param>
+    /// <returns>false if address doesn't belong to pool</returns>
+    BLACKBONE_API bool Free( uint8_t* slot );
+
+private:
+    TrampolinePool() = default;
+
+    /// <summary>
+    /// Reserve and commit new slab
+    /// </summary>
+    /// <param name="nearest">Target address, nullptr if slab can be placed anywhere</param>
+    /// <returns>Slab base, nullptr on failure</returns>
+    uint8_t* CreateSlab( uint8_t* nearest );
+
+    /// <summary>
+    /// Check if slab is within rel32 range of target
+    /// </summary>
+    /// <param name="base">Slab base</param>
+    /// <param name="nearest">Target address</param>
+    /// <returns>true if whole slab is reachable</returns>
+    static bool InRange( uint8_t* base, uint8_t* nearest );
+
+    TrampolinePool( const TrampolinePool& ) = delete;
+    TrampolinePool& operator =( const TrampolinePool& ) = delete;
+
+private:
+    CriticalSection _lock;                  // Slab list lock
+    std::map<uint8_t*, Slab> _slabs;        // Slabs by base address
+};
+
+}
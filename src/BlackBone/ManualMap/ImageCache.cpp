@@ -0,0 +1,92 @@
+#include "ImageCache.h"
+
+namespace blackbone
+{
+
+ImageCache& ImageCache::Instance()
+{
+    static ImageCache instance;
+    return instance;
+}
+
+/// <summary>
+/// Calculate image content hash
+/// </summary>
+/// <param name="data">Image data</param>
+/// <param name="size">Data size</param>
+/// <returns>FNV-1a hash</returns>
+uint64_t ImageCache::Hash( const void* data, size_t size )
+{
+    auto ptr = reinterpret_cast<const uint8_t*>(data);
+    uint64_t hash = 0xCBF29CE484222325;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= ptr[i];
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+/// <summary>
+/// Get cached images for given target base
+/// </summary>
+/// <param name="hash">Image hash</param>
+/// <param name="base">Target image base</param>
+/// <param name="flags">Mapping flags that affect image binding</param>
+/// <returns>Cached images, most recent first</returns>
+vecCachedImages ImageCache::Find( uint64_t hash, ptr_t base, uint32_t flags )
+{
+    CSLock lck( _lock );
+
+    auto iter = _images.find( std::make_tuple( hash, base, flags ) );
+    if (iter == _images.end())
+        return vecCachedImages();
+
+    return vecCachedImages( iter->second.begin(), iter->second.end() );
+}
+
+/// <summary>
+/// Add image to cache
+/// </summary>
+/// <param name="hash">Image hash</param>
+/// <param name="base">Target image base</param>
+/// <param name="flags">Mapping flags that affect image binding</param>
+/// <param name="image">Relocated and bound image</param>
+void ImageCache::Store( uint64_t hash, ptr_t base, uint32_t flags, CachedImagePtr image )
+{
+    CSLock lck( _lock );
+
+    auto& entries = _images[std::make_tuple( hash, base, flags )];
+    entries.emplace_front( std::move( image ) );
+
+    // Drop least recent
+    while (entries.size() > _limit)
+        entries.pop_back();
+}
+
+/// <summary>
+/// Set max number of images with different dependency bases stored per key
+/// </summary>
+/// <param name="limit">Entry limit</param>
+void ImageCache::setLimit( size_t limit )
+{
+    CSLock lck( _lock );
+
+    _limit = limit;
+    for (auto& entry : _images)
+        while (entry.second.size() > _limit)
+            entry.second.pop_back();
+}
+
+/// <summary>
+/// Remove all cached images
+/// </summary>
+void ImageCache::clear()
+{
+    CSLock lck( _lock );
+    _images.clear();
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "../Include/Winheaders.h"
+#include "../Include/Types.h"
+#include "../Misc/Utils.h"
+
+#include <map>
+#include <tuple>
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Module that cached image imports were bound against
+/// </summary>
+struct CachedDependency
+{
+    std::wstring name;      // Name as referenced by image import table
+    module_t     base;      // Module base address
+    uint32_t     size;      // Module image size
+};
+
+/// <summary>
+/// Relocated image with resolved imports
+/// </summary>
+struct CachedImage
+{
+    std::vector<CachedDependency> deps;     // Modules used for import binding
+    std::vector<uint8_t>          image;    // Image memory contents
+};
+
+using CachedImagePtr = std::shared_ptr<const CachedImage>;
+using vecCachedImages = std::vector<CachedImagePtr>;
+
+/// <summary>
+/// Global cache of manually mapped images.
+/// Entries are keyed by (image hash, target base, binding flags),
+/// every entry is valid only for exact set of dependency bases it was built with
+/// </summary>
+class ImageCache
+{
+    using key_t = std::tuple<uint64_t, ptr_t, uint32_t>;
+
+public:
+    BLACKBONE_API ~ImageCache() = default;
+
+    BLACKBONE_API static ImageCache& Instance();
+
+    /// <summary>
+    /// Calculate image content hash
+    /// </summary>
+    /// <param name="data">Image data</param>
+    /// <param name="size">Data size</param>
+    /// <returns>FNV-1a hash</returns>
+    BLACKBONE_API static uint64_t Hash( const void* data, size_t size );
+
+    /// <summary>
+    /// Get cached images for given target base
+    /// </summary>
+    /// <param name="hash">Image hash</param>
+    /// <param name="base">Target image base</param>
+    /// <param name="flags">Mapping flags that affect image binding</param>
+    /// <returns>Cached images, most recent first</returns>
+    BLACKBONE_API vecCachedImages Find( uint64_t hash, ptr_t base, uint32_t flags );
+
+    /// <summary>
+    /// Add image to cache
+    /// </summary>
+    /// <param name="hash">Image hash</param>
+    /// <param name="base">Target image base</param>
+    /// <param name="flags">Mapping flags that affect image binding</param>
+    /// <param name="image">Relocated and bound image</param>
+    BLACKBONE_API void Store( uint64_t hash, ptr_t base, uint32_t flags, CachedImagePtr image );
+
+    /// <summary>
+    /// Set max number of images with different dependency bases stored per key
+    /// </summary>
+    /// <param name="limit">Entry limit</param>
+    BLACKBONE_API void setLimit( size_t limit );
+
+    /// <summary>
+    /// Remove all cached images
+    /// </summary>
+    BLACKBONE_API void clear();
+
+private:
+    // Ensure singleton
+    ImageCache() = default;
+    ImageCache( const ImageCache& ) = delete;
+    ImageCache& operator =( const ImageCache& ) = delete;
+
+private:
+    std::map<key_t, std::list<CachedImagePtr>> _images;     // Cached images
+    size_t _limit = 4;                                      // Entries per key
+    CriticalSection _lock;                                  // Cache lock
+};
+
+}
@@ -5,6 +5,8 @@
 #include "../Misc/PatternLoader.h"
 #include "../Asm/LDasm.h"
 
+#include <algorithm>
+
 namespace blackbone
 {
 
@@ -158,46 +160,109 @@ uint8_t MExcept::_handler32[]=
 /*
 LONG CALLBACK VectoredHandler( PEXCEPTION_POINTERS ExceptionInfo )
 {
+    auto pRecord = ExceptionInfo->ExceptionRecord;
+
     // Check if it's a VC++ exception
     // for SEH RtlAddFunctionTable is enough
-    if (ExceptionInfo->ExceptionRecord->ExceptionCode == EH_EXCEPTION_NUMBER)
+    // Assume that's our exception because ImageBase = 0 and not suitable magic number
+    if (pRecord->ExceptionCode == EH_EXCEPTION_NUMBER
+        && pRecord->ExceptionInformation[0] == EH_PURE_MAGIC_NUMBER1
+        && pRecord->ExceptionInformation[3] == 0)
     {
-        ModuleTable* pTable = reinterpret_cast<ModuleTable*>(0xDEADBEEFDEADBEEF);
-        for (ptr_t i = 0; i < pTable->count; i++)
+        ModuleTable* pTable = *reinterpret_cast<ModuleTable**>(0xDEADBEEFDEADBEEF);
+
+        // Find exception site image
+        for (ptr_t lo = 0, hi = pTable->count; lo < hi;)
         {
-            // Check exception site image boundaries
-            if (ExceptionInfo->ExceptionRecord->ExceptionInformation[2] >= pTable->entry[i].base &&
-                ExceptionInfo->ExceptionRecord->ExceptionInformation[2] <= pTable->entry[i].base + pTable->entry[i].size)
+            ptr_t mid = (lo + hi) / 2;
+            if (pRecord->ExceptionInformation[2] < pTable->entry[mid].base)
+                hi = mid;
+            else if (pRecord->ExceptionInformation[2] >= pTable->entry[mid].base + pTable->entry[mid].size)
+                lo = mid + 1;
+            else
             {
-                // Assume that's our exception because ImageBase = 0 and not suitable magic number
-                if (ExceptionInfo->ExceptionRecord->ExceptionInformation[0] == EH_PURE_MAGIC_NUMBER1
-                    && ExceptionInfo->ExceptionRecord->ExceptionInformation[3] == 0)
-                {
-                    // CRT magic number
-                    ExceptionInfo->ExceptionRecord->ExceptionInformation[0] = (ULONG_PTR)EH_MAGIC_NUMBER1;
+                // CRT magic number
+                pRecord->ExceptionInformation[0] = (ULONG_PTR)EH_MAGIC_NUMBER1;
 
-                    // fix exception image base
-                    ExceptionInfo->ExceptionRecord->ExceptionInformation[3] = (ULONG_PTR)pTable->entry[i].base;
-                }
+                // fix exception image base
+                pRecord->ExceptionInformation[3] = (ULONG_PTR)pTable->entry[mid].base;
+                break;
             }
         }
     }
 
     return EXCEPTION_CONTINUE_SEARCH;
 }*/
-uint8_t MExcept::_handler64[] =
+/// <summary>
+/// Generate x64 vectored handler
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+void MExcept::GenHandler64( IAsmHelper& a )
 {
-    0x48, 0x83, 0xEC, 0x08, 0x48, 0x8B, 0x01, 0x4C, 0x8B, 0xD9, 0x81, 0x38, 0x63, 0x73, 0x6D, 0xE0, 
-    0x0F, 0x85, 0x7C, 0x00, 0x00, 0x00, 0x48, 0x89, 0x1C, 0x24, 0x45, 0x33, 0xC9, 0x48, 0xBB, 0xEF, 
-    0xBE, 0xAD, 0xDE, 0xEF, 0xBE, 0xAD, 0xDE, 0x4C, 0x39, 0x0B, 0x76, 0x5B, 0x48, 0xB8, 0xF7, 0xBE, 
-    0xAD, 0xDE, 0xEF, 0xBE, 0xAD, 0xDE, 0x66, 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x4D, 0x8B, 0x03, 0x48, 0x8B, 0x10, 0x4D, 0x8B, 0x50, 0x30, 0x4C, 0x3B, 0xD2, 0x72, 0x2C, 0x48, 
-    0x03, 0x50, 0x08, 0x4C, 0x3B, 0xD2, 0x77, 0x23, 0x49, 0x81, 0x78, 0x20, 0x00, 0x40, 0x99, 0x01,
-    0x75, 0x19, 0x49, 0x83, 0x78, 0x38, 0x00, 0x75, 0x12, 0x49, 0xC7, 0x40, 0x20, 0x20, 0x05, 0x93, 
-    0x19, 0x49, 0x8B, 0x13, 0x48, 0x8B, 0x08, 0x48, 0x89, 0x4A, 0x38, 0x49, 0xFF, 0xC1, 0x48, 0x83, 
-    0xC0, 0x10, 0x4C, 0x3B, 0x0B, 0x72, 0xB9, 0x33, 0xC0, 0x48, 0x8B, 0x1C, 0x24, 0x48, 0x83, 0xC4, 
-    0x08, 0xC3, 0x33, 0xC0, 0x48, 0x83, 0xC4, 0x08, 0xC3
-};
+    using namespace asmjit::host;
+
+    // ExceptionInformation[0], [2] and [3]
+    constexpr int32_t info0 = static_cast<int32_t>(offsetof( EXCEPTION_RECORD64, ExceptionInformation ));
+    constexpr int32_t info2 = info0 + 2 * sizeof( uint64_t );
+    constexpr int32_t info3 = info0 + 3 * sizeof( uint64_t );
+
+    asmjit::Label l_loop = a->newLabel();
+    asmjit::Label l_below = a->newLabel();
+    asmjit::Label l_found = a->newLabel();
+    asmjit::Label l_exit = a->newLabel();
+
+    a->push( rbx );
+
+    // rax - exception record, r8 - exception site
+    a->mov( rax, qword_ptr( rcx ) );
+    a->cmp( dword_ptr( rax ), EH_EXCEPTION_NUMBER );
+    a->jne( l_exit );
+    a->cmp( qword_ptr( rax, info0 ), EH_PURE_MAGIC_NUMBER1 );
+    a->jne( l_exit );
+    a->cmp( qword_ptr( rax, info3 ), 0 );
+    a->jne( l_exit );
+    a->mov( r8, qword_ptr( rax, info2 ) );
+
+    // r9 - entries of active table, r10 - upper bound, r11 - lower bound
+    a->mov( r9, _pModTable.ptr() );
+    a->mov( r9, qword_ptr( r9 ) );
+    a->mov( r10, qword_ptr( r9 ) );
+    a->add( r9, FIELD_OFFSET( ModuleTable, entry ) );
+    a->xor_( r11, r11 );
+
+    // rdx - middle index, rbx - middle entry
+    a->bind( l_loop );
+    a->cmp( r11, r10 );
+    a->jae( l_exit );
+    a->lea( rdx, qword_ptr( r11, r10 ) );
+    a->shr( rdx, 1 );
+    a->mov( rbx, rdx );
+    a->shl( rbx, 4 );
+    a->add( rbx, r9 );
+    a->cmp( r8, qword_ptr( rbx, FIELD_OFFSET( ExceptionModule, base ) ) );
+    a->jb( l_below );
+    a->mov( rcx, qword_ptr( rbx, FIELD_OFFSET( ExceptionModule, base ) ) );
+    a->add( rcx, qword_ptr( rbx, FIELD_OFFSET( ExceptionModule, size ) ) );
+    a->cmp( r8, rcx );
+    a->jb( l_found );
+    a->lea( r11, qword_ptr( rdx, 1 ) );
+    a->jmp( l_loop );
+
+    a->bind( l_below );
+    a->mov( r10, rdx );
+    a->jmp( l_loop );
+
+    // Fix magic number and image base
+    a->bind( l_found );
+    a->mov( qword_ptr( rax, info0 ), EH_MAGIC_NUMBER1 );
+    a->mov( rcx, qword_ptr( rbx, FIELD_OFFSET( ExceptionModule, base ) ) );
+    a->mov( qword_ptr( rax, info3 ), rcx );
+
+    a->bind( l_exit );
+    a->pop( rbx );
+    a->xor_( eax, eax );
+    a->ret();
+}
 
 /// <summary>
 /// Inject VEH wrapper into process
@@ -206,8 +271,10 @@ uint8_t MExcept::_handler64[] =
 /// <param name="proc">Target process</param>
 /// <param name="mod">Target module</param>
 /// <param name="partial">Partial exception support</param>
-/// <returns>Error code</returns>
-NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial )
+/// <param name="pBatch">If set, handler registration is appended to this code instead of being executed.
+/// Generated code leaves handle in accumulator, it must be passed to setHandle afterwards</param>
+/// <returns>Error code, STATUS_PENDING if registration was appended to batch</returns>
+NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial, IAsmHelper* pBatch /*= nullptr*/ )
 {    
     uint64_t result = 0;
     auto& mods = proc.modules();
@@ -215,24 +282,17 @@ NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial )
     if (mod.type == mt_mod64)
     {
         // Add module to module table
-        if (!_pModTable.valid())
-        {
-            auto mem = proc.memory().Allocate( 0x1000, PAGE_READWRITE, 0, false );
-            if (!mem)
-                return mem.status;
-
-            _pModTable = std::move( mem.result() );
-        }
+        ExceptionModule entry = { mod.baseAddress, mod.size };
+        auto iter = std::lower_bound(
+            _modules.begin(), _modules.end(), entry,
+            []( const auto& l, const auto& r ) { return l.base < r.base; }
+        );
 
-        ModuleTable table;
-        _pModTable.Read ( 0, table );
+        _modules.emplace( iter, entry );
 
-        // Add new entry to the table
-        table.entry[table.count].base = mod.baseAddress;
-        table.entry[table.count].size = mod.size;
-        table.count++;
-
-        _pModTable.Write( 0, table );
+        auto status = UpdateModuleTable( proc );
+        if (!NT_SUCCESS( status ))
+            return status;
     }
 
     // No handler required
@@ -264,16 +324,17 @@ NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial )
         return false;
     };
 
-    uint8_t newHandler[sizeof( _handler32 ) + sizeof( _handler64 )];
+    uint8_t newHandler[sizeof( _handler32 )];
+    const uint8_t* pHandler = newHandler;
     size_t handlerSize = 0;
 
+    auto a64 = AsmFactory::GetAssembler( mt_mod64 );
     if (mod.type == mt_mod64)
     {
-        handlerSize = sizeof( _handler64 );
-        memcpy( newHandler, _handler64, handlerSize );
+        GenHandler64( *a64 );
 
-        replaceStub( newHandler, handlerSize, 0xDEADBEEFDEADBEEF, _pModTable.ptr() );
-        replaceStub( newHandler, handlerSize, 0xDEADBEEFDEADBEF7, _pModTable.ptr() + sizeof( ptr_t ) );    
+        handlerSize = (*a64)->getCodeSize();
+        pHandler = reinterpret_cast<const uint8_t*>((*a64)->make());
     }
     else
     {
@@ -292,7 +353,7 @@ NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial )
     }
 
     // Write handler data into target process
-    if (!NT_SUCCESS( _pVEHCode.Write( 0, handlerSize, newHandler ) ))
+    if (!NT_SUCCESS( _pVEHCode.Write( 0, handlerSize, pHandler ) ))
     {
         _pVEHCode.Free();
         return LastNtStatus();
@@ -303,6 +364,12 @@ NTSTATUS MExcept::CreateVEH( Process& proc, ModuleData& mod, bool partial )
     if (!pAddHandler)
         return pAddHandler.status;
 
+    if (pBatch)
+    {
+        pBatch->GenCall( pAddHandler->procAddress, { 0, _pVEHCode.ptr() } );
+        return STATUS_PENDING;
+    }
+
     auto a = AsmFactory::GetAssembler( mod.type );
 
     a->GenPrologue();
@@ -355,10 +422,106 @@ NTSTATUS MExcept::RemoveVEH( Process& proc, bool partial, eModType mt )
         _pVEHCode.Free();
         _hVEH = 0;
 
-        _pModTable.Free();
+        FreeModuleTable();
     }        
 
     return STATUS_SUCCESS;
 }
 
+/// <summary>
+/// Remove x64 module from handler module table
+/// </summary>
+/// <param name="proc">Target process</param>
+/// <param name="base">Module base</param>
+/// <returns>Status code</returns>
+NTSTATUS MExcept::RemoveModule( Process& proc, ptr_t base )
+{
+    auto iter = std::find_if( _modules.begin(), _modules.end(), [base]( const auto& entry ) { return entry.base == base; } );
+    if (iter == _modules.end())
+        return STATUS_NOT_FOUND;
+
+    _modules.erase( iter );
+    return UpdateModuleTable( proc );
+}
+
+/// <summary>
+/// Reset data
+/// </summary>
+void MExcept::reset()
+{
+    FreeModuleTable();
+}
+
+/// <summary>
+/// Write module list into inactive table buffer and make it active
+/// </summary>
+/// <param name="proc">Target process</param>
+/// <returns>Status code</returns>
+NTSTATUS MExcept::UpdateModuleTable( Process& proc )
+{
+    auto tableSize = []( size_t capacity ) { return FIELD_OFFSET( ModuleTable, entry ) + capacity * sizeof( ExceptionModule ); };
+
+    // Pointer to active table, handler reads it once per exception
+    if (!_pModTable.valid())
+    {
+        auto mem = proc.memory().Allocate( 0x1000, PAGE_READWRITE, 0, false );
+        if (!mem)
+            return mem.status;
+
+        _pModTable = std::move( mem.result() );
+    }
+
+    // Grow both buffers
+    if (_modules.size() > _capacity)
+    {
+        auto capacity = std::max<size_t>( _capacity, 0x40 );
+        while (capacity < _modules.size())
+            capacity *= 2;
+
+        auto mem = proc.memory().Allocate( 2 * tableSize( capacity ), PAGE_READWRITE, 0, false );
+        if (!mem)
+            return mem.status;
+
+        if (_pTables.valid())
+            _retired.emplace_back( std::move( _pTables ) );
+
+        _pTables = std::move( mem.result() );
+        _capacity = capacity;
+    }
+
+    std::vector<uint8_t> table( tableSize( _modules.size() ) );
+    *reinterpret_cast<ptr_t*>(table.data()) = _modules.size();
+    memcpy( table.data() + FIELD_OFFSET( ModuleTable, entry ), _modules.data(), _modules.size() * sizeof( ExceptionModule ) );
+
+    // Fill inactive buffer, then swap pointer with single aligned write
+    auto inactive = _active ^ 1;
+    auto offset = inactive * tableSize( _capacity );
+
+    auto status = _pTables.Write( offset, table.size(), table.data() );
+    if (NT_SUCCESS( status ))
+        status = _pModTable.Write( 0, _pTables.ptr() + offset );
+
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    _active = inactive;
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Free module table buffers
+/// </summary>
+void MExcept::FreeModuleTable()
+{
+    for (auto& mem : _retired)
+        mem.Free();
+
+    _retired.clear();
+    _pTables.Free();
+    _pModTable.Free();
+    _modules.clear();
+    _capacity = 0;
+    _active = 0;
+}
+
 }
@@ -3,6 +3,8 @@
 #include "../Include/Winheaders.h"
 #include "../Process/MemBlock.h"
 
+#include <vector>
+
 namespace blackbone
 {
 
@@ -17,12 +19,13 @@ struct ExceptionModule
 
 
 /// <summary>
-/// x64 module table
+/// x64 module table, entries are sorted by base address.
+/// Handler reaches it through pointer to active one of two table buffers
 /// </summary>
 struct ModuleTable
 {
     ptr_t count;                    // Number of used entries
-    ExceptionModule entry[250];     // Module data
+    ExceptionModule entry[1];       // Module data
 };
 
 /// <summary>
@@ -41,8 +44,10 @@ public:
     /// <param name="proc">Target process</param>
     /// <param name="mod">Target module</param>
     /// <param name="partial">Partial exception support</param>
-    /// <returns>Error code</returns>
-    BLACKBONE_API NTSTATUS CreateVEH( class Process& proc, ModuleData& mod, bool partial );
+    /// <param name="pBatch">If set, handler registration is appended to this code instead of being executed.
+    /// Generated code leaves handle in accumulator, it must be passed to setHandle afterwards</param>
+    /// <returns>Error code, STATUS_PENDING if registration was appended to batch</returns>
+    BLACKBONE_API NTSTATUS CreateVEH( class Process& proc, ModuleData& mod, bool partial, class IAsmHelper* pBatch = nullptr );
 
     /// <summary>
     /// Removes VEH from target process
@@ -53,22 +58,58 @@ public:
     /// <returns>Status code</returns>
     BLACKBONE_API NTSTATUS RemoveVEH( class Process& proc, bool partial, eModType mt );
 
+    /// <summary>
+    /// Remove x64 module from handler module table
+    /// </summary>
+    /// <param name="proc">Target process</param>
+    /// <param name="base">Module base</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS RemoveModule( class Process& proc, ptr_t base );
+
     /// <summary>
     /// Reset data
     /// </summary>
-    BLACKBONE_API  inline void reset() { _pModTable.Free(); }
+    BLACKBONE_API void reset();
+
+    /// <summary>
+    /// Set handle of vectored handler registered by batch code
+    /// </summary>
+    /// <param name="hVEH">VEH handle</param>
+    BLACKBONE_API inline void setHandle( uint64_t hVEH ) { _hVEH = hVEH; }
 
 private:
     MExcept( const MExcept& ) = delete;
     MExcept& operator =(const MExcept&) = delete;
 
+    /// <summary>
+    /// Write module list into inactive table buffer and make it active
+    /// </summary>
+    /// <param name="proc">Target process</param>
+    /// <returns>Status code</returns>
+    NTSTATUS UpdateModuleTable( class Process& proc );
+
+    /// <summary>
+    /// Generate x64 vectored handler
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    void GenHandler64( class IAsmHelper& a );
+
+    /// <summary>
+    /// Free module table buffers
+    /// </summary>
+    void FreeModuleTable();
+
 private:
     MemBlock  _pVEHCode;    // VEH function codecave
-    MemBlock  _pModTable;   // x64 module address range table
+    MemBlock  _pModTable;   // Pointer to active x64 module table
+    MemBlock  _pTables;     // Two x64 module table buffers
     uint64_t  _hVEH = 0;    // VEH handle
+    size_t    _capacity = 0;                    // Entries per table buffer
+    size_t    _active = 0;                      // Active table buffer index
+    std::vector<ExceptionModule> _modules;      // Sorted local copy of module table
+    std::vector<MemBlock> _retired;             // Outgrown table buffers, handler may still read them
 
     static uint8_t _handler32[];
-    static uint8_t _handler64[];
 };
 
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "MMap.h"
 #include "../Process/Process.h"
+#include "../Process/RPC/RemoteCallBatch.h"
 #include "../Misc/NameResolve.h"
 #include "../Misc/Utils.h"
 #include "../Misc/DynImport.h"
@@ -7,6 +8,11 @@
 #include "../DriverControl/DriverControl.h"
 
 #include <random>
+#include <algorithm>
+#include <future>
+#include <set>
+#include <chrono>
+#include <functional>
 #include <VersionHelpers.h>
 
 #ifndef STATUS_INVALID_EXCEPTION_HANDLER
@@ -33,16 +39,18 @@ MMap::~MMap(void)
 /// <param name="flags">Image mapping flags</param>
 /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
 /// <param name="context">User-supplied callback context</param>
+/// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
 /// <returns>Mapped image info </returns>
 call_result_t<ModuleDataPtr> MMap::MapImage(
     const std::wstring& path,
     eLoadFlags flags /*= NoFlags*/,
     MapCallback mapCallback /*= nullptr*/,
     void* context /*= nullptr*/,
-    CustomArgs_t* pCustomArgs /*= nullptr*/
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    MapProfile* pProfile /*= nullptr*/
     )
 {
-    return MapImageInternal( path, nullptr, 0, false, flags, mapCallback, context, pCustomArgs );
+    return MapImageInternal( path, nullptr, 0, false, flags, mapCallback, context, pCustomArgs, nullptr, pProfile );
 }
 
 /// <summary>
@@ -54,6 +62,7 @@ call_result_t<ModuleDataPtr> MMap::MapImage(
 /// <param name="flags">Image mapping flags</param>
 /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
 /// <param name="context">User-supplied callback context</param>
+/// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
 /// <returns>Mapped image info</returns>
 call_result_t<ModuleDataPtr> MMap::MapImage(
     size_t size, void* buffer,
@@ -61,14 +70,64 @@ call_result_t<ModuleDataPtr> MMap::MapImage(
     eLoadFlags flags /*= NoFlags*/,
     MapCallback mapCallback /*= nullptr*/,
     void* context /*= nullptr*/,
-    CustomArgs_t* pCustomArgs /*= nullptr*/
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    MapProfile* pProfile /*= nullptr*/
     )
 {
     // Create fake path
     wchar_t path[64];
     wsprintfW( path, L"MemoryImage_0x%p", buffer );
 
-    return MapImageInternal( path, buffer, size, asImage, flags, mapCallback, context, pCustomArgs );
+    return MapImageInternal( path, buffer, size, asImage, flags, mapCallback, context, pCustomArgs, nullptr, pProfile );
+}
+
+/// <summary>
+/// Manually map image using prepared plan
+/// </summary>
+/// <param name="plan">Image plan made by PlanImage of any process with same architecture and executable directory</param>
+/// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
+/// <param name="context">User-supplied callback context</param>
+/// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
+/// <returns>Mapped image info</returns>
+call_result_t<ModuleDataPtr> MMap::MapImage(
+    const MapPlan& plan,
+    MapCallback mapCallback /*= nullptr*/,
+    void* context /*= nullptr*/,
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    MapProfile* pProfile /*= nullptr*/
+    )
+{
+    return MapImageInternal( plan.root, nullptr, 0, false, plan.flags, mapCallback, context, pCustomArgs, &plan, pProfile );
+}
+
+/// <summary>
+/// Load and parse image and its dependencies for later mapping.
+/// Target process memory isn't touched
+/// </summary>
+/// <param name="path">Image path</param>
+/// <param name="flags">Image mapping flags</param>
+/// <returns>Mapping plan</returns>
+call_result_t<MapPlanPtr> MMap::PlanImage( const std::wstring& path, eLoadFlags flags /*= NoFlags*/ )
+{
+    return PlanImageInternal( path, nullptr, 0, false, flags );
+}
+
+/// <summary>
+/// Load and parse image and its dependencies for later mapping.
+/// Target process memory isn't touched
+/// </summary>
+/// <param name="size">Buffer size.</param>
+/// <param name="buffer">Image data buffer. Must stay valid while plan is in use</param>
+/// <param name="asImage">If set to true - buffer has image memory layout</param>
+/// <param name="flags">Image mapping flags</param>
+/// <returns>Mapping plan</returns>
+call_result_t<MapPlanPtr> MMap::PlanImage( size_t size, void* buffer, bool asImage /*= false*/, eLoadFlags flags /*= NoFlags*/ )
+{
+    // Create fake path
+    wchar_t path[64];
+    wsprintfW( path, L"MemoryImage_0x%p", buffer );
+
+    return PlanImageInternal( path, buffer, size, asImage, flags );
 }
 
 /// <summary>
@@ -81,6 +140,8 @@ call_result_t<ModuleDataPtr> MMap::MapImage(
 /// <param name="flags">Image mapping flags</param>
 /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
 /// <param name="context">User-supplied callback context</param>
+/// <param name="pPlan">Prepared image plan</param>
+/// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
 /// <returns>Mapped image info</returns>
 call_result_t<ModuleDataPtr> MMap::MapImageInternal(
     const std::wstring& path,
@@ -89,15 +150,19 @@ call_result_t<ModuleDataPtr> MMap::MapImageInternal(
     eLoadFlags flags /*= NoFlags*/,
     MapCallback mapCallback /*= nullptr*/,
     void* context /*= nullptr*/,
-    CustomArgs_t* pCustomArgs /*= nullptr*/
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    const MapPlan* pPlan /*= nullptr*/,
+    MapProfile* pProfile /*= nullptr*/
     )
 {
+    ProfileGuard profile( *this, pProfile );
+
     // Already loaded
     if (auto hMod = _process.modules().GetModule( path ))
         return hMod;
 
     // Prepare target process
-    auto mode = (flags & NoThreads) ? Worker_UseExisting : Worker_CreateNew;
+    auto mode = (flags & NoThreads) ? Worker_HijackPersistent : Worker_CreateNew;
     auto status = _process.remote().CreateRPCEnvironment( mode, true );
     if (!NT_SUCCESS( status ))
     {
@@ -119,8 +184,52 @@ call_result_t<ModuleDataPtr> MMap::MapImageInternal(
 
     BLACKBONE_TRACE( L"ManualMap: Mapping image '%ls' with flags 0x%x", path.c_str(), flags );
 
-    // Map module and all dependencies
-    auto mod = FindOrMapModule( path, buffer, size, asImage, flags );
+    // Load all dependencies upfront
+    if (pPlan)
+    {
+        PhaseGuard phase( *this, Phase_Parse );
+        AdoptPlan( *pPlan );
+    }
+    else
+    {
+        call_result_t<ImageContextPtr> root;
+        {
+            PhaseGuard phase( *this, Phase_Parse );
+            root = LoadImageContext( path, buffer, size, asImage, flags );
+        }
+
+        if (root)
+        {
+            PrepareDependencies( root.result() );
+            _prepared.emplace( root.result()->ldrEntry.fullPath, root.result() );
+        }
+    }
+
+    // Map dependencies first, so every image finds its imports already loaded
+    auto depFlags = flags | NoSxS | NoDelayLoad | PartialExcept | IsDependency;
+    for (auto& dep : DependencyOrder( path ))
+    {
+        auto hDep = FindOrMapModule( dep, nullptr, 0, false, depFlags );
+        if (!hDep)
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to load dependency '%ls'. Status 0x%x", dep.c_str(), hDep.status );
+            status = hDep.status;
+            break;
+        }
+    }
+
+    // Map module itself
+    call_result_t<ModuleDataPtr> mod = status;
+    if (NT_SUCCESS( status ))
+        mod = FindOrMapModule( path, buffer, size, asImage, flags );
+
+    // Release images that weren't used
+    for (auto& item : _prepared)
+        item.second->peImage.Release();
+
+    _prepared.clear();
+    _loadData.clear();
+
     if (!mod)
     {
         Cleanup();
@@ -161,22 +270,13 @@ call_result_t<ModuleDataPtr> MMap::MapImageInternal(
         }
     }
 
-    auto wipeMemory = []( Process& proc, ImageContext* img, uintptr_t offset, uintptr_t size )
+    // Run initializers of all new images at once
+    if (flags & BatchInit && !NT_SUCCESS( status = RunInitializersBatch( pCustomArgs ) ))
     {
-        size = Align( size, 0x1000 );
-        std::unique_ptr<uint8_t[]> zeroBuf( new uint8_t[size]() );
-
-        if (img->flags & HideVAD)
-        {
-            Driver().WriteMem( proc.pid(), img->imgMem.ptr() + offset, size, zeroBuf.get() );
-        }
-        else
-        {
-            img->imgMem.Write( offset, size, zeroBuf.get() );
-            proc.memory().Protect( img->imgMem.ptr() + offset, size, PAGE_NOACCESS );
-            proc.memory().Free( img->imgMem.ptr() + offset, size, MEM_DECOMMIT );
-        }
-    };
+        BLACKBONE_TRACE( L"ManualMap: Batched initializers failed, status: 0x%X", status );
+        Cleanup();
+        return status;
+    }
 
     // Run initializers
     for (auto& img : _images)
@@ -205,26 +305,86 @@ call_result_t<ModuleDataPtr> MMap::MapImageInternal(
                 return status;
             }
 
-            // Wipe header
-            if (img->flags & WipeHeader)
-                wipeMemory( _process, img.get(), 0, img->peImage.headersSize() );
-
-            // Wipe discardable sections
-            if(!img->peImage.pureIL())
-            {
-                for (auto& sec : img->peImage.sections())
-                    if (sec.Characteristics & IMAGE_SCN_MEM_DISCARDABLE)
-                        wipeMemory( _process, img.get(), sec.VirtualAddress, sec.Misc.VirtualSize );
-            }
+            // Wipe header and discardable sections
+            WipeImageMemory( img );
 
             img->initialized = true;
         }
     }
 
+    // Let hijacked thread continue its own work
+    if (flags & NoThreads)
+        _process.remote().ReleaseDispatcher();
+
     //Cleanup();
     return mod;
 }
 
+/// <summary>
+/// Load and parse image and its dependencies for later mapping
+/// </summary>
+/// <param name="path">Image path</param>
+/// <param name="buffer">Image data buffer</param>
+/// <param name="size">Buffer size.</param>
+/// <param name="asImage">If set to true - buffer has image memory layout</param>
+/// <param name="flags">Image mapping flags</param>
+/// <returns>Mapping plan</returns>
+call_result_t<MapPlanPtr> MMap::PlanImageInternal(
+    const std::wstring& path,
+    void* buffer, size_t size, bool asImage,
+    eLoadFlags flags
+    )
+{
+    auto root = LoadImageContext( path, buffer, size, asImage, flags );
+    if (!root)
+        return root.status;
+
+    auto pPlan = std::make_shared<MapPlan>();
+    pPlan->root = path;
+    pPlan->flags = flags;
+
+    // Loader callback is supplied at mapping time, so only flags decide loading method here
+    _mapCallback = nullptr;
+    _userContext = nullptr;
+
+    PrepareDependencies( root.result() );
+    pPlan->images = std::move( _prepared );
+    _prepared.clear();
+    _loadData.clear();
+
+    pPlan->images.emplace( root.result()->ldrEntry.fullPath, root.result() );
+    return MapPlanPtr( std::move( pPlan ) );
+}
+
+/// <summary>
+/// Create image contexts over plan images, so files are neither loaded nor resolved again
+/// </summary>
+/// <param name="plan">Image plan</param>
+void MMap::AdoptPlan( const MapPlan& plan )
+{
+    for (auto& item : plan.images)
+    {
+        auto& source = item.second;
+
+        ImageContextPtr pImage( new ImageContext() );
+        pImage->ldrEntry.fullPath = source->ldrEntry.fullPath;
+        pImage->ldrEntry.name = source->ldrEntry.name;
+        pImage->depPaths = source->depPaths;
+        pImage->flags = source->flags;
+
+        // Image is loaded from disk again by FindOrMapModule if this fails
+        auto status = pImage->peImage.Load( source->peImage, source->flags & NoSxS ? true : false );
+        if (!NT_SUCCESS( status ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to load planned image '%ls'. Status 0x%X", item.first.c_str(), status );
+            pImage->peImage.Release();
+            continue;
+        }
+
+        _prepared.emplace( item.first, pImage );
+    }
+}
+
 /// <summary>
 /// Fix image path for pure managed mapping
 /// </summary>
@@ -262,21 +422,20 @@ void MMap::FixManagedPath( ptr_t base, const std::wstring &path )
 }
 
 /// <summary>
-/// Get existing module or map it if absent
+/// Load and parse image without touching target process
 /// </summary>
 /// <param name="path">Image path</param>
 /// <param name="buffer">Image data buffer</param>
 /// <param name="size">Buffer size.</param>
 /// <param name="asImage">If set to true - buffer has image memory layout</param>
 /// <param name="flags">Mapping flags</param>
-/// <returns>Module info</returns>
-call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
+/// <returns>Image data</returns>
+call_result_t<ImageContextPtr> MMap::LoadImageContext(
     const std::wstring& path,
     void* buffer, size_t size, bool asImage,
-    eLoadFlags flags /*= NoFlags*/ 
+    eLoadFlags flags
     )
 {
-    NTSTATUS status = STATUS_SUCCESS;
     ImageContextPtr pImage( new ImageContext() );
     auto& ldrEntry = pImage->ldrEntry;
 
@@ -285,7 +444,7 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
     pImage->flags = flags;
 
     // Load and parse image
-    status = buffer ? pImage->peImage.Load( buffer, size, !asImage ) : pImage->peImage.Load( path, flags & NoSxS ? true : false );
+    auto status = buffer ? pImage->peImage.Load( buffer, size, !asImage ) : pImage->peImage.Load( path, flags & NoSxS ? true : false );
     if (!NT_SUCCESS( status ))
     {
         BLACKBONE_TRACE( L"ManualMap: Failed to load image '%ls'/0x%p. Status 0x%X", path.c_str(), buffer, status );
@@ -293,6 +452,197 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
         return status;
     }
 
+    return pImage;
+}
+
+/// <summary>
+/// Build dependency graph of image.
+/// Resolves paths of all missing dependencies, loads and parses manually mapped ones in parallel.
+/// Loaded images are consumed later by FindOrMapModule
+/// </summary>
+/// <param name="pRoot">Root image</param>
+void MMap::PrepareDependencies( ImageContextPtr pRoot )
+{
+    // Loaded modules snapshot. Target process isn't accessed past this point
+    auto loaded = _process.modules().GetAllModules();
+
+    bool fsRedirect = pRoot->peImage.mType() == mt_mod64 && _process.barrier().sourceWow64;
+    auto depFlags = pRoot->flags | NoSxS | NoDelayLoad | PartialExcept | IsDependency;
+
+    std::set<std::wstring> visited = { pRoot->ldrEntry.fullPath };
+    vecImageCtx level = { pRoot };
+
+    // Resolve image dependency paths, return ones not loaded yet
+    auto resolveDeps = [&]( ImageContextPtr pImage )
+    {
+        FsRedirector fsr( fsRedirect );
+        std::vector<std::wstring> missing;
+
+        auto flags = NameResolve::EnsureFullPath;
+        if (pImage->peImage.mType() == mt_mod32 && !_process.barrier().sourceWow64)
+            flags = static_cast<NameResolve::eResolveFlag>(static_cast<int32_t>(flags) | NameResolve::Wow64);
+
+        auto basedir = pImage->peImage.noPhysFile() ? Utils::GetExeDirectory() : Utils::GetParent( pImage->ldrEntry.fullPath );
+        auto resolveTable = [&]( const pe::mapImports& imports )
+        {
+            for (auto& importMod : imports)
+            {
+                if (pImage->depPaths.count( importMod.first ))
+                    continue;
+
+                // Remote SxS probe is left for commit phase
+                std::wstring path = importMod.first;
+                auto status = NameResolve::Instance().ResolvePath( 
+                    path, 
+                    pImage->ldrEntry.name, 
+                    basedir, 
+                    flags, 
+                    _process, 
+                    pImage->peImage.actx() 
+                );
+
+                if (!NT_SUCCESS( status ))
+                    continue;
+
+                pImage->depPaths.emplace( importMod.first, path );
+                if (loaded.count( std::make_pair( Utils::StripPath( path ), pImage->peImage.mType() ) ) == 0)
+                    missing.emplace_back( path );
+            }
+        };
+
+        resolveTable( pImage->peImage.GetImports() );
+        if (!(pImage->flags & NoDelayLoad))
+            resolveTable( pImage->peImage.GetImports( true ) );
+
+        return missing;
+    };
+
+    // Only manually mapped dependencies are loaded, native loader handles imports of the rest
+    auto isManual = [&]( ImageContextPtr pImage, const std::wstring& path )
+    {
+        auto data = GetLoadData( pImage, path );
+        return data.mtype == MT_Manual || (data.mtype == MT_Default && pImage->flags & ManualImports);
+    };
+
+    // Load missing dependency
+    auto loadDep = [&]( const std::wstring& path )
+    {
+        FsRedirector fsr( fsRedirect );
+        return LoadImageContext( path, nullptr, 0, false, depFlags );
+    };
+
+    // Process graph level by level
+    while (!level.empty())
+    {
+        std::vector<std::wstring> toLoad;
+        {
+            PhaseGuard phase( *this, Phase_ResolvePath );
+
+            std::vector<std::future<std::vector<std::wstring>>> resolvers;
+            for (auto& pImage : level)
+                resolvers.emplace_back( std::async( std::launch::async, resolveDeps, pImage ) );
+
+            // Loader callback is invoked on this thread only
+            for (size_t i = 0; i < resolvers.size(); i++)
+            {
+                for (auto& path : resolvers[i].get())
+                    if (visited.emplace( Utils::ToLower( path ) ).second && isManual( level[i], path ))
+                        toLoad.emplace_back( path );
+            }
+        }
+
+        PhaseGuard phase( *this, Phase_Parse );
+
+        std::vector<std::future<call_result_t<ImageContextPtr>>> loaders;
+        for (auto& path : toLoad)
+            loaders.emplace_back( std::async( std::launch::async, loadDep, path ) );
+
+        level.clear();
+        for (auto& fut : loaders)
+        {
+            auto pImage = fut.get();
+            if (!pImage)
+                continue;
+
+            _prepared.emplace( pImage.result()->ldrEntry.fullPath, pImage.result() );
+            level.emplace_back( pImage.result() );
+        }
+    }
+
+    BLACKBONE_TRACE( L"ManualMap: %d dependencies of '%ls' prepared", static_cast<int>(_prepared.size()), pRoot->ldrEntry.name.c_str() );
+}
+
+/// <summary>
+/// Get mapping order of prepared images
+/// </summary>
+/// <param name="root">Root image path</param>
+/// <returns>Prepared image paths, dependencies go before images importing them. Root is excluded</returns>
+std::vector<std::wstring> MMap::DependencyOrder( const std::wstring& root )
+{
+    std::vector<std::wstring> order;
+    std::set<std::wstring> visited;
+    auto rootPath = Utils::ToLower( root );
+
+    // Post-order walk, import cycles are cut at already visited image
+    std::function<void( const std::wstring& )> visit = [&]( const std::wstring& path )
+    {
+        if (!visited.emplace( path ).second)
+            return;
+
+        auto iter = _prepared.find( path );
+        if (iter == _prepared.end())
+            return;
+
+        for (auto& dep : iter->second->depPaths)
+            visit( Utils::ToLower( dep.second ) );
+
+        if (path != rootPath)
+            order.emplace_back( path );
+    };
+
+    visit( rootPath );
+    return order;
+}
+
+/// <summary>
+/// Get existing module or map it if absent
+/// </summary>
+/// <param name="path">Image path</param>
+/// <param name="buffer">Image data buffer</param>
+/// <param name="size">Buffer size.</param>
+/// <param name="asImage">If set to true - buffer has image memory layout</param>
+/// <param name="flags">Mapping flags</param>
+/// <returns>Module info</returns>
+call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
+    const std::wstring& path,
+    void* buffer, size_t size, bool asImage,
+    eLoadFlags flags /*= NoFlags*/ 
+    )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ImageContextPtr pImage;
+
+    // Use image loaded during dependency graph build
+    auto iter = _prepared.find( Utils::ToLower( path ) );
+    if (iter != _prepared.end())
+    {
+        pImage = std::move( iter->second );
+        pImage->flags = flags;
+        _prepared.erase( iter );
+    }
+    else
+    {
+        PhaseGuard phase( *this, Phase_Parse );
+
+        auto loaded = LoadImageContext( path, buffer, size, asImage, flags );
+        if (!loaded)
+            return loaded.status;
+
+        pImage = std::move( loaded.result() );
+    }
+
+    auto& ldrEntry = pImage->ldrEntry;
+
     // Check if already loaded
     if (auto hMod = _process.modules().GetModule( path, LdrList, pImage->peImage.mType() ))
     {
@@ -312,65 +662,71 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
 
     ldrEntry.type = pImage->peImage.mType();
 
-    // Try to map image in high (>4GB) memory range
-    if (flags & MapInHighMem)
     {
-        AllocateInHighMem( pImage->imgMem, pImage->peImage.imageSize() );
-    }
-    // Try to map image at it's original ASRL-aware base
-    else if (flags & HideVAD)
-    {      
-        ptr_t base  = pImage->peImage.imageBase();
-        ptr_t image_size = pImage->peImage.imageSize();
+        PhaseGuard phase( *this, Phase_Allocate );
 
-        if (!NT_SUCCESS( Driver().EnsureLoaded() ))
+        // Try to map image in high (>4GB) memory range
+        if (flags & MapInHighMem)
         {
-            pImage->peImage.Release();
-            return Driver().status();
+            AllocateInHighMem( pImage->imgMem, pImage->peImage.imageSize() );
         }
+        // Try to map image at it's original ASRL-aware base
+        else if (flags & HideVAD)
+        {      
+            ptr_t base  = pImage->peImage.imageBase();
+            ptr_t image_size = pImage->peImage.imageSize();
 
-        // Allocate as physical at desired base
-        status = Driver().AllocateMem( _process.pid(), base, image_size, MEM_COMMIT, PAGE_EXECUTE_READWRITE, true );
+            if (!NT_SUCCESS( Driver().EnsureLoaded() ))
+            {
+                pImage->peImage.Release();
+                return Driver().status();
+            }
 
-        // Allocate at any base
-        if (!NT_SUCCESS( status ))
-        {
-            base = 0;
-            image_size = pImage->peImage.imageSize();
+            // Allocate as physical at desired base
             status = Driver().AllocateMem( _process.pid(), base, image_size, MEM_COMMIT, PAGE_EXECUTE_READWRITE, true );
-        }
 
-        // Store allocated region
-        if (NT_SUCCESS( status ))
-        {
-            pImage->imgMem = MemBlock( &_process.memory(), base, static_cast<size_t>(image_size), PAGE_EXECUTE_READWRITE, true, true );
-        }
-        // Stop mapping
-        else
-        {
-            //flags &= ~HideVAD;
-            BLACKBONE_TRACE( L"ManualMap: Failed to allocate physical memory for image, status 0x%X", status );
-            pImage->peImage.Release();
-            return status;
+            // Allocate at any base
+            if (!NT_SUCCESS( status ))
+            {
+                base = 0;
+                image_size = pImage->peImage.imageSize();
+                status = Driver().AllocateMem( _process.pid(), base, image_size, MEM_COMMIT, PAGE_EXECUTE_READWRITE, true );
+            }
+
+            // Store allocated region
+            if (NT_SUCCESS( status ))
+            {
+                pImage->imgMem = MemBlock( &_process.memory(), base, static_cast<size_t>(image_size), PAGE_EXECUTE_READWRITE, true, true );
+            }
+            // Stop mapping
+            else
+            {
+                //flags &= ~HideVAD;
+                BLACKBONE_TRACE( L"ManualMap: Failed to allocate physical memory for image, status 0x%X", status );
+                pImage->peImage.Release();
+                return status;
+            }
         }
-    }
 
-    // Allocate normally if something went wrong
-    if (!pImage->imgMem.valid())
-    {
-        auto mem = _process.memory().Allocate( pImage->peImage.imageSize(), PAGE_EXECUTE_READWRITE, pImage->peImage.imageBase() );
-        if (!mem)
+        // Allocate normally if something went wrong
+        if (!pImage->imgMem.valid())
         {
-            BLACKBONE_TRACE( L"ManualMap: Failed to allocate memory for image, status 0x%X", status );
-            pImage->peImage.Release();
-            return mem.status;
-        }
+            auto mem = _process.memory().Allocate( pImage->peImage.imageSize(), PAGE_EXECUTE_READWRITE, pImage->peImage.imageBase() );
+            if (!mem)
+            {
+                BLACKBONE_TRACE( L"ManualMap: Failed to allocate memory for image, status 0x%X", status );
+                pImage->peImage.Release();
+                return mem.status;
+            }
 
-        pImage->imgMem = std::move( mem.result() );
+            pImage->imgMem = std::move( mem.result() );
+        }
     }
 
     ldrEntry.baseAddress = pImage->imgMem.ptr();
     ldrEntry.size = pImage->peImage.imageSize();
+    if (_profile)
+        _profile->images++;
 
     BLACKBONE_TRACE( L"ManualMap: Image base allocated at 0x%016llx", pImage->imgMem.ptr() );
 
@@ -378,7 +734,22 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
     if (pImage->peImage.manifestID() == 0)
         flags |= NoSxS;
 
-    if (!(flags & NoSxS))
+    // In-memory manifest is read from mapped image, so image resources must be in place first
+    bool actxFromImage = pImage->peImage.manifestFile().empty();
+
+    // 32 bit activation context structure can't reference x64 image in WOW64 process, fallback to manifest file
+    if (!(flags & NoSxS) && actxFromImage && pImage->peImage.mType() == mt_mod64 && _process.core().isWow64())
+    {
+        if (!NT_SUCCESS( status = pImage->peImage.DumpManifest() ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to extract manifest for image '%ls', status 0x%X", ldrEntry.name.c_str(), status );
+            pImage->peImage.Release();
+            return status;
+        }
+
+        actxFromImage = false;
+    }
+    if (!(flags & NoSxS) && !actxFromImage)
     {
         status = CreateActx( pImage->peImage );
         if (!NT_SUCCESS( status ))
@@ -389,18 +760,44 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
     }
 
     // Core image mapping operations
+    // Image is assembled in local buffer and written into target process only once.
+    // Relocation is deferred until cache lookup, export data doesn't depend on it
     if (!NT_SUCCESS( status = CopyImage( pImage ) ))
     {
         pImage->peImage.Release();
         return status;
     }
 
-    if (!NT_SUCCESS( status = RelocateImage( pImage ) ))
+    // Dependencies with circular imports must be able to read our exports
+    if (!NT_SUCCESS( status = PublishExports( pImage ) ))
     {
         pImage->peImage.Release();
         return status;
     }
 
+    if (!(flags & NoSxS) && actxFromImage)
+    {
+        auto rsrcRVA = pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_RESOURCE, pe::RVA );
+        auto rsrcSize = pImage->peImage.DirectorySize( IMAGE_DIRECTORY_ENTRY_RESOURCE );
+        if (rsrcRVA == 0 || rsrcRVA + rsrcSize > ldrEntry.size)
+            status = STATUS_INVALID_IMAGE_FORMAT;
+        else if (NT_SUCCESS( status = CommitImage( pImage, rsrcRVA, rsrcSize ) ))
+            status = CreateActx( pImage->peImage, pImage->imgMem.ptr() );
+
+        // Final commit doesn't need to write it again
+        if (NT_SUCCESS( status ))
+        {
+            pImage->rsrcRVA = rsrcRVA;
+            pImage->rsrcSize = rsrcSize;
+        }
+
+        if (!NT_SUCCESS( status ))
+        {
+            pImage->peImage.Release();
+            return status;
+        }
+    }
+
     auto mt = ldrEntry.type;
     auto pMod = _process.modules().AddManualModule( static_cast<ModuleData&>(ldrEntry) );
     {
@@ -409,29 +806,84 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
 
         FsRedirector fsr( fsRedirect );
 
-        // Import
-        if (!NT_SUCCESS( status = ResolveImport( pImage ) ))
+        // Reuse image already relocated and bound for the same bases
+        bool cached = (flags & CacheImage) && ApplyCachedImage( pImage );
+        if (!cached)
         {
-            pImage->peImage.Release();
-            _process.modules().RemoveManualModule( ldrEntry.name, mt );
-            return status;
-        }
+            if (!NT_SUCCESS( status = RelocateImage( pImage ) ))
+            {
+                pImage->peImage.Release();
+                _process.modules().RemoveManualModule( ldrEntry.name, mt );
+                return status;
+            }
 
-        // Delayed import
-        if (!(flags & NoDelayLoad) && !NT_SUCCESS( status = ResolveImport( pImage, true ) ))
-        {
-            pImage->peImage.Release();
-            _process.modules().RemoveManualModule( ldrEntry.name, mt );
-            return status;
+            // Import
+            if (!NT_SUCCESS( status = ResolveImport( pImage ) ))
+            {
+                pImage->peImage.Release();
+                _process.modules().RemoveManualModule( ldrEntry.name, mt );
+                return status;
+            }
+
+            // Delayed import
+            if (!(flags & NoDelayLoad) && !NT_SUCCESS( status = ResolveImport( pImage, true ) ))
+            {
+                pImage->peImage.Release();
+                _process.modules().RemoveManualModule( ldrEntry.name, mt );
+                return status;
+            }
+
+            if (flags & CacheImage)
+                StoreCachedImage( pImage );
         }
     }
 
+    // Initialize security cookie
+    if (!NT_SUCCESS ( status = InitializeCookie( pImage ) ))
+    {
+        BLACKBONE_TRACE( L"ManualMap: Failed to initialize cookie for image %ls", ldrEntry.name.c_str() );
+        pImage->peImage.Release();
+        _process.modules().RemoveManualModule( ldrEntry.name, mt );
+        return status;
+    }
+
+    // Write final image
+    if (!NT_SUCCESS( status = CommitImage( pImage ) ))
+    {
+        pImage->peImage.Release();
+        _process.modules().RemoveManualModule( ldrEntry.name, mt );
+        return status;
+    }
+
+    // Local copy is no longer needed
+    pImage->localImage.reset();
+
     // Apply proper memory protection for sections
     if (!(flags & HideVAD))
         ProtectImageMemory( pImage );
 
+    // Exception directory and SAFESEH presence are needed after image headers are released.
+    // Inverted table record is created by batch code, so SAFESEH can't be checked there
+    auto expRVA = pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_EXCEPTION, pe::RVA );
+    if (expRVA)
+    {
+        pImage->expDirectory = expRVA + pImage->imgMem.ptr<ptr_t>();
+        pImage->expDirectorySize = static_cast<uint32_t>(pImage->peImage.DirectorySize( IMAGE_DIRECTORY_ENTRY_EXCEPTION ));
+    }
+
+    if (flags & BatchInit && mt == mt_mod32)
+    {
+        auto pLoadConfig = reinterpret_cast<PIMAGE_LOAD_CONFIG_DIRECTORY32>(pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG ));
+        bool hasTable = pLoadConfig
+            && pLoadConfig->Size >= offsetof( IMAGE_LOAD_CONFIG_DIRECTORY32, SEHandlerCount ) + sizeof( pLoadConfig->SEHandlerCount )
+            && pLoadConfig->SEHandlerCount != 0;
+
+        ldrEntry.safeSEH = hasTable || (pImage->peImage.DllCharacteristics() & IMAGE_DLLCHARACTERISTICS_NO_SEH) != 0;
+    }
+
     // Make exception handling possible (C and C++)
-    if (!(flags & NoExceptions))
+    // Deferred to initializer batch
+    if (!(flags & NoExceptions) && !(flags & BatchInit))
     {
         if (!NT_SUCCESS( status = EnableExceptions( pImage ) ) && status != STATUS_NOT_FOUND)
         {
@@ -442,214 +894,475 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapModule(
         }
     }
 
-    // Initialize security cookie
-    if (!NT_SUCCESS ( status = InitializeCookie( pImage ) ))
+    // Unlink image from VAD list
+    if (flags & HideVAD && !NT_SUCCESS( status = ConcealVad( pImage->imgMem ) ))
     {
-        BLACKBONE_TRACE( L"ManualMap: Failed to initialize cookie for image %ls", ldrEntry.name.c_str() );
         pImage->peImage.Release();
         _process.modules().RemoveManualModule( ldrEntry.name, mt );
         return status;
     }
 
-    // Unlink image from VAD list
-    if (flags & HideVAD && !NT_SUCCESS( status = ConcealVad( pImage->imgMem ) ))
+    // Get entry point
+    pImage->ldrEntry.entryPoint = pImage->peImage.entryPoint( pImage->imgMem.ptr<ptr_t>() );
+
+    // Create reference for native loader functions
+    pImage->ldrEntry.flags = flags & CreateLdrRef ? Ldr_All : Ldr_None;
+    if (_mapCallback != nullptr)
     {
+        auto mapData = _mapCallback( PostCallback, _userContext, _process, *pMod );
+        if(mapData.ldrFlags != Ldr_Ignore)
+            pImage->ldrEntry.flags = mapData.ldrFlags;
+    }
+
+    if (pImage->ldrEntry.flags != Ldr_None)
+    {       
+        if (!_process.nativeLdr().CreateNTReference( pImage->ldrEntry ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to add loader reference for image %ls", ldrEntry.name.c_str() );
+        }
+    }
+
+    // Headers are released before batched initialization, so TLS directory must be resolved now
+    auto pTls = reinterpret_cast<PIMAGE_TLS_DIRECTORY>(pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_TLS ));
+    if (pTls && pTls->AddressOfIndex)
+        pImage->tlsDirectory = REBASE( pTls, pImage->peImage.base(), pImage->imgMem.ptr() );
+
+    // Static TLS data
+    // Deferred to initializer batch
+    if (!(flags & NoTLS) && !(flags & BatchInit) && !NT_SUCCESS( status = InitStaticTLS( pImage ) ))
+    {
+        BLACKBONE_TRACE( L"ManualMap: Failed to initialize static TLS for image %ls, status 0x%X", ldrEntry.name.c_str(), status );
         pImage->peImage.Release();
         _process.modules().RemoveManualModule( ldrEntry.name, mt );
         return status;
     }
+    
+    // Fill TLS callbacks
+    pImage->peImage.GetTLSCallbacks( pImage->imgMem.ptr<ptr_t>(), pImage->tlsCallbacks );
+
+    // Unload local copy
+    pImage->peImage.Release();
+
+    // Release ownership of image memory block
+    pImage->imgMem.Release();
+
+    // Store image
+    _images.emplace_back( std::move( pImage ) );
+    return pMod;
+}
+
+/// <summary>
+/// Unmap all manually mapped modules
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS MMap::UnmapAllModules()
+{
+    for (auto img = _images.rbegin(); img != _images.rend(); ++img)
+    {
+        auto pImage = *img;
+        BLACKBONE_TRACE( L"ManualMap: Unmapping image '%ls'", pImage->ldrEntry.name.c_str() );
+
+        // Call main
+        RunModuleInitializers( pImage, DLL_PROCESS_DETACH );
+
+        // Remove VEH
+        if (!(pImage->flags & NoExceptions))
+            DisableExceptions( pImage );
+
+        // Remove from loader
+        if (pImage->ldrEntry.flags != Ldr_None)
+            _process.modules().Unlink( pImage->ldrEntry );
+
+        // Free memory
+        pImage->imgMem.Free();
+
+        // Remove reference from local modules list
+        _process.modules().RemoveManualModule( pImage->ldrEntry.name, pImage->peImage.mType() );
+    } 
+
+    Cleanup();
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Copies image headers and sections into local staging buffer
+/// </summary>
+/// <param name="pImage">Image data</param>
+/// <returns>Status code</returns>
+NTSTATUS MMap::CopyImage( ImageContextPtr pImage )
+{
+    PhaseGuard phase( *this, Phase_Copy );
+
+    BLACKBONE_TRACE( L"ManualMap: Performing image copy" );
+
+    pImage->localImage = _arena.Allocate( pImage->ldrEntry.size );
+    auto pLocal = pImage->localImage.get();
+
+    // offset to first section equals to header size
+    size_t dwHeaderSize = std::min<size_t>( pImage->peImage.headersSize(), pImage->ldrEntry.size );
+    memcpy( pLocal, pImage->peImage.base(), dwHeaderSize );
+
+    // Copy sections
+    for (auto& section : pImage->peImage.sections())
+    {
+        // Skip discardable sections
+        if (section.Characteristics & (IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE))
+        {
+            if (section.SizeOfRawData == 0)
+                continue;
+
+            uint8_t* pSource = reinterpret_cast<uint8_t*>(pImage->peImage.ResolveRVAToVA( section.VirtualAddress ));
+            if (pSource == nullptr || section.VirtualAddress >= pImage->ldrEntry.size)
+            {
+                BLACKBONE_TRACE( L"ManualMap: Failed to copy image section at offset 0x%x", section.VirtualAddress );
+                return STATUS_INVALID_IMAGE_FORMAT;
+            }
+
+            // Raw size can exceed image bounds due to file alignment
+            size_t secSize = std::min<size_t>( section.SizeOfRawData, pImage->ldrEntry.size - section.VirtualAddress );
+            memcpy( pLocal + section.VirtualAddress, pSource, secSize );
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Write staged image data into target process
+/// </summary>
+/// <param name="pImage">Image data</param>
+/// <param name="offset">Offset in image</param>
+/// <param name="size">Size of data to write. If 0 - whole image is written, except resource directory written ahead</param>
+/// <returns>Status code</returns>
+NTSTATUS MMap::CommitImage( ImageContextPtr pImage, uintptr_t offset /*= 0*/, size_t size /*= 0*/ )
+{
+    PhaseGuard phase( *this, Phase_Copy );
+
+    NTSTATUS status = STATUS_SUCCESS;
+    if (!pImage->localImage)
+        return STATUS_INVALID_PARAMETER;
+
+    // Write around resource directory
+    if (offset == 0 && size == 0 && pImage->rsrcSize != 0)
+    {
+        auto rsrcEnd = pImage->rsrcRVA + pImage->rsrcSize;
+        if (pImage->rsrcRVA != 0 && !NT_SUCCESS( status = CommitImage( pImage, 0, pImage->rsrcRVA ) ))
+            return status;
+
+        if (rsrcEnd < pImage->ldrEntry.size)
+            status = CommitImage( pImage, rsrcEnd, static_cast<size_t>(pImage->ldrEntry.size) - rsrcEnd );
+
+        return status;
+    }
+
+    if (size == 0)
+        size = static_cast<size_t>(pImage->ldrEntry.size) - offset;
+
+    auto pSource = pImage->localImage.get() + offset;
+    if (pImage->flags & HideVAD)
+        status = Driver().WriteMem( _process.pid(), pImage->imgMem.ptr() + offset, size, pSource );
+    else
+        status = pImage->imgMem.Write( offset, size, pSource );
+
+    if (!NT_SUCCESS( status ))
+    {
+        BLACKBONE_TRACE( 
+            L"ManualMap: Failed to write image data at offset 0x%x, size 0x%x. Status = 0x%x", 
+            offset, size, status 
+        );
+    }
+
+    return status;
+}
+
+/// <summary>
+/// Write image headers and export directory into target process.
+/// Required to resolve circular imports before whole image is committed
+/// </summary>
+/// <param name="pImage">Image data</param>
+/// <returns>Status code</returns>
+NTSTATUS MMap::PublishExports( ImageContextPtr pImage )
+{
+    auto status = CommitImage( pImage, 0, std::min<size_t>( pImage->peImage.headersSize(), pImage->ldrEntry.size ) );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    auto expRVA = pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_EXPORT, pe::RVA );
+    auto expSize = pImage->peImage.DirectorySize( IMAGE_DIRECTORY_ENTRY_EXPORT );
+    if (expRVA == 0 || expSize == 0 || expRVA + expSize > pImage->ldrEntry.size)
+        return STATUS_SUCCESS;
+
+    return CommitImage( pImage, expRVA, expSize );
+}
+
+/// <summary>
+/// Adjust image memory protection
+/// </summary>
+/// <param name="pImage">image data</param>
+/// <returns>Status code</returns>
+NTSTATUS MMap::ProtectImageMemory( ImageContextPtr pImage )
+{
+    PhaseGuard phase( *this, Phase_Protect );
+
+    return ApplyProtectionRuns( pImage, GetProtectionRuns( pImage, false ) );
+}
+
+/// <summary>
+/// Replace staged image with cached one, bound against current dependency bases
+/// </summary>
+/// <param name="pImage">Image data</param>
+/// <returns>true if cached image was applied</returns>
+bool MMap::ApplyCachedImage( ImageContextPtr pImage )
+{
+    PhaseGuard phase( *this, Phase_Imports );
 
-    // Get entry point
-    pImage->ldrEntry.entryPoint = pImage->peImage.entryPoint( pImage->imgMem.ptr<ptr_t>() );
+    // Staged image isn't relocated yet
+    pImage->imageHash = ImageCache::Hash( pImage->localImage.get(), pImage->ldrEntry.size );
 
-    // Create reference for native loader functions
-    pImage->ldrEntry.flags = flags & CreateLdrRef ? Ldr_All : Ldr_None;
-    if (_mapCallback != nullptr)
+    auto cacheFlags = static_cast<uint32_t>(pImage->flags & (ManualImports | NoDelayLoad));
+    for (auto& entry : ImageCache::Instance().Find( pImage->imageHash, pImage->imgMem.ptr(), cacheFlags ))
     {
-        auto mapData = _mapCallback( PostCallback, _userContext, _process, *pMod );
-        if(mapData.ldrFlags != Ldr_Ignore)
-            pImage->ldrEntry.flags = mapData.ldrFlags;
-    }
+        if (entry->image.size() != pImage->ldrEntry.size)
+            continue;
 
-    if (pImage->ldrEntry.flags != Ldr_None)
-    {       
-        if (!_process.nativeLdr().CreateNTReference( pImage->ldrEntry ))
+        // Validate against actual dependency bases.
+        // Only already loaded modules are considered, missing dependency is mapped by regular import resolve
+        bool valid = true;
+        for (auto& dep : entry->deps)
         {
-            BLACKBONE_TRACE( L"ManualMap: Failed to add loader reference for image %ls", ldrEntry.name.c_str() );
+            std::wstring name = dep.name;
+            auto hMod = _process.modules().GetModule( name, LdrList, pImage->peImage.mType(), pImage->ldrEntry.fullPath.c_str() );
+            if (!hMod || hMod->baseAddress != dep.base || hMod->size != dep.size)
+            {
+                valid = false;
+                break;
+            }
         }
-    }
 
-    // Static TLS data
-    if (!(flags & NoTLS) && !NT_SUCCESS( status = InitStaticTLS( pImage ) ))
-    {
-        BLACKBONE_TRACE( L"ManualMap: Failed to initialize static TLS for image %ls, status 0x%X", ldrEntry.name.c_str(), status );
-        pImage->peImage.Release();
-        _process.modules().RemoveManualModule( ldrEntry.name, mt );
-        return status;
+        if (valid)
+        {
+            BLACKBONE_TRACE( L"ManualMap: Using cached image for '%ls'", pImage->ldrEntry.name.c_str() );
+
+            // Resource directory written ahead must match cached one, otherwise final commit writes it again
+            auto pRsrc = pImage->localImage.get() + pImage->rsrcRVA;
+            if (pImage->rsrcSize != 0 && memcmp( pRsrc, entry->image.data() + pImage->rsrcRVA, pImage->rsrcSize ) != 0)
+                pImage->rsrcSize = 0;
+
+            memcpy( pImage->localImage.get(), entry->image.data(), entry->image.size() );
+            pImage->boundDeps = entry->deps;
+            return true;
+        }
     }
-    
-    // Fill TLS callbacks
-    pImage->peImage.GetTLSCallbacks( pImage->imgMem.ptr<ptr_t>(), pImage->tlsCallbacks );
 
-    // Unload local copy
-    pImage->peImage.Release();
+    return false;
+}
 
-    // Release ownership of image memory block
-    pImage->imgMem.Release();
+/// <summary>
+/// Store relocated and bound staged image in cache
+/// </summary>
+/// <param name="pImage">Image data</param>
+void MMap::StoreCachedImage( ImageContextPtr pImage )
+{
+    auto entry = std::make_shared<CachedImage>();
+    entry->deps = pImage->boundDeps;
+    entry->image.assign( pImage->localImage.get(), pImage->localImage.get() + pImage->ldrEntry.size );
 
-    // Store image
-    _images.emplace_back( std::move( pImage ) );
-    return pMod;
+    auto cacheFlags = static_cast<uint32_t>(pImage->flags & (ManualImports | NoDelayLoad));
+    ImageCache::Instance().Store( pImage->imageHash, pImage->imgMem.ptr(), cacheFlags, std::move( entry ) );
 }
 
 /// <summary>
-/// Unmap all manually mapped modules
+/// Build page-granular protection map of image and merge it into runs of equal protection
 /// </summary>
-/// <returns>Status code</returns>
-NTSTATUS MMap::UnmapAllModules()
+/// <param name="pImage">Image data</param>
+/// <param name="wipe">Map only header and discardable sections scheduled for wipe</param>
+/// <returns>Protection runs</returns>
+vecProtRuns MMap::GetProtectionRuns( ImageContextPtr pImage, bool wipe )
 {
-    for (auto img = _images.rbegin(); img != _images.rend(); ++img)
+    // Zero protection - page is left untouched
+    std::vector<DWORD> pages( Align( pImage->peImage.imageSize(), 0x1000 ) / 0x1000, 0 );
+    auto markPages = [&pages]( size_t offset, size_t size, DWORD prot )
     {
-        auto pImage = *img;
-        BLACKBONE_TRACE( L"ManualMap: Unmapping image '%ls'", pImage->ldrEntry.name.c_str() );
-
-        // Call main
-        RunModuleInitializers( pImage, DLL_PROCESS_DETACH );
+        auto last = std::min<size_t>( Align( offset + size, 0x1000 ) / 0x1000, pages.size() );
+        for (size_t i = offset / 0x1000; i < last; i++)
+            pages[i] = prot;
+    };
 
-        // Remove VEH
-        if (!(pImage->flags & NoExceptions))
-            DisableExceptions( pImage );
+    if (!wipe)
+    {
+        markPages( 0, pImage->peImage.headersSize(), PAGE_READONLY );
+        for (auto& section : pImage->peImage.sections())
+            markPages( section.VirtualAddress, section.Misc.VirtualSize, GetSectionProt( section.Characteristics ) );
+    }
+    else
+    {
+        if (pImage->flags & WipeHeader)
+            markPages( 0, pImage->peImage.headersSize(), PAGE_NOACCESS );
 
-        // Remove from loader
-        if (pImage->ldrEntry.flags != Ldr_None)
-            _process.modules().Unlink( pImage->ldrEntry );
+        if (!pImage->peImage.pureIL())
+        {
+            for (auto& section : pImage->peImage.sections())
+                if (section.Characteristics & IMAGE_SCN_MEM_DISCARDABLE)
+                    markPages( section.VirtualAddress, section.Misc.VirtualSize, PAGE_NOACCESS );
+        }
+    }
 
-        // Free memory
-        pImage->imgMem.Free();
+    // Merge adjacent pages
+    vecProtRuns runs;
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        if (pages[i] == 0)
+            continue;
 
-        // Remove reference from local modules list
-        _process.modules().RemoveManualModule( pImage->ldrEntry.name, pImage->peImage.mType() );
-    } 
+        if (!runs.empty() && runs.back().prot == pages[i] && runs.back().offset + runs.back().size == i * 0x1000)
+            runs.back().size += 0x1000;
+        else
+            runs.emplace_back( ProtectionRun{ i * 0x1000, 0x1000, pages[i] } );
+    }
 
-    Cleanup();
-    return STATUS_SUCCESS;
+    return runs;
 }
 
 /// <summary>
-/// Copies image into target process
+/// Apply protection runs to image memory, all runs are submitted in a single remote call when possible
 /// </summary>
 /// <param name="pImage">Image data</param>
+/// <param name="runs">Protection runs, PAGE_NOACCESS runs are decommitted</param>
 /// <returns>Status code</returns>
-NTSTATUS MMap::CopyImage( ImageContextPtr pImage )
+NTSTATUS MMap::ApplyProtectionRuns( ImageContextPtr pImage, const vecProtRuns& runs )
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    auto reportDecommit = []( const ProtectionRun& run, NTSTATUS status )
+    {
+        if (!NT_SUCCESS( status ))
+        {
+            BLACKBONE_TRACE(
+                L"ManualMap: Failed to decommit image memory at offset 0x%x. Status = 0x%x",
+                run.offset, status
+            );
+        }
+    };
 
-    BLACKBONE_TRACE( L"ManualMap: Performing image copy" );
+    auto reportProtect = []( const ProtectionRun& run, NTSTATUS status )
+    {
+        if (!NT_SUCCESS( status ))
+        {
+            BLACKBONE_TRACE(
+                L"ManualMap: Failed to set image memory protection at offset 0x%x. Status = 0x%x",
+                run.offset, status
+            );
+        }
 
-    // offset to first section equals to header size
-    size_t dwHeaderSize = pImage->peImage.headersSize();
+        return status;
+    };
 
-    // Copy header
-    if (pImage->flags & HideVAD)
-        status = Driver().WriteMem( _process.pid(), pImage->imgMem.ptr(), dwHeaderSize, pImage->peImage.base() );
-    else
-        status = pImage->imgMem.Write( 0, dwHeaderSize, pImage->peImage.base() );
+    // Batch stub runs in worker thread of process architecture, hijack mode must not create one
+    auto mt = pImage->ldrEntry.type;
+    bool batch = runs.size() > 1
+        && mt == (_process.core().isWow64() ? mt_mod32 : mt_mod64)
+        && !(pImage->flags & NoThreads);
 
-    if (!NT_SUCCESS( status ))
+    call_result_t<exportData> pProtect, pFree;
+    if (batch)
     {
-        BLACKBONE_TRACE( L"ManualMap: Failed to copy image headers. Status = 0x%x", status );
-        return status;
+        pProtect = _process.modules().GetNtdllExport( "NtProtectVirtualMemory", mt );
+        pFree = _process.modules().GetNtdllExport( "NtFreeVirtualMemory", mt );
+        batch = pProtect && pFree;
     }
 
-    // Set header protection
-    if (!(pImage->flags & HideVAD))
+    if (!batch)
     {
-        status = pImage->imgMem.Protect( PAGE_READONLY, 0, dwHeaderSize );
-        if (!NT_SUCCESS( status ))
+        for (auto& run : runs)
         {
-            BLACKBONE_TRACE( L"ManualMap: Failed to set header memory protection. Status = 0x%x", status );
-            return status;
+            // Decommit pages with NO_ACCESS protection
+            if (run.prot == PAGE_NOACCESS)
+            {
+                reportDecommit( run, _process.memory().Free( pImage->imgMem.ptr() + run.offset, run.size, MEM_DECOMMIT ) );
+                continue;
+            }
+
+            auto status = reportProtect( run, pImage->imgMem.Protect( run.prot, run.offset, run.size ) );
+            if (!NT_SUCCESS( status ))
+                return status;
         }
+
+        return STATUS_SUCCESS;
     }
 
-    // Copy sections
-    for (auto& section : pImage->peImage.sections())
+    // Base and size are updated by syscall, so every run needs own copy
+    struct RunArgs
     {
-        // Skip discardable sections
-        if (section.Characteristics & (IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE))
-        {
-            if (section.SizeOfRawData == 0)
-                continue;
+        uint64_t base;
+        uint64_t size;
+        uint32_t oldProt;
+    };
 
-            uint8_t* pSource = reinterpret_cast<uint8_t*>(pImage->peImage.ResolveRVAToVA( section.VirtualAddress ));
-            
-            // Copy section data
-            if (pImage->flags & HideVAD)
-            {
-                status = Driver().WriteMem(
-                    _process.pid(), pImage->imgMem.ptr() + section.VirtualAddress,
-                    section.SizeOfRawData, pSource
-                    );
-            }
-            else
-            {
-                status = pImage->imgMem.Write( section.VirtualAddress, section.SizeOfRawData, pSource );
-            }
+    std::vector<RunArgs> args( runs.size() );
+    size_t ptrSize = mt == mt_mod64 ? sizeof( uint64_t ) : sizeof( uint32_t );
+    RemoteCallBatch calls( _process );
 
-            if (!NT_SUCCESS( status ))
-            {
-                BLACKBONE_TRACE(
-                    L"ManualMap: Failed to copy image section at offset 0x%x. Status = 0x%x",
-                    section.VirtualAddress, status
-                    );
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        auto& run = runs[i];
+        args[i] = RunArgs{ pImage->imgMem.ptr() + run.offset, run.size, 0 };
 
-                return status;
-            }
-        } 
+        // NtCurrentProcess
+        ptr_t hProcess = static_cast<ptr_t>(-1);
+        AsmVariant base( &args[i].base, ptrSize );
+        AsmVariant size( &args[i].size, ptrSize );
+
+        if (run.prot == PAGE_NOACCESS)
+            calls.Add( pFree->procAddress, { hProcess, base, size, MEM_DECOMMIT } );
+        else
+            calls.Add( pProtect->procAddress, { hProcess, base, size, run.prot, AsmVariant( &args[i].oldProt, sizeof( uint32_t ) ) } );
+    }
+
+    auto status = calls.Execute();
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        auto& run = runs[i];
+        auto result = calls.result<NTSTATUS>( i ).result( STATUS_UNSUCCESSFUL );
+
+        if (run.prot == PAGE_NOACCESS)
+            reportDecommit( run, result );
+        else if (!NT_SUCCESS( reportProtect( run, result ) ))
+            return result;
     }
 
     return STATUS_SUCCESS;
 }
 
 /// <summary>
-/// Adjust image memory protection
+/// Erase header and discardable sections of initialized image
 /// </summary>
-/// <param name="pImage">image data</param>
-/// <returns>Status code</returns>
-NTSTATUS MMap::ProtectImageMemory( ImageContextPtr pImage )
+/// <param name="pImage">Image data</param>
+void MMap::WipeImageMemory( ImageContextPtr pImage )
 {
-    // Set section memory protection
-    for (auto& section : pImage->peImage.sections())
+    PhaseGuard phase( *this, Phase_Protect );
+
+    auto runs = GetProtectionRuns( pImage, true );
+    if (runs.empty())
+        return;
+
+    // Decommit discards page contents
+    if (!(pImage->flags & HideVAD))
     {
-        auto prot = GetSectionProt( section.Characteristics );
-        if (prot != PAGE_NOACCESS)
-        {
-            auto status = pImage->imgMem.Protect( prot, section.VirtualAddress, section.Misc.VirtualSize );
-            if (!NT_SUCCESS( status ))
-            {
-                BLACKBONE_TRACE(
-                    L"ManualMap: Failed to set section memory protection at offset 0x%x. Status = 0x%x",
-                    section.VirtualAddress, status
-                    );
+        ApplyProtectionRuns( pImage, runs );
+        return;
+    }
 
-                return status;
-            }
-        }
-        // Decommit pages with NO_ACCESS protection
-        else
+    // Physical memory can't be decommitted, overwrite with zeroes
+    static const uint8_t zeroBuf[0x10000] = { 0 };
+    for (auto& run : runs)
+    {
+        for (size_t offset = 0; offset < run.size; offset += sizeof( zeroBuf ))
         {
-            auto status = _process.memory().Free( pImage->imgMem.ptr() + section.VirtualAddress, section.Misc.VirtualSize, MEM_DECOMMIT );
-            if (!NT_SUCCESS( status ))
-            {
-                BLACKBONE_TRACE(
-                    L"ManualMap: Failed to set section memory protection at offset 0x%x. Status = 0x%x",
-                    section.VirtualAddress, status
-                );
-            }
+            auto size = std::min<size_t>( sizeof( zeroBuf ), run.size - offset );
+            Driver().WriteMem( _process.pid(), pImage->imgMem.ptr() + run.offset + offset, size, const_cast<uint8_t*>(zeroBuf) );
         }
     }
-
-    return STATUS_SUCCESS;
 }
 
 /// <summary>
@@ -659,7 +1372,8 @@ NTSTATUS MMap::ProtectImageMemory( ImageContextPtr pImage )
 /// <returns>true on success</returns>
 NTSTATUS MMap::RelocateImage( ImageContextPtr pImage )
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    PhaseGuard phase( *this, Phase_Relocate );
+
     BLACKBONE_TRACE( L"ManualMap: Relocating image '%ls'", pImage->ldrEntry.fullPath.c_str() );
 
     // Reloc delta
@@ -690,13 +1404,15 @@ NTSTATUS MMap::RelocateImage( ImageContextPtr pImage )
         return STATUS_SUCCESS;
     }
 
-    // Read whole image to process it locally
-    std::unique_ptr<uint8_t[]> localImage( new uint8_t[pImage->ldrEntry.size] );
-    auto pLocal = localImage.get();
-    _process.memory().Read( pImage->imgMem.ptr(), pImage->ldrEntry.size, pLocal );
+    // Patch staged image
+    auto pLocal = pImage->localImage.get();
 
     while ((uintptr_t)fixrec < end && fixrec->BlockSize)
     {
+        // Resource directory written ahead is patched, so final commit must write it again
+        if (fixrec->PageRVA < pImage->rsrcRVA + pImage->rsrcSize && fixrec->PageRVA + 0x1000 > pImage->rsrcRVA)
+            pImage->rsrcSize = 0;
+
         DWORD count = (fixrec->BlockSize - 8) >> 1;             // records count
 
         for (DWORD i = 0; i < count; ++i)
@@ -735,18 +1451,7 @@ NTSTATUS MMap::RelocateImage( ImageContextPtr pImage )
         fixrec = reinterpret_cast<pe::RelocData*>(reinterpret_cast<uintptr_t>(fixrec) + fixrec->BlockSize);
     }
 
-    // Apply relocations, skip header
-    if (pImage->flags & HideVAD)
-        status = Driver().WriteMem( _process.pid(), pImage->ldrEntry.baseAddress + 0x1000, pImage->ldrEntry.size - 0x1000, pLocal + 0x1000 );
-    else
-        status = _process.memory().Write( pImage->ldrEntry.baseAddress + 0x1000, pImage->ldrEntry.size - 0x1000, pLocal + 0x1000 );
-
-    if (!NT_SUCCESS( status ))
-    {
-        BLACKBONE_TRACE( L"ManualMap: Failed to apply relocations. Status = 0x%x", status );
-    }
-
-    return status;
+    return STATUS_SUCCESS;
 }
 
 /// <summary>
@@ -764,51 +1469,51 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapDependency( ImageContextPtr pImage,
 
     BLACKBONE_TRACE( L"ManualMap: Loading new dependency '%ls'", path.c_str() );
 
-    auto flags = NameResolve::EnsureFullPath;
-
-    // Wow64 fs redirection
-    if (pImage->ldrEntry.type == mt_mod32 && !_process.barrier().sourceWow64)
-        flags = static_cast<NameResolve::eResolveFlag>(static_cast<int32_t>(flags) | NameResolve::Wow64);
-
-    auto basedir = pImage->peImage.noPhysFile() ? Utils::GetExeDirectory() : Utils::GetParent( pImage->ldrEntry.fullPath );
-    auto status = NameResolve::Instance().ResolvePath( 
-        path,
-        pImage->ldrEntry.name, 
-        basedir, 
-        flags, 
-        _process, 
-        pImage->peImage.actx() 
-    );
+    NTSTATUS status = STATUS_SUCCESS;
 
-    // Do remote SxS probe
-    if (status == STATUS_SXS_IDENTITIES_DIFFERENT)
+    // Path was resolved during dependency graph build
+    auto resolved = pImage->depPaths.find( path );
+    if (resolved != pImage->depPaths.end())
     {
-        status = ProbeRemoteSxS( path );
+        path = resolved->second;
     }
-
-    if (!NT_SUCCESS( status ))
+    else
     {
-        BLACKBONE_TRACE( L"ManualMap: Failed to resolve dependency path '%ls', status 0x%x", path.c_str(), status );
-        return status;
-    }
-
-    BLACKBONE_TRACE( L"ManualMap: Dependency path resolved to '%ls'", path.c_str() );
+        PhaseGuard phase( *this, Phase_ResolvePath );
+
+        auto flags = NameResolve::EnsureFullPath;
+
+        // Wow64 fs redirection
+        if (pImage->ldrEntry.type == mt_mod32 && !_process.barrier().sourceWow64)
+            flags = static_cast<NameResolve::eResolveFlag>(static_cast<int32_t>(flags) | NameResolve::Wow64);
+
+        auto basedir = pImage->peImage.noPhysFile() ? Utils::GetExeDirectory() : Utils::GetParent( pImage->ldrEntry.fullPath );
+        status = NameResolve::Instance().ResolvePath( 
+            path,
+            pImage->ldrEntry.name, 
+            basedir, 
+            flags, 
+            _process, 
+            pImage->peImage.actx() 
+        );
 
-    LoadData data;
-    if (_mapCallback != nullptr)
-    {
-        ModuleData tmpData;
-        tmpData.baseAddress = 0;
-        tmpData.manual = ((pImage->flags & ManualImports) != 0);
-        tmpData.fullPath = path;
-        tmpData.name = Utils::ToLower( Utils::StripPath( path ) );
-        tmpData.size = 0;
-        tmpData.type = pImage->ldrEntry.type;
+        // Do remote SxS probe
+        if (status == STATUS_SXS_IDENTITIES_DIFFERENT)
+        {
+            status = ProbeRemoteSxS( path );
+        }
 
-        data = _mapCallback( PreCallback, _userContext, _process, tmpData );
+        if (!NT_SUCCESS( status ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to resolve dependency path '%ls', status 0x%x", path.c_str(), status );
+            return status;
+        }
     }
 
+    BLACKBONE_TRACE( L"ManualMap: Dependency path resolved to '%ls'", path.c_str() );
+
     // Loading method
+    auto data = GetLoadData( pImage, path );
     if (data.mtype == MT_Manual || (data.mtype == MT_Default && pImage->flags & ManualImports))
     {
         return FindOrMapModule( path, nullptr, 0, false, pImage->flags | NoSxS | NoDelayLoad | PartialExcept | IsDependency );
@@ -824,6 +1529,38 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapDependency( ImageContextPtr pImage,
     }
 };
 
+/// <summary>
+/// Get loading method of missing dependency, decision is made once per mapping
+/// </summary>
+/// <param name="pImage">Image importing dependency</param>
+/// <param name="path">Resolved dependency path</param>
+/// <returns>Loading method</returns>
+LoadData MMap::GetLoadData( ImageContextPtr pImage, const std::wstring& path )
+{
+    // Decided during dependency graph build
+    auto key = Utils::ToLower( path );
+    auto iter = _loadData.find( key );
+    if (iter != _loadData.end())
+        return iter->second;
+
+    LoadData data;
+    if (_mapCallback != nullptr)
+    {
+        ModuleData tmpData;
+        tmpData.baseAddress = 0;
+        tmpData.manual = ((pImage->flags & ManualImports) != 0);
+        tmpData.fullPath = path;
+        tmpData.name = Utils::ToLower( Utils::StripPath( path ) );
+        tmpData.size = 0;
+        tmpData.type = pImage->peImage.mType();
+
+        data = _mapCallback( PreCallback, _userContext, _process, tmpData );
+    }
+
+    _loadData.emplace( key, data );
+    return data;
+}
+
 /// <summary>
 /// Resolves image import or delayed image import
 /// </summary>
@@ -832,14 +1569,27 @@ call_result_t<ModuleDataPtr> MMap::FindOrMapDependency( ImageContextPtr pImage,
 /// <returns>Status code</returns>
 NTSTATUS MMap::ResolveImport( ImageContextPtr pImage, bool useDelayed /*= false */ )
 {
+    PhaseGuard phase( *this, Phase_Imports );
+
     auto imports = pImage->peImage.GetImports( useDelayed );
     if (imports.empty())
         return STATUS_SUCCESS;
 
-    // Read whole image to process it locally
-    std::unique_ptr<uint8_t[]> localImage( new uint8_t[pImage->ldrEntry.size] );
-    auto pLocal = localImage.get();
-    _process.memory().Read( pImage->imgMem.ptr(), pImage->ldrEntry.size, pLocal );
+    // Bind staged image
+    auto pLocal = pImage->localImage.get();
+
+    // Remember modules used for binding
+    auto recordDep = [pImage]( const std::wstring& name, const ModuleDataPtr& mod )
+    {
+        if (!(pImage->flags & CacheImage))
+            return;
+
+        for (auto& dep : pImage->boundDeps)
+            if (dep.name == name)
+                return;
+
+        pImage->boundDeps.emplace_back( CachedDependency{ name, mod->baseAddress, mod->size } );
+    };
 
     // Traverse entries
     for (auto& importMod : imports)
@@ -854,6 +1604,8 @@ NTSTATUS MMap::ResolveImport( ImageContextPtr pImage, bool useDelayed /*= false
             return hMod.status;
         }
 
+        recordDep( importMod.first, hMod.result() );
+
         for (auto& importFn : importMod.second)
         {
             call_result_t<exportData> expData;
@@ -876,6 +1628,8 @@ NTSTATUS MMap::ResolveImport( ImageContextPtr pImage, bool useDelayed /*= false
                     return hFwdMod.status;
                 }
 
+                recordDep( expData->forwardModule, hFwdMod.result() );
+
                 if (expData->forwardByOrd)
                 {
                     expData = _process.modules().GetExport(
@@ -910,42 +1664,15 @@ NTSTATUS MMap::ResolveImport( ImageContextPtr pImage, bool useDelayed /*= false
 
                 return expData.status;
             }
-
-            if (pImage->ldrEntry.type == mt_mod64)
-                *reinterpret_cast<uint64_t*>(pLocal + importFn.ptrRVA) = expData->procAddress;
-            else
-                *reinterpret_cast<uint32_t*>(pLocal + importFn.ptrRVA) = static_cast<uint32_t>(expData->procAddress);
-        }
-    }
-
-    auto status = STATUS_SUCCESS;
-
-    // Apply imports, skip header
-    if (pImage->flags & HideVAD)
-    {
-        status = Driver().WriteMem(
-            _process.pid(),
-            pImage->ldrEntry.baseAddress + 0x1000,
-            pImage->ldrEntry.size - 0x1000,
-            pLocal + 0x1000
-        );
-    }
-    else
-    {
-        status = _process.memory().Write(
-            pImage->ldrEntry.baseAddress + 0x1000,
-            pImage->ldrEntry.size - 0x1000,
-            pLocal + 0x1000
-        );
-    }
-
-    // Write function address
-    if (!NT_SUCCESS( status ))
-    {
-        BLACKBONE_TRACE( L"ManualMap: Failed to write import function. Status 0x%x", status );
+
+            if (pImage->ldrEntry.type == mt_mod64)
+                *reinterpret_cast<uint64_t*>(pLocal + importFn.ptrRVA) = expData->procAddress;
+            else
+                *reinterpret_cast<uint32_t*>(pLocal + importFn.ptrRVA) = static_cast<uint32_t>(expData->procAddress);
+        }
     }
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
 /// <summary>
@@ -955,6 +1682,8 @@ NTSTATUS MMap::ResolveImport( ImageContextPtr pImage, bool useDelayed /*= false
 /// <returns>true on success</returns>
 NTSTATUS MMap::EnableExceptions( ImageContextPtr pImage )
 {
+    PhaseGuard phase( *this, Phase_Exceptions );
+
     BLACKBONE_TRACE( L"ManualMap: Enabling exception support for image '%ls'", pImage->ldrEntry.name.c_str() );
     bool partial = (pImage->flags & PartialExcept) != 0;
     bool success = _process.nativeLdr().InsertInvertedFunctionTable( pImage->ldrEntry );
@@ -965,16 +1694,15 @@ NTSTATUS MMap::EnableExceptions( ImageContextPtr pImage )
         if (!success)
         {
             // Retry with documented method
-            auto expTableRVA = pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_EXCEPTION, pe::RVA );
-            size_t size = pImage->peImage.DirectorySize( IMAGE_DIRECTORY_ENTRY_EXCEPTION );
+            size_t size = pImage->expDirectorySize;
 
             // Invoke RtlAddFunctionTable
-            if (expTableRVA)
+            if (pImage->expDirectory)
             {
                 auto a = AsmFactory::GetAssembler( pImage->ldrEntry.type );
                 uint64_t result = 0;
 
-                pImage->pExpTableAddr = expTableRVA + pImage->imgMem.ptr<ptr_t>();
+                pImage->pExpTableAddr = pImage->expDirectory;
                 auto pAddTable = _process.modules().GetNtdllExport( "RtlAddFunctionTable", pImage->ldrEntry.type );
                 if (!pAddTable)
                     return pAddTable.status;
@@ -1040,6 +1768,8 @@ NTSTATUS MMap::DisableExceptions( ImageContextPtr pImage )
         auto status = _process.remote().ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), result );
         if (!NT_SUCCESS( status ))
             return status;
+
+        _expMgr.RemoveModule( _process, pImage->ldrEntry.baseAddress );
     }
 
     partial = (pImage->flags & PartialExcept) != 0;
@@ -1053,14 +1783,13 @@ NTSTATUS MMap::DisableExceptions( ImageContextPtr pImage )
 /// <returns>Status code</returns>
 NTSTATUS MMap::InitStaticTLS( ImageContextPtr pImage )
 {
-    auto pTls = reinterpret_cast<PIMAGE_TLS_DIRECTORY>(pImage->peImage.DirectoryAddress( IMAGE_DIRECTORY_ENTRY_TLS ));
-    auto rebasedTlsPtr = REBASE( pTls, pImage->peImage.base(), pImage->imgMem.ptr() );
+    PhaseGuard phase( *this, Phase_TLS );
 
     // Use native TLS initialization
-    if (pTls && pTls->AddressOfIndex)
+    if (pImage->tlsDirectory != 0)
     {
         BLACKBONE_TRACE( L"ManualMap: Performing static TLS initialization for image '%ls'", pImage->ldrEntry.name.c_str() );
-        return _process.nativeLdr().AddStaticTLSEntry( pImage->ldrEntry, rebasedTlsPtr );
+        return _process.nativeLdr().AddStaticTLSEntry( pImage->ldrEntry, pImage->tlsDirectory );
     }
 
     return STATUS_SUCCESS;
@@ -1123,7 +1852,13 @@ NTSTATUS MMap::InitializeCookie( ImageContextPtr pImage )
             cookie |= (cookie | 0x4711) << 16;
     }
 
-    return _process.memory().Write( REBASE( pCookie, pImage->peImage.imageBase(), pImage->imgMem.ptr() ), size, &cookie );
+    // Cookie is written into staged image
+    auto cookieRVA = static_cast<uintptr_t>(pCookie - pImage->peImage.imageBase());
+    if (cookieRVA + size > pImage->ldrEntry.size)
+        return STATUS_INVALID_IMAGE_FORMAT;
+
+    memcpy( pImage->localImage.get() + cookieRVA, &cookie, size );
+    return STATUS_SUCCESS;
 }
 
 /// <summary>
@@ -1139,6 +1874,8 @@ NTSTATUS MMap::InitializeCookie( ImageContextPtr pImage )
 /// <returns>DllMain result</returns>
 call_result_t<uint64_t> MMap::RunModuleInitializers( ImageContextPtr pImage, DWORD dwReason, CustomArgs_t* pCustomArgs /*= nullptr*/ )
 {
+    PhaseGuard phase( *this, Phase_Initializers );
+
     auto a = AsmFactory::GetAssembler( pImage->ldrEntry.type );
     uint64_t result = 0;
 
@@ -1157,18 +1894,302 @@ call_result_t<uint64_t> MMap::RunModuleInitializers( ImageContextPtr pImage, DWO
     }
 
     // Prepare custom arguments
-    ptr_t customArgumentsAddress = 0;
-    if (pCustomArgs)
+    auto customArgumentsAddress = CopyCustomArgs( pCustomArgs );
+    if (!customArgumentsAddress)
+        return customArgumentsAddress.status;
+
+    GenModuleInitializers( *a, pImage, dwReason, customArgumentsAddress.result() );
+    if (pImage->ldrEntry.entryPoint != 0)
+        _process.remote().SaveCallResult( *a );
+
+    // DeactivateActCtx
+    if (_pAContext.valid() && pDeactivateActx)
+    {
+        (*a)->mov( (*a)->zax, _pAContext.ptr() + sizeof( ptr_t ) );
+        (*a)->mov( (*a)->zax, asmjit::host::dword_ptr( (*a)->zax ) );
+        a->GenCall( pDeactivateActx->procAddress, { 0, (*a)->zax } );
+    }
+
+    // Set invalid return code offset to preserve one from DllMain
+    _process.remote().AddReturnWithEvent( *a, pImage->ldrEntry.type, rt_int32, ARGS_OFFSET );
+    a->GenEpilogue();
+
+    NTSTATUS status = _process.remote().ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), result );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    if (pImage->ldrEntry.entryPoint == 0)
+        return call_result_t<uint64_t>( ERROR_SUCCESS, STATUS_SUCCESS );
+    
+    BLACKBONE_TRACE( L"ManualMap: DllMain of '%ls' returned %lld", pImage->ldrEntry.name.c_str(), result );
+    return result;
+}
+
+/// <summary>
+/// Run exception setup, static TLS setup, TLS callbacks and entry points of all uninitialized images in a single remote call
+/// </summary>
+/// <param name="pCustomArgs">Custom arguments passed to initializers</param>
+/// <returns>Status code</returns>
+NTSTATUS MMap::RunInitializersBatch( CustomArgs_t* pCustomArgs )
+{
+    using namespace asmjit::host;
+
+    vecImageCtx pending;
+    for (auto& img : _images)
+        if (!img->initialized)
+            pending.emplace_back( img );
+
+    if (pending.empty())
+        return STATUS_SUCCESS;
+
+    // Single stub can't mix native and wow64 code, fallback to per-image initialization
+    auto mt = pending.front()->ldrEntry.type;
+    if (std::any_of( pending.begin(), pending.end(), [mt]( const ImageContextPtr& img ) { return img->ldrEntry.type != mt; } ))
+    {
+        for (auto& img : pending)
+        {
+            NTSTATUS status = STATUS_SUCCESS;
+
+            // SAFESEH is checked by native inverted table insertion
+            img->ldrEntry.safeSEH = false;
+            if (!(img->flags & NoExceptions) && !NT_SUCCESS( status = EnableExceptions( img ) ) && status != STATUS_NOT_FOUND)
+                return status;
+
+            if (!(img->flags & NoTLS) && !NT_SUCCESS( status = InitStaticTLS( img ) ))
+                return status;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    PhaseGuard phase( *this, Phase_Initializers );
+
+    // Result block layout: { TLS setup status, exception setup status, DllMain result } for every image, VEH handle
+    const size_t slots = 3;
+    const size_t vehSlot = pending.size() * slots;
+
+    auto mem = _process.memory().heap().Allocate( (vehSlot + 1) * sizeof( uint64_t ) );
+    if (!mem)
+        return mem.status;
+
+    // Heap slots are reused, so results not written by stub must be cleared
+    auto resultBlock = std::move( mem.result() );
+    std::vector<uint64_t> results( vehSlot + 1 );
+    auto status = resultBlock.Write( 0, results.size() * sizeof( uint64_t ), results.data() );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    auto a = AsmFactory::GetAssembler( mt );
+    uint64_t result = 0;
+    bool vehPending = false;
+
+    // Failed setup step skips all initializers
+    asmjit::Label l_failed = (*a)->newLabel();
+
+    auto saveResult = [&a, &resultBlock]( size_t index )
+    {
+        (*a)->mov( (*a)->zdx, resultBlock.ptr() + index * sizeof( uint64_t ) );
+        (*a)->mov( asmjit::host::dword_ptr( (*a)->zdx ), (*a)->zax );
+    };
+
+    auto saveStatus = [&]( size_t index )
+    {
+        saveResult( index );
+        (*a)->test( eax, eax );
+        (*a)->js( l_failed );
+    };
+
+    auto hNtdll = _process.modules().GetModule( L"ntdll.dll", LdrList, mt );
+    auto pActivateActx = _process.modules().GetExport( hNtdll, "RtlActivateActivationContext" );
+    auto pDeactivateActx = _process.modules().GetExport( hNtdll, "RtlDeactivateActivationContext" );
+
+    a->GenPrologue();
+
+    // Exception support and static TLS of all images must be ready before any initializer runs
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& img = pending[i];
+
+        if (!(img->flags & NoExceptions))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Enabling exception support for image '%ls'", img->ldrEntry.name.c_str() );
+
+            status = _process.nativeLdr().InsertInvertedFunctionTable( img->ldrEntry, *a );
+            bool inserted = NT_SUCCESS( status );
+            if (status == STATUS_PENDING)
+                saveStatus( i * slots + 1 );
+
+            if (!inserted && mt == mt_mod32)
+                return STATUS_INVALID_EXCEPTION_HANDLER;
+
+            // Retry with documented method
+            bool tableAdded = inserted;
+            if (!inserted && img->expDirectory)
+            {
+                auto pAddTable = _process.modules().GetNtdllExport( "RtlAddFunctionTable", mt );
+                if (!pAddTable)
+                    return pAddTable.status;
+
+                img->pExpTableAddr = img->expDirectory;
+                a->GenCall(
+                    pAddTable->procAddress, {
+                    img->pExpTableAddr,
+                    img->expDirectorySize / sizeof( IMAGE_RUNTIME_FUNCTION_ENTRY ),
+                    img->imgMem.ptr() }
+                );
+
+                asmjit::Label l_added = (*a)->newLabel();
+
+                (*a)->test( al, al );
+                (*a)->mov( eax, STATUS_SUCCESS );
+                (*a)->jnz( l_added );
+                (*a)->mov( eax, STATUS_INVALID_EXCEPTION_HANDLER );
+                (*a)->bind( l_added );
+                saveStatus( i * slots + 1 );
+
+                tableAdded = true;
+            }
+
+            // Custom handler not required
+            bool noHandler = img->ldrEntry.safeSEH || (mt == mt_mod64 && (img->flags & CreateLdrRef || inserted));
+            if (tableAdded && !noHandler)
+            {
+                // Single handler serves all images
+                bool partial = (img->flags & PartialExcept) != 0 || vehPending;
+
+                status = _expMgr.CreateVEH( _process, img->ldrEntry, partial, a.get() );
+                if (status == STATUS_PENDING)
+                {
+                    asmjit::Label l_registered = (*a)->newLabel();
+
+                    saveResult( vehSlot );
+                    (*a)->test( (*a)->zax, (*a)->zax );
+                    (*a)->jnz( l_registered );
+                    (*a)->mov( eax, STATUS_NO_MEMORY );
+                    saveStatus( i * slots + 1 );
+                    (*a)->bind( l_registered );
+
+                    vehPending = true;
+                }
+                else if (!NT_SUCCESS( status ))
+                    return status;
+            }
+        }
+
+        if (img->flags & NoTLS || img->tlsDirectory == 0)
+            continue;
+
+        BLACKBONE_TRACE( L"ManualMap: Performing static TLS initialization for image '%ls'", img->ldrEntry.name.c_str() );
+
+        status = _process.nativeLdr().AddStaticTLSEntry( img->ldrEntry, img->tlsDirectory, a.get() );
+        if (status == STATUS_PENDING)
+            saveStatus( i * slots );
+        else if (!NT_SUCCESS( status ))
+            return status;
+    }
+
+    // ActivateActCtx
+    if (_pAContext.valid() && pActivateActx)
+    {
+        (*a)->mov( (*a)->zax, _pAContext.ptr() );
+        (*a)->mov( (*a)->zax, asmjit::host::dword_ptr( (*a)->zax ) );
+        a->GenCall( pActivateActx->procAddress, { 0, (*a)->zax, _pAContext.ptr() + sizeof( ptr_t ) } );
+    }
+
+    auto customArgumentsAddress = CopyCustomArgs( pCustomArgs );
+    if (!customArgumentsAddress)
+        return customArgumentsAddress.status;
+
+    for (size_t i = 0; i < pending.size(); i++)
     {
-        auto memBuf = _process.memory().Allocate( pCustomArgs->size() + sizeof( uint64_t ), PAGE_EXECUTE_READWRITE, 0, false );
-        if (!memBuf)
-            return memBuf.status;
+        auto& img = pending[i];
 
-        memBuf->Write( 0, pCustomArgs->size() );
-        memBuf->Write( sizeof( uint64_t ), pCustomArgs->size(), pCustomArgs->data() );
-        customArgumentsAddress = memBuf->ptr();
+        // Hack for IL dlls
+        if (!img->peImage.isExe() && img->peImage.pureIL())
+        {
+            DWORD flOld = 0;
+            auto flg = img->imgMem.Read( img->peImage.ilFlagOffset(), 0 );
+            img->imgMem.Protect( PAGE_EXECUTE_READWRITE, img->peImage.ilFlagOffset(), sizeof( flg ), &flOld );
+            img->imgMem.Write( img->peImage.ilFlagOffset(), flg & ~COMIMAGE_FLAGS_ILONLY );
+            img->imgMem.Protect( flOld, img->peImage.ilFlagOffset(), sizeof( flg ), &flOld );
+        }
+
+        // Don't run initializer for pure IL dlls
+        if (img->peImage.pureIL() && !img->peImage.isExe())
+            continue;
+
+        GenModuleInitializers( *a, img, DLL_PROCESS_ATTACH, customArgumentsAddress.result() );
+        if (img->ldrEntry.entryPoint != 0)
+            saveResult( i * slots + 2 );
+    }
+
+    // DeactivateActCtx
+    if (_pAContext.valid() && pDeactivateActx)
+    {
+        (*a)->mov( (*a)->zax, _pAContext.ptr() + sizeof( ptr_t ) );
+        (*a)->mov( (*a)->zax, asmjit::host::dword_ptr( (*a)->zax ) );
+        a->GenCall( pDeactivateActx->procAddress, { 0, (*a)->zax } );
+    }
+
+    (*a)->bind( l_failed );
+    _process.remote().AddReturnWithEvent( *a, mt, rt_int32, ARGS_OFFSET );
+    a->GenEpilogue();
+
+    status = _process.remote().ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), result );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    if (!NT_SUCCESS( status = resultBlock.Read( 0, results.size() * sizeof( uint64_t ), results.data() ) ))
+        return status;
+
+    // Handler must be known to cleanup even if later step has failed
+    if (vehPending && results[vehSlot] != 0)
+        _expMgr.setHandle( results[vehSlot] );
+
+    // Status occupies lower 32 bits
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& img = pending[i];
+
+        auto expStatus = static_cast<NTSTATUS>(results[i * slots + 1]);
+        if (!NT_SUCCESS( expStatus ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to enable exception handling for image %ls, status 0x%X", img->ldrEntry.name.c_str(), expStatus );
+            return expStatus;
+        }
+
+        auto tlsStatus = static_cast<NTSTATUS>(results[i * slots]);
+        if (!NT_SUCCESS( tlsStatus ))
+        {
+            BLACKBONE_TRACE( L"ManualMap: Failed to initialize static TLS for image %ls, status 0x%X", img->ldrEntry.name.c_str(), tlsStatus );
+            return tlsStatus;
+        }
+    }
+
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& img = pending[i];
+        if (img->ldrEntry.entryPoint != 0)
+            BLACKBONE_TRACE( L"ManualMap: DllMain of '%ls' returned %lld", img->ldrEntry.name.c_str(), results[i * slots + 2] );
+
+        // Wipe header and discardable sections
+        WipeImageMemory( img );
+
+        img->initialized = true;
     }
 
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Generate TLS callback and entry point calls
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="pImage">Image data</param>
+/// <param name="dwReason">Call reason</param>
+/// <param name="customArgs">Address of custom arguments</param>
+void MMap::GenModuleInitializers( IAsmHelper& a, ImageContextPtr pImage, DWORD dwReason, ptr_t customArgs )
+{
     // Function order
     // TLS first, entry point last
     if (!(pImage->flags & NoTLS))
@@ -1181,7 +2202,7 @@ call_result_t<uint64_t> MMap::RunModuleInitializers( ImageContextPtr pImage, DWO
                 pCallback, pImage->ldrEntry.name.c_str(), dwReason 
             );
 
-            a->GenCall( pCallback, { pImage->imgMem.ptr(), dwReason, customArgumentsAddress } );
+            a.GenCall( pCallback, { pImage->imgMem.ptr(), dwReason, customArgs } );
         }
     }
 
@@ -1189,31 +2210,27 @@ call_result_t<uint64_t> MMap::RunModuleInitializers( ImageContextPtr pImage, DWO
     if (pImage->ldrEntry.entryPoint != 0)
     {
         BLACKBONE_TRACE( L"ManualMap: Calling entry point for '%ls', Reason: %d", pImage->ldrEntry.name.c_str(), dwReason );
-        a->GenCall( pImage->ldrEntry.entryPoint, { pImage->imgMem.ptr(), dwReason, customArgumentsAddress } );
-        _process.remote().SaveCallResult( *a );
-    }
-
-    // DeactivateActCtx
-    if (_pAContext.valid() && pDeactivateActx)
-    {
-        (*a)->mov( (*a)->zax, _pAContext.ptr() + sizeof( ptr_t ) );
-        (*a)->mov( (*a)->zax, asmjit::host::dword_ptr( (*a)->zax ) );
-        a->GenCall( pDeactivateActx->procAddress, { 0, (*a)->zax } );
+        a.GenCall( pImage->ldrEntry.entryPoint, { pImage->imgMem.ptr(), dwReason, customArgs } );
     }
+}
 
-    // Set invalid return code offset to preserve one from DllMain
-    _process.remote().AddReturnWithEvent( *a, pImage->ldrEntry.type, rt_int32, ARGS_OFFSET );
-    a->GenEpilogue();
+/// <summary>
+/// Copy custom initializer arguments into target process
+/// </summary>
+/// <param name="pCustomArgs">Custom arguments</param>
+/// <returns>Arguments address, 0 if no arguments were supplied</returns>
+call_result_t<ptr_t> MMap::CopyCustomArgs( CustomArgs_t* pCustomArgs )
+{
+    if (!pCustomArgs)
+        return ptr_t( 0 );
 
-    NTSTATUS status = _process.remote().ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), result );
-    if (!NT_SUCCESS( status ))
-        return status;
+    auto memBuf = _process.memory().Allocate( pCustomArgs->size() + sizeof( uint64_t ), PAGE_EXECUTE_READWRITE, 0, false );
+    if (!memBuf)
+        return memBuf.status;
 
-    if (pImage->ldrEntry.entryPoint == 0)
-        return call_result_t<uint64_t>( ERROR_SUCCESS, STATUS_SUCCESS );
-    
-    BLACKBONE_TRACE( L"ManualMap: DllMain of '%ls' returned %lld", pImage->ldrEntry.name.c_str(), result );
-    return result;
+    memBuf->Write( 0, pCustomArgs->size() );
+    memBuf->Write( sizeof( uint64_t ), pCustomArgs->size(), pCustomArgs->data() );
+    return memBuf->ptr();
 }
 
 
@@ -1225,15 +2242,24 @@ call_result_t<uint64_t> MMap::RunModuleInitializers( ImageContextPtr pImage, DWO
 /// -----------------------------
 /// </summary>
 /// <param name="image">Source umage</param>
+/// <param name="hModule">Mapped image base. If set, manifest is taken from mapped image resources</param>
 /// <returns>true on success</returns>
-NTSTATUS MMap::CreateActx( const pe::PEImage& image  )
+NTSTATUS MMap::CreateActx( const pe::PEImage& image, ptr_t hModule /*= 0*/ )
 {   
     auto a = AsmFactory::GetAssembler( image.mType() );
 
     NTSTATUS status = STATUS_SUCCESS;
     uint64_t result = 0;
 
-    auto mem = _process.memory().Allocate( 512, PAGE_READWRITE );
+    // Manifest source. Target process executable serves as application directory for in-memory images
+    std::wstring source = image.manifestFile();
+    if (hModule != 0)
+    {
+        auto mainMod = _process.modules().GetMainModule();
+        source = mainMod ? mainMod->fullPath : std::wstring();
+    }
+
+    auto mem = _process.memory().Allocate( 0x1000, PAGE_READWRITE );
     if (!mem)
         return mem.status;
 
@@ -1254,6 +2280,14 @@ NTSTATUS MMap::CreateActx( const pe::PEImage& image  )
     // Emulate Wow64
     if (switchMode)
     {
+        // 32 bit structure can't reference image, manifest file must be extracted by caller
+        if (hModule != 0 || image.manifestFile().empty())
+        {
+            BLACKBONE_TRACE( L"ManualMap: In-memory activation context isn't supported for x64 image in WOW64 process" );
+            _pAContext.Free();
+            return STATUS_NOT_SUPPORTED;
+        }
+
         _ACTCTXW_T<uint32_t> act32 = { 0 };
 
         act32.cbSize = sizeof(act32);
@@ -1294,15 +2328,22 @@ NTSTATUS MMap::CreateActx( const pe::PEImage& image  )
     // Native way
     else
     {
-        auto fillACTX = [this, &image]( auto act )
+        auto fillACTX = [this, &image, &source, hModule]( auto act )
         {
             memset( &act, 0, sizeof( act ) );
 
             act.cbSize = sizeof( act );
             act.lpSource = static_cast<decltype(act.lpSource)>(this->_pAContext.ptr() + sizeof( ptr_t ) + sizeof( act ));
 
+            // Manifest resource of mapped image
+            if (hModule != 0)
+            {
+                act.dwFlags = ACTCTX_FLAG_HMODULE_VALID | ACTCTX_FLAG_RESOURCE_NAME_VALID;
+                act.lpResourceName = static_cast<decltype(act.lpResourceName)>(image.manifestID());
+                act.hModule = static_cast<decltype(act.hModule)>(hModule);
+            }
             // Ignore some fields for pure manifest file
-            if (!image.noPhysFile())
+            else if (!image.noPhysFile())
             {
                 act.dwFlags = ACTCTX_FLAG_RESOURCE_NAME_VALID;
                 act.lpResourceName = static_cast<decltype(act.lpResourceName)>(image.manifestID());
@@ -1312,8 +2353,8 @@ NTSTATUS MMap::CreateActx( const pe::PEImage& image  )
             NTSTATUS status = this->_pAContext.Write( sizeof( ptr_t ), act );
             status |= this->_pAContext.Write(
                 sizeof( ptr_t ) + sizeof( act ),
-                (image.manifestFile().length() + 1) * sizeof( wchar_t ),
-                image.manifestFile().c_str()
+                (source.length() + 1) * sizeof( wchar_t ),
+                source.c_str()
             );
 
             return status;
@@ -1535,6 +2576,123 @@ void MMap::Cleanup()
 }
 
 
+/// <summary>
+/// Allocate zero-initialized buffer
+/// </summary>
+/// <param name="size">Buffer size</param>
+/// <returns>Buffer</returns>
+StagingArena::Buffer StagingArena::Allocate( size_t size )
+{
+    constexpr size_t minChunkSize = 0x400000;
+    size = Align( size, 0x10 );
+
+    // Chunks past the last used block are free
+    size_t chunk = 0, offset = 0;
+    if (!_blocks.empty())
+    {
+        chunk = _blocks.back().chunk;
+        offset = _blocks.back().offset + _blocks.back().size;
+    }
+
+    for (; chunk < _chunks.size(); chunk++, offset = 0)
+        if (_chunks[chunk].size - offset >= size)
+            break;
+
+    if (chunk == _chunks.size())
+    {
+        auto chunkSize = std::max<size_t>( size, minChunkSize );
+        _chunks.emplace_back( Chunk{ std::unique_ptr<uint8_t[]>( new uint8_t[chunkSize] ), chunkSize } );
+        offset = 0;
+    }
+
+    auto ptr = _chunks[chunk].data.get() + offset;
+    memset( ptr, 0, size );
+
+    _blocks.emplace_back( Block{ chunk, offset, size, false } );
+    return Buffer( ptr, Deleter{ this } );
+}
+
+/// <summary>
+/// Free all chunks. No buffers may be in use
+/// </summary>
+void StagingArena::reset()
+{
+    assert( _blocks.empty() );
+
+    _blocks.clear();
+    _chunks.clear();
+}
+
+/// <summary>
+/// Return buffer into arena
+/// </summary>
+/// <param name="ptr">Buffer pointer</param>
+void StagingArena::Release( uint8_t* ptr )
+{
+    for (auto iter = _blocks.rbegin(); iter != _blocks.rend(); ++iter)
+    {
+        if (_chunks[iter->chunk].data.get() + iter->offset == ptr)
+        {
+            iter->released = true;
+            break;
+        }
+    }
+
+    // Blocks released out of order are reclaimed once blocks above them are gone
+    while (!_blocks.empty() && _blocks.back().released)
+        _blocks.pop_back();
+}
+
+/// <summary>
+/// Attribute counters collected since last mark to current phase
+/// </summary>
+void MMap::FlushPhase()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto mem = _process.memory().stats();
+    auto calls = _process.remote().callCount();
+
+    if (!_phases.empty())
+    {
+        auto& stats = _profile->phases[_phases.back()];
+
+        stats.duration += std::chrono::duration_cast<std::chrono::microseconds>(now - _markTime).count();
+        stats.bytes += (mem.bytesRead - _markMem.bytesRead) + (mem.bytesWritten - _markMem.bytesWritten);
+        stats.syscalls += mem.syscalls - _markMem.syscalls;
+        stats.remoteCalls += calls - _markCalls;
+    }
+
+    _markTime = now;
+    _markMem = mem;
+    _markCalls = calls;
+}
+
+/// <summary>
+/// Start nested mapping phase
+/// </summary>
+/// <param name="phase">Mapping phase</param>
+void MMap::EnterPhase( MapPhase phase )
+{
+    if (!_profiling)
+        return;
+
+    FlushPhase();
+    _phases.emplace_back( phase );
+    _profile->phases[phase].count++;
+}
+
+/// <summary>
+/// End current mapping phase
+/// </summary>
+void MMap::LeavePhase()
+{
+    if (!_profiling)
+        return;
+
+    FlushPhase();
+    _phases.pop_back();
+}
+
 /// <summary>
 /// Transform section characteristics into memory protection flags
 /// </summary>
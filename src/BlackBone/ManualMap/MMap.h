@@ -6,13 +6,16 @@
 #include "../PE/PEImage.h"
 
 #include "../Process/MemBlock.h"
+#include "../Process/ProcessMemory.h"
 #include "../ManualMap/Native/NtLoader.h"
 #include "MExcept.h"
+#include "ImageCache.h"
 
 #include <array>
 #include <vector>
 #include <map>
 #include <tuple>
+#include <chrono>
 
 namespace blackbone
 {
@@ -107,6 +110,8 @@ enum eLoadFlags
     NoSxS           = 0x08000,   // Do not apply SxS activation context
     NoTLS           = 0x10000,   // Skip TLS initialization and don't execute TLS callbacks
     IsDependency    = 0x20000,   // Module is a dependency
+    CacheImage      = 0x40000,   // Reuse relocated and bound image from previous mappings at the same base
+    BatchInit       = 0x80000,   // Run static TLS setup, exception setup and initializers of all new images in a single remote call
 };
 
 ENUM_OPS( eLoadFlags )
@@ -132,6 +137,8 @@ struct LoadData
         , ldrFlags( ldrFlags_ ) { }
 };
 
+using mapLoadData = std::map<std::wstring, LoadData>;
+
 // Image mapping callback
 enum CallbackType
 {
@@ -142,24 +149,160 @@ enum CallbackType
 using MapCallback = LoadData( *)(CallbackType type, void* context, Process& process, const ModuleData& modInfo);
 
 
+// Manual mapping phases
+enum MapPhase
+{
+    Phase_ResolvePath = 0,  // Dependency path resolution
+    Phase_Parse,            // Image loading and parsing
+    Phase_Allocate,         // Image memory allocation
+    Phase_Copy,             // Image staging and transfer into target process
+    Phase_Relocate,         // Relocation processing
+    Phase_Imports,          // Import binding
+    Phase_Protect,          // Memory protection and wiping
+    Phase_TLS,              // Static TLS initialization
+    Phase_Exceptions,       // Exception handling support
+    Phase_Initializers,     // TLS callbacks and entry points
+    Phase_Count
+};
+
+/// <summary>
+/// Mapping phase counters.
+/// Nested phases are excluded from enclosing ones
+/// </summary>
+struct PhaseStats
+{
+    uint64_t duration = 0;      // Time spent, microseconds
+    uint64_t bytes = 0;         // Bytes transferred to or from target process
+    uint64_t syscalls = 0;      // Remote memory syscalls
+    uint64_t remoteCalls = 0;   // Code executions in target process
+    uint32_t count = 0;         // Number of times phase was entered
+};
+
+/// <summary>
+/// Profile of single MapImage call, aggregated across all dependencies
+/// </summary>
+struct MapProfile
+{
+    std::array<PhaseStats, Phase_Count> phases; // Per-phase counters
+    uint64_t duration = 0;                      // Total mapping time, microseconds
+    uint32_t images = 0;                        // Number of manually mapped images
+};
+
+/// <summary>
+/// Image memory range with uniform page protection
+/// </summary>
+struct ProtectionRun
+{
+    uintptr_t offset;   // Offset from image base
+    size_t    size;     // Range size, page aligned
+    DWORD     prot;     // Page protection
+};
+
+using vecProtRuns = std::vector<ProtectionRun>;
+
+/// <summary>
+/// Local staging buffer allocator.
+/// Buffers are carved from chunks retained for the lifetime of the mapper,
+/// so repeated mappings don't go to the heap for every image
+/// </summary>
+class StagingArena
+{
+public:
+    /// <summary>
+    /// Returns buffer into arena
+    /// </summary>
+    struct Deleter
+    {
+        StagingArena* arena = nullptr;
+
+        void operator()( uint8_t* ptr ) const
+        {
+            if (arena)
+                arena->Release( ptr );
+        }
+    };
+
+    using Buffer = std::unique_ptr<uint8_t[], Deleter>;
+
+    /// <summary>
+    /// Allocate zero-initialized buffer
+    /// </summary>
+    /// <param name="size">Buffer size</param>
+    /// <returns>Buffer</returns>
+    BLACKBONE_API Buffer Allocate( size_t size );
+
+    /// <summary>
+    /// Free all chunks. No buffers may be in use
+    /// </summary>
+    BLACKBONE_API void reset();
+
+private:
+    /// <summary>
+    /// Return buffer into arena
+    /// </summary>
+    /// <param name="ptr">Buffer pointer</param>
+    void Release( uint8_t* ptr );
+
+    struct Chunk
+    {
+        std::unique_ptr<uint8_t[]> data;    // Chunk memory
+        size_t size;                        // Chunk size
+    };
+
+    struct Block
+    {
+        size_t chunk;                       // Chunk index
+        size_t offset;                      // Offset in chunk
+        size_t size;                        // Block size
+        bool released;                      // Block was released out of order
+    };
+
+    std::vector<Chunk> _chunks;             // Memory chunks
+    std::vector<Block> _blocks;             // Blocks in use, in allocation order
+};
+
 /// <summary>
 /// Image data
 /// </summary>
 struct ImageContext
 {
     using vecPtr = std::vector<ptr_t>;
+    using mapPaths = std::map<std::wstring, std::wstring>;
 
     pe::PEImage    peImage;                 // PE image data
     MemBlock       imgMem;                  // Target image memory region
+    StagingArena::Buffer localImage;        // Local staging copy of target image memory
     NtLdrEntry     ldrEntry;                // Native loader module information
     vecPtr         tlsCallbacks;            // TLS callback routines
+    ptr_t          tlsDirectory = 0;        // Remote TLS directory address, 0 if no static TLS
+    mapPaths       depPaths;                // Dependency paths resolved during graph build phase
+    std::vector<CachedDependency> boundDeps;// Modules used for import binding
+    uint64_t       imageHash = 0;           // Image content hash
     ptr_t          pExpTableAddr = 0;       // Exception table address (amd64 only)
+    ptr_t          expDirectory = 0;        // Remote exception directory address
+    uintptr_t      rsrcRVA = 0;             // Resource directory written ahead of final commit
+    size_t         rsrcSize = 0;            // Size of resource directory written ahead, 0 if none
+    uint32_t       expDirectorySize = 0;    // Exception directory size
     eLoadFlags     flags = NoFlags;         // Image loader flags
     bool           initialized = false;     // Image entry point was called
 };
 
 using ImageContextPtr = std::shared_ptr<ImageContext>;
 using vecImageCtx = std::vector<ImageContextPtr>;
+using mapImageCtx = std::map<std::wstring, ImageContextPtr>;
+
+/// <summary>
+/// Parsed image with resolved dependency graph.
+/// Shared read-only between mappings of the same image into multiple processes
+/// </summary>
+struct MapPlan
+{
+    std::wstring root;                      // Root image path
+    mapImageCtx  images;                    // Parsed images by full path, root included
+    eLoadFlags   flags = NoFlags;           // Image mapping flags
+};
+
+using MapPlanPtr = std::shared_ptr<const MapPlan>;
 
 /// <summary>
 /// Manual image mapper
@@ -177,13 +320,15 @@ public:
     /// <param name="flags">Image mapping flags</param>
     /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
     /// <param name="context">User-supplied callback context</param>
+    /// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
     /// <returns>Mapped image info </returns>
     BLACKBONE_API call_result_t<ModuleDataPtr> MapImage(
         const std::wstring& path,
         eLoadFlags flags = NoFlags,
         MapCallback mapCallback = nullptr,
         void* context = nullptr,
-        CustomArgs_t* pCustomArgs_t = nullptr
+        CustomArgs_t* pCustomArgs_t = nullptr,
+        MapProfile* pProfile = nullptr
         );
 
     /// <summary>
@@ -195,6 +340,7 @@ public:
     /// <param name="flags">Image mapping flags</param>
     /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
     /// <param name="context">User-supplied callback context</param>
+    /// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
     /// <returns>Mapped image info</returns>
     BLACKBONE_API call_result_t<ModuleDataPtr> MapImage(
         size_t size, void* buffer,
@@ -202,9 +348,46 @@ public:
         eLoadFlags flags = NoFlags,
         MapCallback mapCallback = nullptr,
         void* context = nullptr,
-        CustomArgs_t* pCustomArgs_t = nullptr
+        CustomArgs_t* pCustomArgs_t = nullptr,
+        MapProfile* pProfile = nullptr
         );
 
+    /// <summary>
+    /// Manually map image using prepared plan
+    /// </summary>
+    /// <param name="plan">Image plan made by PlanImage of any process with same architecture and executable directory</param>
+    /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
+    /// <param name="context">User-supplied callback context</param>
+    /// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
+    /// <returns>Mapped image info</returns>
+    BLACKBONE_API call_result_t<ModuleDataPtr> MapImage(
+        const MapPlan& plan,
+        MapCallback mapCallback = nullptr,
+        void* context = nullptr,
+        CustomArgs_t* pCustomArgs_t = nullptr,
+        MapProfile* pProfile = nullptr
+        );
+
+    /// <summary>
+    /// Load and parse image and its dependencies for later mapping.
+    /// Target process memory isn't touched
+    /// </summary>
+    /// <param name="path">Image path</param>
+    /// <param name="flags">Image mapping flags</param>
+    /// <returns>Mapping plan</returns>
+    BLACKBONE_API call_result_t<MapPlanPtr> PlanImage( const std::wstring& path, eLoadFlags flags = NoFlags );
+
+    /// <summary>
+    /// Load and parse image and its dependencies for later mapping.
+    /// Target process memory isn't touched
+    /// </summary>
+    /// <param name="size">Buffer size.</param>
+    /// <param name="buffer">Image data buffer. Must stay valid while plan is in use</param>
+    /// <param name="asImage">If set to true - buffer has image memory layout</param>
+    /// <param name="flags">Image mapping flags</param>
+    /// <returns>Mapping plan</returns>
+    BLACKBONE_API call_result_t<MapPlanPtr> PlanImage( size_t size, void* buffer, bool asImage = false, eLoadFlags flags = NoFlags );
+
     /// <summary>
     /// Unmap all manually mapped modules
     /// </summary>
@@ -220,7 +403,7 @@ public:
     /// <summary>
     /// Reset local data
     /// </summary>
-    BLACKBONE_API inline void reset() { _images.clear(); _pAContext.Reset(); _usedBlocks.clear(); }
+    BLACKBONE_API inline void reset() { _images.clear(); _prepared.clear(); _loadData.clear(); _pAContext.Reset(); _usedBlocks.clear(); _arena.reset(); }
 private:
     /// <summary>
     /// Manually map PE image into underlying target process
@@ -232,6 +415,8 @@ private:
     /// <param name="flags">Image mapping flags</param>
     /// <param name="mapCallback">Mapping callback. Triggers for each mapped module</param>
     /// <param name="context">User-supplied callback context</param>
+    /// <param name="pPlan">Prepared image plan</param>
+    /// <param name="pProfile">If not null - receives per-phase profile of this mapping</param>
     /// <returns>Mapped image info</returns>
     call_result_t<ModuleDataPtr> MapImageInternal(
         const std::wstring& path,
@@ -240,8 +425,31 @@ private:
         eLoadFlags flags = NoFlags,
         MapCallback ldrCallback = nullptr,
         void* ldrContext = nullptr,
-        CustomArgs_t* pCustomArgs_t = nullptr
+        CustomArgs_t* pCustomArgs_t = nullptr,
+        const MapPlan* pPlan = nullptr,
+        MapProfile* pProfile = nullptr
+        );
+
+    /// <summary>
+    /// Load and parse image and its dependencies for later mapping
+    /// </summary>
+    /// <param name="path">Image path</param>
+    /// <param name="buffer">Image data buffer</param>
+    /// <param name="size">Buffer size.</param>
+    /// <param name="asImage">If set to true - buffer has image memory layout</param>
+    /// <param name="flags">Image mapping flags</param>
+    /// <returns>Mapping plan</returns>
+    call_result_t<MapPlanPtr> PlanImageInternal(
+        const std::wstring& path,
+        void* buffer, size_t size, bool asImage,
+        eLoadFlags flags
         );
+
+    /// <summary>
+    /// Create image contexts over plan images, so files are neither loaded nor resolved again
+    /// </summary>
+    /// <param name="plan">Image plan</param>
+    void AdoptPlan( const MapPlan& plan );
  
     /// <summary>
     /// Fix image path for pure managed mapping
@@ -251,6 +459,36 @@ private:
     template<typename T>
     void FixManagedPath( ptr_t base, const std::wstring &path );
 
+    /// <summary>
+    /// Load and parse image without touching target process
+    /// </summary>
+    /// <param name="path">Image path</param>
+    /// <param name="buffer">Image data buffer</param>
+    /// <param name="size">Buffer size.</param>
+    /// <param name="asImage">If set to true - buffer has image memory layout</param>
+    /// <param name="flags">Mapping flags</param>
+    /// <returns>Image data</returns>
+    call_result_t<ImageContextPtr> LoadImageContext(
+        const std::wstring& path,
+        void* buffer, size_t size, bool asImage,
+        eLoadFlags flags
+        );
+
+    /// <summary>
+    /// Build dependency graph of image.
+    /// Resolves paths of all missing dependencies, loads and parses manually mapped ones in parallel.
+    /// Loaded images are consumed later by FindOrMapModule
+    /// </summary>
+    /// <param name="pRoot">Root image</param>
+    void PrepareDependencies( ImageContextPtr pRoot );
+
+    /// <summary>
+    /// Get mapping order of prepared images
+    /// </summary>
+    /// <param name="root">Root image path</param>
+    /// <returns>Prepared image paths, dependencies go before images importing them. Root is excluded</returns>
+    std::vector<std::wstring> DependencyOrder( const std::wstring& root );
+
     /// <summary>
     /// Get existing module or map it if absent
     /// </summary>
@@ -277,12 +515,52 @@ private:
     call_result_t<uint64_t> RunModuleInitializers( ImageContextPtr pImage, DWORD dwReason, CustomArgs_t* pCustomArgs_t = nullptr );
 
     /// <summary>
-    /// Copies image into target process
+    /// Run exception setup, static TLS setup, TLS callbacks and entry points of all uninitialized images in a single remote call
+    /// </summary>
+    /// <param name="pCustomArgs">Custom arguments passed to initializers</param>
+    /// <returns>Status code</returns>
+    NTSTATUS RunInitializersBatch( CustomArgs_t* pCustomArgs );
+
+    /// <summary>
+    /// Generate TLS callback and entry point calls
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="pImage">Image data</param>
+    /// <param name="dwReason">Call reason</param>
+    /// <param name="customArgs">Address of custom arguments</param>
+    void GenModuleInitializers( IAsmHelper& a, ImageContextPtr pImage, DWORD dwReason, ptr_t customArgs );
+
+    /// <summary>
+    /// Copy custom initializer arguments into target process
+    /// </summary>
+    /// <param name="pCustomArgs">Custom arguments</param>
+    /// <returns>Arguments address, 0 if no arguments were supplied</returns>
+    call_result_t<ptr_t> CopyCustomArgs( CustomArgs_t* pCustomArgs );
+
+    /// <summary>
+    /// Copies image headers and sections into local staging buffer
     /// </summary>
     /// <param name="pImage">Image data</param>
     /// <returns>Status code</returns>
     NTSTATUS CopyImage( ImageContextPtr pImage );
 
+    /// <summary>
+    /// Write staged image data into target process
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    /// <param name="offset">Offset in image</param>
+    /// <param name="size">Size of data to write. If 0 - whole image is written, except resource directory written ahead</param>
+    /// <returns>Status code</returns>
+    NTSTATUS CommitImage( ImageContextPtr pImage, uintptr_t offset = 0, size_t size = 0 );
+
+    /// <summary>
+    /// Write image headers and export directory into target process.
+    /// Required to resolve circular imports before whole image is committed
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    /// <returns>Status code</returns>
+    NTSTATUS PublishExports( ImageContextPtr pImage );
+
     /// <summary>
     /// Adjust image memory protection
     /// </summary>
@@ -290,6 +568,41 @@ private:
     /// <returns>Status code</returns>
     NTSTATUS ProtectImageMemory( ImageContextPtr pImage );
 
+    /// <summary>
+    /// Replace staged image with cached one, bound against current dependency bases
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    /// <returns>true if cached image was applied</returns>
+    bool ApplyCachedImage( ImageContextPtr pImage );
+
+    /// <summary>
+    /// Store relocated and bound staged image in cache
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    void StoreCachedImage( ImageContextPtr pImage );
+
+    /// <summary>
+    /// Build page-granular protection map of image and merge it into runs of equal protection
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    /// <param name="wipe">Map only header and discardable sections scheduled for wipe</param>
+    /// <returns>Protection runs</returns>
+    vecProtRuns GetProtectionRuns( ImageContextPtr pImage, bool wipe );
+
+    /// <summary>
+    /// Apply protection runs to image memory, all runs are submitted in a single remote call when possible
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    /// <param name="runs">Protection runs, PAGE_NOACCESS runs are decommitted</param>
+    /// <returns>Status code</returns>
+    NTSTATUS ApplyProtectionRuns( ImageContextPtr pImage, const vecProtRuns& runs );
+
+    /// <summary>
+    /// Erase header and discardable sections of initialized image
+    /// </summary>
+    /// <param name="pImage">Image data</param>
+    void WipeImageMemory( ImageContextPtr pImage );
+
     /// <summary>
     ///  Fix relocations if image wasn't loaded at base address
     /// </summary>
@@ -341,6 +654,14 @@ private:
     /// <returns></returns>
     call_result_t<ModuleDataPtr> FindOrMapDependency( ImageContextPtr pImage, std::wstring& path );
 
+    /// <summary>
+    /// Get loading method of missing dependency, decision is made once per mapping
+    /// </summary>
+    /// <param name="pImage">Image importing dependency</param>
+    /// <param name="path">Resolved dependency path</param>
+    /// <returns>Loading method</returns>
+    LoadData GetLoadData( ImageContextPtr pImage, const std::wstring& path );
+
     /// <summary>
     /// Create activation context
     /// Target memory layout:
@@ -351,8 +672,9 @@ private:
     /// <param name="path">Manifest container path</param>
     /// <param name="id">Manifest resource id</param>
     /// <param name="asImage">if true - 'path' points to a valid PE file, otherwise - 'path' points to separate manifest file</param>
+    /// <param name="hModule">Mapped image base. If set, manifest is taken from mapped image resources</param>
     /// <returns>true on success</returns>
-    NTSTATUS CreateActx( const pe::PEImage& image );
+    NTSTATUS CreateActx( const pe::PEImage& image, ptr_t hModule = 0 );
 
     /// <summary>
     /// Do SxS path probing in the target process
@@ -383,15 +705,97 @@ private:
     /// <returns>Memory protection value</returns>
     DWORD GetSectionProt( DWORD characteristics );
 
+    /// <summary>
+    /// Attribute counters collected since last mark to current phase
+    /// </summary>
+    void FlushPhase();
+
+    /// <summary>
+    /// Start nested mapping phase
+    /// </summary>
+    /// <param name="phase">Mapping phase</param>
+    void EnterPhase( MapPhase phase );
+
+    /// <summary>
+    /// End current mapping phase
+    /// </summary>
+    void LeavePhase();
+
+    /// <summary>
+    /// Accounts counters to mapping phase while in scope
+    /// </summary>
+    class PhaseGuard
+    {
+    public:
+        PhaseGuard( MMap& mmap, MapPhase phase )
+            : _mmap( mmap )
+        {
+            _mmap.EnterPhase( phase );
+        }
+
+        ~PhaseGuard()
+        {
+            _mmap.LeavePhase();
+        }
+
+    private:
+        MMap& _mmap;
+    };
+
+    /// <summary>
+    /// Profiles whole mapping while in scope and hands profile to the caller
+    /// </summary>
+    class ProfileGuard
+    {
+    public:
+        ProfileGuard( MMap& mmap, MapProfile* pOut )
+            : _mmap( mmap )
+            , _pOut( pOut )
+        {
+            _mmap._profile = &_profile;
+            _mmap._phases.clear();
+            _mmap._profiling = true;
+            _mmap.FlushPhase();
+            _start = _mmap._markTime;
+        }
+
+        ~ProfileGuard()
+        {
+            _mmap.FlushPhase();
+            _mmap._profiling = false;
+            _mmap._profile = nullptr;
+            _profile.duration = std::chrono::duration_cast<std::chrono::microseconds>(_mmap._markTime - _start).count();
+
+            if (_pOut)
+                *_pOut = _profile;
+        }
+
+    private:
+        MMap& _mmap;
+        MapProfile _profile;
+        MapProfile* _pOut;
+        std::chrono::steady_clock::time_point _start;
+    };
+
 private:
     class Process&  _process;               // Target process manager
     MExcept         _expMgr;                // Exception handler manager
+    StagingArena    _arena;                 // Local image staging buffers
     vecImageCtx     _images;                // Mapped images
+    mapImageCtx     _prepared;              // Images loaded during dependency graph build
+    mapLoadData     _loadData;              // Loading methods of dependencies decided during graph build
     MemBlock        _pAContext;             // SxS activation context memory address
     MapCallback     _mapCallback = nullptr; // Loader callback for adding image into loader lists
     void*           _userContext = nullptr; // user context for _ldrCallback       
 
     std::vector<std::pair<ptr_t, size_t>> _usedBlocks;   // Used memory blocks 
+
+    MapProfile*             _profile = nullptr; // Profile of mapping in progress
+    std::vector<MapPhase>   _phases;        // Active phase stack
+    std::chrono::steady_clock::time_point _markTime;    // Last counter snapshot time
+    MemoryStats             _markMem;       // Last memory counters snapshot
+    uint64_t                _markCalls = 0; // Last remote call counter snapshot
+    bool                    _profiling = false; // MapImage call is being profiled
 };
 
 }
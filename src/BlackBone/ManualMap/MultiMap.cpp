@@ -0,0 +1,160 @@
+#include "MultiMap.h"
+#include "../Process/Process.h"
+#include "../Misc/Utils.h"
+#include "../Misc/Trace.hpp"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Manually map PE image into every target process
+/// </summary>
+/// <param name="targets">Target processes, must be distinct</param>
+/// <param name="path">Image path</param>
+/// <param name="flags">Image mapping flags</param>
+/// <param name="mapCallback">Mapping callback. Triggers for each mapped module, may be called concurrently</param>
+/// <param name="context">User-supplied callback context</param>
+/// <param name="threads">Number of worker threads. If 0 - number of CPUs is used</param>
+/// <returns>Per-target results</returns>
+MultiMapReport MultiMap::MapImage(
+    const std::vector<Process*>& targets,
+    const std::wstring& path,
+    eLoadFlags flags /*= NoFlags*/,
+    MapCallback mapCallback /*= nullptr*/,
+    void* context /*= nullptr*/,
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    uint32_t threads /*= 0*/
+    )
+{
+    auto plan = [&]( Process& proc ) { return proc.mmap().PlanImage( path, flags ); };
+    return MapInternal( targets, plan, mapCallback, context, pCustomArgs, threads );
+}
+
+/// <summary>
+/// Manually map PE image into every target process
+/// </summary>
+/// <param name="targets">Target processes, must be distinct</param>
+/// <param name="size">Buffer size.</param>
+/// <param name="buffer">Image data buffer</param>
+/// <param name="asImage">If set to true - buffer has image memory layout</param>
+/// <param name="flags">Image mapping flags</param>
+/// <param name="mapCallback">Mapping callback. Triggers for each mapped module, may be called concurrently</param>
+/// <param name="context">User-supplied callback context</param>
+/// <param name="threads">Number of worker threads. If 0 - number of CPUs is used</param>
+/// <returns>Per-target results</returns>
+MultiMapReport MultiMap::MapImage(
+    const std::vector<Process*>& targets,
+    size_t size, void* buffer,
+    bool asImage /*= false*/,
+    eLoadFlags flags /*= NoFlags*/,
+    MapCallback mapCallback /*= nullptr*/,
+    void* context /*= nullptr*/,
+    CustomArgs_t* pCustomArgs /*= nullptr*/,
+    uint32_t threads /*= 0*/
+    )
+{
+    auto plan = [&]( Process& proc ) { return proc.mmap().PlanImage( size, buffer, asImage, flags ); };
+    return MapInternal( targets, plan, mapCallback, context, pCustomArgs, threads );
+}
+
+/// <summary>
+/// Plan image once per target group and map it into all targets
+/// </summary>
+/// <param name="targets">Target processes</param>
+/// <param name="plan">Plan routine, called with process planning for its group</param>
+/// <param name="mapCallback">Mapping callback</param>
+/// <param name="context">User-supplied callback context</param>
+/// <param name="threads">Number of worker threads</param>
+/// <returns>Per-target results</returns>
+MultiMapReport MultiMap::MapInternal(
+    const std::vector<Process*>& targets,
+    const std::function<call_result_t<MapPlanPtr>( Process& )>& plan,
+    MapCallback mapCallback,
+    void* context,
+    CustomArgs_t* pCustomArgs,
+    uint32_t threads
+    )
+{
+    using namespace std::chrono;
+
+    MultiMapReport report;
+    auto start = steady_clock::now();
+
+    // Dependency paths depend only on target architecture and executable directory
+    std::map<std::pair<eBarrier, std::wstring>, std::vector<size_t>> groups;
+
+    report.targets.resize( targets.size() );
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        auto& proc = *targets[i];
+        auto mainMod = proc.modules().GetMainModule();
+        auto dir = mainMod ? Utils::GetParent( Utils::ToLower( mainMod->fullPath ) ) : std::wstring();
+
+        report.targets[i].process = targets[i];
+        groups[std::make_pair( proc.barrier().type, dir )].emplace_back( i );
+    }
+
+    std::vector<std::pair<size_t, MapPlanPtr>> work;
+    for (auto& group : groups)
+    {
+        auto pPlan = plan( *targets[group.second.front()] );
+        if (!pPlan)
+            BLACKBONE_TRACE( L"MultiMap: Failed to plan image for '%ls' group, status 0x%X", group.first.second.c_str(), pPlan.status );
+
+        for (auto idx : group.second)
+        {
+            if (pPlan)
+                work.emplace_back( idx, pPlan.result() );
+            else
+                report.targets[idx].module = pPlan.status;
+        }
+    }
+
+    report.planDuration = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    // Commit phase
+    std::atomic<size_t> next( 0 );
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < work.size(); i = next++)
+        {
+            auto& item = report.targets[work[i].first];
+            auto& mmap = item.process->mmap();
+            auto mapStart = steady_clock::now();
+
+            item.module = mmap.MapImage( *work[i].second, mapCallback, context, pCustomArgs, &item.profile );
+            item.duration = duration_cast<microseconds>(steady_clock::now() - mapStart).count();
+        }
+    };
+
+    if (threads == 0)
+        threads = std::max<uint32_t>( std::thread::hardware_concurrency(), 1 );
+
+    threads = static_cast<uint32_t>(std::min<size_t>( threads, work.size() ));
+
+    // Calling thread is a worker too
+    std::vector<std::thread> pool;
+    for (uint32_t i = 1; i < threads; i++)
+        pool.emplace_back( worker );
+
+    worker();
+
+    for (auto& thd : pool)
+        thd.join();
+
+    report.duration = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    BLACKBONE_TRACE(
+        L"MultiMap: %d targets in %d groups mapped in %llu us, planning took %llu us",
+        static_cast<int>(targets.size()), static_cast<int>(groups.size()), report.duration, report.planDuration
+    );
+
+    return report;
+}
+
+}
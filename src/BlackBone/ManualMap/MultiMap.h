@@ -0,0 +1,103 @@
+#pragma once
+
+#include "MMap.h"
+
+#include <vector>
+#include <functional>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Result of mapping into single target
+/// </summary>
+struct MultiMapResult
+{
+    class Process* process = nullptr;       // Target process
+    call_result_t<ModuleDataPtr> module;    // Mapped image info
+    MapProfile profile;                     // Per-phase profile of mapping
+    uint64_t duration = 0;                  // Mapping time, us
+};
+
+/// <summary>
+/// Results of mapping into all targets
+/// </summary>
+struct MultiMapReport
+{
+    std::vector<MultiMapResult> targets;    // Per-target results, in order of targets
+    uint64_t planDuration = 0;              // Time spent loading and resolving images, us
+    uint64_t duration = 0;                  // Total time, us
+};
+
+/// <summary>
+/// Maps single image into multiple processes.
+/// Image and its dependencies are loaded, parsed and resolved once per group of targets
+/// sharing architecture and executable directory, then targets are mapped concurrently
+/// </summary>
+class MultiMap
+{
+public:
+    /// <summary>
+    /// Manually map PE image into every target process
+    /// </summary>
+    /// <param name="targets">Target processes, must be distinct</param>
+    /// <param name="path">Image path</param>
+    /// <param name="flags">Image mapping flags</param>
+    /// <param name="mapCallback">Mapping callback. Triggers for each mapped module, may be called concurrently</param>
+    /// <param name="context">User-supplied callback context</param>
+    /// <param name="threads">Number of worker threads. If 0 - number of CPUs is used</param>
+    /// <returns>Per-target results</returns>
+    BLACKBONE_API static MultiMapReport MapImage(
+        const std::vector<class Process*>& targets,
+        const std::wstring& path,
+        eLoadFlags flags = NoFlags,
+        MapCallback mapCallback = nullptr,
+        void* context = nullptr,
+        CustomArgs_t* pCustomArgs = nullptr,
+        uint32_t threads = 0
+        );
+
+    /// <summary>
+    /// Manually map PE image into every target process
+    /// </summary>
+    /// <param name="targets">Target processes, must be distinct</param>
+    /// <param name="size">Buffer size.</param>
+    /// <param name="buffer">Image data buffer</param>
+    /// <param name="asImage">If set to true - buffer has image memory layout</param>
+    /// <param name="flags">Image mapping flags</param>
+    /// <param name="mapCallback">Mapping callback. Triggers for each mapped module, may be called concurrently</param>
+    /// <param name="context">User-supplied callback context</param>
+    /// <param name="threads">Number of worker threads. If 0 - number of CPUs is used</param>
+    /// <returns>Per-target results</returns>
+    BLACKBONE_API static MultiMapReport MapImage(
+        const std::vector<class Process*>& targets,
+        size_t size, void* buffer,
+        bool asImage = false,
+        eLoadFlags flags = NoFlags,
+        MapCallback mapCallback = nullptr,
+        void* context = nullptr,
+        CustomArgs_t* pCustomArgs = nullptr,
+        uint32_t threads = 0
+        );
+
+private:
+    /// <summary>
+    /// Plan image once per target group and map it into all targets
+    /// </summary>
+    /// <param name="targets">Target processes</param>
+    /// <param name="plan">Plan routine, called with process planning for its group</param>
+    /// <param name="mapCallback">Mapping callback</param>
+    /// <param name="context">User-supplied callback context</param>
+    /// <param name="threads">Number of worker threads</param>
+    /// <returns>Per-target results</returns>
+    static MultiMapReport MapInternal(
+        const std::vector<class Process*>& targets,
+        const std::function<call_result_t<MapPlanPtr>( class Process& )>& plan,
+        MapCallback mapCallback,
+        void* context,
+        CustomArgs_t* pCustomArgs,
+        uint32_t threads
+        );
+};
+
+}
@@ -8,6 +8,10 @@
 
 #include "../contrib/VersionHelpers.h"
 
+#ifndef STATUS_INVALID_EXCEPTION_HANDLER
+#define STATUS_INVALID_EXCEPTION_HANDLER ((NTSTATUS)0xC00001A5L)
+#endif
+
 namespace blackbone
 {
 
@@ -153,8 +157,9 @@ ptr_t NtLdr::SetNode( ptr_t ptr, Module pModule )
 /// </summary>
 /// <param name="mod">Module data</param>
 /// <param name="tlsPtr">TLS directory of target image</param>
-/// <returns>Status code</returns>
-NTSTATUS NtLdr::AddStaticTLSEntry( const NtLdrEntry& mod, ptr_t tlsPtr )
+/// <param name="pBatch">If set, native TLS handler call is appended to this code instead of being executed</param>
+/// <returns>Status code, STATUS_PENDING if call was appended to batch</returns>
+NTSTATUS NtLdr::AddStaticTLSEntry( const NtLdrEntry& mod, ptr_t tlsPtr, IAsmHelper* pBatch /*= nullptr*/ )
 {
     bool wxp = IsWindowsXPOrGreater() && !IsWindowsVistaOrGreater();
     ptr_t pNode = _nodeMap.count( mod.baseAddress ) ? _nodeMap[mod.baseAddress] : 0;
@@ -204,11 +209,18 @@ NTSTATUS NtLdr::AddStaticTLSEntry( const NtLdrEntry& mod, ptr_t tlsPtr )
     // Use native method
     if (LdrpHandleTlsData)
     {
+        auto callConv = IsWindows8Point1OrGreater() ? cc_thiscall : cc_stdcall;
+        if (pBatch)
+        {
+            pBatch->GenCall( LdrpHandleTlsData, { pNode }, callConv );
+            return STATUS_PENDING;
+        }
+
         auto a = AsmFactory::GetAssembler( mod.type );
         uint64_t result = 0;
 
         a->GenPrologue();
-        a->GenCall( LdrpHandleTlsData, { pNode }, IsWindows8Point1OrGreater() ? cc_thiscall : cc_stdcall );
+        a->GenCall( LdrpHandleTlsData, { pNode }, callConv );
         _process.remote().AddReturnWithEvent( *a );
         a->GenEpilogue();
 
@@ -337,6 +349,137 @@ bool NtLdr::InsertInvertedFunctionTable( NtLdrEntry& mod )
     }
 }
 
+/// <summary>
+/// Append LdrpInvertedFunctionTable record creation to batch code.
+/// Generated code leaves status in eax
+/// </summary>
+/// <param name="mod">Module data, safeSEH must be set beforehand</param>
+/// <param name="batch">Target assembly helper</param>
+/// <returns>Status code, STATUS_PENDING if code was appended, STATUS_SUCCESS if record already exists</returns>
+NTSTATUS NtLdr::InsertInvertedFunctionTable( NtLdrEntry& mod, IAsmHelper& batch )
+{
+    using namespace asmjit::host;
+
+    ptr_t RtlInsertInvertedFunctionTable = g_PatternLoader->data().RtlInsertInvertedFunctionTable64;
+    ptr_t LdrpInvertedFunctionTable = g_PatternLoader->data().LdrpInvertedFunctionTable64;
+    ptr_t LdrProtectMrdata = 0;
+    if (mod.type == mt_mod32)
+    {
+        RtlInsertInvertedFunctionTable = g_PatternLoader->data().RtlInsertInvertedFunctionTable32;
+        LdrpInvertedFunctionTable = g_PatternLoader->data().LdrpInvertedFunctionTable32;
+        LdrProtectMrdata = g_PatternLoader->data().LdrProtectMrdata;
+    }
+
+    // Invalid addresses. Probably pattern scan has failed
+    if (RtlInsertInvertedFunctionTable == 0 || LdrpInvertedFunctionTable == 0)
+        return STATUS_ORDINAL_NOT_FOUND;
+
+    auto GenInsert = [&]( auto table ) -> NTSTATUS
+    {
+        using Table = decltype(table);
+        using Entry = std::decay_t<decltype(table.Entries[0])>;
+
+        auto& a = batch;
+        auto& memory = _process.memory();
+
+        memory.Read( LdrpInvertedFunctionTable, sizeof( table ), &table );
+        for (ULONG i = 0; i < table.Count; i++)
+            if (table.Entries[i].ImageBase == mod.baseAddress)
+                return STATUS_SUCCESS;
+
+        // Fake exception directory is filled by VEH during exception handling.
+        // x64 dispatcher doesn't use it
+        uint32_t pEncoded = 0;
+        if (!mod.safeSEH && mod.type == mt_mod32)
+        {
+            auto mem = memory.Allocate( sizeof( DWORD ) * 0x800, PAGE_READWRITE, 0, false );
+            if (!mem)
+                return mem.status;
+
+            auto cookie = *reinterpret_cast<uint32_t*>(0x7FFE0330);
+            pEncoded = _rotr( cookie ^ mem->ptr<uint32_t>(), cookie & 0x1F );
+        }
+
+        if (IsWindows8Point1OrGreater())
+            a.GenCall( RtlInsertInvertedFunctionTable, { mod.baseAddress, mod.size }, cc_fastcall );
+        else if (IsWindows8OrGreater())
+            a.GenCall( RtlInsertInvertedFunctionTable, { mod.baseAddress, mod.size } );
+        else
+            a.GenCall( RtlInsertInvertedFunctionTable, { LdrpInvertedFunctionTable, mod.baseAddress, mod.size } );
+
+        asmjit::Label l_loop = a->newLabel();
+        asmjit::Label l_found = a->newLabel();
+        asmjit::Label l_failed = a->newLabel();
+        asmjit::Label l_exit = a->newLabel();
+
+        // zdx - current entry, ecx - entries left
+        a->mov( a->zdx, LdrpInvertedFunctionTable );
+        a->mov( ecx, dword_ptr( a->zdx, FIELD_OFFSET( Table, Count ) ) );
+        a->add( a->zdx, FIELD_OFFSET( Table, Entries ) );
+        a->mov( a->zax, mod.baseAddress );
+
+        a->bind( l_loop );
+        a->test( ecx, ecx );
+        a->jz( l_failed );
+        a->cmp( a->intptr_ptr( a->zdx, FIELD_OFFSET( Entry, ImageBase ) ), a->zax );
+        a->je( l_found );
+        a->add( a->zdx, sizeof( Entry ) );
+        a->dec( ecx );
+        a->jmp( l_loop );
+
+        // If Image has SAFESEH, RtlInsertInvertedFunctionTable is enough
+        a->bind( l_found );
+        a->xor_( eax, eax );
+        if (mod.type == mt_mod32)
+        {
+            a->cmp( dword_ptr( a->zdx, FIELD_OFFSET( Entry, SizeOfTable ) ), 0 );
+            a->jne( l_exit );
+
+            // Image was expected to have SAFESEH
+            if (pEncoded == 0)
+                a->jmp( l_failed );
+
+            // In Win10 LdrpInvertedFunctionTable is located in mrdata section
+            if (LdrProtectMrdata)
+            {
+                a->push( a->zdx );
+                a.GenCall( LdrProtectMrdata, { FALSE } );
+                a->pop( a->zdx );
+            }
+
+            a->mov( dword_ptr( a->zdx, FIELD_OFFSET( Entry, ExceptionDirectory ) ), pEncoded );
+
+            if (LdrProtectMrdata)
+                a.GenCall( LdrProtectMrdata, { TRUE } );
+
+            a->xor_( eax, eax );
+        }
+
+        a->jmp( l_exit );
+
+        a->bind( l_failed );
+        a->mov( eax, STATUS_INVALID_EXCEPTION_HANDLER );
+
+        a->bind( l_exit );
+        return STATUS_PENDING;
+    };
+
+    if (IsWindows8OrGreater())
+    {
+        if (mod.type == mt_mod64)
+            return GenInsert( _RTL_INVERTED_FUNCTION_TABLE8<DWORD64>() );
+        else
+            return GenInsert( _RTL_INVERTED_FUNCTION_TABLE8<DWORD>() );
+    }
+    else
+    {
+        if (mod.type == mt_mod64)
+            return GenInsert( _RTL_INVERTED_FUNCTION_TABLE7<DWORD64>() );
+        else
+            return GenInsert( _RTL_INVERTED_FUNCTION_TABLE7<DWORD>() );
+    }
+}
+
 /// <summary>
 ///  Initialize OS-specific module entry
 /// </summary>
@@ -56,8 +56,9 @@ public:
     /// </summary>
     /// <param name="mod">Module data</param>
     /// <param name="tlsPtr">TLS directory of target image</param>
-    /// <returns>Status code</returns>
-    BLACKBONE_API NTSTATUS AddStaticTLSEntry( const NtLdrEntry& mod, ptr_t tlsPtr );
+    /// <param name="pBatch">If set, native TLS handler call is appended to this code instead of being executed</param>
+    /// <returns>Status code, STATUS_PENDING if call was appended to batch</returns>
+    BLACKBONE_API NTSTATUS AddStaticTLSEntry( const NtLdrEntry& mod, ptr_t tlsPtr, class IAsmHelper* pBatch = nullptr );
 
     /// <summary>
     /// Create module record in LdrpInvertedFunctionTable
@@ -67,6 +68,15 @@ public:
     /// <returns>true on success</returns>
     BLACKBONE_API bool InsertInvertedFunctionTable( NtLdrEntry& mod );
 
+    /// <summary>
+    /// Append LdrpInvertedFunctionTable record creation to batch code.
+    /// Generated code leaves status in eax
+    /// </summary>
+    /// <param name="mod">Module data, safeSEH must be set beforehand</param>
+    /// <param name="batch">Target assembly helper</param>
+    /// <returns>Status code, STATUS_PENDING if code was appended, STATUS_SUCCESS if record already exists</returns>
+    BLACKBONE_API NTSTATUS InsertInvertedFunctionTable( NtLdrEntry& mod, class IAsmHelper& batch );
+
     /// <summary>
     /// Unlink module from Ntdll loader
     /// </summary>
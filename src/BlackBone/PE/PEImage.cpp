@@ -98,6 +98,31 @@ NTSTATUS PEImage::Load( void* pData, size_t size, bool plainData /*= true */ )
     return PrepareACTX();
 }
 
+/// <summary>
+/// Load image sharing file view of another loaded image.
+/// Source image must stay loaded while this one is in use
+/// </summary>
+/// <param name="source">Source image</param>
+/// <param name="skipActx">If true - do not initialize activation context</param>
+/// <returns>Status code</returns>
+NTSTATUS PEImage::Load( const PEImage& source, bool skipActx /*= false*/ )
+{
+    Release( true );
+
+    _imagePath = source._imagePath;
+    _noFile = source._noFile;
+    _sharedView = true;
+    _pFileBase = source._pFileBase;
+    _isPlainData = source._isPlainData;
+
+    auto status = Parse();
+    if (!NT_SUCCESS( status ) || skipActx)
+        return status;
+
+    // Temporary manifest file belongs to source, so in-memory image gets its own context
+    return _noFile ? PrepareACTX() : PrepareACTX( _imagePath.c_str() );
+}
+
 /// <summary>
 /// Reload closed image
 /// </summary>
@@ -115,8 +140,11 @@ void PEImage::Release( bool temporary /*= false*/ )
 {
     if (_pFileBase)
     {
-        UnmapViewOfFile( _pFileBase );
+        if (!_sharedView)
+            UnmapViewOfFile( _pFileBase );
+
         _pFileBase = nullptr;
+        _sharedView = false;
     }
 
     _hMapping.reset();
@@ -132,7 +160,7 @@ void PEImage::Release( bool temporary /*= false*/ )
         _imagePath.clear();
 
         // Ensure temporary file is deleted
-        if (_noFile)
+        if (_noFile && !_manifestPath.empty())
             DeleteFileW( _manifestPath.c_str() );
 
         _manifestPath.clear();
@@ -155,6 +183,11 @@ NTSTATUS PEImage::Parse( void* pImageBase /*= nullptr*/ )
     if (!_pFileBase)
         return STATUS_INVALID_ADDRESS;
 
+    // Drop data of previously parsed image
+    _sections.clear();
+    _imports.clear();
+    _delayImports.clear();
+
     // Get DOS header
     pDosHdr = reinterpret_cast<const IMAGE_DOS_HEADER*>(_pFileBase);
 
@@ -231,6 +264,10 @@ mapImports& PEImage::GetImports( bool useDelayed /*= false*/ )
 {
     if(useDelayed)
     {
+        // Already processed
+        if (!_delayImports.empty())
+            return _delayImports;
+
         auto pImportTbl = reinterpret_cast<PIMAGE_DELAYLOAD_DESCRIPTOR>(DirectoryAddress( IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT ));
         if (!pImportTbl)
             return _delayImports;
@@ -279,6 +316,10 @@ mapImports& PEImage::GetImports( bool useDelayed /*= false*/ )
     }
     else
     {
+        // Already processed
+        if (!_imports.empty())
+            return _imports;
+
         auto *pImportTbl = reinterpret_cast<PIMAGE_IMPORT_DESCRIPTOR>(DirectoryAddress( IMAGE_DIRECTORY_ENTRY_IMPORT ));
         if (!pImportTbl)
             return _imports;
@@ -471,11 +512,13 @@ int PEImage::GetTLSCallbacks( module_t targetBase, std::vector<ptr_t>& result )
 /// <summary>
 /// Prepare activation context
 /// </summary>
-/// <param name="filepath">Path to PE file. If nullptr - manifest is extracted from memory to disk</param>
+/// <param name="filepath">
+/// Path to PE file. If nullptr - manifest is taken from image resources in memory.
+/// If that fails, manifest is extracted from memory to disk
+/// </param>
 /// <returns>Status code</returns>
 NTSTATUS PEImage::PrepareACTX( const wchar_t* filepath /*= nullptr*/ )
 {
-    wchar_t tempPath[256] = { 0 };
     uint32_t manifestSize = 0;
 
     ACTCTXW act = { 0 };
@@ -487,28 +530,39 @@ NTSTATUS PEImage::PrepareACTX( const wchar_t* filepath /*= nullptr*/ )
         return STATUS_SUCCESS;
 
     //
-    // Dump manifest to TMP folder
+    // Use image resources directly, low bit marks data file layout
     //
     if (filepath == nullptr)
     {
-        wchar_t tempDir[256] = { 0 };
-
-        GetTempPathW( ARRAYSIZE( tempDir ), tempDir );
-        if (GetTempFileNameW( tempDir, L"ImageManifest", 0, tempPath ) == 0)
-            return STATUS_SXS_CANT_GEN_ACTCTX;
-     
-        auto hTmpFile = FileHandle( CreateFileW( tempPath, FILE_GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, 0, NULL ) );
-        if (hTmpFile != INVALID_HANDLE_VALUE)
-        {
-            DWORD bytes = 0;
-            WriteFile( hTmpFile, pManifest, manifestSize, &bytes, NULL );
-            hTmpFile.reset();
+        wchar_t exePath[MAX_PATH] = { 0 };
+        GetModuleFileNameW( NULL, exePath, ARRAYSIZE( exePath ) );
+
+        act.dwFlags = ACTCTX_FLAG_HMODULE_VALID | ACTCTX_FLAG_RESOURCE_NAME_VALID;
+        act.hModule = reinterpret_cast<HMODULE>(reinterpret_cast<uintptr_t>(_pFileBase) | (_isPlainData ? 1 : 0));
+        act.lpResourceName = MAKEINTRESOURCEW( _manifestIdx );
+        act.lpSource = exePath;
 
-            act.lpSource = tempPath;
-            _manifestPath = tempPath;
+        _hctx = CreateActCtxW( &act );
+        if (_hctx != INVALID_HANDLE_VALUE)
+        {
+            _manifestPath.clear();
+            return STATUS_SUCCESS;
         }
-        else
-            return LastNtStatus();
+
+        act = { 0 };
+        act.cbSize = sizeof( act );
+    }
+
+    //
+    // Dump manifest to TMP folder
+    //
+    if (filepath == nullptr)
+    {
+        NTSTATUS status = DumpManifest();
+        if (!NT_SUCCESS( status ))
+            return status;
+
+        act.lpSource = _manifestPath.c_str();
     }
     else
     {
@@ -535,6 +589,41 @@ NTSTATUS PEImage::PrepareACTX( const wchar_t* filepath /*= nullptr*/ )
     return LastNtStatus();
 }
 
+/// <summary>
+/// Extract manifest resource to temporary file, used when manifest can't be referenced in image memory.
+/// File is deleted on image release
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS PEImage::DumpManifest()
+{
+    wchar_t tempDir[256] = { 0 };
+    wchar_t tempPath[256] = { 0 };
+    uint32_t manifestSize = 0;
+
+    auto pManifest = GetManifest( manifestSize, _manifestIdx );
+    if (!pManifest)
+        return STATUS_NOT_FOUND;
+
+    // Manifest file already available
+    if (!_manifestPath.empty())
+        return STATUS_SUCCESS;
+
+    GetTempPathW( ARRAYSIZE( tempDir ), tempDir );
+    if (GetTempFileNameW( tempDir, L"ImageManifest", 0, tempPath ) == 0)
+        return STATUS_SXS_CANT_GEN_ACTCTX;
+
+    auto hTmpFile = FileHandle( CreateFileW( tempPath, FILE_GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, 0, NULL ) );
+    if (hTmpFile == INVALID_HANDLE_VALUE)
+        return LastNtStatus();
+
+    DWORD bytes = 0;
+    WriteFile( hTmpFile, pManifest, manifestSize, &bytes, NULL );
+    hTmpFile.reset();
+
+    _manifestPath = tempPath;
+    return STATUS_SUCCESS;
+}
+
 /// <summary>
 /// Get manifest from image data
 /// </summary>
@@ -112,6 +112,15 @@ public:
     /// <returns>Status code</returns>
     BLACKBONE_API NTSTATUS Load( void* pData, size_t size, bool plainData = true );
 
+    /// <summary>
+    /// Load image sharing file view of another loaded image.
+    /// Source image must stay loaded while this one is in use
+    /// </summary>
+    /// <param name="source">Source image</param>
+    /// <param name="skipActx">If true - do not initialize activation context</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS Load( const PEImage& source, bool skipActx = false );
+
     /// <summary>
     /// Reload closed image
     /// </summary>
@@ -152,6 +161,13 @@ public:
     /// <returns>Number of TLS callbacks in image</returns>
     BLACKBONE_API int GetTLSCallbacks( module_t targetBase, std::vector<ptr_t>& result ) const;
 
+    /// <summary>
+    /// Extract manifest resource to temporary file, used when manifest can't be referenced in image memory.
+    /// File is deleted on image release
+    /// </summary>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS DumpManifest();
+
     /// <summary>
     /// Retrieve data directory address
     /// </summary>
@@ -270,7 +286,7 @@ public:
     /// <summary>
     /// Get manifest resource file
     /// </summary>
-    /// <returns>Manifest resource file</returns>
+    /// <returns>Manifest resource file, empty if manifest is used directly from image memory</returns>
     BLACKBONE_API inline const std::wstring& manifestFile() const { return _manifestPath; }
 
     /// <summary>
@@ -318,6 +334,7 @@ private:
     bool        _isExe = false;                 // Image is an .exe file
     bool        _isPureIL = false;              // Pure IL image
     bool        _noFile = false;                // Parsed from memory, no underlying PE file available        
+    bool        _sharedView = false;            // File view is owned by another image
     PCHDR32     _pImageHdr32 = nullptr;         // PE header info
     PCHDR64     _pImageHdr64 = nullptr;         // PE header info
     ptr_t       _imgBase = 0;                   // Image base
@@ -1,6 +1,7 @@
 #include "MemBlock.h"
 #include "ProcessMemory.h"
 #include "ProcessCore.h"
+#include "RemoteHeap.h"
 #include "../Subsystem/NativeSubsystem.h"
 #include "../Misc/Trace.hpp"
 
@@ -91,10 +92,12 @@ call_result_t<MemBlock> MemBlock::Allocate(
     ptr_t desired64 = desired;
     DWORD newProt = CastProtection( protection, process.core().DEP() );
     
+    process.countSyscall();
     NTSTATUS status = process.core().native()->VirtualAllocExT( desired64, size, MEM_RESERVE | MEM_COMMIT, newProt );
     if (!NT_SUCCESS( status ))
     {
         desired64 = 0;
+        process.countSyscall();
         status = process.core().native()->VirtualAllocExT( desired64, size, MEM_COMMIT, newProt );
         if (NT_SUCCESS( status ))
             return call_result_t<MemBlock>( MemBlock( &process, desired64, size, protection, own ), STATUS_IMAGE_NOT_AT_BASE );
@@ -119,11 +122,17 @@ call_result_t<ptr_t> MemBlock::Realloc( size_t size, ptr_t desired /*= 0*/, DWOR
     if (!_pImpl)
         return STATUS_MEMORY_NOT_ALLOCATED;
 
+    // Heap slot shares pages with other blocks
+    if (_pImpl->_heapSlot)
+        return STATUS_NOT_SUPPORTED;
+
     ptr_t desired64 = desired;
+    _pImpl->_memory->countSyscall();
     auto status = _pImpl->_memory->core().native()->VirtualAllocExT( desired64, size, MEM_COMMIT, protection );
     if (!desired64)
     {
         desired64 = 0;
+        _pImpl->_memory->countSyscall();
         status = _pImpl->_memory->core().native()->VirtualAllocExT( desired64, size, MEM_COMMIT, protection );
         if (!NT_SUCCESS( status ))
             return status;
@@ -157,6 +166,10 @@ NTSTATUS MemBlock::Protect( DWORD protection, uintptr_t offset /*= 0*/, size_t s
     if (!_pImpl)
         return STATUS_MEMORY_NOT_ALLOCATED;
 
+    // Heap slot shares pages with other blocks
+    if (_pImpl->_heapSlot)
+        return STATUS_NOT_SUPPORTED;
+
     auto prot = CastProtection( protection, _pImpl->_memory->core().DEP() );
 
     if (size == 0)
@@ -187,6 +200,18 @@ NTSTATUS MemBlock::MemBlockImpl::Free( size_t size /*= 0 */ )
     if (_ptr == 0)
         return STATUS_MEMORY_NOT_ALLOCATED;
 
+    // Return slot into heap, unless heap was reset
+    if (_heapSlot)
+    {
+        if (auto heap = _heap.lock())
+            RemoteHeap::Free( *heap, _ptr, _size, _protection );
+
+        _ptr = 0;
+        _size = 0;
+        _protection = 0;
+        return STATUS_SUCCESS;
+    }
+
     size = Align( size, 0x1000 );
 
     NTSTATUS status = _physical ? Driver().FreeMem( _memory->core().pid(), _ptr, size, MEM_RELEASE ) :
@@ -11,6 +11,8 @@
 namespace blackbone
 {
 
+struct RemoteHeapArena;
+
 /// <summary>
 /// Get rid of EXECUTABLE flag if DEP isn't enabled
 /// </summary>
@@ -42,6 +44,7 @@ public:
     class MemBlockImpl
     {
         friend class MemBlock;
+        friend class RemoteHeap;
 
     public:
         MemBlockImpl() = default;
@@ -74,6 +77,8 @@ public:
         DWORD  _protection = 0;         // Region protection
         bool   _own = true;             // Memory will be freed in destructor
         bool   _physical = false;       // Memory allocated as direct physical
+        bool   _heapSlot = false;       // Memory is a slot of remote heap chunk
+        std::weak_ptr<RemoteHeapArena> _heap;   // Owning remote heap
         class ProcessMemory* _memory;   // Target process routines
     }; 
 
@@ -259,6 +264,8 @@ public:
     BLACKBONE_API inline operator ptr_t() const  { return _pImpl ? _pImpl->_ptr : 0; }
 
 private:
+    friend class RemoteHeap;
+
     std::shared_ptr<MemBlockImpl> _pImpl;
 };
 
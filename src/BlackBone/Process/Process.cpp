@@ -132,6 +132,7 @@ NTSTATUS Process::Detach()
     _mmap.reset();
     _threads.reset();
     _hooks.reset();
+    _memory.heap().reset();
     _core.Close();
 
     return STATUS_SUCCESS;
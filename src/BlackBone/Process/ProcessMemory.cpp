@@ -9,6 +9,7 @@ ProcessMemory::ProcessMemory( Process* process )
     : RemoteMemory( process )
     , _process( process )
     , _core( process->core() )  
+    , _heap( *this )
 {
 }
 
@@ -29,6 +30,68 @@ call_result_t<MemBlock> ProcessMemory::Allocate( size_t size, DWORD protection /
     return MemBlock::Allocate( *this, size, desired, protection, own );
 }
 
+/// <summary>
+/// Allocate new memory block reachable from address by rel32 jump.
+/// Free regions closest to address are tried first
+/// </summary>
+/// <param name="nearest">Address block must be reachable from</param>
+/// <param name="size">Block size</param>
+/// <param name="protection">Memory protection</param>
+/// <returns>Memory block. STATUS_IMAGE_NOT_AT_BASE if block was allocated out of range</returns>
+call_result_t<MemBlock> ProcessMemory::AllocateNear( ptr_t nearest, size_t size, DWORD protection /*= PAGE_EXECUTE_READWRITE*/ )
+{
+    const ptr_t range = 0x7FFF0000;
+    const ptr_t granularity = 0x10000;
+
+    // Whole address space is reachable
+    if (_core.isWow64())
+        return Allocate( size, protection );
+
+    MEMORY_BASIC_INFORMATION64 mbi = { 0 };
+    ptr_t low = nearest > range + granularity ? nearest - range : granularity;
+    ptr_t high = nearest + range;
+
+    // Free regions below target, closest first
+    for (ptr_t addr = nearest; addr > low; addr = mbi.BaseAddress - 1)
+    {
+        if (!NT_SUCCESS( Query( addr, &mbi ) ))
+            break;
+
+        ptr_t base = (mbi.BaseAddress + mbi.RegionSize - size) & ~(granularity - 1);
+        if (mbi.State == MEM_FREE && mbi.RegionSize >= size && base >= mbi.BaseAddress && base >= low)
+        {
+            auto mem = Allocate( size, protection, base );
+            if (mem.status == STATUS_SUCCESS)
+                return mem;
+        }
+
+        if (mbi.BaseAddress == 0)
+            break;
+    }
+
+    // Free regions above target
+    for (ptr_t addr = nearest; addr < high; addr = mbi.BaseAddress + mbi.RegionSize)
+    {
+        if (!NT_SUCCESS( Query( addr, &mbi ) ))
+            break;
+
+        ptr_t base = (mbi.BaseAddress + granularity - 1) & ~(granularity - 1);
+        if (mbi.State == MEM_FREE && base + size <= mbi.BaseAddress + mbi.RegionSize && base + size <= high)
+        {
+            auto mem = Allocate( size, protection, base );
+            if (mem.status == STATUS_SUCCESS)
+                return mem;
+        }
+    }
+
+    // Caller has to handle far block
+    auto mem = Allocate( size, protection );
+    if (mem)
+        mem.status = STATUS_IMAGE_NOT_AT_BASE;
+
+    return mem;
+}
+
 /// <summary>
 /// Free memory
 /// </summary>
@@ -46,6 +109,7 @@ NTSTATUS ProcessMemory::Free( ptr_t pAddr, size_t size /*= 0*/, DWORD freeType /
         BLACKBONE_TRACE( L"Free: Free at address 0x%p", static_cast<uintptr_t>(pAddr) );
     }
 #endif
+    _syscalls++;
     return _core.native()->VirtualFreeExT( pAddr, size, freeType );
 }
 
@@ -57,6 +121,7 @@ NTSTATUS ProcessMemory::Free( ptr_t pAddr, size_t size /*= 0*/, DWORD freeType /
 /// <returns>Status</returns>
 NTSTATUS ProcessMemory::Query( ptr_t pAddr, PMEMORY_BASIC_INFORMATION64 pInfo )
 {
+    _syscalls++;
     return _core.native()->VirtualQueryExT( pAddr, pInfo );
 }
 
@@ -74,6 +139,7 @@ NTSTATUS ProcessMemory::Protect( ptr_t pAddr, size_t size, DWORD flProtect, DWOR
     if (pOld == nullptr)
         pOld = &junk;
 
+    _syscalls++;
     return _core.native()->VirtualProtectExT( pAddr, size, CastProtection( flProtect, _core.DEP() ), pOld );
 }
 
@@ -97,6 +163,8 @@ NTSTATUS ProcessMemory::Read( ptr_t dwAddress, size_t dwSize, PVOID pResult, boo
     // Simple read
     if (!handleHoles)
     {
+        _syscalls++;
+        _bytesRead += dwSize;
         return _core.native()->ReadProcessMemoryT( dwAddress, pResult, dwSize, &dwRead );
     }
     // Read all committed memory regions
@@ -106,6 +174,7 @@ NTSTATUS ProcessMemory::Read( ptr_t dwAddress, size_t dwSize, PVOID pResult, boo
 
         for (ptr_t memptr = dwAddress; memptr < dwAddress + dwSize; memptr = mbi.BaseAddress + mbi.RegionSize)
         {
+            _syscalls++;
             if (_core.native()->VirtualQueryExT( memptr, &mbi ) != STATUS_SUCCESS)
                 continue;
 
@@ -115,6 +184,8 @@ NTSTATUS ProcessMemory::Read( ptr_t dwAddress, size_t dwSize, PVOID pResult, boo
 
             uint64_t region_ptr = memptr - dwAddress;
 
+            _syscalls++;
+            _bytesRead += mbi.RegionSize;
             auto status = _core.native()->ReadProcessMemoryT(
                 mbi.BaseAddress,
                 reinterpret_cast<uint8_t*>(pResult) + region_ptr,
@@ -166,6 +237,8 @@ NTSTATUS ProcessMemory::Read( std::vector<ptr_t>&& adrList, size_t dwSize, PVOID
 /// <returns>Status</returns>
 NTSTATUS ProcessMemory::Write( ptr_t pAddress, size_t dwSize, const void* pData )
 {
+    _syscalls++;
+    _bytesWritten += dwSize;
     return _core.native()->WriteProcessMemoryT( pAddress, pData, dwSize );
 }
 
@@ -192,6 +265,20 @@ NTSTATUS ProcessMemory::Write( std::vector<ptr_t>&& adrList, size_t dwSize, cons
     return Write( ptr + adrList.back(), dwSize, pData );
 }
 
+/// <summary>
+/// Get remote memory operation counters
+/// </summary>
+/// <returns>Counters snapshot</returns>
+MemoryStats ProcessMemory::stats() const
+{
+    MemoryStats stats;
+    stats.syscalls = _syscalls;
+    stats.bytesRead = _bytesRead;
+    stats.bytesWritten = _bytesWritten;
+
+    return stats;
+}
+
 /// <summary>
 /// Enumerate valid memory regions
 /// </summary>
@@ -3,13 +3,25 @@
 #include "../Include/Winheaders.h"
 #include "RPC/RemoteMemory.h"
 #include "MemBlock.h"
+#include "RemoteHeap.h"
 
 #include <vector>
 #include <list>
+#include <atomic>
 
 namespace blackbone
 {
 
+/// <summary>
+/// Remote memory operation counters
+/// </summary>
+struct MemoryStats
+{
+    uint64_t syscalls = 0;      // Memory syscalls issued
+    uint64_t bytesRead = 0;     // Bytes read from target process
+    uint64_t bytesWritten = 0;  // Bytes written into target process
+};
+
 class ProcessMemory : public RemoteMemory
 {
 public:
@@ -26,6 +38,16 @@ public:
     /// <returns>Memory block. If failed - returned block will be invalid</returns>
     BLACKBONE_API call_result_t<MemBlock> Allocate( size_t size, DWORD protection = PAGE_EXECUTE_READWRITE, ptr_t desired = 0, bool own = true );
 
+    /// <summary>
+    /// Allocate new memory block reachable from address by rel32 jump.
+    /// Free regions closest to address are tried first
+    /// </summary>
+    /// <param name="nearest">Address block must be reachable from</param>
+    /// <param name="size">Block size</param>
+    /// <param name="protection">Memory protection</param>
+    /// <returns>Memory block. STATUS_IMAGE_NOT_AT_BASE if block was allocated out of range</returns>
+    BLACKBONE_API call_result_t<MemBlock> AllocateNear( ptr_t nearest, size_t size, DWORD protection = PAGE_EXECUTE_READWRITE );
+
     /// <summary>
     /// Free memory
     /// </summary>
@@ -178,6 +200,23 @@ public:
     /// <returns>Found regions</returns>
     BLACKBONE_API std::vector<MEMORY_BASIC_INFORMATION64> EnumRegions( bool includeFree = false );
 
+    /// <summary>
+    /// Get remote memory operation counters
+    /// </summary>
+    /// <returns>Counters snapshot</returns>
+    BLACKBONE_API MemoryStats stats() const;
+
+    /// <summary>
+    /// Account memory syscall issued outside of this class
+    /// </summary>
+    BLACKBONE_API inline void countSyscall() { _syscalls++; }
+
+    /// <summary>
+    /// Get sub-allocator for small blocks
+    /// </summary>
+    /// <returns>Remote heap</returns>
+    BLACKBONE_API inline RemoteHeap& heap() { return _heap; }
+
     BLACKBONE_API inline class ProcessCore& core() { return _core; }
     BLACKBONE_API inline class Process* process()  { return _process; }
 
@@ -188,6 +227,11 @@ private:
 private:
     class Process* _process;    // Owning process object
     class ProcessCore& _core;   // Core routines
+    RemoteHeap _heap;           // Small block sub-allocator
+
+    std::atomic<uint64_t> _syscalls = 0;        // Memory syscalls issued
+    std::atomic<uint64_t> _bytesRead = 0;       // Bytes read
+    std::atomic<uint64_t> _bytesWritten = 0;    // Bytes written
 };
 
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "../Misc/Utils.h"
 #include "../Misc/PatternLoader.h"
 #include "../Asm/AsmFactory.h"
+#include "../Asm/StubTemplates.h"
 
 #include <memory>
 #include <type_traits>
@@ -395,8 +396,9 @@ call_result_t<ModuleDataPtr> ProcessModules::Inject( const std::wstring& path, T
     if (mod = GetModule( path, LdrList, img.mType() ))
         return call_result_t<ModuleDataPtr>( mod, STATUS_IMAGE_ALREADY_LOADED );
 
-    // Image path
-    auto modName = _memory.Allocate( 0x1000, PAGE_READWRITE );
+    // Image path, followed by loaded module handle
+    auto handleOffset = Align( sizeof( _UNICODE_STRING64 ) + (path.size() + 1) * sizeof( wchar_t ), sizeof( uint64_t ) );
+    auto modName = _memory.heap().Allocate( handleOffset + sizeof( uint64_t ) );
     if (!modName)
         return modName.status;
 
@@ -407,7 +409,7 @@ call_result_t<ModuleDataPtr> ProcessModules::Inject( const std::wstring& path, T
         ustr.MaximumLength = ustr.Length = static_cast<USHORT>(path.size() * sizeof( wchar_t ));
 
         modName->Write( 0, ustr );
-        modName->Write( sizeof( ustr ), path.size() * sizeof( wchar_t ), path.c_str() );
+        modName->Write( sizeof( ustr ), (path.size() + 1) * sizeof( wchar_t ), path.c_str() );
 
         return static_cast<uint32_t>(sizeof( ustr ));
     };
@@ -458,10 +460,10 @@ call_result_t<ModuleDataPtr> ProcessModules::Inject( const std::wstring& path, T
         _ldrPatched = true;
     }
 
-    auto a = AsmFactory::GetAssembler( img.mType() );
-
-    a->GenCall( pLdrLoadDll->procAddress, { 0, 0, modName->ptr(), modName->ptr() + 0x800 } );
-    (*a)->ret();
+    // LdrLoadDll( nullptr, 0, &ustr, &hMod )
+    uint8_t code[stubs::Call4_x64.size()] = { 0 };
+    std::initializer_list<uint64_t> slots = { 0, 0, modName->ptr(), modName->ptr() + handleOffset, pLdrLoadDll->procAddress };
+    size_t size = img.mType() == mt_mod64 ? stubs::Call4_x64.Fill( code, slots ) : stubs::Call4_x86.Fill( code, slots );
 
     _proc.remote().CreateRPCEnvironment( Worker_None, true );
 
@@ -469,16 +471,16 @@ call_result_t<ModuleDataPtr> ProcessModules::Inject( const std::wstring& path, T
     if (pThread != nullptr)
     {
         if (pThread == _proc.remote().getWorker())
-            status = _proc.remote().ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), res );
+            status = _proc.remote().ExecInWorkerThread( code, size, res );
         else
-            status = _proc.remote().ExecInAnyThread( (*a)->make(), (*a)->getCodeSize(), res, pThread );
+            status = _proc.remote().ExecInAnyThread( code, size, res, pThread );
 
         if (NT_SUCCESS( status ))
             status = static_cast<NTSTATUS>(res);
     }
     else
     {
-        status = _proc.remote().ExecInNewThread( (*a)->make(), (*a)->getCodeSize(), res, switchMode );
+        status = _proc.remote().ExecInNewThread( code, size, res, switchMode );
         if (NT_SUCCESS( status ))
             status = static_cast<NTSTATUS>(res);
     }
@@ -515,12 +517,11 @@ NTSTATUS ProcessModules::Unload( const ModuleDataPtr& hMod )
         threadSwitch = ForceSwitch;
 
     uint64_t res = 0;
-    auto a = AsmFactory::GetAssembler( hMod->type );
-
-    a->GenCall( pUnload->procAddress, { hMod->baseAddress } );
-    (*a)->ret();
+    uint8_t code[stubs::Call1_x64.size()] = { 0 };
+    std::initializer_list<uint64_t> slots = { hMod->baseAddress, pUnload->procAddress };
+    size_t size = hMod->type == mt_mod64 ? stubs::Call1_x64.Fill( code, slots ) : stubs::Call1_x86.Fill( code, slots );
 
-    _proc.remote().ExecInNewThread( (*a)->make(), (*a)->getCodeSize(), res, threadSwitch );
+    _proc.remote().ExecInNewThread( code, size, res, threadSwitch );
 
     // Remove module from cache
     _modules.erase( std::make_pair( hMod->name, hMod->type ) );
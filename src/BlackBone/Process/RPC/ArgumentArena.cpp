@@ -0,0 +1,123 @@
+#include "ArgumentArena.h"
+#include "../ProcessMemory.h"
+
+#include <algorithm>
+
+namespace blackbone
+{
+
+ArgumentArena::ArgumentArena( bool x86 )
+    : _x86( x86 )
+{
+}
+
+/// <summary>
+/// Copy pointed data of call arguments.
+/// Structures go first, so their offsets depend only on argument layout
+/// </summary>
+/// <param name="args">Call arguments</param>
+void ArgumentArena::Add( std::vector<AsmVariant>& args )
+{
+    // Transform 64 bit imm values
+    for (auto& arg : args)
+    {
+        if (arg.type == AsmVariant::imm && arg.size > sizeof( uint32_t ) && _x86)
+        {
+            arg.type = AsmVariant::dataStruct;
+            arg.buf.resize( arg.size );
+            memcpy( arg.buf.data(), &arg.imm_val64, arg.size );
+            arg.imm_val64 = reinterpret_cast<uint64_t>(arg.buf.data());
+        }
+    }
+
+    for (auto type : { AsmVariant::dataStruct, AsmVariant::dataPtr })
+        for (auto& arg : args)
+            if (arg.type == type)
+                _refs.emplace_back( &arg, Reserve( arg.size, reinterpret_cast<const void*>(arg.imm_val) ) );
+}
+
+/// <summary>
+/// Reserve aligned space
+/// </summary>
+/// <param name="size">Space size</param>
+/// <param name="pSrc">Initial data, if any</param>
+/// <returns>Offset in arena</returns>
+size_t ArgumentArena::Reserve( size_t size, const void* pSrc /*= nullptr*/ )
+{
+    size_t offset = Align( _data.size(), 0x10 );
+    _data.resize( offset + size );
+    if (pSrc)
+        memcpy( _data.data() + offset, pSrc, size );
+
+    return offset;
+}
+
+/// <summary>
+/// Set remote addresses of added arguments
+/// </summary>
+/// <param name="base">Remote arena address</param>
+void ArgumentArena::Bind( ptr_t base )
+{
+    for (auto& [arg, offset] : _refs)
+        arg->new_imm_val = base + offset;
+}
+
+/// <summary>
+/// Bind arguments to block and write arena into it
+/// </summary>
+/// <param name="block">Target memory block</param>
+/// <param name="offset">Arena offset in block</param>
+/// <returns>Status code</returns>
+NTSTATUS ArgumentArena::Commit( MemBlock& block, uintptr_t offset /*= 0*/ )
+{
+    if (offset + _data.size() > block.size())
+        return STATUS_BUFFER_TOO_SMALL;
+
+    Bind( block.ptr() + offset );
+    return _data.empty() ? STATUS_SUCCESS : block.Write( offset, _data.size(), _data.data() );
+}
+
+/// <summary>
+/// Read back all pointer arguments of a call with single remote read
+/// </summary>
+/// <param name="memory">Process memory</param>
+/// <param name="args">Bound call arguments</param>
+/// <returns>Status code</returns>
+NTSTATUS ArgumentArena::Readback( ProcessMemory& memory, const std::vector<AsmVariant>& args )
+{
+    ptr_t low = ~0ull, high = 0;
+    for (auto& arg : args)
+    {
+        if (writable( arg ))
+        {
+            low = std::min<ptr_t>( low, arg.new_imm_val );
+            high = std::max<ptr_t>( high, arg.new_imm_val + arg.size );
+        }
+    }
+
+    if (high <= low)
+        return STATUS_SUCCESS;
+
+    std::vector<uint8_t> buf( static_cast<size_t>(high - low) );
+    auto status = memory.Read( low, buf.size(), buf.data() );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    Update( args, buf.data(), low );
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Copy pointed data of non-const pointer arguments from local image of remote memory
+/// </summary>
+/// <param name="args">Bound call arguments</param>
+/// <param name="data">Local copy of remote memory</param>
+/// <param name="base">Remote address of data</param>
+void ArgumentArena::Update( const std::vector<AsmVariant>& args, const uint8_t* data, ptr_t base )
+{
+    for (auto& arg : args)
+        if (writable( arg ))
+            memcpy( reinterpret_cast<void*>(arg.imm_val), data + (arg.new_imm_val - base), arg.size );
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "../../Asm/AsmVariant.hpp"
+#include "../MemBlock.h"
+
+#include <vector>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Local image of call argument data.
+/// Structures and strings of one or many calls are laid out contiguously and written with a single remote write.
+/// Argument lists must stay alive and unchanged in size until Bind/Commit
+/// </summary>
+class ArgumentArena
+{
+public:
+    BLACKBONE_API ArgumentArena( bool x86 );
+
+    /// <summary>
+    /// Copy pointed data of call arguments.
+    /// Structures go first, so their offsets depend only on argument layout
+    /// </summary>
+    /// <param name="args">Call arguments</param>
+    BLACKBONE_API void Add( std::vector<AsmVariant>& args );
+
+    /// <summary>
+    /// Reserve aligned space
+    /// </summary>
+    /// <param name="size">Space size</param>
+    /// <param name="pSrc">Initial data, if any</param>
+    /// <returns>Offset in arena</returns>
+    BLACKBONE_API size_t Reserve( size_t size, const void* pSrc = nullptr );
+
+    /// <summary>
+    /// Set remote addresses of added arguments
+    /// </summary>
+    /// <param name="base">Remote arena address</param>
+    BLACKBONE_API void Bind( ptr_t base );
+
+    /// <summary>
+    /// Bind arguments to block and write arena into it
+    /// </summary>
+    /// <param name="block">Target memory block</param>
+    /// <param name="offset">Arena offset in block</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS Commit( MemBlock& block, uintptr_t offset = 0 );
+
+    /// <summary>
+    /// Read back all pointer arguments of a call with single remote read
+    /// </summary>
+    /// <param name="memory">Process memory</param>
+    /// <param name="args">Bound call arguments</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API static NTSTATUS Readback( class ProcessMemory& memory, const std::vector<AsmVariant>& args );
+
+    /// <summary>
+    /// Copy pointed data of non-const pointer arguments from local image of remote memory.
+    /// Const data, e.g. string literals, may reside in read-only memory and is skipped
+    /// </summary>
+    /// <param name="args">Bound call arguments</param>
+    /// <param name="data">Local copy of remote memory</param>
+    /// <param name="base">Remote address of data</param>
+    BLACKBONE_API static void Update( const std::vector<AsmVariant>& args, const uint8_t* data, ptr_t base );
+
+    /// <summary>
+    /// Get arena size
+    /// </summary>
+    /// <returns>Size in bytes</returns>
+    BLACKBONE_API inline size_t size() const { return _data.size(); }
+
+    /// <summary>
+    /// Get arena data
+    /// </summary>
+    /// <returns>Arena data</returns>
+    BLACKBONE_API inline uint8_t* data() { return _data.data(); }
+
+private:
+    /// <summary>
+    /// Check if argument data must be copied back after call
+    /// </summary>
+    /// <param name="arg">Bound argument</param>
+    /// <returns>true if argument points to mutable host data</returns>
+    static inline bool writable( const AsmVariant& arg ) { return arg.type == AsmVariant::dataPtr && !arg.readOnly; }
+
+private:
+    bool _x86;                                          // Target is 32 bit
+    std::vector<uint8_t> _data;                         // Arena image
+    std::vector<std::pair<AsmVariant*, size_t>> _refs;  // Arguments and their data offsets
+};
+
+}
@@ -0,0 +1,242 @@
+#include "AsyncWaiter.h"
+#include "RemoteExec.h"
+
+#include <algorithm>
+
+namespace blackbone
+{
+
+AsyncWaiter::AsyncWaiter()
+{
+    _hWake = CreateEventW( NULL, FALSE, FALSE, NULL );
+    _hPolled = CreateEventW( NULL, TRUE, TRUE, NULL );
+}
+
+AsyncWaiter::~AsyncWaiter()
+{
+    {
+        CSLock lck( _lock );
+        _stop = true;
+
+        while (!_watched.empty())
+            Drop( _watched.begin() );
+    }
+
+    SetEvent( _hWake );
+    if (_thread.joinable())
+        _thread.join();
+
+    for (auto hEvent : _retired)
+        CloseHandle( hEvent );
+
+    CloseHandle( _hPolled );
+    CloseHandle( _hWake );
+}
+
+/// <summary>
+/// Get global waiter
+/// </summary>
+/// <returns>Waiter instance</returns>
+AsyncWaiter& AsyncWaiter::Instance()
+{
+    static AsyncWaiter instance;
+    return instance;
+}
+
+/// <summary>
+/// Start waiting for completed calls of executor
+/// </summary>
+/// <param name="exec">Executor with pending calls</param>
+void AsyncWaiter::Watch( RemoteExec* exec )
+{
+    CSLock lck( _lock );
+    if (_stop)
+        return;
+
+    if (_polling == exec)
+        _repoll = true;
+
+    // Already in wait set, completion event wakes waiter
+    if (_watched.count( exec ) != 0)
+        return;
+
+    // Executor may close its event while waiter is blocked on it, so waiter uses own handle
+    HANDLE hEvent = NULL;
+    if (exec->asyncEvent())
+        DuplicateHandle( GetCurrentProcess(), exec->asyncEvent(), GetCurrentProcess(), &hEvent, SYNCHRONIZE, FALSE, 0 );
+
+    _watched.emplace( exec, hEvent );
+
+    // Previous thread has already left the loop
+    if (!_active)
+    {
+        if (_thread.joinable())
+            _thread.join();
+
+        _active = true;
+        _thread = std::thread( &AsyncWaiter::Run, this );
+    }
+
+    SetEvent( _hWake );
+}
+
+/// <summary>
+/// Stop waiting for executor. Returns only after executor is no longer accessed by waiter thread
+/// </summary>
+/// <param name="exec">Executor</param>
+void AsyncWaiter::Unwatch( RemoteExec* exec )
+{
+    for (;;)
+    {
+        {
+            CSLock lck( _lock );
+
+            auto iter = _watched.find( exec );
+            if (iter != _watched.end())
+                Drop( iter );
+
+            // Executor may be released from its own completion routine
+            if (_polling != exec || std::this_thread::get_id() == _thread.get_id())
+                return;
+        }
+
+        WaitForSingleObject( _hPolled, INFINITE );
+    }
+}
+
+/// <summary>
+/// Stop waiting for executor. _lock must be held
+/// </summary>
+/// <param name="iter">Executor entry</param>
+void AsyncWaiter::Drop( std::map<RemoteExec*, HANDLE>::iterator iter )
+{
+    // Waiter thread may be blocked on this event right now
+    if (iter->second)
+    {
+        _retired.emplace_back( iter->second );
+        if (std::this_thread::get_id() != _thread.get_id())
+            SetEvent( _hWake );
+    }
+
+    _watched.erase( iter );
+}
+
+/// <summary>
+/// Complete finished calls of executor, unless it was unwatched.
+/// Executor without pending calls is dropped
+/// </summary>
+/// <param name="exec">Executor</param>
+void AsyncWaiter::Poll( RemoteExec* exec )
+{
+    {
+        CSLock lck( _lock );
+        if (_watched.count( exec ) == 0)
+            return;
+
+        _polling = exec;
+        ResetEvent( _hPolled );
+    }
+
+    auto left = exec->PollAsync();
+
+    CSLock lck( _lock );
+
+    // Keep executor if new calls were posted during poll
+    auto iter = _watched.find( exec );
+    if (left == 0 && !_repoll && iter != _watched.end())
+        Drop( iter );
+
+    _polling = nullptr;
+    _repoll = false;
+    SetEvent( _hPolled );
+}
+
+/// <summary>
+/// Waiter thread routine.
+/// Executors are polled outside of lock, so completion routines are free to start or cancel other calls
+/// </summary>
+void AsyncWaiter::Run()
+{
+    std::vector<std::pair<RemoteExec*, HANDLE>> evented;
+    std::vector<RemoteExec*> waited, polled;
+    std::vector<HANDLE> handles;
+
+    for (uint32_t idle = 0;;)
+    {
+        DWORD timeout = 1000;
+        bool empty = false;
+
+        evented.clear();
+        waited.clear();
+        polled.clear();
+        handles.clear();
+        {
+            CSLock lck( _lock );
+
+            // Waiter isn't blocked on dropped events anymore
+            for (auto hEvent : _retired)
+                CloseHandle( hEvent );
+
+            _retired.clear();
+
+            // Exit after staying idle for a while
+            empty = _watched.empty();
+            if (empty && (_stop || idle > 0))
+            {
+                _active = false;
+                return;
+            }
+
+            for (auto& item : _watched)
+            {
+                if (item.second)
+                    evented.emplace_back( item );
+                else
+                    polled.emplace_back( item.first );
+            }
+
+            // Wait window is rotated when events don't fit into one wait, the rest is polled
+            size_t count = std::min<size_t>( evented.size(), MAXIMUM_WAIT_OBJECTS - 1 );
+            _window = evented.empty() ? 0 : _window % evented.size();
+
+            for (size_t i = 0; i < evented.size(); i++)
+            {
+                auto& item = evented[(_window + i) % evented.size()];
+                if (i < count)
+                {
+                    waited.emplace_back( item.first );
+                    handles.emplace_back( item.second );
+                }
+                else
+                    polled.emplace_back( item.first );
+            }
+
+            _window += count;
+        }
+
+        // Executors outside of wait are checked every millisecond
+        if (!polled.empty())
+            timeout = 1;
+
+        handles.emplace_back( _hWake );
+        DWORD result = WaitForMultipleObjects( static_cast<DWORD>(handles.size()), handles.data(), FALSE, timeout );
+
+        if (result >= WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + waited.size())
+        {
+            // Events are auto-reset, collect every signaled one
+            for (size_t i = result - WAIT_OBJECT_0; i < waited.size(); i++)
+                if (i == result - WAIT_OBJECT_0 || WaitForSingleObject( handles[i], 0 ) == WAIT_OBJECT_0)
+                    polled.emplace_back( waited[i] );
+        }
+        // Nothing was signaled for a while, check that workers are still alive
+        else if (result != WAIT_OBJECT_0 + waited.size())
+            polled.insert( polled.end(), waited.begin(), waited.end() );
+
+        for (auto exec : polled)
+            Poll( exec );
+
+        idle = (empty && result == WAIT_TIMEOUT) ? idle + 1 : 0;
+    }
+}
+
+}
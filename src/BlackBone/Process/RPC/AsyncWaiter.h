@@ -0,0 +1,79 @@
+#pragma once
+
+#include "../../Include/Winheaders.h"
+#include "../../Misc/Utils.h"
+
+#include <map>
+#include <vector>
+#include <thread>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Single host thread completing asynchronous remote calls of all processes.
+/// Thread blocks on completion events signaled by ring threads, is started on demand and exits after staying idle
+/// </summary>
+class AsyncWaiter
+{
+public:
+    BLACKBONE_API ~AsyncWaiter();
+
+    /// <summary>
+    /// Get global waiter
+    /// </summary>
+    /// <returns>Waiter instance</returns>
+    BLACKBONE_API static AsyncWaiter& Instance();
+
+    /// <summary>
+    /// Start waiting for completed calls of executor
+    /// </summary>
+    /// <param name="exec">Executor with pending calls</param>
+    BLACKBONE_API void Watch( class RemoteExec* exec );
+
+    /// <summary>
+    /// Stop waiting for executor. Returns only after executor is no longer accessed by waiter thread
+    /// </summary>
+    /// <param name="exec">Executor</param>
+    BLACKBONE_API void Unwatch( class RemoteExec* exec );
+
+private:
+    AsyncWaiter();
+
+    /// <summary>
+    /// Waiter thread routine.
+    /// Executors are polled outside of lock, so completion routines are free to start or cancel other calls
+    /// </summary>
+    void Run();
+
+    /// <summary>
+    /// Complete finished calls of executor, unless it was unwatched.
+    /// Executor without pending calls is dropped
+    /// </summary>
+    /// <param name="exec">Executor</param>
+    void Poll( class RemoteExec* exec );
+
+    /// <summary>
+    /// Stop waiting for executor. _lock must be held
+    /// </summary>
+    /// <param name="iter">Executor entry</param>
+    void Drop( std::map<class RemoteExec*, HANDLE>::iterator iter );
+
+    AsyncWaiter( const AsyncWaiter& ) = delete;
+    AsyncWaiter& operator =( const AsyncWaiter& ) = delete;
+
+private:
+    CriticalSection _lock;                  // Executor set lock
+    HANDLE _hWake = NULL;                   // Signaled when executor set changes
+    HANDLE _hPolled = NULL;                 // Signaled when no executor is being polled
+    std::map<class RemoteExec*, HANDLE> _watched;   // Executors with pending calls and copies of their completion events
+    std::vector<HANDLE> _retired;           // Events of dropped executors, closed once waiter thread isn't waiting on them
+    size_t _window = 0;                     // First executor in wait window, when not all events fit into one wait
+    class RemoteExec* _polling = nullptr;   // Executor being polled by waiter thread
+    bool _repoll = false;                   // Polled executor got new calls during poll
+    std::thread _thread;                    // Waiter thread
+    bool _active = false;                   // Waiter thread is running
+    bool _stop = false;                     // Waiter is being destroyed
+};
+
+}
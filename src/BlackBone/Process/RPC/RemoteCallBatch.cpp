@@ -0,0 +1,202 @@
+#include "RemoteCallBatch.h"
+#include "ArgumentArena.h"
+#include "../Process.h"
+
+namespace blackbone
+{
+
+RemoteCallBatch::RemoteCallBatch( Process& proc )
+    : _process( proc )
+{
+}
+
+/// <summary>
+/// Add function call
+/// </summary>
+/// <param name="pfn">Function address</param>
+/// <param name="args">Function arguments</param>
+/// <param name="cc">Calling convention</param>
+/// <param name="retType">Return type</param>
+/// <param name="retSize">Returned structure size, if retType is rt_struct</param>
+/// <returns>Call index</returns>
+size_t RemoteCallBatch::Add(
+    ptr_t pfn,
+    const std::vector<AsmVariant>& args,
+    eCalligConvention cc /*= cc_stdcall*/,
+    eReturnType retType /*= rt_int32*/,
+    size_t retSize /*= 0*/
+    )
+{
+    CallEntry entry;
+    entry.pfn = pfn;
+    entry.args = args;
+    entry.cc = cc;
+    entry.retType = retType;
+    entry.retSize = retSize;
+
+    _entries.emplace_back( std::move( entry ) );
+    _data.clear();
+
+    return _entries.size() - 1;
+}
+
+/// <summary>
+/// Execute all calls in worker thread
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS RemoteCallBatch::Execute()
+{
+    uint64_t result = 0;
+    auto& remote = _process.remote();
+
+    _data.clear();
+    if (_entries.empty())
+        return STATUS_SUCCESS;
+
+    auto status = remote.CreateRPCEnvironment( Worker_CreateNew, true );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    auto a = AsmFactory::GetAssembler( _process.core().isWow64() );
+    ArgumentArena arena( (*a)->getArch() == asmjit::kArchX86 );
+    LayoutData( arena );
+
+    auto block = _process.memory().heap().Allocate( arena.size() );
+    if (!block)
+        return block.status;
+
+    if (!NT_SUCCESS( status = arena.Commit( block.result() ) ))
+        return status;
+
+    GenCalls( *a, block->ptr() );
+
+    // Results, returned structures and out parameters are read at once
+    std::vector<uint8_t> data( arena.size() );
+
+    status = remote.ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), result );
+    if (!NT_SUCCESS( status ) || !NT_SUCCESS( status = block->Read( 0, data.size(), data.data() ) ))
+        return status;
+
+    // Update arguments
+    for (auto& entry : _entries)
+        ArgumentArena::Update( entry.args, data.data(), block->ptr() );
+
+    _data = std::move( data );
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Get thread last error value after call
+/// </summary>
+/// <param name="idx">Call index</param>
+/// <returns>Last error value</returns>
+uint32_t RemoteCallBatch::lastError( size_t idx ) const
+{
+    if (idx >= _entries.size() || _data.empty())
+        return ERROR_INVALID_INDEX;
+
+    return slot( idx ).lastError;
+}
+
+/// <summary>
+/// Remove all calls and results
+/// </summary>
+void RemoteCallBatch::clear()
+{
+    _entries.clear();
+    _data.clear();
+}
+
+/// <summary>
+/// Copy call arguments and reserve returned structures in arena
+///
+/// Data block layout:
+/// ----------------------------------------------------------------------
+/// |  Call results  |  Copied arguments, strings and returned structures |
+/// ----------------------------------------------------------------------
+/// | 16 bytes each  |                                                    |
+/// ----------------------------------------------------------------------
+/// </summary>
+/// <param name="arena">Argument arena</param>
+void RemoteCallBatch::LayoutData( ArgumentArena& arena )
+{
+    arena.Reserve( _entries.size() * sizeof( CallResult ) );
+
+    for (auto& entry : _entries)
+    {
+        arena.Add( entry.args );
+
+        if (entry.retType == rt_struct)
+            entry.retOffset = arena.Reserve( entry.retSize );
+    }
+}
+
+/// <summary>
+/// Generate call sequence
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="base">Data block address</param>
+void RemoteCallBatch::GenCalls( IAsmHelper& a, ptr_t base )
+{
+    bool x86 = a.assembler()->getArch() == asmjit::kArchX86;
+
+    a.GenPrologue();
+
+    for (size_t i = 0; i < _entries.size(); i++)
+    {
+        auto& entry = _entries[i];
+        auto args = entry.args;
+        ptr_t slotPtr = base + i * sizeof( CallResult );
+
+        // Hidden pointer to returned structure
+        if (entry.retType == rt_struct)
+        {
+            args.emplace( args.begin(), AsmVariant( base + entry.retOffset ) );
+            args.front().new_imm_val = args.front().imm_val;
+            args.front().type = AsmVariant::structRet;
+        }
+
+        a.GenCall( entry.pfn, args, entry.cc );
+
+        // Save return value
+        a->mov( a->zcx, slotPtr );
+        if (entry.retType == rt_float || entry.retType == rt_double)
+        {
+            if (!x86 && entry.retType == rt_double)
+                a->movsd( asmjit::Mem( a->zcx, 0 ), asmjit::host::xmm0 );
+            else if (!x86)
+                a->movss( asmjit::Mem( a->zcx, 0 ), asmjit::host::xmm0 );
+            else
+                a->fstp( asmjit::Mem( a->zcx, 0, entry.retType * sizeof( float ) ) );
+        }
+        else if (entry.retType == rt_int64 && x86)
+        {
+            a->mov( asmjit::host::dword_ptr( a->zcx ), asmjit::host::eax );
+            a->mov( asmjit::host::dword_ptr( a->zcx, sizeof( uint32_t ) ), asmjit::host::edx );
+        }
+        else
+            a->mov( a->intptr_ptr( a->zcx ), a->zax );
+
+        // Save last error
+        if (x86)
+        {
+            a->mov( asmjit::host::edx, asmjit::host::dword_ptr_abs( 0x18 ).setSegment( asmjit::host::fs ) );
+            a->mov( asmjit::host::edx, asmjit::host::dword_ptr( asmjit::host::edx, 0x34 ) );
+        }
+        else
+        {
+            a->mov( asmjit::host::rdx, asmjit::host::dword_ptr_abs( 0x30 ).setSegment( asmjit::host::gs ) );
+            a->mov( asmjit::host::edx, asmjit::host::dword_ptr( asmjit::host::rdx, 0x68 ) );
+        }
+
+        a->mov( asmjit::host::dword_ptr( a->zcx, offsetof( CallResult, lastError ) ), asmjit::host::edx );
+    }
+
+    // Number of executed calls
+    a->mov( a->zax, _entries.size() );
+
+    _process.remote().AddReturnWithEvent( a );
+    a.GenEpilogue();
+}
+
+}
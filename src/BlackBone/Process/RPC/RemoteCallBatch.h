@@ -0,0 +1,139 @@
+#pragma once
+
+#include "RemoteFunction.hpp"
+
+#include <vector>
+#include <algorithm>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Sequence of remote calls executed by a single stub in one round trip.
+/// Pointer arguments must remain valid until Execute returns
+/// </summary>
+class RemoteCallBatch
+{
+    // Per-call result slot in target process
+    struct CallResult
+    {
+        uint64_t value;         // Return value or returned structure address
+        uint32_t lastError;     // Thread last error value after call
+        uint32_t padding;
+    };
+
+    struct CallEntry
+    {
+        ptr_t pfn = 0;                      // Function address
+        std::vector<AsmVariant> args;       // Function arguments
+        eCalligConvention cc = cc_cdecl;    // Calling convention
+        eReturnType retType = rt_int32;     // Return type
+        size_t retSize = 0;                 // Returned structure size
+        size_t retOffset = 0;               // Returned structure offset in data block
+    };
+
+public:
+    BLACKBONE_API RemoteCallBatch( class Process& proc );
+
+    /// <summary>
+    /// Add function call
+    /// </summary>
+    /// <param name="pfn">Function address</param>
+    /// <param name="args">Function arguments</param>
+    /// <param name="cc">Calling convention</param>
+    /// <param name="retType">Return type</param>
+    /// <param name="retSize">Returned structure size, if retType is rt_struct</param>
+    /// <returns>Call index</returns>
+    BLACKBONE_API size_t Add(
+        ptr_t pfn,
+        const std::vector<AsmVariant>& args,
+        eCalligConvention cc = cc_stdcall,
+        eReturnType retType = rt_int32,
+        size_t retSize = 0
+        );
+
+    /// <summary>
+    /// Add typed function call
+    /// </summary>
+    /// <param name="fn">Remote function</param>
+    /// <param name="args">Function arguments</param>
+    /// <returns>Call index</returns>
+    template<typename R, typename... Args, typename... T>
+    size_t Add( const RemoteFunctionBase<R, Args...>& fn, const T&... args )
+    {
+        using ReturnType = typename RemoteFunctionBase<R, Args...>::ReturnType;
+
+        typename RemoteFunctionBase<R, Args...>::CallArguments a( args... );
+        return Add( fn.ptr(), a.arguments, fn.conv(), ReturnTypeOf<ReturnType>(), sizeof( ReturnType ) );
+    }
+
+    /// <summary>
+    /// Execute all calls in worker thread
+    /// </summary>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS Execute();
+
+    /// <summary>
+    /// Get call return value
+    /// </summary>
+    /// <param name="idx">Call index</param>
+    /// <returns>Return value</returns>
+    template<typename T>
+    call_result_t<T> result( size_t idx ) const
+    {
+        T value = {};
+        if (idx >= _entries.size() || _data.empty())
+            return call_result_t<T>( value, STATUS_INVALID_PARAMETER );
+
+        if constexpr (sizeof( T ) > sizeof( uint64_t ))
+            memcpy( &value, _data.data() + _entries[idx].retOffset, std::min<size_t>( sizeof( T ), _entries[idx].retSize ) );
+        else
+            memcpy( &value, &slot( idx ).value, sizeof( T ) );
+
+        return call_result_t<T>( value, STATUS_SUCCESS );
+    }
+
+    /// <summary>
+    /// Get thread last error value after call
+    /// </summary>
+    /// <param name="idx">Call index</param>
+    /// <returns>Last error value</returns>
+    BLACKBONE_API uint32_t lastError( size_t idx ) const;
+
+    /// <summary>
+    /// Get number of calls
+    /// </summary>
+    /// <returns>Call count</returns>
+    BLACKBONE_API inline size_t size() const { return _entries.size(); }
+
+    /// <summary>
+    /// Remove all calls and results
+    /// </summary>
+    BLACKBONE_API void clear();
+
+private:
+    /// <summary>
+    /// Copy call arguments and reserve returned structures in arena
+    /// </summary>
+    /// <param name="arena">Argument arena</param>
+    void LayoutData( class ArgumentArena& arena );
+
+    /// <summary>
+    /// Generate call sequence
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="base">Data block address</param>
+    void GenCalls( IAsmHelper& a, ptr_t base );
+
+    inline const CallResult& slot( size_t idx ) const { return reinterpret_cast<const CallResult*>(_data.data())[idx]; }
+
+    RemoteCallBatch( const RemoteCallBatch& ) = delete;
+    RemoteCallBatch& operator =( const RemoteCallBatch& ) = delete;
+
+private:
+    class Process& _process;
+    std::vector<CallEntry> _entries;    // Queued calls
+    std::vector<uint8_t> _data;         // Data block contents after execution
+};
+
+}
@@ -0,0 +1,148 @@
+#include "RemoteCallStats.h"
+
+#include <intrin.h>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Add sample
+/// </summary>
+/// <param name="ns">Latency in nanoseconds</param>
+void LatencyHistogram::Record( uint64_t ns )
+{
+    _buckets[BucketOf( ns )].fetch_add( 1, std::memory_order_relaxed );
+    _count.fetch_add( 1, std::memory_order_relaxed );
+    _sum.fetch_add( ns, std::memory_order_relaxed );
+}
+
+/// <summary>
+/// Get latency percentile
+/// </summary>
+/// <param name="p">Percentile, 0-100</param>
+/// <returns>Upper bound of matching bucket in nanoseconds, 0 if histogram is empty</returns>
+uint64_t LatencyHistogram::percentile( double p ) const
+{
+    uint64_t total = _count;
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+    rank = std::min<uint64_t>( std::max<uint64_t>( rank, 1 ), total );
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BucketCount; i++)
+    {
+        seen += _buckets[i].load( std::memory_order_relaxed );
+        if (seen >= rank)
+            return BucketLimit( i );
+    }
+
+    return BucketLimit( BucketCount - 1 );
+}
+
+/// <summary>
+/// Get average latency
+/// </summary>
+/// <returns>Average in nanoseconds</returns>
+uint64_t LatencyHistogram::mean() const
+{
+    uint64_t total = _count;
+    return total ? _sum / total : 0;
+}
+
+/// <summary>
+/// Remove all samples
+/// </summary>
+void LatencyHistogram::reset()
+{
+    for (auto& bucket : _buckets)
+        bucket = 0;
+
+    _count = 0;
+    _sum = 0;
+}
+
+/// <summary>
+/// Values below SubBuckets get own bucket, larger ones are split by highest bit and next 3 bits
+/// </summary>
+/// <param name="ns">Latency</param>
+/// <returns>Bucket index</returns>
+uint32_t LatencyHistogram::BucketOf( uint64_t ns )
+{
+    if (ns < SubBuckets)
+        return static_cast<uint32_t>(ns);
+
+    unsigned long msb = 0;
+#ifdef USE64
+    _BitScanReverse64( &msb, ns );
+#else
+    if (_BitScanReverse( &msb, static_cast<unsigned long>(ns >> 32) ))
+        msb += 32;
+    else
+        _BitScanReverse( &msb, static_cast<unsigned long>(ns) );
+#endif
+
+    uint32_t sub = static_cast<uint32_t>(ns >> (msb - 3)) & (SubBuckets - 1);
+    return (msb - 2) * SubBuckets + sub;
+}
+
+/// <summary>
+/// Get largest value falling into bucket
+/// </summary>
+/// <param name="bucket">Bucket index</param>
+/// <returns>Bucket upper bound</returns>
+uint64_t LatencyHistogram::BucketLimit( uint32_t bucket )
+{
+    if (bucket < SubBuckets)
+        return bucket;
+
+    uint32_t msb = bucket / SubBuckets + 2;
+    uint64_t sub = bucket % SubBuckets;
+
+    return ((SubBuckets + sub + 1) << (msb - 3)) - 1;
+}
+
+RemoteCallStats::RemoteCallStats()
+{
+    LARGE_INTEGER freq = { 0 }, qpcStart = { 0 }, qpcEnd = { 0 };
+    QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &qpcStart );
+    uint64_t tscStart = __rdtsc();
+
+    // Calibrate TSC against QPC over ~2ms
+    do
+    {
+        YieldProcessor();
+        QueryPerformanceCounter( &qpcEnd );
+    } while ((qpcEnd.QuadPart - qpcStart.QuadPart) * 500 < freq.QuadPart);
+
+    uint64_t ticks = __rdtsc() - tscStart;
+    double ns = (qpcEnd.QuadPart - qpcStart.QuadPart) * 1e9 / freq.QuadPart;
+    if (ticks != 0)
+        _nsPerTick = ns / ticks;
+}
+
+/// <summary>
+/// Add phase sample
+/// </summary>
+/// <param name="phase">Call phase</param>
+/// <param name="tscStart">Phase start timestamp</param>
+/// <param name="tscEnd">Phase end timestamp</param>
+void RemoteCallStats::Record( eCallPhase phase, uint64_t tscStart, uint64_t tscEnd )
+{
+    // Timestamps taken on different cores may be slightly out of order
+    uint64_t ticks = tscEnd > tscStart ? tscEnd - tscStart : 0;
+    _phases[phase].Record( static_cast<uint64_t>(ticks * _nsPerTick) );
+}
+
+/// <summary>
+/// Remove all samples
+/// </summary>
+void RemoteCallStats::reset()
+{
+    for (auto& histogram : _phases)
+        histogram.reset();
+}
+
+}
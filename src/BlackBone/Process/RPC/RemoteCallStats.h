@@ -0,0 +1,118 @@
+#pragma once
+
+#include "../../Include/Winheaders.h"
+#include "../../Config.h"
+
+#include <atomic>
+#include <array>
+#include <stdint.h>
+
+namespace blackbone
+{
+
+// Remote call phases
+enum eCallPhase
+{
+    Phase_Prepare = 0,  // Stub generation and argument copy
+    Phase_Copy,         // Code copy into target
+    Phase_Queue,        // APC queueing or command ring publishing
+    Phase_Schedule,     // Delay until stub starts executing in target
+    Phase_Execute,      // Called function execution in target
+    Phase_Readback,     // Delay until host observes completion and reads result
+    Phase_Total,        // From code copy until result is available
+
+    Phase_Count
+};
+
+/// <summary>
+/// Logarithmic latency histogram, ~12% bucket precision
+/// </summary>
+class LatencyHistogram
+{
+    static constexpr uint32_t SubBuckets = 8;
+    static constexpr uint32_t BucketCount = 64 * SubBuckets;
+
+public:
+    /// <summary>
+    /// Add sample
+    /// </summary>
+    /// <param name="ns">Latency in nanoseconds</param>
+    BLACKBONE_API void Record( uint64_t ns );
+
+    /// <summary>
+    /// Get latency percentile
+    /// </summary>
+    /// <param name="p">Percentile, 0-100</param>
+    /// <returns>Upper bound of matching bucket in nanoseconds, 0 if histogram is empty</returns>
+    BLACKBONE_API uint64_t percentile( double p ) const;
+
+    /// <summary>
+    /// Get average latency
+    /// </summary>
+    /// <returns>Average in nanoseconds</returns>
+    BLACKBONE_API uint64_t mean() const;
+
+    /// <summary>
+    /// Get sample count
+    /// </summary>
+    /// <returns>Sample count</returns>
+    BLACKBONE_API inline uint64_t count() const { return _count; }
+
+    /// <summary>
+    /// Remove all samples
+    /// </summary>
+    BLACKBONE_API void reset();
+
+private:
+    static uint32_t BucketOf( uint64_t ns );
+    static uint64_t BucketLimit( uint32_t bucket );
+
+private:
+    std::array<std::atomic<uint64_t>, BucketCount> _buckets = {};
+    std::atomic<uint64_t> _count{ 0 };
+    std::atomic<uint64_t> _sum{ 0 };
+};
+
+/// <summary>
+/// Per-phase remote call latency statistics.
+/// Timestamps are TSC values, shared by host and target since both run on the same machine
+/// </summary>
+class RemoteCallStats
+{
+public:
+    BLACKBONE_API RemoteCallStats();
+
+    /// <summary>
+    /// Add phase sample
+    /// </summary>
+    /// <param name="phase">Call phase</param>
+    /// <param name="tscStart">Phase start timestamp</param>
+    /// <param name="tscEnd">Phase end timestamp</param>
+    BLACKBONE_API void Record( eCallPhase phase, uint64_t tscStart, uint64_t tscEnd );
+
+    /// <summary>
+    /// Get phase latency histogram
+    /// </summary>
+    /// <param name="phase">Call phase</param>
+    /// <returns>Histogram</returns>
+    BLACKBONE_API inline const LatencyHistogram& phase( eCallPhase phase ) const { return _phases[phase]; }
+
+    /// <summary>
+    /// Get phase latency percentile
+    /// </summary>
+    /// <param name="phase">Call phase</param>
+    /// <param name="p">Percentile, 0-100</param>
+    /// <returns>Latency in nanoseconds</returns>
+    BLACKBONE_API inline uint64_t percentile( eCallPhase phase, double p ) const { return _phases[phase].percentile( p ); }
+
+    /// <summary>
+    /// Remove all samples
+    /// </summary>
+    BLACKBONE_API void reset();
+
+private:
+    std::array<LatencyHistogram, Phase_Count> _phases;
+    double _nsPerTick = 1.0;    // TSC period
+};
+
+}
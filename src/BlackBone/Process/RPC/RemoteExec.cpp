@@ -1,4 +1,6 @@
 #include "RemoteExec.h"
+#include "ArgumentArena.h"
+#include "AsyncWaiter.h"
 #include "../Process.h"
 #include "../../Misc/DynImport.h"
 #include "../../Misc/PatternLoader.h"
@@ -41,6 +43,7 @@ NTSTATUS RemoteExec::ExecInNewThread(
     )
 {
     NTSTATUS status = STATUS_SUCCESS;
+    _callCount++;
 
     // Write code
     if (!NT_SUCCESS( status = CopyCode( pCode, size ) ))
@@ -111,19 +114,82 @@ NTSTATUS RemoteExec::ExecInNewThread(
 NTSTATUS RemoteExec::ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& callResult )
 {
     NTSTATUS status = STATUS_SUCCESS;
+    uint64_t tscBegin = StatStamp();
 
     // Delegate to another thread
     if (_hijackThread)
         return ExecInAnyThread( pCode, size, callResult, _hijackThread );
 
+    // Post into command ring
+    if (_ring.valid())
+    {
+        auto ticket = PostToWorker( pCode, size );
+        if (!ticket)
+            return ticket.status;
+
+        if (!NT_SUCCESS( status = WaitForWorker( ticket.result(), callResult ) ))
+            return status;
+
+        RecordCall( tscBegin );
+        return status;
+    }
+
+    // Write code
+    if (!NT_SUCCESS( status = CopyCode( pCode, size ) ))
+        return status;
+
+    if (_statsEnabled)
+        _stats->Record( Phase_Copy, tscBegin, __rdtsc() );
+
+    return ExecCommand( _userCode.ptr(), callResult, tscBegin );
+}
+
+/// <summary>
+/// Execute code already present in target process in context of our worker thread
+/// </summary>
+/// <param name="pRemoteCode">Code address</param>
+/// <param name="callResult">Execution result</param>
+/// <returns>Status</returns>
+NTSTATUS RemoteExec::ExecInWorkerThread( ptr_t pRemoteCode, uint64_t& callResult )
+{
+    // Hijacked thread executes only copied code
+    if (_hijackThread)
+        return STATUS_NOT_SUPPORTED;
+
+    return ExecCommand( pRemoteCode, callResult, StatStamp() );
+}
+
+/// <summary>
+/// Execute code already present in target process and collect its result
+/// </summary>
+/// <param name="pRemoteCode">Code address</param>
+/// <param name="callResult">Execution result</param>
+/// <param name="tscBegin">Call start timestamp</param>
+/// <returns>Status</returns>
+NTSTATUS RemoteExec::ExecCommand( ptr_t pRemoteCode, uint64_t& callResult, uint64_t tscBegin )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Post into command ring
+    if (_ring.valid())
+    {
+        auto ticket = PostToWorker( pRemoteCode );
+        if (!ticket)
+            return ticket.status;
+
+        if (!NT_SUCCESS( status = WaitForWorker( ticket.result(), callResult ) ))
+            return status;
+
+        RecordCall( tscBegin );
+        return status;
+    }
+
     assert( _workerThread );
     assert( _hWaitEvent != NULL );
     if (!_workerThread || !_hWaitEvent)
         return STATUS_INVALID_PARAMETER;
 
-    // Write code
-    if (!NT_SUCCESS( status = CopyCode( pCode, size ) ))
-        return status;
+    _callCount++;
 
     if (_hWaitEvent)
         ResetEvent( _hWaitEvent );
@@ -150,14 +216,22 @@ NTSTATUS RemoteExec::ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& cal
             _apcPatched = true;
     }*/
 
-    auto pRemoteCode = _userCode.ptr();
-
     // Execute code in thread context
     // TODO: Find out why am I passing pRemoteCode as an argument???
+    uint64_t tscQueue = StatStamp();
     if (NT_SUCCESS( _process.core().native()->QueueApcT( _workerThread->handle(), pRemoteCode, pRemoteCode ) ))
     {
+        if (_statsEnabled)
+        {
+            _tscPosted = __rdtsc();
+            _stats->Record( Phase_Queue, tscQueue, _tscPosted );
+        }
+
         status = WaitForSingleObject( _hWaitEvent, 30 * 1000 /*wait 30s*/ );
         callResult = _userData.Read<uint64_t>( RET_OFFSET, 0 );
+
+        if (status == WAIT_OBJECT_0)
+            RecordCall( tscBegin );
     }
     else
         return LastNtStatus();
@@ -168,6 +242,287 @@ NTSTATUS RemoteExec::ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& cal
     return status;
 }
 
+/// <summary>
+/// Post code into persistent worker command ring without waiting for its execution.
+/// Completion must be collected before RING_CAPACITY more commands are posted
+/// </summary>
+/// <param name="pCode">Code to execute</param>
+/// <param name="size">Code size</param>
+/// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+/// <param name="flags">Command flags</param>
+/// <returns>Command ticket</returns>
+call_result_t<uint32_t> RemoteExec::PostToWorker( PVOID pCode, size_t size, ptr_t arg /*= 0*/, uint32_t flags /*= 0*/ )
+{
+    uint64_t tscBegin = StatStamp();
+
+    assert( _ring.valid() && _workerThread );
+    if (!_ring.valid() || !_workerThread)
+        return STATUS_INVALID_PARAMETER;
+
+    auto status = AcquireEntry();
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    uint32_t idx = _ringHead % RING_CAPACITY;
+    uint32_t codeOffset = RING_CODE_OFFSET + idx * RING_CODE_SIZE;
+    ptr_t pRemoteCode = _ring.ptr() + codeOffset;
+
+    if (size > RING_CODE_SIZE)
+    {
+        auto mem = _memory.heap().Allocate( size, PAGE_EXECUTE_READWRITE );
+        if (!mem)
+            return mem.status;
+
+        if (!NT_SUCCESS( status = mem->Write( 0, size, pCode ) ))
+            return status;
+
+        pRemoteCode = mem->ptr();
+        _ringSpill[idx] = std::move( mem.result() );
+    }
+    else if (!NT_SUCCESS( status = RingWrite( codeOffset, size, pCode ) ))
+        return status;
+
+    if (_statsEnabled)
+        _stats->Record( Phase_Copy, tscBegin, __rdtsc() );
+
+    return PublishCommand( pRemoteCode, arg, flags );
+}
+
+/// <summary>
+/// Post code already present in target process into persistent worker command ring
+/// </summary>
+/// <param name="pRemoteCode">Code address</param>
+/// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+/// <param name="flags">Command flags</param>
+/// <returns>Command ticket</returns>
+call_result_t<uint32_t> RemoteExec::PostToWorker( ptr_t pRemoteCode, ptr_t arg /*= 0*/, uint32_t flags /*= 0*/ )
+{
+    assert( _ring.valid() && _workerThread );
+    if (!_ring.valid() || !_workerThread)
+        return STATUS_INVALID_PARAMETER;
+
+    auto status = AcquireEntry();
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    return PublishCommand( pRemoteCode, arg, flags );
+}
+
+/// <summary>
+/// Wait for posted command completion
+/// </summary>
+/// <param name="ticket">Command ticket</param>
+/// <param name="callResult">Code return value</param>
+/// <param name="timeout">Wait timeout in ms</param>
+/// <returns>Status</returns>
+NTSTATUS RemoteExec::WaitForWorker( uint32_t ticket, uint64_t& callResult, uint32_t timeout /*= 30 * 1000*/ )
+{
+    // Not posted yet or entry was already reused
+    if (!_ring.valid() || _ringHead - ticket - 1 >= RING_CAPACITY)
+        return STATUS_INVALID_PARAMETER;
+
+    uint32_t entry = RING_ENTRY_OFFSET + (ticket % RING_CAPACITY) * RING_ENTRY_SIZE;
+    auto status = RingWait( [this, entry, ticket]() { return RingRead<uint32_t>( entry + CMD_DONE_OFFSET ) == ticket + 1; }, timeout );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    callResult = RingRead<uint64_t>( entry + CMD_RESULT_OFFSET );
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Execute code in any persistent worker thread without blocking.
+/// Completion is reported by the shared waiter thread, STATUS_NOT_SUPPORTED is returned without command ring.
+/// Code runs concurrently with other commands, so it must not use _userData
+/// </summary>
+/// <param name="pCode">Code to execute</param>
+/// <param name="size">Code size</param>
+/// <returns>Code return value</returns>
+std::future<call_result_t<uint64_t>> RemoteExec::ExecAsync( PVOID pCode, size_t size )
+{
+    auto promise = std::make_shared<std::promise<call_result_t<uint64_t>>>();
+    auto future = promise->get_future();
+
+    auto status = QueueAsync( pCode, size, MemBlock(), vecArgs(), [promise]( call_result_t<uint64_t> result )
+    {
+        promise->set_value( std::move( result ) );
+    } );
+
+    if (!NT_SUCCESS( status ))
+        promise->set_value( call_result_t<uint64_t>( status ) );
+
+    return future;
+}
+
+/// <summary>
+/// Call remote function in any persistent worker thread without blocking.
+/// Arguments are copied into separate data block, so many calls can be in flight.
+/// Pointer arguments are updated before callback is invoked and must remain valid until then
+/// </summary>
+/// <param name="pfn">Remote function pointer</param>
+/// <param name="args">Function arguments</param>
+/// <param name="cc">Calling convention</param>
+/// <param name="retType">Return type, structures aren't supported</param>
+/// <param name="callback">Completion routine, may be invoked from waiter thread</param>
+/// <returns>Status code, STATUS_NOT_SUPPORTED if persistent worker isn't running</returns>
+NTSTATUS RemoteExec::CallAsync(
+    ptr_t pfn,
+    std::vector<AsmVariant> args,
+    eCalligConvention cc,
+    eReturnType retType,
+    AsyncCallback callback
+    )
+{
+    bool x86 = _process.core().isWow64();
+    auto a = AsmFactory::GetAssembler( x86 );
+    ArgumentArena arena( x86 );
+    MemBlock block;
+
+    // Invalid calling convention
+    if (cc < cc_cdecl || cc > cc_fastcall)
+        return STATUS_INVALID_PARAMETER_3;
+
+    // Returned structure would need separate buffer too
+    if (retType == rt_struct || !_ring.valid())
+        return STATUS_NOT_SUPPORTED;
+
+    // Copy structures and strings into call data block
+    arena.Add( args );
+    if (arena.size() != 0)
+    {
+        auto mem = _memory.Allocate( arena.size(), PAGE_READWRITE );
+        if (!mem)
+            return mem.status;
+
+        block = std::move( mem.result() );
+
+        auto status = arena.Commit( block );
+        if (!NT_SUCCESS( status ))
+            return status;
+    }
+
+    // Result is left in accumulator, _userData is shared with commands running on other ring threads
+    auto callArgs = args;
+    a->GenPrologue();
+    a->GenCall( pfn, callArgs, cc );
+
+    if (retType == rt_float || retType == rt_double)
+    {
+        if (x86)
+        {
+            (*a)->sub( asmjit::host::esp, sizeof( uint64_t ) );
+            (*a)->fstp( asmjit::Mem( asmjit::host::esp, 0, retType * sizeof( float ) ) );
+            (*a)->pop( asmjit::host::eax );
+            (*a)->pop( asmjit::host::edx );
+        }
+        else
+            (*a)->movq( asmjit::host::rax, asmjit::host::xmm0 );
+    }
+
+    a->GenEpilogue();
+
+    return QueueAsync( (*a)->make(), (*a)->getCodeSize(), std::move( block ), std::move( args ), std::move( callback ) );
+}
+
+/// <summary>
+/// Complete finished asynchronous calls
+/// </summary>
+/// <returns>Number of calls still pending</returns>
+size_t RemoteExec::PollAsync()
+{
+    CSLock lck( _asyncLock );
+    if (_asyncCalls.empty())
+        return 0;
+
+    if (!_ring.valid() || !_workerThread || _workerThread->Join( 0 ))
+        CancelAsync( STATUS_THREAD_IS_TERMINATING );
+    else
+        ReapAsync();
+
+    return _asyncCalls.size();
+}
+
+/// <summary>
+/// Get number of pending asynchronous calls
+/// </summary>
+/// <returns>Pending call count</returns>
+size_t RemoteExec::asyncPending()
+{
+    CSLock lck( _asyncLock );
+    return _asyncCalls.size();
+}
+
+/// <summary>
+/// Post code and register its completion routine
+/// </summary>
+/// <param name="pCode">Code to execute</param>
+/// <param name="size">Code size</param>
+/// <param name="data">Call data block, released after completion</param>
+/// <param name="args">Arguments to update after completion</param>
+/// <param name="callback">Completion routine</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::QueueAsync( PVOID pCode, size_t size, MemBlock&& data, vecArgs&& args, AsyncCallback callback )
+{
+    // Without command ring there is nothing to wait on asynchronously
+    if (!_ring.valid())
+        return STATUS_NOT_SUPPORTED;
+
+    auto ticket = PostToWorker( pCode, size, 0, CMD_ASYNC );
+    if (!ticket)
+        return ticket.status;
+
+    {
+        CSLock lck( _asyncLock );
+        _asyncCalls.emplace_back( AsyncCall{ ticket.result(), _tscPosted, std::move( data ), std::move( args ), std::move( callback ) } );
+    }
+
+    _asyncWatched = true;
+    AsyncWaiter::Instance().Watch( this );
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Complete asynchronous calls executed by ring threads, in any order. _asyncLock must be held
+/// </summary>
+void RemoteExec::ReapAsync()
+{
+    for (size_t i = 0; i < _asyncCalls.size();)
+    {
+        uint32_t entry = RING_ENTRY_OFFSET + (_asyncCalls[i].ticket % RING_CAPACITY) * RING_ENTRY_SIZE;
+        if (RingRead<uint32_t>( entry + CMD_DONE_OFFSET ) != _asyncCalls[i].ticket + 1)
+        {
+            i++;
+            continue;
+        }
+
+        auto result = RingRead<uint64_t>( entry + CMD_RESULT_OFFSET );
+        auto call = std::move( _asyncCalls[i] );
+        _asyncCalls.erase( _asyncCalls.begin() + i );
+
+        ArgumentArena::Readback( _memory, call.args );
+        call.data.Free();
+
+        // Asynchronous stubs don't store target timestamps, so only total time is known
+        if (_statsEnabled)
+            _stats->Record( Phase_Total, call.tscPosted, __rdtsc() );
+
+        call.callback( call_result_t<uint64_t>( result, STATUS_SUCCESS ) );
+    }
+}
+
+/// <summary>
+/// Fail all pending asynchronous calls. _asyncLock must be held
+/// </summary>
+/// <param name="status">Failure status</param>
+void RemoteExec::CancelAsync( NTSTATUS status )
+{
+    auto calls = std::move( _asyncCalls );
+    _asyncCalls.clear();
+
+    for (auto& call : calls)
+        call.callback( call_result_t<uint64_t>( status ) );
+}
+
 /// <summary>
 /// Execute code in context of any existing thread
 /// </summary>
@@ -185,7 +540,26 @@ NTSTATUS RemoteExec::ExecInAnyThread( PVOID pCode, size_t size, uint64_t& callRe
     assert( _hWaitEvent != NULL );
     if (_hWaitEvent == NULL)
         return STATUS_NOT_FOUND;
-    
+
+    // First hijack installs dispatcher, following calls are posted to it
+    if (_hijackPersistent && thd == _hijackThread)
+    {
+        if (!_hijackActive && !NT_SUCCESS( status = InstallDispatcher( thd ) ) && status != STATUS_NOT_SUPPORTED)
+            return status;
+
+        if (_hijackActive)
+        {
+            status = DispatchHijacked( pCode, size, callResult );
+            if (status != STATUS_NOT_FOUND)
+                return status;
+        }
+
+        // Dispatcher is gone, hijack thread for this call only
+        status = STATUS_SUCCESS;
+    }
+
+    _callCount++;
+
     // Write code
     if (!NT_SUCCESS( status = CopyCode( pCode, size ) ))
         return status;
@@ -226,7 +600,7 @@ NTSTATUS RemoteExec::ExecInAnyThread( PVOID pCode, size_t size, uint64_t& callRe
             (*a)->mov( asmjit::Mem( asmjit::host::rsp, i * sizeof( uint64_t ) ), regs[i] );
 
         a->GenCall( _userCode.ptr(), { _userData.ptr() } );
-        AddReturnWithEvent( *a );
+        AddReturnWithEvent( *a, mt_default, rt_int32, RET_OFFSET, true );
 
         // Restore registers
         for (int i = 0; i < count; i++)
@@ -253,7 +627,7 @@ NTSTATUS RemoteExec::ExecInAnyThread( PVOID pCode, size_t size, uint64_t& callRe
 
         a->GenCall( _userCode.ptr(), { _userData.ptr() } );
         (*a)->add( asmjit::host::esp, sizeof( uint32_t ) );
-        AddReturnWithEvent( *a, mt_mod32, rt_int32, INTRET_OFFSET );
+        AddReturnWithEvent( *a, mt_mod32, rt_int32, INTRET_OFFSET, true );
 
         (*a)->popf();
         (*a)->popa();
@@ -286,6 +660,164 @@ NTSTATUS RemoteExec::ExecInAnyThread( PVOID pCode, size_t size, uint64_t& callRe
     return status;
 }
 
+/// <summary>
+/// Hijack thread and park command dispatcher in it
+/// </summary>
+/// <param name="thd">Target thread</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::InstallDispatcher( ThreadPtr& thd )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    _CONTEXT32 ctx32 = { 0 };
+    _CONTEXT64 ctx64 = { 0 };
+    bool wow64 = _process.core().isWow64();
+
+    auto pDelay = _mods.GetNtdllExport( "NtDelayExecution", mt_default, Sections );
+    if (!pDelay)
+        return STATUS_NOT_SUPPORTED;
+
+    // Dispatcher that failed to start may still enter old block, leave it to that thread
+    if (_hijackInUse)
+    {
+        _hijackBlock.Release();
+        _hijackBlock.Reset();
+        _hijackInUse = false;
+    }
+
+    if (!_hijackBlock.valid())
+    {
+        auto mem = _memory.Allocate( HIJACK_SIZE, PAGE_EXECUTE_READWRITE );
+        if (!mem)
+            return mem.status;
+
+        _hijackBlock = std::move( mem.result() );
+    }
+
+    // Command slot is idle, wait 1ms between polls
+    uint8_t header[HIJACK_LOOP_OFFSET] = { 0 };
+    LARGE_INTEGER liDelay = { { 0 } };
+    liDelay.QuadPart = -10 * 1000;
+    memcpy( header + HIJACK_DELAY_OFFSET, &liDelay, sizeof( liDelay ) );
+
+    if (!NT_SUCCESS( status = _hijackBlock.Write( 0, sizeof( header ), header ) ))
+        return status;
+
+    if (!thd->Suspend())
+        return LastNtStatus();
+
+    auto a = AsmFactory::GetAssembler( wow64 );
+    if (wow64)
+        status = thd->GetContext( ctx32, CONTEXT_CONTROL, true );
+    else
+        status = thd->GetContext( ctx64, CONTEXT64_CONTROL, true );
+
+    if (NT_SUCCESS( status ))
+    {
+        GenHijackLoop( *a, pDelay->procAddress, wow64 ? ctx32.Eip : ctx64.Rip );
+        status = _hijackBlock.Write( HIJACK_LOOP_OFFSET, (*a)->getCodeSize(), (*a)->make() );
+    }
+
+    if (NT_SUCCESS( status ))
+    {
+        if (wow64)
+        {
+            ctx32.Eip = static_cast<uint32_t>(_hijackBlock.ptr() + HIJACK_LOOP_OFFSET);
+            status = thd->SetContext( ctx32, true );
+        }
+        else
+        {
+            ctx64.Rip = _hijackBlock.ptr() + HIJACK_LOOP_OFFSET;
+            status = thd->SetContext( ctx64, true );
+        }
+    }
+
+    thd->Resume();
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    _hijackSeq = 0;
+    _hijackActive = true;
+    _hijackInUse = true;
+
+    // Thread may be blocked in kernel and start dispatcher later
+    status = RingWait( [this]() { return _hijackBlock.Read<uint32_t>( HIJACK_ACTIVE_OFFSET, 0 ) != 0; }, 20 * 1000, thd.get() );
+    if (!NT_SUCCESS( status ))
+    {
+        // Let dispatcher return right away if it ever starts
+        _hijackBlock.Write( HIJACK_STOP_OFFSET, 1u );
+        _hijackActive = false;
+    }
+
+    return status;
+}
+
+/// <summary>
+/// Execute code by dispatcher running in hijacked thread
+/// </summary>
+/// <param name="pCode">Code to execute</param>
+/// <param name="size">Code size</param>
+/// <param name="callResult">Execution result</param>
+/// <returns>Status code, STATUS_NOT_FOUND if dispatcher has exited</returns>
+NTSTATUS RemoteExec::DispatchHijacked( PVOID pCode, size_t size, uint64_t& callResult )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    auto isDone = [this]() { return _hijackBlock.Read<uint32_t>( HIJACK_DONE_OFFSET, 0 ) == _hijackSeq; };
+
+    if (_hijackBlock.Read<uint32_t>( HIJACK_ACTIVE_OFFSET, 0 ) == 0)
+    {
+        _hijackActive = false;
+        _hijackInUse = false;
+        return STATUS_NOT_FOUND;
+    }
+
+    // Previous code may still be finishing after it has signaled the event
+    if (!NT_SUCCESS( status = RingWait( isDone, 20 * 1000, _hijackThread.get() ) ))
+        return status;
+
+    if (!NT_SUCCESS( status = CopyCode( pCode, size ) ))
+        return status;
+
+    ResetEvent( _hWaitEvent );
+
+    // Publish command after code address is written
+    if (!NT_SUCCESS( status = _hijackBlock.Write( HIJACK_CODE_OFFSET, _userCode.ptr() ) ) ||
+        !NT_SUCCESS( status = _hijackBlock.Write( HIJACK_SEQ_OFFSET, _hijackSeq + 1 ) ))
+    {
+        return status;
+    }
+
+    _hijackSeq++;
+    _callCount++;
+
+    WaitForSingleObject( _hWaitEvent, 20 * 1000 );
+
+    // Dispatcher saves return value after the event is signaled
+    if (!NT_SUCCESS( status = RingWait( isDone, 1000, _hijackThread.get() ) ))
+        return status;
+
+    return _userData.Read( RET_OFFSET, callResult );
+}
+
+/// <summary>
+/// Stop dispatcher and resume hijacked thread at its original location
+/// </summary>
+void RemoteExec::ReleaseDispatcher()
+{
+    // Persistent mode ends with dispatcher, later calls hijack thread once per call
+    _hijackPersistent = false;
+    if (!_hijackActive)
+        return;
+
+    _hijackActive = false;
+    if (!NT_SUCCESS( _hijackBlock.Write( HIJACK_STOP_OFFSET, 1u ) ))
+        return;
+
+    // Block can be freed only after dispatcher has left it
+    auto status = RingWait( [this]() { return _hijackBlock.Read<uint32_t>( HIJACK_ACTIVE_OFFSET, 0 ) == 0; }, 1000, _hijackThread.get() );
+    if (NT_SUCCESS( status ))
+        _hijackInUse = false;
+}
+
 
 /// <summary>
 /// Create new thread with specified entry point and argument
@@ -321,11 +853,11 @@ NTSTATUS RemoteExec::CreateRPCEnvironment( WorkerThreadMode mode /*= Worker_None
     DWORD thdID = GetTickCount();       // randomize thread id
     NTSTATUS status = STATUS_SUCCESS;
 
-    auto allocMem = [this]( auto& result, uint32_t size = 0x1000, DWORD prot = PAGE_EXECUTE_READWRITE ) -> NTSTATUS
+    auto allocMem = [this]( auto& result, uint32_t size = 0x1000, DWORD prot = PAGE_EXECUTE_READWRITE, bool sub = false ) -> NTSTATUS
     {
         if (!result.valid())
         {
-            auto mem = _memory.Allocate( size, prot );
+            auto mem = sub ? _memory.heap().Allocate( size, prot ) : _memory.Allocate( size, prot );
             if (!mem)
                 return mem.status;
                 
@@ -338,7 +870,7 @@ NTSTATUS RemoteExec::CreateRPCEnvironment( WorkerThreadMode mode /*= Worker_None
     //
     // Allocate environment codecave
     //
-    if (!NT_SUCCESS( status = allocMem( _workerCode ) ))
+    if (!NT_SUCCESS( status = allocMem( _workerCode, 0x1000, PAGE_EXECUTE_READWRITE, true ) ))
         return status;
     if (!NT_SUCCESS( status = allocMem( _userCode ) ))
         return status;
@@ -346,8 +878,13 @@ NTSTATUS RemoteExec::CreateRPCEnvironment( WorkerThreadMode mode /*= Worker_None
         return status;
 
     // Create RPC thread
-    if (mode == Worker_CreateNew)
+    if (mode == Worker_CreateNew || mode == Worker_Persistent)
     {
+        // Worker loop is bound to the ring, so it must exist first
+        bool newWorker = !_workerThread || !_workerThread->valid();
+        if (mode == Worker_Persistent && newWorker && !NT_SUCCESS( status = CreateCommandRing() ))
+            return status;
+
         auto thd = CreateWorkerThread();
         if (!thd)
             return thd.status;
@@ -355,11 +892,19 @@ NTSTATUS RemoteExec::CreateRPCEnvironment( WorkerThreadMode mode /*= Worker_None
         thdID = thd.result();
     }
     // Get thread to hijack
-    else if (mode == Worker_UseExisting)
+    else if (mode == Worker_UseExisting || mode == Worker_HijackPersistent)
     {
-        _hijackThread = _process.threads().getMostExecuted();
-        if (!_hijackThread)
-            return STATUS_INVALID_THREAD;
+        // Thread with parked dispatcher is reused
+        if (!_hijackActive || !_hijackThread->valid())
+        {
+            ReleaseDispatcher();
+
+            _hijackThread = _process.threads().getMostExecuted();
+            if (!_hijackThread)
+                return STATUS_INVALID_THREAD;
+        }
+
+        _hijackPersistent |= mode == Worker_HijackPersistent;
 
         thdID = _hijackThread->id();
     }
@@ -408,8 +953,11 @@ call_result_t<DWORD> RemoteExec::CreateWorkerThread()
         auto ntdll = _mods.GetModule( L"ntdll.dll", Sections );
         auto proc = _mods.GetExport( ntdll, "NtDelayExecution" );
         auto pExitThread = _mods.GetExport( ntdll, "NtTerminateThread" );
-        if (!proc || !pExitThread)
-            return proc.status ? proc.status : pExitThread.status;
+        auto pSetEvent = _mods.GetExport( ntdll, "NtSetEvent" );
+        if (!proc || !pExitThread || !pSetEvent)
+            return !proc ? proc.status : (!pExitThread ? pExitThread.status : pSetEvent.status);
+
+        auto helper = AsmFactory::GetAssembler( _process.core().isWow64() );
 
         /*
             for(;;)
@@ -417,30 +965,319 @@ call_result_t<DWORD> RemoteExec::CreateWorkerThread()
 
             ExitThread(SetEvent(m_hWaitEvent));
         */
-        (*a)->bind( l_loop );
-        a->GenCall( proc->procAddress, { TRUE, _workerCode.ptr() } );
-        (*a)->jmp( l_loop );
+        if (_ring.valid())
+        {
+            GenRingLoop( *a, proc->procAddress, pExitThread->procAddress, pSetEvent->procAddress, false );
+            GenRingLoop( *helper, proc->procAddress, pExitThread->procAddress, pSetEvent->procAddress, true );
+        }
+        else
+        {
+            (*a)->bind( l_loop );
+            a->GenCall( proc->procAddress, { TRUE, _workerCode.ptr() } );
+            (*a)->jmp( l_loop );
+
+            a->ExitThreadWithStatus( pExitThread->procAddress, _userData.ptr() );
+        }
+
+        // Write code into process
+        LARGE_INTEGER liDelay = { { 0 } };
+        liDelay.QuadPart = -10 * 1000 * 5;
+
+        size_t helperOffset = sizeof( LARGE_INTEGER ) + (*a)->getCodeSize();
+
+        _workerCode.Write( 0, liDelay );
+        _workerCode.Write( sizeof(LARGE_INTEGER), (*a)->getCodeSize(), (*a)->make() );
+        if (_ring.valid())
+            _workerCode.Write( helperOffset, (*helper)->getCodeSize(), (*helper)->make() );
+
+        auto thd = _threads.CreateNew( _workerCode.ptr() + sizeof( LARGE_INTEGER ), _userData.ptr()/*, HideFromDebug*/ );
+        if (!thd)
+            return thd.status;
+
+        _workerThread = std::move( thd.result() );
+
+        // Asynchronous commands are spread over several threads, main worker alone is enough for the rest
+        for (int i = 1; _ring.valid() && i < RING_WORKERS; i++)
+        {
+            auto helperThd = _threads.CreateNew( _workerCode.ptr() + helperOffset, _userData.ptr() );
+            if (!helperThd)
+                break;
+
+            _ringHelpers.emplace_back( std::move( helperThd.result() ) );
+        }
+    }
+
+    return _workerThread->id();
+}
+
+
+/// <summary>
+/// Generate persistent worker loop
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="pDelay">NtDelayExecution address</param>
+/// <param name="pExitThread">NtTerminateThread address</param>
+/// <param name="pSetEvent">NtSetEvent address</param>
+/// <param name="helper">Execute only CMD_ASYNC commands, main worker executes everything</param>
+void RemoteExec::GenRingLoop( IAsmHelper& a, ptr_t pDelay, ptr_t pExitThread, ptr_t pSetEvent, bool helper )
+{
+    /*
+        for(;;)
+        {
+            for(spin = RING_SPIN_COUNT;; spin--)
+            {
+                ticket = tail;
+                if(ticket != head && (!helper || entries[ticket % RING_CAPACITY].flags & CMD_ASYNC))
+                {
+                    if(InterlockedCompareExchange(&tail, ticket + 1, ticket) == ticket)
+                        break;
+
+                    continue;
+                }
+
+                if(stop)
+                    ExitThread(0);
+
+                if(spin == 0)
+                    SleepEx(5, TRUE), spin = RING_SPIN_COUNT;
+            }
+
+            cmd = &entries[ticket % RING_CAPACITY];
+            cmd->result = cmd->code(cmd->arg);
+            flags = cmd->flags;
+            cmd->done = ticket + 1;
+
+            if((flags & CMD_ASYNC) && event)
+                NtSetEvent(event, NULL);
+        }
+    */
+    bool x86 = a.assembler()->getArch() == asmjit::kArchX86;
+    asmjit::Label l_loop = a->newLabel();
+    asmjit::Label l_poll = a->newLabel();
+    asmjit::Label l_idle = a->newLabel();
+    asmjit::Label l_exec = a->newLabel();
+    asmjit::Label l_exit = a->newLabel();
+
+    a->mov( a->zbx, _ring.ptr() );
+
+    a->bind( l_loop );
+    a->mov( a->zsi, RING_SPIN_COUNT );
+
+    a->bind( l_poll );
+    a->mov( asmjit::host::eax, asmjit::host::dword_ptr( a->zbx, RING_TAIL_OFFSET ) );
+    a->cmp( asmjit::host::eax, asmjit::host::dword_ptr( a->zbx, RING_HEAD_OFFSET ) );
+    a->je( l_idle );
+
+    // Synchronous commands are left to main worker
+    if (helper)
+    {
+        a->mov( asmjit::host::ecx, asmjit::host::eax );
+        a->and_( asmjit::host::ecx, RING_CAPACITY - 1 );
+        a->shl( asmjit::host::ecx, 5 );     // RING_ENTRY_SIZE
+        a->test( asmjit::host::dword_ptr( a->zbx, a->zcx, 0, RING_ENTRY_OFFSET + CMD_FLAGS_OFFSET ), CMD_ASYNC );
+        a->jz( l_idle );
+    }
+
+    // Claim command, other ring thread may take it first
+    a->mov( asmjit::host::ecx, asmjit::host::eax );
+    a->inc( asmjit::host::ecx );
+    a->lock().cmpxchg( asmjit::host::dword_ptr( a->zbx, RING_TAIL_OFFSET ), asmjit::host::ecx );
+    a->jne( l_poll );
+    a->jmp( l_exec );
+
+    a->bind( l_idle );
+    a->cmp( asmjit::host::dword_ptr( a->zbx, RING_STOP_OFFSET ), 0 );
+    a->jne( l_exit );
+    a->pause();
+    a->dec( a->zsi );
+    a->jnz( l_poll );
+
+    // Ring is idle, wait alertable so APCs still get delivered
+    a.GenCall( pDelay, { TRUE, _workerCode.ptr() } );
+    a->jmp( l_loop );
+
+    // Execute command. Generated x86 code may not preserve esi/edi, so ticket is kept elsewhere
+    a->bind( l_exec );
+    if (x86)
+        a->push( a->zax );
+    else
+        a->mov( asmjit::host::r12, asmjit::host::rax );
+
+    a->and_( asmjit::host::eax, RING_CAPACITY - 1 );
+    a->shl( asmjit::host::eax, 5 );     // RING_ENTRY_SIZE
+    a->lea( a->zdi, a->intptr_ptr( a->zbx, a->zax, 0, RING_ENTRY_OFFSET ) );
+    a->mov( a->zax, a->intptr_ptr( a->zdi, CMD_CODE_OFFSET ) );
+    a.GenCall( a->zax, { a->intptr_ptr( a->zdi, CMD_ARG_OFFSET ) } );
+
+    // Code is cdecl, like APC routine
+    if (x86)
+    {
+        a->add( asmjit::host::esp, sizeof( uint32_t ) );
+        a->pop( a->zcx );
+    }
+    else
+        a->mov( asmjit::host::rcx, asmjit::host::r12 );
+
+    a->mov( asmjit::host::edi, asmjit::host::ecx );
+    a->and_( asmjit::host::edi, RING_CAPACITY - 1 );
+    a->shl( asmjit::host::edi, 5 );
+    a->lea( a->zdi, a->intptr_ptr( a->zbx, a->zdi, 0, RING_ENTRY_OFFSET ) );
+
+    // Store result, then mark command as completed. Entry belongs to host after that
+    a->mov( a->intptr_ptr( a->zdi, CMD_RESULT_OFFSET ), a->zax );
+    if (x86)
+        a->mov( asmjit::host::dword_ptr( a->zdi, CMD_RESULT_OFFSET + sizeof( uint32_t ) ), asmjit::host::edx );
+
+    a->mov( asmjit::host::edx, asmjit::host::dword_ptr( a->zdi, CMD_FLAGS_OFFSET ) );
+    a->inc( asmjit::host::ecx );
+    a->mov( asmjit::host::dword_ptr( a->zdi, CMD_DONE_OFFSET ), asmjit::host::ecx );
+
+    // Wake host waiter
+    a->test( asmjit::host::edx, CMD_ASYNC );
+    a->jz( l_loop );
+    a->cmp( a->intptr_ptr( a->zbx, RING_EVENT_OFFSET ), 0 );
+    a->je( l_loop );
+    a.GenCall( pSetEvent, { a->intptr_ptr( a->zbx, RING_EVENT_OFFSET ), 0 } );
+    a->jmp( l_loop );
+
+    a->bind( l_exit );
+    a->xor_( asmjit::host::eax, asmjit::host::eax );
+    a.ExitThreadWithStatus( pExitThread, 0 );
+}
+
+/// <summary>
+/// Generate dispatcher loop for hijacked thread
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="pDelay">NtDelayExecution address</param>
+/// <param name="returnAddress">Address to resume hijacked thread at</param>
+void RemoteExec::GenHijackLoop( IAsmHelper& a, ptr_t pDelay, ptr_t returnAddress )
+{
+    /*
+        active = 1;
+        for(;;)
+        {
+            for(spin = RING_SPIN_COUNT; seq == done; spin--)
+            {
+                if(stop)
+                    goto exit;
+
+                if(spin == 0)
+                    SleepEx(1, TRUE), spin = RING_SPIN_COUNT;
+            }
+
+            code(userData);
+            SetEvent(hEvent);
+            done = seq;
+        }
+
+    exit:
+        active = 0;
+        restore context and jump to returnAddress
+    */
+    bool x86 = a.assembler()->getArch() == asmjit::kArchX86;
+    ptr_t base = _hijackBlock.ptr();
+    asmjit::Label l_loop = a->newLabel();
+    asmjit::Label l_poll = a->newLabel();
+    asmjit::Label l_exec = a->newLabel();
+    asmjit::Label l_exit = a->newLabel();
+
+    const int count = 15;
+    static const asmjit::GpReg regs[] =
+    {
+        asmjit::host::rax, asmjit::host::rbx, asmjit::host::rcx, asmjit::host::rdx, asmjit::host::rsi,
+        asmjit::host::rdi, asmjit::host::r8,  asmjit::host::r9,  asmjit::host::r10, asmjit::host::r11,
+        asmjit::host::r12, asmjit::host::r13, asmjit::host::r14, asmjit::host::r15, asmjit::host::rbp
+    };
+
+    // Preserve thread context
+    if (x86)
+    {
+        a->pusha();
+        a->pushf();
+    }
+    else
+    {
+        a->sub( asmjit::host::rsp, count * sizeof( uint64_t ) );
+        a->pushf();
 
-        a->ExitThreadWithStatus( pExitThread->procAddress, _userData.ptr() );
+        for (int i = 0; i < count; i++)
+            a->mov( asmjit::Mem( asmjit::host::rsp, (i + 1) * sizeof( uint64_t ) ), regs[i] );
+    }
 
-        // Write code into process
-        LARGE_INTEGER liDelay = { { 0 } };
-        liDelay.QuadPart = -10 * 1000 * 5;
+    // Hijacked thread stack can have any alignment
+    a->mov( a->zax, a->zsp );
+    a->mov( a->zbx, base );
+    a->mov( a->intptr_ptr( a->zbx, HIJACK_SP_OFFSET ), a->zax );
+    a->and_( a->zsp, -16 );
+    if (!x86)
+        a->sub( a->zsp, 0x28 );
+
+    a->mov( asmjit::host::dword_ptr( a->zbx, HIJACK_ACTIVE_OFFSET ), 1 );
+
+    a->bind( l_loop );
+    a->mov( a->zsi, RING_SPIN_COUNT );
+
+    a->bind( l_poll );
+    a->mov( asmjit::host::eax, asmjit::host::dword_ptr( a->zbx, HIJACK_SEQ_OFFSET ) );
+    a->cmp( asmjit::host::eax, asmjit::host::dword_ptr( a->zbx, HIJACK_DONE_OFFSET ) );
+    a->jne( l_exec );
+    a->cmp( asmjit::host::dword_ptr( a->zbx, HIJACK_STOP_OFFSET ), 0 );
+    a->jne( l_exit );
+    a->pause();
+    a->dec( a->zsi );
+    a->jnz( l_poll );
+
+    // Slot is idle, wait alertable so thread still receives its APCs
+    a.GenCall( pDelay, { TRUE, base + HIJACK_DELAY_OFFSET } );
+    a->jmp( l_loop );
+
+    // Execute command
+    a->bind( l_exec );
+    a->mov( a->zax, a->intptr_ptr( a->zbx, HIJACK_CODE_OFFSET ) );
+    a.GenCall( a->zax, { _userData.ptr() } );
+
+    // Code is cdecl, like APC routine
+    if (x86)
+        a->add( asmjit::host::esp, sizeof( uint32_t ) );
+
+    // Call result is already in RET_OFFSET, stub return value must not overwrite it
+    AddReturnWithEvent( a, x86 ? mt_mod32 : mt_default, rt_int32, INTRET_OFFSET, true );
+
+    // Host may overwrite code only after this point
+    a->mov( a->zbx, base );
+    a->mov( asmjit::host::eax, asmjit::host::dword_ptr( a->zbx, HIJACK_SEQ_OFFSET ) );
+    a->mov( asmjit::host::dword_ptr( a->zbx, HIJACK_DONE_OFFSET ), asmjit::host::eax );
+    a->jmp( l_loop );
+
+    // Restore thread context
+    a->bind( l_exit );
+    a->mov( asmjit::host::dword_ptr( a->zbx, HIJACK_ACTIVE_OFFSET ), 0 );
+    a->mov( a->zsp, a->intptr_ptr( a->zbx, HIJACK_SP_OFFSET ) );
+
+    if (x86)
+    {
+        a->popf();
+        a->popa();
 
-        _workerCode.Write( 0, liDelay );
-        _workerCode.Write( sizeof(LARGE_INTEGER), (*a)->getCodeSize(), (*a)->make() );
+        a->push( static_cast<int>(returnAddress) );
+        a->ret();
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+            a->mov( regs[i], asmjit::Mem( asmjit::host::rsp, (i + 1) * sizeof( uint64_t ) ) );
 
-        auto thd = _threads.CreateNew( _workerCode.ptr() + sizeof( LARGE_INTEGER ), _userData.ptr()/*, HideFromDebug*/ );
-        if (!thd)
-            return thd.status;
+        a->popf();
+        a->add( asmjit::host::rsp, count * sizeof( uint64_t ) );
 
-        _workerThread = std::move( thd.result() );
+        // jmp [rip]
+        a->dw( '\xFF\x25' );
+        a->dd( 0 );
+        a->dq( returnAddress );
     }
-
-    return _workerThread->id();
 }
 
-
 /// <summary>
 /// Create event to synchronize APC procedures
 /// </summary>
@@ -542,6 +1379,234 @@ NTSTATUS RemoteExec::CreateAPCEvent( DWORD threadID )
     return status;
 }
 
+/// <summary>
+/// Allocate persistent worker command ring
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::CreateCommandRing()
+{
+    if (_ring.valid())
+        return STATUS_SUCCESS;
+
+    // Map ring into both processes, so commands are posted without any syscalls.
+    // Target view must be addressable by the host, so this requires same bitness
+    auto type = _process.barrier().type;
+    if (type == wow_32_32 || type == wow_64_64)
+    {
+        PVOID pRemote = nullptr;
+        SIZE_T viewSize = 0;
+
+        _hRing = CreateFileMappingW( INVALID_HANDLE_VALUE, NULL, PAGE_EXECUTE_READWRITE, 0, RING_SIZE, NULL );
+        if (_hRing)
+            _ringLocal = static_cast<uint8_t*>(MapViewOfFile( _hRing, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, RING_SIZE ));
+
+        if (_ringLocal && NT_SUCCESS( SAFE_NATIVE_CALL(
+                NtMapViewOfSection, _hRing, _process.core().handle(), &pRemote,
+                0, 0, nullptr, &viewSize, 2 /*ViewUnmap*/, 0, PAGE_EXECUTE_READWRITE
+            ) ))
+        {
+            _ring = MemBlock( &_memory, reinterpret_cast<ptr_t>(pRemote), RING_SIZE, PAGE_EXECUTE_READWRITE, false );
+        }
+        else
+            FreeCommandRing();
+    }
+
+    // Fallback to remote memory access
+    if (!_ring.valid())
+    {
+        auto mem = _memory.Allocate( RING_SIZE, PAGE_EXECUTE_READWRITE );
+        if (!mem)
+            return mem.status;
+
+        _ring = std::move( mem.result() );
+    }
+
+    // Entry is free when command posted RING_CAPACITY tickets earlier is done
+    for (uint32_t i = 0; i < RING_CAPACITY; i++)
+    {
+        uint32_t done = i - RING_CAPACITY + 1;
+        RingWrite( RING_ENTRY_OFFSET + i * RING_ENTRY_SIZE + CMD_DONE_OFFSET, sizeof( done ), &done );
+    }
+
+    _ringHead = 0;
+    _ringSpill.resize( RING_CAPACITY );
+
+    CreateRingEvent();
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Create ring completion event and pass it to target process
+/// </summary>
+void RemoteExec::CreateRingEvent()
+{
+    HANDLE hRemote = NULL;
+
+    _hRingEvent = CreateEventW( NULL, FALSE, FALSE, NULL );
+    if (!_hRingEvent)
+        return;
+
+    // Without event waiter falls back to polling
+    if (!DuplicateHandle( GetCurrentProcess(), _hRingEvent, _process.core().handle(), &hRemote, EVENT_MODIFY_STATE, FALSE, 0 ))
+        return;
+
+    _hRingEventRemote = reinterpret_cast<ptr_t>(hRemote);
+    RingWrite( RING_EVENT_OFFSET, sizeof( _hRingEventRemote ), &_hRingEventRemote );
+}
+
+/// <summary>
+/// Release persistent worker command ring
+/// </summary>
+void RemoteExec::FreeCommandRing()
+{
+    _ringSpill.clear();
+
+    if (_hRingEventRemote)
+    {
+        DuplicateHandle(
+            _process.core().handle(), reinterpret_cast<HANDLE>(_hRingEventRemote),
+            NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE
+            );
+
+        _hRingEventRemote = 0;
+    }
+
+    if (_hRingEvent)
+    {
+        CloseHandle( _hRingEvent );
+        _hRingEvent = NULL;
+    }
+
+    if (_hRing)
+    {
+        if (_ring.valid())
+            SAFE_NATIVE_CALL( NtUnmapViewOfSection, _process.core().handle(), reinterpret_cast<PVOID>(_ring.ptr()) );
+        if (_ringLocal)
+            UnmapViewOfFile( _ringLocal );
+
+        CloseHandle( _hRing );
+        _hRing = NULL;
+        _ringLocal = nullptr;
+    }
+
+    _ring.Reset();
+    _ringHead = 0;
+}
+
+/// <summary>
+/// Spin and then sleep until condition is met
+/// </summary>
+/// <param name="cond">Condition to wait for</param>
+/// <param name="timeout">Wait timeout in ms</param>
+/// <param name="thread">Thread executing commands. If null - worker thread</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::RingWait( const std::function<bool()>& cond, uint32_t timeout, Thread* thread /*= nullptr*/ )
+{
+    auto start = GetTickCount64();
+    if (!thread)
+        thread = _workerThread.get();
+
+    for (uint32_t spin = 0; !cond(); spin++)
+    {
+        if (spin < RING_SPIN_COUNT)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        if (!thread || thread->Join( 0 ))
+            return STATUS_THREAD_IS_TERMINATING;
+
+        if (GetTickCount64() - start > timeout)
+            return STATUS_TIMEOUT;
+
+        Sleep( spin < 2 * RING_SPIN_COUNT ? 0 : 1 );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Write command ring data
+/// </summary>
+/// <param name="offset">Data offset</param>
+/// <param name="size">Data size</param>
+/// <param name="pData">Data to write</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::RingWrite( uint32_t offset, size_t size, const void* pData )
+{
+    if (_ringLocal)
+    {
+        memcpy( _ringLocal + offset, pData, size );
+        return STATUS_SUCCESS;
+    }
+
+    return _ring.Write( offset, size, pData );
+}
+
+/// <summary>
+/// Wait for next command entry to become free
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExec::AcquireEntry()
+{
+    // Commands complete out of order, so entry is free once its previous command is done
+    uint32_t entry = RING_ENTRY_OFFSET + (_ringHead % RING_CAPACITY) * RING_ENTRY_SIZE;
+    uint32_t prevDone = _ringHead - RING_CAPACITY + 1;
+
+    auto status = RingWait( [this, entry, prevDone]() { return RingRead<uint32_t>( entry + CMD_DONE_OFFSET ) == prevDone; }, 30 * 1000 );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    // Previous command in this entry has already finished, collect its result before entry is reused
+    {
+        CSLock lck( _asyncLock );
+        ReapAsync();
+    }
+
+    _ringSpill[_ringHead % RING_CAPACITY].Reset();
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Fill next command entry and make it visible to worker
+/// </summary>
+/// <param name="pRemoteCode">Code address</param>
+/// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+/// <param name="flags">Command flags</param>
+/// <returns>Command ticket</returns>
+call_result_t<uint32_t> RemoteExec::PublishCommand( ptr_t pRemoteCode, ptr_t arg, uint32_t flags )
+{
+    uint64_t tscBegin = StatStamp();
+    uint32_t ticket = _ringHead;
+    uint32_t entry = RING_ENTRY_OFFSET + (ticket % RING_CAPACITY) * RING_ENTRY_SIZE;
+    ptr_t cmd[2] = { pRemoteCode, arg ? arg : _userData.ptr() };
+
+    auto status = RingWrite( entry + CMD_CODE_OFFSET, sizeof( cmd ), cmd );
+    if (NT_SUCCESS( status ))
+        status = RingWrite( entry + CMD_FLAGS_OFFSET, sizeof( flags ), &flags );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    // Publish entry after it was fully written
+    uint32_t head = ticket + 1;
+    if (_ringLocal)
+        InterlockedExchange( reinterpret_cast<volatile LONG*>(_ringLocal + RING_HEAD_OFFSET), static_cast<LONG>(head) );
+    else if (!NT_SUCCESS( status = _ring.Write( RING_HEAD_OFFSET, head ) ))
+        return status;
+
+    _ringHead = head;
+    _callCount++;
+
+    if (_statsEnabled)
+    {
+        _tscPosted = __rdtsc();
+        _stats->Record( Phase_Queue, tscBegin, _tscPosted );
+    }
+
+    return ticket;
+}
+
 /// <summary>
 /// Generate assembly code for remote call.
 /// </summary>
@@ -559,34 +1624,152 @@ NTSTATUS RemoteExec::PrepareCallAssembly(
     eReturnType retType
     )
 {
-    uintptr_t data_offset = ARGS_OFFSET;
+    uint64_t tscBegin = StatStamp();
+    ArgumentArena arena( a.assembler()->getArch() == asmjit::kArchX86 );
 
     // Invalid calling convention
     if (cc < cc_cdecl || cc > cc_fastcall)
         return STATUS_INVALID_PARAMETER_3;
 
     // Copy structures and strings
-    for (auto& arg : args)
+    arena.Add( args );
+
+    auto status = arena.Commit( _userData, ARGS_OFFSET );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    GenCallStub( a, pfn, args, cc, retType );
+
+    if (_statsEnabled)
+        _stats->Record( Phase_Prepare, tscBegin, __rdtsc() );
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Get resident call stub for given function and argument layout, generating it on first use.
+/// Stub loads argument values from slots at ARGS_OFFSET, so they are written into _userData on every call
+/// </summary>
+/// <param name="pfn">Remote function pointer</param>
+/// <param name="args">Function arguments</param>
+/// <param name="cc">Calling convention</param>
+/// <param name="retType">Return type</param>
+/// <returns>Stub address</returns>
+call_result_t<ptr_t> RemoteExec::PrepareCachedCall(
+    ptr_t pfn,
+    std::vector<AsmVariant>& args,
+    eCalligConvention cc,
+    eReturnType retType
+    )
+{
+    bool x86 = _process.core().isWow64();
+    uint64_t tscBegin = StatStamp();
+    std::vector<uint64_t> layout;
+
+    // Invalid calling convention
+    if (cc < cc_cdecl || cc > cc_fastcall)
+        return STATUS_INVALID_PARAMETER_3;
+
+    // Returned structure shares space with argument slots.
+    // Hijacked thread executes only copied code
+    if (retType == rt_struct || _hijackThread)
+        return STATUS_NOT_SUPPORTED;
+
+    //
+    // Argument data layout:
+    // Argument slots, then structures at fixed offsets, then strings and other pointed data
+    //
+    ptr_t argBase = _userData.ptr() + ARGS_OFFSET;
+    ArgumentArena arena( x86 );
+
+    arena.Reserve( args.size() * sizeof( uint64_t ) );
+    arena.Add( args );
+    arena.Bind( argBase );
+
+    for (size_t i = 0; i < args.size(); i++)
     {
-        // Transform 64 bit imm values
-        if (arg.type == AsmVariant::imm && arg.size > sizeof( uint32_t ) && a.assembler()->getArch() == asmjit::kArchX86)
-        {
-            arg.type = AsmVariant::dataStruct;
-            arg.buf.resize( arg.size );
-            memcpy( arg.buf.data(), &arg.imm_val64, arg.size );
-            arg.imm_val64 = reinterpret_cast<uint64_t>(arg.buf.data());
-        }
+        auto& arg = args[i];
 
-        if (arg.type == AsmVariant::dataStruct || arg.type == AsmVariant::dataPtr)
-        {
-            _userData.Write( data_offset, arg.size, reinterpret_cast<const void*>(arg.imm_val) );
-            arg.new_imm_val = _userData.ptr() + data_offset;
+        // Pointed data size doesn't affect generated code, structure size does
+        if (arg.type == AsmVariant::imm || arg.type == AsmVariant::dataPtr)
+            layout.emplace_back( arg.type );
+        else if (arg.type == AsmVariant::dataStruct)
+            layout.emplace_back( (static_cast<uint64_t>(arg.size) << 8) | arg.type );
+        else
+            return STATUS_NOT_SUPPORTED;
 
-            // Add some padding after data
-            data_offset += arg.size + 0x10;
-        }
+        uint64_t value = arg.type == AsmVariant::imm ? arg.imm_val64 : arg.new_imm_val;
+        memcpy( arena.data() + i * sizeof( uint64_t ), &value, sizeof( value ) );
+    }
+
+    auto status = arena.Commit( _userData, ARGS_OFFSET );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    StubKey key( pfn, cc, retType, std::move( layout ) );
+    auto iter = _stubCache.find( key );
+    if (iter != _stubCache.end())
+    {
+        if (_statsEnabled)
+            _stats->Record( Phase_Prepare, tscBegin, __rdtsc() );
+
+        return iter->second.ptr();
+    }
+
+    //
+    // Generate stub that loads every argument from its slot.
+    // x86 structures are copied onto stack from their fixed address
+    //
+    auto a = AsmFactory::GetAssembler( x86 );
+    std::vector<AsmVariant> stubArgs;
+
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (x86 && args[i].type == AsmVariant::dataStruct)
+            stubArgs.emplace_back( args[i] );
+        else if (x86)
+            stubArgs.emplace_back( asmjit::host::dword_ptr_abs( argBase + i * sizeof( uint64_t ) ) );
+        else
+            stubArgs.emplace_back( asmjit::host::qword_ptr( asmjit::host::r10, static_cast<int32_t>(i * sizeof( uint64_t )) ) );
     }
 
+    if (!x86)
+        (*a)->mov( asmjit::host::r10, argBase );
+
+    GenCallStub( *a, pfn, stubArgs, cc, retType );
+
+    auto mem = _memory.heap().Allocate( (*a)->getCodeSize(), PAGE_EXECUTE_READWRITE );
+    if (!mem)
+        return mem.status;
+
+    if (!NT_SUCCESS( status = mem->Write( 0, (*a)->getCodeSize(), (*a)->make() ) ))
+        return status;
+
+    ptr_t pStub = mem->ptr();
+    _stubCache.emplace( std::move( key ), std::move( mem.result() ) );
+
+    if (_statsEnabled)
+        _stats->Record( Phase_Prepare, tscBegin, __rdtsc() );
+
+    return pStub;
+}
+
+/// <summary>
+/// Generate call with return value saving
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="pfn">Remote function pointer</param>
+/// <param name="args">Function arguments with remote data addresses set</param>
+/// <param name="cc">Calling convention</param>
+/// <param name="retType">Return type</param>
+void RemoteExec::GenCallStub(
+    IAsmHelper& a,
+    ptr_t pfn,
+    std::vector<AsmVariant>& args,
+    eCalligConvention cc,
+    eReturnType retType
+    )
+{
     // Insert hidden variable if return type is struct.
     // This variable contains address of buffer in which return value is copied
     if (retType == rt_struct)
@@ -597,8 +1780,15 @@ NTSTATUS RemoteExec::PrepareCallAssembly(
     }
         
     a.GenPrologue();
+
+    if (_statsEnabled)
+        GenTimestamp( a, TSC_OFFSET );
+
     a.GenCall( pfn, args, cc );
 
+    if (_statsEnabled)
+        GenTimestamp( a, TSC_OFFSET + sizeof( uint64_t ) );
+
     // Retrieve result from XMM0 or ST0
     if (retType == rt_float || retType == rt_double)
     {
@@ -616,8 +1806,6 @@ NTSTATUS RemoteExec::PrepareCallAssembly(
 
     AddReturnWithEvent( a, mt_default, retType );
     a.GenEpilogue();
-
-    return STATUS_SUCCESS;
 }
 
 /// <summary>
@@ -655,11 +1843,13 @@ NTSTATUS RemoteExec::CopyCode( PVOID pCode, size_t size )
 /// <param name="mt">32/64bit loader</param>
 /// <param name="retType">Function return type</param>
 /// <param name="retOffset">Return value offset</param>
+/// <param name="forceEvent">Signal event even if persistent worker is used</param>
 void RemoteExec::AddReturnWithEvent(
     IAsmHelper& a,
     eModType mt /*= mt_default*/,
     eReturnType retType /*= rt_int32 */,
-    uint32_t retOffset /*= RET_OFFSET*/ 
+    uint32_t retOffset /*= RET_OFFSET*/,
+    bool forceEvent /*= false*/
     )
 {
     // Allocate block if missing
@@ -673,16 +1863,137 @@ void RemoteExec::AddReturnWithEvent(
     }
 
     ptr_t ptr = _userData.ptr();
+
+    // Persistent worker picks return value from accumulator, no event is required.
+    // Call result is always taken from RET_OFFSET, like APC path does, retOffset may intentionally point elsewhere
+    if (_ring.valid() && !_hijackThread && !forceEvent)
+    {
+        a.SaveRetVal( ptr + retOffset, ptr + ERR_OFFSET, retType );
+        a->mov( a->zcx, ptr + RET_OFFSET );
+        a->mov( a->zax, a->intptr_ptr( a->zcx ) );
+        if (a.assembler()->getArch() == asmjit::kArchX86)
+            a->mov( asmjit::host::edx, asmjit::host::dword_ptr( a->zcx, sizeof( uint32_t ) ) );
+
+        return;
+    }
+
     auto pSetEvent = _process.modules().GetNtdllExport( "NtSetEvent", mt );
     if(pSetEvent)
         a.SaveRetValAndSignalEvent( pSetEvent->procAddress, ptr + retOffset, ptr + EVENT_OFFSET, ptr + ERR_OFFSET, retType );
 }
 
+/// <summary>
+/// Store TSC value into _userData, preserving call result registers
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="offset">Timestamp offset</param>
+void RemoteExec::GenTimestamp( IAsmHelper& a, uint32_t offset )
+{
+    a->push( a->zax );
+    a->push( a->zdx );
+    a->push( a->zcx );
+
+    a->rdtsc();
+    a->mov( a->zcx, _userData.ptr() + offset );
+    a->mov( asmjit::host::dword_ptr( a->zcx ), asmjit::host::eax );
+    a->mov( asmjit::host::dword_ptr( a->zcx, sizeof( uint32_t ) ), asmjit::host::edx );
+
+    a->pop( a->zcx );
+    a->pop( a->zdx );
+    a->pop( a->zax );
+}
+
+/// <summary>
+/// Record phases of completed call
+/// </summary>
+/// <param name="tscBegin">Call start timestamp</param>
+void RemoteExec::RecordCall( uint64_t tscBegin )
+{
+    if (!_statsEnabled)
+        return;
+
+    uint64_t stamps[2] = { 0 };
+    uint64_t tscDone = __rdtsc();
+
+    // Target timestamps are written only by generated call stubs, skip stale ones
+    if (NT_SUCCESS( _userData.Read( TSC_OFFSET, sizeof( stamps ), stamps ) ) && stamps[0] >= tscBegin && stamps[1] >= stamps[0])
+    {
+        _stats->Record( Phase_Schedule, _tscPosted, stamps[0] );
+        _stats->Record( Phase_Execute, stamps[0], stamps[1] );
+        _stats->Record( Phase_Readback, stamps[1], tscDone );
+    }
+
+    _stats->Record( Phase_Total, tscBegin, tscDone );
+}
+
+/// <summary>
+/// Enable or disable per-phase call latency collection.
+/// Generated call stubs additionally store target side timestamps while enabled
+/// </summary>
+/// <param name="enable">Collect statistics</param>
+void RemoteExec::EnableStats( bool enable )
+{
+    if (enable == _statsEnabled)
+        return;
+
+    // Collected samples are kept until explicitly reset
+    if (enable && !_stats)
+        _stats = std::make_unique<RemoteCallStats>();
+
+    _statsEnabled = enable;
+
+    // Resident stubs were generated with or without timestamps
+    _stubCache.clear();
+}
+
 /// <summary>
 /// Terminate existing worker thread
 /// </summary>
 void RemoteExec::TerminateWorker()
 {
+    // Complete or fail pending asynchronous calls while ring is still accessible
+    if (_asyncWatched)
+    {
+        AsyncWaiter::Instance().Unwatch( this );
+        _asyncWatched = false;
+
+        CSLock lck( _asyncLock );
+        if (_ring.valid())
+            ReapAsync();
+
+        CancelAsync( STATUS_CANCELLED );
+    }
+
+    // Resume hijacked thread before its sync event is closed
+    ReleaseDispatcher();
+
+    // Ask persistent worker to exit on its own
+    if (_ring.valid())
+    {
+        uint32_t stop = 1;
+        RingWrite( RING_STOP_OFFSET, sizeof( stop ), &stop );
+
+        if (_workerThread && _workerThread->valid())
+            _workerThread->Join( 100 );
+
+        for (auto& helper : _ringHelpers)
+            helper->Join( 100 );
+    }
+
+    // Helpers still inside asynchronous command can't be waited for
+    for (auto& helper : _ringHelpers)
+    {
+        if (helper->valid() && !helper->Join( 0 ))
+        {
+            helper->Terminate();
+            helper->Join();
+        }
+
+        helper->Close();
+    }
+
+    _ringHelpers.clear();
+
     // Close remote event handle
     ptr_t hRemoteEvent = 0;
     _userData.Read( EVENT_OFFSET, hRemoteEvent );
@@ -720,6 +2031,11 @@ void RemoteExec::TerminateWorker()
         _workerThread.reset();
         _workerCode.Free();
     }
+
+    FreeCommandRing();
+
+    // Stubs were generated for this worker mode
+    _stubCache.clear();
 }
 
 /// <summary>
@@ -729,9 +2045,21 @@ void RemoteExec::reset()
 {
     TerminateWorker();
 
+    // Dispatcher didn't confirm exit, leak memory it may still use rather than free code being executed
+    if (_hijackInUse)
+    {
+        _hijackBlock.Release();
+        _userCode.Release();
+        _userData.Release();
+    }
+
     _userCode.Reset();
     _userData.Reset();
     _workerCode.Reset();
+    _hijackBlock.Reset();
+    _hijackInUse = false;
+
+    _hijackPersistent = false;
 
     _apcPatched = false;
 }
@@ -4,6 +4,16 @@
 #include "../../Asm/AsmFactory.h"
 #include "../Threads/Threads.h"
 #include "../MemBlock.h"
+#include "../../Misc/Utils.h"
+#include "RemoteCallStats.h"
+
+#include <intrin.h>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <future>
+#include <vector>
+#include <functional>
 
 
 // User data offsets
@@ -11,7 +21,44 @@
 #define RET_OFFSET      0x08
 #define ERR_OFFSET      0x10
 #define EVENT_OFFSET    0x18
-#define ARGS_OFFSET     0x20
+#define TSC_OFFSET      0x20    // Target side call start/end timestamps
+#define ARGS_OFFSET     0x30
+
+// Command ring offsets
+#define RING_HEAD_OFFSET    0x00    // Next ticket to post, written by host
+#define RING_STOP_OFFSET    0x08    // Worker exit request
+#define RING_EVENT_OFFSET   0x10    // Target handle of asynchronous completion event
+#define RING_TAIL_OFFSET    0x40    // Next ticket to execute, claimed atomically by workers
+#define RING_ENTRY_OFFSET   0x80    // Command entries
+#define RING_CODE_OFFSET    0x1000  // Command code slots
+
+#define RING_CAPACITY       32
+#define RING_ENTRY_SIZE     0x20
+#define RING_CODE_SIZE      0x400
+#define RING_SIZE           (RING_CODE_OFFSET + RING_CAPACITY * RING_CODE_SIZE)
+#define RING_SPIN_COUNT     0x4000
+#define RING_WORKERS        4       // Threads serving command ring, including main worker
+
+// Command entry offsets
+#define CMD_CODE_OFFSET     0x00
+#define CMD_ARG_OFFSET      0x08
+#define CMD_RESULT_OFFSET   0x10
+#define CMD_DONE_OFFSET     0x18
+#define CMD_FLAGS_OFFSET    0x1C
+
+// Command flags
+#define CMD_ASYNC           0x01    // Any ring thread may execute command, completion signals event
+
+// Hijack dispatcher offsets
+#define HIJACK_SEQ_OFFSET       0x00    // Last posted command, written by host
+#define HIJACK_DONE_OFFSET      0x04    // Last completed command, written by dispatcher
+#define HIJACK_STOP_OFFSET      0x08    // Dispatcher exit request
+#define HIJACK_ACTIVE_OFFSET    0x0C    // Dispatcher is running
+#define HIJACK_CODE_OFFSET      0x10    // Command code address
+#define HIJACK_DELAY_OFFSET     0x18    // Idle wait interval
+#define HIJACK_SP_OFFSET        0x20    // Hijacked thread stack pointer
+#define HIJACK_LOOP_OFFSET      0x40    // Dispatcher code
+#define HIJACK_SIZE             0x1000
 
 
 namespace blackbone
@@ -22,13 +69,21 @@ enum WorkerThreadMode
     Worker_None,            // No worker thread
     Worker_CreateNew,       // Create dedicated worker thread
     Worker_UseExisting,     // Hijack existing thread
+    Worker_Persistent,      // Create dedicated worker threads polling shared command ring
+    Worker_HijackPersistent,// Hijack existing thread once and keep command dispatcher running in it
 };
 
 class RemoteExec
 {
     using vecArgs = std::vector<AsmVariant>;
 
+    // Function, calling convention, return type, argument layout
+    using StubKey = std::tuple<ptr_t, eCalligConvention, eReturnType, std::vector<uint64_t>>;
+
 public:
+    // Asynchronous call completion routine
+    using AsyncCallback = std::function<void( call_result_t<uint64_t> )>;
+
     BLACKBONE_API RemoteExec( class Process& proc );
     BLACKBONE_API ~RemoteExec();
 
@@ -36,11 +91,11 @@ public:
     /// Create environment for future remote procedure calls
     ///
     /// _userData layout (x86/x64):
-    /// --------------------------------------------------------------------------------------------------------------------------
-    /// | Internal return value | Return value |  Last Status code  |  Event handle   |  Space for copied arguments and strings  |
-    /// -------------------------------------------------------------------------------------------------------------------------
-    /// |       8/8 bytes       |   8/8 bytes  |      8/8 bytes     |    8/8 bytes    |                                          |
-    /// --------------------------------------------------------------------------------------------------------------------------
+    /// ------------------------------------------------------------------------------------------------------------------------------------------
+    /// | Internal return value | Return value |  Last Status code  |  Event handle   |  Timestamps  |  Space for copied arguments and strings  |
+    /// ------------------------------------------------------------------------------------------------------------------------------------------
+    /// |       8/8 bytes       |   8/8 bytes  |      8/8 bytes     |    8/8 bytes    |  16/16 bytes |                                          |
+    /// ------------------------------------------------------------------------------------------------------------------------------------------
     /// </summary>
     /// <param name="mode">Worket thread mode</param>
     /// <param name="bEvent">Create sync event for worker thread</param>
@@ -70,6 +125,90 @@ public:
     /// <returns>Status</returns>
     BLACKBONE_API NTSTATUS ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& callResult );
 
+    /// <summary>
+    /// Execute code already present in target process in context of our worker thread
+    /// </summary>
+    /// <param name="pRemoteCode">Code address</param>
+    /// <param name="callResult">Execution result</param>
+    /// <returns>Status</returns>
+    BLACKBONE_API NTSTATUS ExecInWorkerThread( ptr_t pRemoteCode, uint64_t& callResult );
+
+    /// <summary>
+    /// Post code into persistent worker command ring without waiting for its execution.
+    /// Completion must be collected before RING_CAPACITY more commands are posted
+    /// </summary>
+    /// <param name="pCode">Code to execute</param>
+    /// <param name="size">Code size</param>
+    /// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+    /// <param name="flags">Command flags</param>
+    /// <returns>Command ticket</returns>
+    BLACKBONE_API call_result_t<uint32_t> PostToWorker( PVOID pCode, size_t size, ptr_t arg = 0, uint32_t flags = 0 );
+
+    /// <summary>
+    /// Post code already present in target process into persistent worker command ring
+    /// </summary>
+    /// <param name="pRemoteCode">Code address</param>
+    /// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+    /// <param name="flags">Command flags</param>
+    /// <returns>Command ticket</returns>
+    BLACKBONE_API call_result_t<uint32_t> PostToWorker( ptr_t pRemoteCode, ptr_t arg = 0, uint32_t flags = 0 );
+
+    /// <summary>
+    /// Wait for posted command completion
+    /// </summary>
+    /// <param name="ticket">Command ticket</param>
+    /// <param name="callResult">Code return value</param>
+    /// <param name="timeout">Wait timeout in ms</param>
+    /// <returns>Status</returns>
+    BLACKBONE_API NTSTATUS WaitForWorker( uint32_t ticket, uint64_t& callResult, uint32_t timeout = 30 * 1000 );
+
+    /// <summary>
+    /// Execute code in any persistent worker thread without blocking.
+    /// Completion is reported by the shared waiter thread, STATUS_NOT_SUPPORTED is returned without command ring.
+    /// Code runs concurrently with other commands, so it must not use _userData
+    /// </summary>
+    /// <param name="pCode">Code to execute</param>
+    /// <param name="size">Code size</param>
+    /// <returns>Code return value</returns>
+    BLACKBONE_API std::future<call_result_t<uint64_t>> ExecAsync( PVOID pCode, size_t size );
+
+    /// <summary>
+    /// Call remote function in any persistent worker thread without blocking.
+    /// Arguments are copied into separate data block, so many calls can be in flight.
+    /// Pointer arguments are updated before callback is invoked and must remain valid until then
+    /// </summary>
+    /// <param name="pfn">Remote function pointer</param>
+    /// <param name="args">Function arguments</param>
+    /// <param name="cc">Calling convention</param>
+    /// <param name="retType">Return type, structures aren't supported</param>
+    /// <param name="callback">Completion routine, may be invoked from waiter thread</param>
+    /// <returns>Status code, STATUS_NOT_SUPPORTED if persistent worker isn't running</returns>
+    BLACKBONE_API NTSTATUS CallAsync(
+        ptr_t pfn,
+        std::vector<AsmVariant> args,
+        eCalligConvention cc,
+        eReturnType retType,
+        AsyncCallback callback
+        );
+
+    /// <summary>
+    /// Complete finished asynchronous calls
+    /// </summary>
+    /// <returns>Number of calls still pending</returns>
+    BLACKBONE_API size_t PollAsync();
+
+    /// <summary>
+    /// Get number of pending asynchronous calls
+    /// </summary>
+    /// <returns>Pending call count</returns>
+    BLACKBONE_API size_t asyncPending();
+
+    /// <summary>
+    /// Get event signaled by ring threads after asynchronous command completion
+    /// </summary>
+    /// <returns>Event handle, NULL if completion must be polled</returns>
+    BLACKBONE_API inline HANDLE asyncEvent() const { return _hRingEvent; }
+
     /// <summary>
     /// Execute code in context of any existing thread
     /// </summary>
@@ -80,6 +219,12 @@ public:
     /// <returns>Status</returns>
     BLACKBONE_API NTSTATUS ExecInAnyThread( PVOID pCode, size_t size, uint64_t& callResult, ThreadPtr& thread );
 
+    /// <summary>
+    /// Stop dispatcher installed by Worker_HijackPersistent mode and resume hijacked thread at its original location.
+    /// Persistent mode is left, so following calls don't park the thread again
+    /// </summary>
+    BLACKBONE_API void ReleaseDispatcher();
+
     /// <summary>
     /// Create new thread with specified entry point and argument
     /// </summary>
@@ -105,6 +250,22 @@ public:
         eReturnType retType
     );
 
+    /// <summary>
+    /// Get resident call stub for given function and argument layout, generating it on first use.
+    /// Stub loads argument values from slots at ARGS_OFFSET, so they are written into _userData on every call
+    /// </summary>
+    /// <param name="pfn">Remote function pointer</param>
+    /// <param name="args">Function arguments</param>
+    /// <param name="cc">Calling convention</param>
+    /// <param name="retType">Return type</param>
+    /// <returns>Stub address</returns>
+    BLACKBONE_API call_result_t<ptr_t> PrepareCachedCall(
+        ptr_t pfn,
+        std::vector<AsmVariant>& args,
+        eCalligConvention cc,
+        eReturnType retType
+    );
+
     /// <summary>
     /// Generate return from function with event synchronization
     /// </summary>
@@ -112,11 +273,13 @@ public:
     /// <param name="mt">32/64bit loader</param>
     /// <param name="retType">Function return type</param>
     /// <param name="retOffset">Return value offset</param>
+    /// <param name="forceEvent">Signal event even if persistent worker is used</param>
     BLACKBONE_API void AddReturnWithEvent(
         IAsmHelper& a,
         eModType mt = mt_default, 
         eReturnType retType = rt_int32,
-        uint32_t retOffset = RET_OFFSET 
+        uint32_t retOffset = RET_OFFSET,
+        bool forceEvent = false
         );
 
     /// <summary>
@@ -157,6 +320,25 @@ public:
         return _userData.Read<NTSTATUS>( ERR_OFFSET, STATUS_NOT_FOUND );
     }
 
+    /// <summary>
+    /// Get number of code executions in target process
+    /// </summary>
+    /// <returns>Execution count</returns>
+    BLACKBONE_API inline uint64_t callCount() const { return _callCount; }
+
+    /// <summary>
+    /// Enable or disable per-phase call latency collection.
+    /// Generated call stubs additionally store target side timestamps while enabled
+    /// </summary>
+    /// <param name="enable">Collect statistics</param>
+    BLACKBONE_API void EnableStats( bool enable );
+
+    /// <summary>
+    /// Get call latency statistics
+    /// </summary>
+    /// <returns>Statistics, nullptr if collection was never enabled</returns>
+    BLACKBONE_API inline RemoteCallStats* stats() { return _stats.get(); }
+
     /// <summary>
     /// Terminate existing worker thread
     /// </summary>
@@ -174,6 +356,18 @@ public:
     /// <returns></returns>
     BLACKBONE_API inline ThreadPtr getExecThread() { return _hijackThread ? _hijackThread : _workerThread; }
 
+    /// <summary>
+    /// Check if persistent worker command ring is used
+    /// </summary>
+    /// <returns>true if command ring is active</returns>
+    BLACKBONE_API inline bool persistentWorker() const { return _ring.valid(); }
+
+    /// <summary>
+    /// Get number of commands posted to persistent worker and not yet executed
+    /// </summary>
+    /// <returns>Queued command count</returns>
+    BLACKBONE_API inline uint32_t pendingCommands() { return _ring.valid() ? _ringHead - RingRead<uint32_t>( RING_TAIL_OFFSET ) : 0; }
+
     /// <summary>
     /// Ge memory routines
     /// </summary>
@@ -200,6 +394,169 @@ private:
     /// <returns>Status code</returns>
     NTSTATUS CreateAPCEvent( DWORD threadID );
 
+    /// <summary>
+    /// Allocate persistent worker command ring
+    /// </summary>
+    /// <returns>Status code</returns>
+    NTSTATUS CreateCommandRing();
+
+    /// <summary>
+    /// Release persistent worker command ring
+    /// </summary>
+    void FreeCommandRing();
+
+    /// <summary>
+    /// Wait for next command entry to become free
+    /// </summary>
+    /// <returns>Status code</returns>
+    NTSTATUS AcquireEntry();
+
+    /// <summary>
+    /// Fill next command entry and make it visible to worker
+    /// </summary>
+    /// <param name="pRemoteCode">Code address</param>
+    /// <param name="arg">Code argument. If 0 - _userData address is passed</param>
+    /// <param name="flags">Command flags</param>
+    /// <returns>Command ticket</returns>
+    call_result_t<uint32_t> PublishCommand( ptr_t pRemoteCode, ptr_t arg, uint32_t flags );
+
+    /// <summary>
+    /// Create ring completion event and pass it to target process
+    /// </summary>
+    void CreateRingEvent();
+
+    /// <summary>
+    /// Execute code already present in target process and collect its result
+    /// </summary>
+    /// <param name="pRemoteCode">Code address</param>
+    /// <param name="callResult">Execution result</param>
+    /// <param name="tscBegin">Call start timestamp</param>
+    /// <returns>Status</returns>
+    NTSTATUS ExecCommand( ptr_t pRemoteCode, uint64_t& callResult, uint64_t tscBegin );
+
+    /// <summary>
+    /// Store TSC value into _userData, preserving call result registers
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="offset">Timestamp offset</param>
+    void GenTimestamp( IAsmHelper& a, uint32_t offset );
+
+    /// <summary>
+    /// Record phases of completed call
+    /// </summary>
+    /// <param name="tscBegin">Call start timestamp</param>
+    void RecordCall( uint64_t tscBegin );
+
+    /// <summary>
+    /// Get timestamp if statistics are collected
+    /// </summary>
+    /// <returns>TSC value or 0</returns>
+    inline uint64_t StatStamp() const { return _statsEnabled ? __rdtsc() : 0; }
+
+    /// <summary>
+    /// Post code and register its completion routine
+    /// </summary>
+    /// <param name="pCode">Code to execute</param>
+    /// <param name="size">Code size</param>
+    /// <param name="data">Call data block, released after completion</param>
+    /// <param name="args">Arguments to update after completion</param>
+    /// <param name="callback">Completion routine</param>
+    /// <returns>Status code</returns>
+    NTSTATUS QueueAsync( PVOID pCode, size_t size, MemBlock&& data, vecArgs&& args, AsyncCallback callback );
+
+    /// <summary>
+    /// Complete asynchronous calls executed by ring threads, in any order. _asyncLock must be held
+    /// </summary>
+    void ReapAsync();
+
+    /// <summary>
+    /// Fail all pending asynchronous calls. _asyncLock must be held
+    /// </summary>
+    /// <param name="status">Failure status</param>
+    void CancelAsync( NTSTATUS status );
+
+    /// <summary>
+    /// Generate persistent worker loop
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="pDelay">NtDelayExecution address</param>
+    /// <param name="pExitThread">NtTerminateThread address</param>
+    /// <param name="pSetEvent">NtSetEvent address</param>
+    /// <param name="helper">Execute only CMD_ASYNC commands, main worker executes everything</param>
+    void GenRingLoop( IAsmHelper& a, ptr_t pDelay, ptr_t pExitThread, ptr_t pSetEvent, bool helper );
+
+    /// <summary>
+    /// Generate dispatcher loop for hijacked thread
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="pDelay">NtDelayExecution address</param>
+    /// <param name="returnAddress">Address to resume hijacked thread at</param>
+    void GenHijackLoop( IAsmHelper& a, ptr_t pDelay, ptr_t returnAddress );
+
+    /// <summary>
+    /// Hijack thread and park command dispatcher in it
+    /// </summary>
+    /// <param name="thd">Target thread</param>
+    /// <returns>Status code</returns>
+    NTSTATUS InstallDispatcher( ThreadPtr& thd );
+
+    /// <summary>
+    /// Execute code by dispatcher running in hijacked thread
+    /// </summary>
+    /// <param name="pCode">Code to execute</param>
+    /// <param name="size">Code size</param>
+    /// <param name="callResult">Execution result</param>
+    /// <returns>Status code, STATUS_NOT_FOUND if dispatcher has exited</returns>
+    NTSTATUS DispatchHijacked( PVOID pCode, size_t size, uint64_t& callResult );
+
+    /// <summary>
+    /// Spin and then sleep until condition is met
+    /// </summary>
+    /// <param name="cond">Condition to wait for</param>
+    /// <param name="timeout">Wait timeout in ms</param>
+    /// <param name="thread">Thread executing commands. If null - worker thread</param>
+    /// <returns>Status code</returns>
+    NTSTATUS RingWait( const std::function<bool()>& cond, uint32_t timeout, Thread* thread = nullptr );
+
+    /// <summary>
+    /// Write command ring data
+    /// </summary>
+    /// <param name="offset">Data offset</param>
+    /// <param name="size">Data size</param>
+    /// <param name="pData">Data to write</param>
+    /// <returns>Status code</returns>
+    NTSTATUS RingWrite( uint32_t offset, size_t size, const void* pData );
+
+    /// <summary>
+    /// Read command ring value
+    /// </summary>
+    /// <param name="offset">Value offset</param>
+    /// <returns>Value</returns>
+    template<typename T>
+    inline T RingRead( uint32_t offset )
+    {
+        if (_ringLocal)
+            return *reinterpret_cast<volatile T*>(_ringLocal + offset);
+
+        return _ring.Read<T>( offset, T() );
+    }
+
+    /// <summary>
+    /// Generate call with return value saving
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="pfn">Remote function pointer</param>
+    /// <param name="args">Function arguments with remote data addresses set</param>
+    /// <param name="cc">Calling convention</param>
+    /// <param name="retType">Return type</param>
+    void GenCallStub(
+        IAsmHelper& a,
+        ptr_t pfn,
+        std::vector<AsmVariant>& args,
+        eCalligConvention cc,
+        eReturnType retType
+    );
+
     /// <summary>
     /// Copy executable code into remote codecave for future execution
     /// </summary>
@@ -225,6 +582,42 @@ private:
     MemBlock  _userCode;        // Codecave for code execution
     MemBlock  _userData;        // Region to store copied structures and strings
     bool      _apcPatched;      // KiUserApcDispatcher was patched
+    uint64_t  _callCount = 0;   // Remote code executions
+
+    MemBlock  _ring;                    // Persistent worker command ring
+    HANDLE    _hRing = NULL;            // Command ring section, if shared with target
+    uint8_t*  _ringLocal = nullptr;     // Local view of command ring section
+    uint32_t  _ringHead = 0;            // Next command ticket
+    std::vector<MemBlock> _ringSpill;   // Code that doesn't fit into command slot
+    std::vector<ThreadPtr> _ringHelpers;// Ring threads executing asynchronous commands only
+    HANDLE    _hRingEvent = NULL;       // Asynchronous command completion event
+    ptr_t     _hRingEventRemote = 0;    // Completion event handle in target process
+
+    std::map<StubKey, MemBlock> _stubCache; // Resident call stubs
+
+    MemBlock  _hijackBlock;             // Hijack dispatcher code and command slot
+    bool      _hijackPersistent = false;// Keep dispatcher in hijacked thread
+    bool      _hijackActive = false;    // Dispatcher is parked in _hijackThread
+    bool      _hijackInUse = false;     // Target thread may still execute dispatcher block
+    uint32_t  _hijackSeq = 0;           // Last posted dispatcher command
+
+    // Pending asynchronous call
+    struct AsyncCall
+    {
+        uint32_t ticket;            // Command ticket
+        uint64_t tscPosted;         // Post timestamp
+        MemBlock data;              // Call data block
+        vecArgs args;               // Arguments to update after completion
+        AsyncCallback callback;     // Completion routine
+    };
+
+    std::deque<AsyncCall> _asyncCalls;  // Calls posted to command ring, in ticket order, completed in any order
+    CriticalSection _asyncLock;         // Pending call lock
+    bool _asyncWatched = false;         // Registered in shared waiter
+
+    std::unique_ptr<RemoteCallStats> _stats;    // Call latency statistics
+    bool _statsEnabled = false;                 // Statistics are being collected
+    uint64_t _tscPosted = 0;                    // Last command post timestamp
 };
 
 
@@ -0,0 +1,154 @@
+#include "RemoteExecPool.h"
+#include "../Process.h"
+
+namespace blackbone
+{
+
+RemoteExecPool::RemoteExecPool( Process& proc )
+    : _process( proc )
+{
+}
+
+RemoteExecPool::~RemoteExecPool()
+{
+    Destroy();
+}
+
+/// <summary>
+/// Start worker threads
+/// </summary>
+/// <param name="count">Number of workers</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExecPool::Create( size_t count /*= 4*/ )
+{
+    CSLock lck( _lock );
+
+    while (_workers.size() < count)
+    {
+        auto worker = std::make_unique<Worker>();
+        worker->exec = std::make_unique<RemoteExec>( _process );
+
+        auto status = worker->exec->CreateRPCEnvironment( Worker_Persistent, true );
+        if (!NT_SUCCESS( status ))
+            return status;
+
+        _workers.emplace_back( std::move( worker ) );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Terminate all worker threads. Waits until host threads stop using them
+/// </summary>
+void RemoteExecPool::Destroy()
+{
+    // Detached workers can't be selected anymore
+    decltype(_workers) workers;
+    {
+        CSLock lck( _lock );
+        workers.swap( _workers );
+    }
+
+    for (auto& worker : workers)
+    {
+        // Wait for host threads still using worker
+        while (worker->users != 0)
+            Sleep( 1 );
+
+        // Last user may still be leaving worker lock
+        CSLock wlck( worker->lock );
+        worker->exec->TerminateWorker();
+    }
+}
+
+/// <summary>
+/// Execute code in least busy worker thread
+/// </summary>
+/// <param name="pCode">Code to execute</param>
+/// <param name="size">Code size</param>
+/// <param name="callResult">Execution result</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExecPool::ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& callResult )
+{
+    auto worker = Acquire();
+    if (!worker)
+        return STATUS_NO_MORE_ENTRIES;
+
+    auto status = worker->exec->ExecInWorkerThread( pCode, size, callResult );
+
+    Release( worker );
+    return status;
+}
+
+/// <summary>
+/// Call remote function in least busy worker thread without blocking
+/// </summary>
+/// <param name="pfn">Remote function pointer</param>
+/// <param name="args">Function arguments</param>
+/// <param name="cc">Calling convention</param>
+/// <param name="retType">Return type, structures aren't supported</param>
+/// <param name="callback">Completion routine, may be invoked from waiter thread</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteExecPool::CallAsync(
+    ptr_t pfn,
+    const std::vector<AsmVariant>& args,
+    eCalligConvention cc,
+    eReturnType retType,
+    RemoteExec::AsyncCallback callback
+    )
+{
+    auto worker = Acquire();
+    if (!worker)
+        return STATUS_NO_MORE_ENTRIES;
+
+    auto status = worker->exec->CallAsync( pfn, args, cc, retType, std::move( callback ) );
+
+    Release( worker );
+    return status;
+}
+
+/// <summary>
+/// Select least busy worker and lock it for current thread
+/// </summary>
+/// <returns>Worker, nullptr if pool is empty</returns>
+RemoteExecPool::Worker* RemoteExecPool::Acquire()
+{
+    Worker* selected = nullptr;
+    {
+        CSLock lck( _lock );
+        uint64_t minLoad = ~0ull;
+
+        // Worker used by another host thread is busier than any queued command backlog
+        for (auto& worker : _workers)
+        {
+            uint64_t load = static_cast<uint64_t>(worker->users) * (RING_CAPACITY + 1) + worker->exec->pendingCommands();
+            if (load < minLoad)
+            {
+                minLoad = load;
+                selected = worker.get();
+            }
+        }
+
+        if (!selected)
+            return nullptr;
+
+        selected->users++;
+    }
+
+    selected->lock.lock();
+    return selected;
+}
+
+/// <summary>
+/// Unlock worker acquired by Acquire
+/// </summary>
+/// <param name="worker">Worker</param>
+void RemoteExecPool::Release( Worker* worker )
+{
+    // Worker can be destroyed as soon as it is unlocked with no users left
+    worker->users--;
+    worker->lock.unlock();
+}
+
+}
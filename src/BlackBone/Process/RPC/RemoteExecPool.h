@@ -0,0 +1,181 @@
+#pragma once
+
+#include "RemoteFunction.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Several persistent RPC workers in one target process.
+/// Every worker owns its code/data blocks and command ring, calls go to the least busy one,
+/// so long-running remote calls don't block unrelated ones
+/// </summary>
+class RemoteExecPool
+{
+    struct Worker
+    {
+        std::unique_ptr<RemoteExec> exec;   // Worker executor
+        CriticalSection lock;               // Host side access lock
+        std::atomic<uint32_t> users{ 0 };   // Host threads that selected worker and haven't released it yet
+    };
+
+public:
+    BLACKBONE_API RemoteExecPool( class Process& proc );
+    BLACKBONE_API ~RemoteExecPool();
+
+    /// <summary>
+    /// Start worker threads
+    /// </summary>
+    /// <param name="count">Number of workers</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS Create( size_t count = 4 );
+
+    /// <summary>
+    /// Terminate all worker threads. Waits until host threads stop using them
+    /// </summary>
+    BLACKBONE_API void Destroy();
+
+    /// <summary>
+    /// Execute code in least busy worker thread
+    /// </summary>
+    /// <param name="pCode">Code to execute</param>
+    /// <param name="size">Code size</param>
+    /// <param name="callResult">Execution result</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS ExecInWorkerThread( PVOID pCode, size_t size, uint64_t& callResult );
+
+    /// <summary>
+    /// Call remote function in least busy worker thread without blocking
+    /// </summary>
+    /// <param name="pfn">Remote function pointer</param>
+    /// <param name="args">Function arguments</param>
+    /// <param name="cc">Calling convention</param>
+    /// <param name="retType">Return type, structures aren't supported</param>
+    /// <param name="callback">Completion routine, may be invoked from waiter thread</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API NTSTATUS CallAsync(
+        ptr_t pfn,
+        const std::vector<AsmVariant>& args,
+        eCalligConvention cc,
+        eReturnType retType,
+        RemoteExec::AsyncCallback callback
+        );
+
+    /// <summary>
+    /// Call remote function in least busy worker thread
+    /// </summary>
+    /// <param name="pfn">Remote function pointer</param>
+    /// <param name="args">Function arguments</param>
+    /// <param name="cc">Calling convention</param>
+    /// <returns>Function return value</returns>
+    template<typename T = uint64_t>
+    call_result_t<T> Call( ptr_t pfn, std::vector<AsmVariant> args, eCalligConvention cc = cc_stdcall )
+    {
+        T result = {};
+        uint64_t tmpResult = 0;
+
+        auto worker = Acquire();
+        if (!worker)
+            return call_result_t<T>( result, STATUS_NO_MORE_ENTRIES );
+
+        auto& remote = *worker->exec;
+        auto a = AsmFactory::GetAssembler( _process.core().isWow64() );
+
+        auto status = remote.PrepareCallAssembly( *a, pfn, args, cc, ReturnTypeOf<T>() );
+        if (NT_SUCCESS( status ))
+            status = remote.ExecInWorkerThread( (*a)->make(), (*a)->getCodeSize(), tmpResult );
+        if (NT_SUCCESS( status ))
+            status = remote.GetCallResult( result );
+
+        // Update arguments
+        if (NT_SUCCESS( status ))
+            ArgumentArena::Readback( _process.memory(), args );
+
+        Release( worker );
+        return call_result_t<T>( result, status );
+    }
+
+    /// <summary>
+    /// Call typed remote function in least busy worker thread
+    /// </summary>
+    /// <param name="fn">Remote function</param>
+    /// <param name="args">Function arguments</param>
+    /// <returns>Function return value</returns>
+    template<typename R, typename... Args, typename... T>
+    auto Call( const RemoteFunctionBase<R, Args...>& fn, const T&... args )
+    {
+        using ReturnType = typename RemoteFunctionBase<R, Args...>::ReturnType;
+
+        typename RemoteFunctionBase<R, Args...>::CallArguments a( args... );
+        return Call<ReturnType>( fn.ptr(), a.arguments, fn.conv() );
+    }
+
+    /// <summary>
+    /// Call typed remote function in least busy worker thread without blocking.
+    /// Pointer arguments must remain valid until result is ready
+    /// </summary>
+    /// <param name="fn">Remote function</param>
+    /// <param name="args">Function arguments</param>
+    /// <returns>Function return value</returns>
+    template<typename R, typename... Args, typename... T>
+    auto CallAsync( const RemoteFunctionBase<R, Args...>& fn, const T&... args )
+    {
+        using ReturnType = typename RemoteFunctionBase<R, Args...>::ReturnType;
+        static_assert(
+            !std::is_reference_v<ReturnType> && sizeof( ReturnType ) <= sizeof( uint64_t ),
+            "Asynchronous calls support only scalar return types"
+            );
+
+        auto promise = std::make_shared<std::promise<call_result_t<ReturnType>>>();
+        auto future = promise->get_future();
+
+        typename RemoteFunctionBase<R, Args...>::CallArguments a( args... );
+        auto status = CallAsync( fn.ptr(), a.arguments, fn.conv(), ReturnTypeOf<ReturnType>(),
+            [promise]( call_result_t<uint64_t> raw )
+            {
+                ReturnType result = {};
+                if (raw.success())
+                    memcpy( &result, &raw.result(), sizeof( result ) );
+
+                promise->set_value( call_result_t<ReturnType>( result, raw.status ) );
+            } );
+
+        if (!NT_SUCCESS( status ))
+            promise->set_value( call_result_t<ReturnType>( ReturnType(), status ) );
+
+        return future;
+    }
+
+    /// <summary>
+    /// Get number of workers
+    /// </summary>
+    /// <returns>Worker count</returns>
+    BLACKBONE_API inline size_t size() const { return _workers.size(); }
+
+private:
+    /// <summary>
+    /// Select least busy worker and lock it for current thread
+    /// </summary>
+    /// <returns>Worker, nullptr if pool is empty</returns>
+    BLACKBONE_API Worker* Acquire();
+
+    /// <summary>
+    /// Unlock worker acquired by Acquire
+    /// </summary>
+    /// <param name="worker">Worker</param>
+    BLACKBONE_API void Release( Worker* worker );
+
+    RemoteExecPool( const RemoteExecPool& ) = delete;
+    RemoteExecPool& operator =( const RemoteExecPool& ) = delete;
+
+private:
+    class Process& _process;
+    std::vector<std::unique_ptr<Worker>> _workers;  // Worker threads
+    CriticalSection _lock;                          // Worker selection lock
+};
+
+}
@@ -2,7 +2,9 @@
 
 #include "../../Asm/IAsmHelper.h"
 #include "../Process.h"
+#include "ArgumentArena.h"
 
+#include <future>
 #include <type_traits>
 
 // TODO: Find more elegant way to deduce calling convention
@@ -10,6 +12,25 @@
 
 namespace blackbone
 {
+/// <summary>
+/// Get remote call return type
+/// </summary>
+/// <returns>Return type</returns>
+template<typename T>
+constexpr eReturnType ReturnTypeOf()
+{
+    if constexpr (std::is_same_v<T, float>)
+        return rt_float;
+    else if constexpr (std::is_same_v<T, double> || std::is_same_v<T, long double>)
+        return rt_double;
+    else if constexpr (sizeof( T ) == sizeof( uint64_t ))
+        return rt_int64;
+    else if constexpr (!std::is_reference_v<T> && sizeof( T ) > sizeof( uint64_t ))
+        return rt_struct;
+    else
+        return rt_int32;
+}
+
 template<typename R, typename... Args>
 class RemoteFunctionBase
 {
@@ -56,7 +77,6 @@ public:
         ReturnType result = {};
         uint64_t tmpResult = 0;
         NTSTATUS status = STATUS_SUCCESS;
-        auto a = AsmFactory::GetAssembler( _process.core().isWow64() );
 
         // Ensure RPC environment exists
         auto mode = contextThread == _process.remote().getWorker() ? Worker_CreateNew : Worker_None;
@@ -64,26 +84,24 @@ public:
         if (!NT_SUCCESS( status ))
             return call_result_t<ReturnType>( result, status );
 
-        // FPU check
-        constexpr bool isFloat = std::is_same_v<ReturnType, float>;
-        constexpr bool isDouble = std::is_same_v<ReturnType, double> || std::is_same_v<ReturnType, long double>;
-
         // Deduce return type
-        eReturnType retType = rt_int32;
+        eReturnType retType = ReturnTypeOf<ReturnType>();
 
-        if constexpr (isFloat)
-            retType = rt_float;
-        else if constexpr (isDouble)
-            retType = rt_double;
-        else if constexpr (sizeof( ReturnType ) == sizeof( uint64_t ))
-            retType = rt_int64;
-        else if constexpr (!std::is_reference_v<ReturnType> && sizeof( ReturnType ) > sizeof( uint64_t ))
-            retType = rt_struct;
+        // Reuse resident stub for worker thread calls
+        auto stub = contextThread && contextThread == _process.remote().getWorker()
+            ? _process.remote().PrepareCachedCall( _ptr, args.arguments, _conv, retType )
+            : call_result_t<ptr_t>( STATUS_NOT_SUPPORTED );
 
-        _process.remote().PrepareCallAssembly( *a, _ptr, args.arguments, _conv, retType );
+        auto a = AsmFactory::GetAssembler( _process.core().isWow64() );
+        if (!stub && !NT_SUCCESS( status = _process.remote().PrepareCallAssembly( *a, _ptr, args.arguments, _conv, retType ) ))
+            return call_result_t<ReturnType>( result, status );
 
         // Choose execution thread
-        if (!contextThread)
+        if (stub)
+        {
+            status = _process.remote().ExecInWorkerThread( stub.result(), tmpResult );
+        }
+        else if (!contextThread)
         {
             status = _process.remote().ExecInNewThread( (*a)->make(), (*a)->getCodeSize(), tmpResult );
         }
@@ -101,13 +119,50 @@ public:
             return call_result_t<ReturnType>( result, status );
 
         // Update arguments
-        for (auto& arg : args.arguments)
-            if (arg.type == AsmVariant::dataPtr)
-                _process.memory().Read( arg.new_imm_val, arg.size, reinterpret_cast<void*>(arg.imm_val) );
+        ArgumentArena::Readback( _process.memory(), args.arguments );
 
         return call_result_t<ReturnType>( result, STATUS_SUCCESS );
     }
 
+    /// <summary>
+    /// Call function in persistent worker thread without waiting for its completion.
+    /// Pointer arguments must remain valid until result is ready
+    /// </summary>
+    /// <param name="args">Function arguments</param>
+    /// <returns>Function return value</returns>
+    std::future<call_result_t<ReturnType>> CallAsync( CallArguments& args )
+    {
+        static_assert(
+            !std::is_reference_v<ReturnType> && sizeof( ReturnType ) <= sizeof( uint64_t ),
+            "Asynchronous calls support only scalar return types"
+            );
+
+        auto promise = std::make_shared<std::promise<call_result_t<ReturnType>>>();
+        auto future = promise->get_future();
+
+        auto status = _process.remote().CreateRPCEnvironment( Worker_Persistent, true );
+        if (NT_SUCCESS( status ))
+        {
+            status = _process.remote().CallAsync( _ptr, args.arguments, _conv, ReturnTypeOf<ReturnType>(),
+                [promise]( call_result_t<uint64_t> raw )
+                {
+                    ReturnType result = {};
+                    if (raw.success())
+                        memcpy( &result, &raw.result(), sizeof( result ) );
+
+                    promise->set_value( call_result_t<ReturnType>( result, raw.status ) );
+                } );
+        }
+
+        if (!NT_SUCCESS( status ))
+            promise->set_value( call_result_t<ReturnType>( ReturnType(), status ) );
+
+        return future;
+    }
+
+    inline ptr_t ptr() const { return _ptr; }
+    inline eCalligConvention conv() const { return _conv; }
+
 private:
     Process& _process;
     ptr_t _ptr = 0;
@@ -145,6 +200,12 @@ public: \
     { \
         return RemoteFunctionBase::Call( args, contextThread ); \
     } \
+\
+    std::future<call_result_t<ReturnType>> CallAsync( const Args&... args ) \
+    { \
+        CallArguments a( args... ); \
+        return RemoteFunctionBase::CallAsync( a ); \
+    } \
 };
 
 //
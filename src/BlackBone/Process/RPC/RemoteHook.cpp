@@ -1,5 +1,8 @@
 #include "RemoteHook.h"
 #include "../Process.h"
+#include "../../Asm/AsmFactory.h"
+#include "../../Asm/CodeRelocator.h"
+#include "../../Asm/LDasm.h"
 
 #include <algorithm>
 
@@ -84,9 +87,21 @@ void RemoteHook::EndDebug()
 /// <param name="newFn">Callback</param>
 /// <param name="pClass">Class reference.</param>
 /// <param name="pThread">Thread to hook. Valid only for HWBP</param>
+/// <param name="filter">Hit filter. Valid only for int 3</param>
 /// <returns>Status code</returns>
-NTSTATUS RemoteHook::ApplyP( eHookType type, uint64_t ptr, fnCallback newFn, const void* pClass /*= nullptr*/, ThreadPtr pThread /*= nullptr*/ )
+NTSTATUS RemoteHook::ApplyP(
+    eHookType type,
+    uint64_t ptr,
+    fnCallback newFn,
+    const void* pClass /*= nullptr*/,
+    ThreadPtr pThread /*= nullptr*/,
+    const HookFilter* filter /*= nullptr*/
+    )
 {
+    // Debug registers can't be filtered without debug event
+    if (filter != nullptr && type == hwbp)
+        return STATUS_NOT_SUPPORTED;
+
     NTSTATUS status = EnsureDebug();
     if (!NT_SUCCESS( status ))
         return status;
@@ -127,6 +142,13 @@ NTSTATUS RemoteHook::ApplyP( eHookType type, uint64_t ptr, fnCallback newFn, con
                 thread->AddHWBP( ptr, hwbp_execute, hwbp_1 );
         }
     }
+    // Jump to filtering trampoline
+    else if (filter != nullptr)
+    {
+        status = InstallFilter( ptr, *filter );
+        if (!NT_SUCCESS( status ))
+            return status;
+    }
     // Write int3
     else
     {
@@ -195,8 +217,47 @@ void RemoteHook::Remove( uint64_t ptr )
 /// <param name="ptr">Hooked address</param>
 void RemoteHook::Restore( const HookData &hook, uint64_t ptr )
 {
+    auto filter = _filters.find( ptr );
+
+    // Restore bytes replaced by trampoline jump
+    if (filter != _filters.end())
+    {
+        auto& data = filter->second;
+        auto& original = data.original;
+
+        // Bytes are not written atomically
+        auto process = _memory.process();
+        process->Suspend();
+
+        DWORD flOld = 0;
+        _memory.Protect( ptr, original.size(), PAGE_EXECUTE_READWRITE, &flOld );
+        NTSTATUS status = _memory.Write( ptr, original.size(), original.data() );
+        _memory.Protect( ptr, original.size(), flOld, nullptr );
+
+        // Return addresses of relocated calls may point into trampoline, so it is never freed
+        bool freeable = NT_SUCCESS( status ) && !data.pinned;
+        bool freed = freeable && LeaveTrampoline( ptr, data );
+
+        process->Resume();
+
+        // Threads inside filter code leave it shortly
+        for (int i = 0; i < 20 && freeable && !freed; i++)
+        {
+            Sleep( 5 );
+
+            process->Suspend();
+            freed = LeaveTrampoline( ptr, data );
+            process->Resume();
+        }
+
+        if (!freed)
+            data.code.Release();
+
+        _filterBreaks.erase( data.breakAddr );
+        _filters.erase( filter );
+    }
     // Remove HWBP
-    if (hook.type == hwbp)
+    else if (hook.type == hwbp)
     {       
         if (hook.threadID != 0)
         {
@@ -219,6 +280,353 @@ void RemoteHook::Restore( const HookData &hook, uint64_t ptr )
     }
 }
 
+/// <summary>
+/// Redirect hooked address to filtering trampoline
+///
+/// Trampoline layout:
+/// -------------------------------------------------------------
+/// | Hit counter |   Filter code, int 3   |  Relocated original |
+/// -------------------------------------------------------------
+/// |   8 bytes   |                        |  code, jump back    |
+/// -------------------------------------------------------------
+/// </summary>
+/// <param name="ptr">Hooked address</param>
+/// <param name="filter">Hit filter</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteHook::InstallFilter( ptr_t ptr, const HookFilter& filter )
+{
+    bool x64 = _x64Target != FALSE;
+    uint8_t code[0x40] = { 0 };
+
+    for (auto& cond : filter.conditions)
+        if (cond.operand == HookFilter::reg && cond.index > static_cast<uint32_t>(x64 ? HookFilter::r15 : HookFilter::rdi))
+            return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS status = _memory.Read( ptr, sizeof( code ), code, true );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    // Near block keeps hook jump short and RIP-relative code relocatable
+    auto block = _memory.AllocateNear( ptr, 0x1000, PAGE_EXECUTE_READWRITE );
+    if (!block)
+        return block.status;
+
+    FilterData data;
+    data.code = std::move( block.result() );
+
+    ptr_t counter = data.code.ptr();
+    ptr_t codeBase = counter + sizeof( uint64_t );
+
+    auto a = AsmFactory::GetAssembler( !x64 );
+    data.breakAddr = codeBase + GenFilter( *a, filter, counter );
+
+    // Original code is placed right after filter code
+    std::vector<uint8_t> relocated;
+    data.relocated = codeBase + (*a)->getCodeSize();
+    auto moved = CodeRelocator::Relocate(
+        code, sizeof( code ), ptr, data.relocated, CodeRelocator::JumpSize( ptr, codeBase, x64 ), x64, relocated, &data.offsets
+        );
+
+    if (!moved)
+        return moved.status;
+
+    data.pinned = ContainsCall( code, data.offsets, x64 );
+
+    data.code.Write( 0, uint64_t( filter.hitModulus ) );
+    data.code.Write( codeBase - counter, (*a)->getCodeSize(), (*a)->make() );
+    status = data.code.Write( data.relocated - counter, relocated.size(), relocated.data() );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    // Jump over whole moved instructions
+    std::vector<uint8_t> patch;
+    CodeRelocator::EmitJump( patch, ptr, codeBase, x64 );
+    patch.resize( moved.result(), 0x90 );
+    data.original.assign( code, code + moved.result() );
+
+    // Jump is not written atomically
+    auto process = _memory.process();
+    process->Suspend();
+
+    // Threads can't be left in the middle of replaced instructions
+    status = EnterTrampoline( ptr, data );
+    if (NT_SUCCESS( status ))
+    {
+        DWORD flOld = 0;
+        _memory.Protect( ptr, patch.size(), PAGE_EXECUTE_READWRITE, &flOld );
+        status = _memory.Write( ptr, patch.size(), patch.data() );
+        _memory.Protect( ptr, patch.size(), flOld, nullptr );
+    }
+
+    process->Resume();
+
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    _filterBreaks.emplace( data.breakAddr, ptr );
+    _filters.emplace( ptr, std::move( data ) );
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Generate filter code.
+/// Matching hits reach int 3, others jump to the end of generated code
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <param name="filter">Hit filter</param>
+/// <param name="counter">Hit counter address</param>
+/// <returns>int 3 offset in generated code</returns>
+size_t RemoteHook::GenFilter( IAsmHelper& a, const HookFilter& filter, ptr_t counter )
+{
+    bool x64 = a->getArch() == asmjit::kArchX64;
+    int32_t ws = x64 ? sizeof( uint64_t ) : sizeof( uint32_t );
+
+    asmjit::Label l_skip = a->newLabel();
+    asmjit::Label l_orig = a->newLabel();
+
+    // Saved flags, zax and zcx
+    const int32_t saved = 3 * ws;
+
+    a->pushf();
+    a->push( a->zax );
+    a->push( a->zcx );
+
+    for (auto& cond : filter.conditions)
+    {
+        if (cond.operand == HookFilter::reg)
+        {
+            switch (cond.index)
+            {
+                case HookFilter::rax:
+                    a->mov( a->zax, a->intptr_ptr( a->zsp, ws ) );
+                    break;
+
+                case HookFilter::rcx:
+                    a->mov( a->zax, a->intptr_ptr( a->zsp ) );
+                    break;
+
+                case HookFilter::rsp:
+                    a->lea( a->zax, a->intptr_ptr( a->zsp, saved ) );
+                    break;
+
+                default:
+                    a->mov( a->zax, a->gpz( cond.index ) );
+                    break;
+            }
+        }
+        // Integer arguments in registers
+        else if (x64 && cond.index < 4)
+        {
+            static const asmjit::X86GpReg regArgs[] = { asmjit::host::rcx, asmjit::host::rdx, asmjit::host::r8, asmjit::host::r9 };
+
+            if (cond.index == 0)
+                a->mov( a->zax, a->intptr_ptr( a->zsp ) );
+            else
+                a->mov( a->zax, regArgs[cond.index] );
+        }
+        // Stack arguments above return address
+        else
+        {
+            a->mov( a->zax, a->intptr_ptr( a->zsp, saved + ws + cond.index * ws ) );
+        }
+
+        a->mov( a->zcx, cond.value );
+        a->cmp( a->zax, a->zcx );
+
+        switch (cond.compare)
+        {
+            case HookFilter::equal:
+                a->jne( l_skip );
+                break;
+
+            case HookFilter::notEqual:
+                a->je( l_skip );
+                break;
+
+            case HookFilter::below:
+                a->jae( l_skip );
+                break;
+
+            case HookFilter::above:
+                a->jbe( l_skip );
+                break;
+        }
+    }
+
+    // Count matching hits
+    if (filter.hitModulus > 1)
+    {
+        a->mov( a->zax, counter );
+        a->lock().dec( asmjit::host::dword_ptr( a->zax ) );
+        a->jnz( l_skip );
+        a->mov( asmjit::host::dword_ptr( a->zax ), filter.hitModulus );
+    }
+
+    // Break with original context
+    a->pop( a->zcx );
+    a->pop( a->zax );
+    a->popf();
+
+    size_t breakOffset = a->getOffset();
+    a->db( 0xCC );
+    a->jmp( l_orig );
+
+    a->bind( l_skip );
+    a->pop( a->zcx );
+    a->pop( a->zax );
+    a->popf();
+
+    a->bind( l_orig );
+    return breakOffset;
+}
+
+/// <summary>
+/// Move threads stopped inside code replaced by trampoline jump into relocated copy of that code.
+/// Process must be suspended
+/// </summary>
+/// <param name="ptr">Hooked address</param>
+/// <param name="data">Filtering trampoline</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteHook::EnterTrampoline( ptr_t ptr, const FilterData& data )
+{
+    size_t size = data.original.size();
+
+    for (auto& thread : _memory.process()->threads().getAll())
+    {
+        ptr_t ip = 0;
+        if (!NT_SUCCESS( GetIP( *thread, ip ) ))
+            continue;
+
+        // Jump starts at hooked address, threads stopped there just take it
+        if (ip <= ptr || ip >= ptr + size)
+            continue;
+
+        auto iter = std::find_if( data.offsets.begin(), data.offsets.end(), [&]( auto& pair ) { return ptr + pair.first == ip; } );
+        if (iter == data.offsets.end())
+            return STATUS_INVALID_ADDRESS;
+
+        NTSTATUS status = SetIP( *thread, data.relocated + iter->second );
+        if (!NT_SUCCESS( status ))
+            return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Move threads stopped inside relocated code back to original code and free trampoline.
+/// Process must be suspended
+/// </summary>
+/// <param name="ptr">Hooked address</param>
+/// <param name="data">Filtering trampoline</param>
+/// <returns>true if trampoline was freed, false if some thread is still inside filter code</returns>
+bool RemoteHook::LeaveTrampoline( ptr_t ptr, FilterData& data )
+{
+    ptr_t begin = data.code.ptr();
+    ptr_t end = begin + data.code.size();
+
+    for (auto& thread : _memory.process()->threads().getAll())
+    {
+        ptr_t ip = 0;
+        if (!NT_SUCCESS( GetIP( *thread, ip ) ) || ip < begin || ip >= end)
+            continue;
+
+        // Filter code keeps saved registers on stack, thread must finish it
+        auto iter = std::find_if( data.offsets.begin(), data.offsets.end(), [&]( auto& pair ) { return data.relocated + pair.second == ip; } );
+        if (iter == data.offsets.end() || !NT_SUCCESS( SetIP( *thread, ptr + iter->first ) ))
+            return false;
+    }
+
+    data.code.Free();
+    return true;
+}
+
+/// <summary>
+/// Check if relocated instructions contain a call
+/// </summary>
+/// <param name="code">Original code</param>
+/// <param name="offsets">Original and relocated instruction offsets</param>
+/// <param name="x64">64 bit code</param>
+/// <returns>true if call was found</returns>
+bool RemoteHook::ContainsCall( const uint8_t* code, const std::vector<std::pair<size_t, size_t>>& offsets, bool x64 )
+{
+    // Last pair is the end of moved code
+    for (size_t i = 0; i + 1 < offsets.size(); i++)
+    {
+        ldasm_data ld = { 0 };
+        const uint8_t* pInstr = code + offsets[i].first;
+        ldasm( const_cast<uint8_t*>(pInstr), &ld, x64 );
+
+        uint8_t opcode = pInstr[ld.opcd_offset];
+        uint8_t regField = (ld.modrm >> 3) & 7;
+
+        // call rel32, call r/m, call far
+        if (ld.opcd_size == 1 && (opcode == 0xE8 || opcode == 0x9A || (opcode == 0xFF && (regField == 2 || regField == 3))))
+            return true;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Get thread instruction pointer
+/// </summary>
+/// <param name="thread">Thread</param>
+/// <param name="ip">Instruction pointer</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteHook::GetIP( Thread& thread, ptr_t& ip )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (_memory.core().isWow64())
+    {
+        _CONTEXT32 ctx32 = { 0 };
+        if (NT_SUCCESS( status = thread.GetContext( ctx32, CONTEXT_CONTROL, true ) ))
+            ip = ctx32.Eip;
+    }
+    else
+    {
+        _CONTEXT64 ctx64 = { 0 };
+        if (NT_SUCCESS( status = thread.GetContext( ctx64, CONTEXT64_CONTROL, true ) ))
+            ip = ctx64.Rip;
+    }
+
+    return status;
+}
+
+/// <summary>
+/// Set thread instruction pointer
+/// </summary>
+/// <param name="thread">Thread</param>
+/// <param name="ip">Instruction pointer</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteHook::SetIP( Thread& thread, ptr_t ip )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (_memory.core().isWow64())
+    {
+        _CONTEXT32 ctx32 = { 0 };
+        if (NT_SUCCESS( status = thread.GetContext( ctx32, CONTEXT_CONTROL, true ) ))
+        {
+            ctx32.Eip = static_cast<uint32_t>(ip);
+            status = thread.SetContext( ctx32, true );
+        }
+    }
+    else
+    {
+        _CONTEXT64 ctx64 = { 0 };
+        if (NT_SUCCESS( status = thread.GetContext( ctx64, CONTEXT64_CONTROL, true ) ))
+        {
+            ctx64.Rip = ip;
+            status = thread.SetContext( ctx64, true );
+        }
+    }
+
+    return status;
+}
+
 /// <summary>
 /// Wrapper for debug event thread
 /// </summary>
@@ -285,6 +693,20 @@ DWORD RemoteHook::EventThread()
                     }
                 break;
 
+                // Cached regions and function tables are stale
+            case LOAD_DLL_DEBUG_EVENT:
+                if (DebugEv.u.LoadDll.hFile)
+                    CloseHandle( DebugEv.u.LoadDll.hFile );
+
+                _regions.clear();
+                _unwindTables.clear();
+                break;
+
+            case UNLOAD_DLL_DEBUG_EVENT:
+                _regions.clear();
+                _unwindTables.clear();
+                break;
+
             default:
                 break;
         }
@@ -340,6 +762,11 @@ DWORD RemoteHook::OnBreakpoint( const DEBUG_EVENT& DebugEv )
     ptr_t ip = 0, sp = 0;
     Thread thd( DebugEv.dwThreadId, &_core );
 
+    // Breakpoint in filtering trampoline
+    auto filtered = _filterBreaks.find( addr );
+    if (filtered != _filterBreaks.end())
+        addr = filtered->second;
+
     if (_hooks.count( addr ))
     {
         _CONTEXT64 ctx64;
@@ -357,10 +784,15 @@ DWORD RemoteHook::OnBreakpoint( const DEBUG_EVENT& DebugEv )
             ip = ctx64.Rip;
             sp = ctx64.Rsp;
         }
+
+        // Trampoline int 3 stands for function entry, registers and stack are already restored
+        ptr_t resumeIP = ctx64.Rip;
+        if (filtered != _filterBreaks.end())
+            ctx64.Rip = ip = addr;
         
         // Get stack frame pointer
         std::vector<std::pair<ptr_t, ptr_t>> results;
-        StackBacktrace( ip, sp, thd, results, 1 );
+        StackBacktrace( ip, sp, thd, results, 1, _x64Target ? &ctx64 : nullptr );
 
         RemoteContext context( _memory, thd, ctx64, !results.empty() ? results.back().first : 0, _x64Target, _wordSize );
 
@@ -380,6 +812,16 @@ DWORD RemoteHook::OnBreakpoint( const DEBUG_EVENT& DebugEv )
             _retHooks.emplace( newReturn, addr );
         }
 
+        // Trampoline continues with original code after int 3, unless callback redirected execution
+        if (filtered != _filterBreaks.end())
+        {
+            if (ctx64.Rip == addr)
+                ctx64.Rip = resumeIP;
+
+            thd.SetContext( ctx64, true );
+            return DBG_CONTINUE;
+        }
+
         // Resume execution
         DWORD flOld = 0;
         _memory.Protect( addr, sizeof( hook.oldByte ), PAGE_EXECUTE_READWRITE, &flOld );
@@ -445,7 +887,7 @@ DWORD RemoteHook::OnSinglestep( const DEBUG_EVENT& DebugEv )
     {
         // Get stack frame pointer
         std::vector<std::pair<ptr_t, ptr_t>> results;
-        StackBacktrace( ip, sp, thd, results, 1 );
+        StackBacktrace( ip, sp, thd, results, 1, _x64Target ? &ctx64 : nullptr );
 
         RemoteContext context( _memory, thd, ctx64, !results.empty() ? results.back().first : 0, _x64Target, _wordSize );
 
@@ -548,7 +990,7 @@ DWORD RemoteHook::OnAccessViolation( const DEBUG_EVENT& DebugEv )
 
     // Get stack frame pointer
     std::vector<std::pair<ptr_t, ptr_t>> results;
-    StackBacktrace( ip, sp, thd, results, 1 );
+    StackBacktrace( ip, sp, thd, results, 1, _x64Target ? &ctx64 : nullptr );
 
     RemoteContext context( _memory, thd, ctx64, !results.empty() ? results.back().first : 0, _x64Target, _wordSize );
 
@@ -612,11 +1054,19 @@ DWORD RemoteHook::OnAccessViolation( const DEBUG_EVENT& DebugEv )
 /// <param name="thd">Stack owner</param>
 /// <param name="results">Stack frames</param>
 /// <param name="depth">Max frame count</param>
+/// <param name="ctx">Thread context of x64 target, used for precise unwinding</param>
 /// <returns>Frame count</returns>
-DWORD RemoteHook::StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<std::pair<ptr_t, ptr_t>>& results, int depth /*= 100 */ )
+DWORD RemoteHook::StackBacktrace(
+    ptr_t ip,
+    ptr_t sp,
+    Thread& thd,
+    std::vector<std::pair<ptr_t, ptr_t>>& results,
+    int depth /*= 100 */,
+    const _CONTEXT64* ctx /*= nullptr*/
+    )
 {
     int i = 0;
-    uint64_t stack_base = 0;
+    StackView stack;
 
     // Get stack base
     if(_core.isWow64())
@@ -625,7 +1075,7 @@ DWORD RemoteHook::StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<s
         if (thd.teb( &teb32 ) == 0)
             return 0;
 
-        stack_base = teb32.NtTib.StackBase;
+        stack.limit = teb32.NtTib.StackBase;
     }
     else
     {
@@ -633,18 +1083,53 @@ DWORD RemoteHook::StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<s
         if (thd.teb( &teb64 ) == 0)
             return 0;
 
-        stack_base = teb64.NtTib.StackBase;
+        stack.limit = teb64.NtTib.StackBase;
     }
 
+    stack.base = sp;
+
     // Store exception address
     results.emplace_back( 0, ip );
 
-    // Walk stack
-    for (ptr_t stackPtr = sp; stackPtr < stack_base && i < depth; stackPtr += _wordSize)
+    // Unwind while frames are described by image function tables
+    if (_x64Target && ctx != nullptr)
+    {
+        uint64_t regs[16] = { 0 };
+        memcpy( regs, &ctx->Rax, sizeof( regs ) );
+        regs[4] = sp;
+
+        for (ptr_t retSlot = 0; i < depth && UnwindFrame( stack, regs, ip, i != 0, retSlot ); i++)
+        {
+            results.emplace_back( retSlot, ip );
+
+            // Reached thread start
+            if (ip == 0 || regs[4] >= stack.limit)
+                return i + 1;
+        }
+
+        sp = regs[4];
+    }
+
+    return i + ScanStack( stack, sp, results, depth - i );
+}
+
+/// <summary>
+/// Find return addresses by scanning stack for values pointing after 'call' instructions
+/// </summary>
+/// <param name="stack">Thread stack</param>
+/// <param name="sp">Address to start scan from</param>
+/// <param name="results">Stack frames</param>
+/// <param name="depth">Max frame count</param>
+/// <returns>Frame count</returns>
+DWORD RemoteHook::ScanStack( StackView& stack, ptr_t sp, std::vector<std::pair<ptr_t, ptr_t>>& results, int depth )
+{
+    int i = 0;
+
+    for (ptr_t stackPtr = sp; stackPtr < stack.limit && i < depth; stackPtr += _wordSize)
     {
         ptr_t stack_val = 0;
-        _memory.Read( stackPtr, _wordSize, &stack_val );
-        MEMORY_BASIC_INFORMATION64 meminfo = { 0 };
+        if (!ReadStack( stack, stackPtr, stack_val ))
+            break;
 
         ptr_t original = stack_val & 0x7FFFFFFFFFFFFFFF;
 
@@ -653,15 +1138,9 @@ DWORD RemoteHook::StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<s
             continue;
 
         // Check if memory is executable
-        if (_core.native()->VirtualQueryExT( original, &meminfo ) != STATUS_SUCCESS)
-            continue;
-
-        if ( meminfo.AllocationProtect != PAGE_EXECUTE_READ &&
-             meminfo.AllocationProtect != PAGE_EXECUTE_WRITECOPY &&
-             meminfo.AllocationProtect != PAGE_EXECUTE_READWRITE)
-        {
+        auto region = QueryRegion( original );
+        if (region == nullptr || !region->executable)
             continue;
-        }
 
         uint8_t codeChunk[6] = {0};
         _memory.Read( original - 6, sizeof(codeChunk), codeChunk );
@@ -678,6 +1157,246 @@ DWORD RemoteHook::StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<s
     return i;
 }
 
+/// <summary>
+/// Unwind single x64 frame using image function table
+/// </summary>
+/// <param name="stack">Thread stack</param>
+/// <param name="regs">General purpose registers in Rax..R15 order, updated only on success</param>
+/// <param name="ip">Instruction pointer, replaced with return address</param>
+/// <param name="caller">ip is a return address, so it may point past the end of calling function</param>
+/// <param name="retSlot">Return address location</param>
+/// <returns>false if frame can't be unwound precisely</returns>
+bool RemoteHook::UnwindFrame( StackView& stack, uint64_t* regs, ptr_t& ip, bool caller, ptr_t& retSlot )
+{
+    enum
+    {
+        UWOP_PUSH_NONVOL = 0, UWOP_ALLOC_LARGE, UWOP_ALLOC_SMALL, UWOP_SET_FPREG, UWOP_SAVE_NONVOL,
+        UWOP_SAVE_NONVOL_FAR, UWOP_EPILOG, UWOP_SPARE_CODE, UWOP_SAVE_XMM128, UWOP_SAVE_XMM128_FAR, UWOP_PUSH_MACHFRAME
+    };
+
+    // Slots used by each unwind code
+    static const uint8_t opSlots[] = { 1, 2, 1, 1, 2, 3, 2, 3, 2, 3, 1 };
+
+    ptr_t pc = caller ? ip - 1 : ip;
+    auto region = QueryRegion( pc );
+    if (region == nullptr || !region->executable)
+        return false;
+
+    // Image has no function table
+    ptr_t imageBase = region->allocationBase;
+    auto& table = UnwindTable( imageBase );
+    if (table.empty())
+        return false;
+
+    uint64_t state[16] = { 0 };
+    memcpy( state, regs, sizeof( state ) );
+
+    uint32_t rva = static_cast<uint32_t>(pc - imageBase);
+    auto iter = std::upper_bound( table.begin(), table.end(), rva, []( uint32_t val, const UnwindEntry& entry ) { return val < entry.begin; } );
+
+    // Leaf function, return address is on top of the stack
+    bool leaf = iter == table.begin() || rva >= (--iter)->end;
+    uint32_t prologOffset = leaf ? 0 : rva - iter->begin;
+    uint32_t infoRVA = iter->unwindInfo;
+
+    for (bool last = leaf; !last; )
+    {
+        // UNWIND_INFO header, up to 255 codes and chained entry
+        uint8_t info[4 + 0xFF * 2 + sizeof( UnwindEntry ) + 2] = { 0 };
+        if (!NT_SUCCESS( _memory.Read( imageBase + infoRVA, sizeof( info ), info, true ) ))
+            return false;
+
+        uint8_t flags = info[0] >> 3;
+        uint8_t codeCount = info[2];
+        uint8_t frameReg = info[3] & 0xF;
+        uint8_t frameOffset = info[3] >> 4;
+        auto codes = reinterpret_cast<const uint16_t*>(info + 4);
+
+        for (uint32_t i = 0; i < codeCount; )
+        {
+            uint8_t codeOffset = codes[i] & 0xFF;
+            uint8_t op = (codes[i] >> 8) & 0xF;
+            uint8_t opInfo = codes[i] >> 12;
+
+            if (op >= sizeof( opSlots ))
+                return false;
+
+            uint32_t slots = opSlots[op] + (op == UWOP_ALLOC_LARGE && opInfo != 0 ? 1 : 0);
+
+            // Instruction wasn't executed yet
+            if (codeOffset > prologOffset)
+            {
+                i += slots;
+                continue;
+            }
+
+            switch (op)
+            {
+            case UWOP_PUSH_NONVOL:
+                if (!ReadStack( stack, state[4], state[opInfo] ))
+                    return false;
+
+                state[4] += sizeof( uint64_t );
+                break;
+
+            case UWOP_ALLOC_LARGE:
+                state[4] += opInfo == 0 ? codes[i + 1] * 8ull : codes[i + 1] | (static_cast<uint32_t>(codes[i + 2]) << 16);
+                break;
+
+            case UWOP_ALLOC_SMALL:
+                state[4] += opInfo * 8ull + 8;
+                break;
+
+            case UWOP_SET_FPREG:
+                state[4] = state[frameReg] - frameOffset * 16ull;
+                break;
+
+            case UWOP_SAVE_NONVOL:
+            case UWOP_SAVE_NONVOL_FAR:
+            {
+                uint64_t offset = op == UWOP_SAVE_NONVOL ? codes[i + 1] * 8ull : codes[i + 1] | (static_cast<uint32_t>(codes[i + 2]) << 16);
+                if (!ReadStack( stack, state[4] + offset, state[opInfo] ))
+                    return false;
+
+                break;
+            }
+
+            case UWOP_PUSH_MACHFRAME:
+            {
+                // Interrupt frame holds return address and stack pointer
+                ptr_t frame = state[4] + (opInfo ? sizeof( uint64_t ) : 0);
+                if (!ReadStack( stack, frame, ip ) || !ReadStack( stack, frame + 3 * sizeof( uint64_t ), state[4] ))
+                    return false;
+
+                retSlot = frame;
+                memcpy( regs, state, sizeof( state ) );
+                return true;
+            }
+
+            default:
+                break;
+            }
+
+            i += slots;
+        }
+
+        // UNW_FLAG_CHAININFO, chained entry describes rest of the prolog
+        last = !(flags & 0x4);
+        if (last)
+            break;
+
+        auto chained = reinterpret_cast<const UnwindEntry*>(codes + ((codeCount + 1) & ~1));
+        infoRVA = chained->unwindInfo;
+        prologOffset = 0xFFFFFFFF;
+    }
+
+    ptr_t retAddr = 0;
+    if (!ReadStack( stack, state[4], retAddr ))
+        return false;
+
+    retSlot = state[4];
+    ip = retAddr;
+    state[4] += sizeof( uint64_t );
+    memcpy( regs, state, sizeof( state ) );
+    return true;
+}
+
+/// <summary>
+/// Read pointer-sized value from thread stack
+/// </summary>
+/// <param name="stack">Thread stack</param>
+/// <param name="address">Value address</param>
+/// <param name="value">Read value</param>
+/// <returns>true on success</returns>
+bool RemoteHook::ReadStack( StackView& stack, ptr_t address, ptr_t& value )
+{
+    value = 0;
+    if (address < stack.base || address + _wordSize > stack.limit)
+        return false;
+
+    // Fetch more stack, doubling read size each time
+    ptr_t offset = address - stack.base;
+    if (offset + _wordSize > stack.data.size())
+    {
+        size_t oldSize = stack.data.size();
+        size_t newSize = std::max<size_t>( Align( static_cast<size_t>(offset) + _wordSize, 0x1000 ), oldSize * 2 );
+        newSize = static_cast<size_t>(std::min<ptr_t>( newSize, stack.limit - stack.base ));
+
+        stack.data.resize( newSize );
+        if (!NT_SUCCESS( _memory.Read( stack.base + oldSize, newSize - oldSize, stack.data.data() + oldSize, true ) ))
+        {
+            stack.data.resize( oldSize );
+            return false;
+        }
+    }
+
+    memcpy( &value, stack.data.data() + offset, _wordSize );
+    return true;
+}
+
+/// <summary>
+/// Get cached region containing address
+/// </summary>
+/// <param name="address">Address to query</param>
+/// <returns>Region info, nullptr if address is invalid</returns>
+const RemoteHook::CodeRegion* RemoteHook::QueryRegion( ptr_t address )
+{
+    auto iter = _regions.upper_bound( address );
+    if (iter != _regions.begin() && address < std::prev( iter )->second.end)
+        return &std::prev( iter )->second;
+
+    MEMORY_BASIC_INFORMATION64 meminfo = { 0 };
+    if (_core.native()->VirtualQueryExT( address, &meminfo ) != STATUS_SUCCESS)
+        return nullptr;
+
+    CodeRegion region;
+    region.end = meminfo.BaseAddress + meminfo.RegionSize;
+    region.allocationBase = meminfo.AllocationBase;
+    region.executable =
+        meminfo.AllocationProtect == PAGE_EXECUTE_READ ||
+        meminfo.AllocationProtect == PAGE_EXECUTE_WRITECOPY ||
+        meminfo.AllocationProtect == PAGE_EXECUTE_READWRITE;
+
+    return &(_regions[meminfo.BaseAddress] = region);
+}
+
+/// <summary>
+/// Get cached function table of x64 image
+/// </summary>
+/// <param name="imageBase">Image base address</param>
+/// <returns>Function table sorted by address, empty if not available</returns>
+const std::vector<RemoteHook::UnwindEntry>& RemoteHook::UnwindTable( ptr_t imageBase )
+{
+    auto iter = _unwindTables.find( imageBase );
+    if (iter != _unwindTables.end())
+        return iter->second;
+
+    auto& table = _unwindTables[imageBase];
+
+    IMAGE_DOS_HEADER dosHdr = { 0 };
+    IMAGE_NT_HEADERS64 ntHdr = { 0 };
+    if (!NT_SUCCESS( _memory.Read( imageBase, dosHdr ) ) || dosHdr.e_magic != IMAGE_DOS_SIGNATURE)
+        return table;
+
+    if (!NT_SUCCESS( _memory.Read( imageBase + dosHdr.e_lfanew, ntHdr ) ) ||
+         ntHdr.Signature != IMAGE_NT_SIGNATURE ||
+         ntHdr.OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC ||
+         ntHdr.OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_EXCEPTION)
+    {
+        return table;
+    }
+
+    auto& dir = ntHdr.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+    if (dir.VirtualAddress == 0 || dir.Size < sizeof( UnwindEntry ))
+        return table;
+
+    table.resize( dir.Size / sizeof( UnwindEntry ) );
+    if (!NT_SUCCESS( _memory.Read( imageBase + dir.VirtualAddress, table.size() * sizeof( UnwindEntry ), table.data() ) ))
+        table.clear();
+
+    return table;
+}
+
 /// <summary>
 /// Stop debug and remove all hooks
 /// </summary>
@@ -691,6 +1410,10 @@ void RemoteHook::reset()
 
         _hooks.clear();
         _repatch.clear();
+        _filters.clear();
+        _filterBreaks.clear();
+        _regions.clear();
+        _unwindTables.clear();
 
         _lock.unlock();
 
@@ -7,9 +7,12 @@
 #include "../../Include/Macro.h"
 #include "../../Misc/Utils.h"
 #include "../Threads/Threads.h"
+#include "../MemBlock.h"
+#include "../../Asm/IAsmHelper.h"
 
 #include <map>
 #include <set>
+#include <vector>
 #include <stdint.h>
 
 namespace blackbone
@@ -64,10 +67,99 @@ public:
         _CONTEXT64 entryCtx;            // Thread context on function entry (used in function return hook)
     };
 
+    /// <summary>
+    /// Hook filter, evaluated inside target process.
+    /// Breakpoint is raised only if all conditions are met
+    /// </summary>
+    struct HookFilter
+    {
+        // Compared value
+        enum eOperand
+        {
+            reg = 0,            // General purpose register on function entry
+            arg                 // Integer function argument
+        };
+
+        // Unsigned comparison of operand with constant
+        enum eCompare
+        {
+            equal = 0,
+            notEqual,
+            below,
+            above
+        };
+
+        // Register index, r8-r15 are valid for x64 targets only
+        enum eRegister
+        {
+            rax = 0, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+            r8, r9, r10, r11, r12, r13, r14, r15
+        };
+
+        struct Condition
+        {
+            eOperand operand;           // Operand type
+            uint32_t index;             // eRegister value or argument index
+            eCompare compare;           // Comparison type
+            uint64_t value;             // Value to compare with
+        };
+
+        std::vector<Condition> conditions;  // Conditions to check
+        uint32_t hitModulus = 0;            // Break on every N-th matching hit, 0 to break on each one
+    };
+
     using mapHook = std::map<ptr_t, HookData>;
     using mapAddress = std::map<ptr_t, ptr_t>;
     using setAddresses = std::map<ptr_t, bool>;
 
+private:
+    /// <summary>
+    /// Cached memory region
+    /// </summary>
+    struct CodeRegion
+    {
+        ptr_t end = 0;              // Region end
+        ptr_t allocationBase = 0;   // Region allocation base
+        bool  executable = false;   // Region can contain code
+    };
+
+    /// <summary>
+    /// x64 function table entry
+    /// </summary>
+    struct UnwindEntry
+    {
+        uint32_t begin;             // Function start RVA
+        uint32_t end;               // Function end RVA
+        uint32_t unwindInfo;        // UNWIND_INFO RVA
+    };
+
+    /// <summary>
+    /// Thread stack, read in growing chunks on demand
+    /// </summary>
+    struct StackView
+    {
+        ptr_t base = 0;             // Lowest address, thread stack pointer
+        ptr_t limit = 0;            // Thread stack base
+        std::vector<uint8_t> data;  // Stack contents starting from base
+    };
+
+    /// <summary>
+    /// Filtering trampoline of int 3 hook
+    /// </summary>
+    struct FilterData
+    {
+        ptr_t breakAddr = 0;            // Trampoline int 3 address
+        ptr_t relocated = 0;            // Relocated original code address
+        MemBlock code;                  // Hit counter, filter and relocated original code
+        std::vector<uint8_t> original;  // Original bytes replaced by jump
+        std::vector<std::pair<size_t, size_t>> offsets;    // Original and relocated instruction offsets
+        bool pinned = false;            // Relocated code calls out, so return addresses may point into trampoline
+    };
+
+    using mapRegions = std::map<ptr_t, CodeRegion>;
+    using mapUnwindTables = std::map<ptr_t, std::vector<UnwindEntry>>;
+    using mapFilters = std::map<ptr_t, FilterData>;
+
 public:
     BLACKBONE_API RemoteHook( class ProcessMemory& memory );
     BLACKBONE_API ~RemoteHook();
@@ -85,6 +177,19 @@ public:
         return ApplyP( type, ptr, newFn, nullptr, pThread );
     }
 
+    /// <summary>
+    /// Hook specified address with int 3 raised only when filter conditions are met.
+    /// Hooked address is patched with jump to filtering trampoline
+    /// </summary>
+    /// <param name="ptr">Address</param>
+    /// <param name="filter">Hit filter</param>
+    /// <param name="newFn">Callback</param>
+    /// <returns>Status code</returns>
+    BLACKBONE_API inline NTSTATUS ApplyFiltered( uint64_t ptr, const HookFilter& filter, fnCallback newFn )
+    {
+        return ApplyP( int3, ptr, newFn, nullptr, nullptr, &filter );
+    }
+
     /// <summary>
     /// Hook function return
     /// This hook will only work if function is hooked normally
@@ -115,6 +220,20 @@ public:
         return ApplyP( type, ptr, brutal_cast<fnCallback>(newFn), &classRef, pThread );
     }
 
+    /// <summary>
+    /// Hook specified address with int 3 raised only when filter conditions are met
+    /// </summary>
+    /// <param name="ptr">Address</param>
+    /// <param name="filter">Hit filter</param>
+    /// <param name="newFn">Callback</param>
+    /// <param name="classRef">Class reference.</param>
+    /// <returns>Status code</returns>
+    template<typename C>
+    inline NTSTATUS ApplyFiltered( uint64_t ptr, const HookFilter& filter, void(C::* newFn)(RemoteContext& ctx), const C& classRef )
+    {
+        return ApplyP( int3, ptr, brutal_cast<fnCallback>(newFn), &classRef, nullptr, &filter );
+    }
+
     /// <summary>
     /// Hook function return
     /// This hook will only work if function is hooked normally
@@ -151,8 +270,16 @@ private:
     /// <param name="newFn">Callback</param>
     /// <param name="pClass">Class reference.</param>
     /// <param name="pThread">Thread to hook. Valid only for HWBP</param>
+    /// <param name="filter">Hit filter. Valid only for int 3</param>
     /// <returns>true on success</returns>
-    BLACKBONE_API NTSTATUS ApplyP( eHookType type, uint64_t ptr, fnCallback newFn, const void* pClass = nullptr, ThreadPtr pThread = nullptr );
+    BLACKBONE_API NTSTATUS ApplyP(
+        eHookType type,
+        uint64_t ptr,
+        fnCallback newFn,
+        const void* pClass = nullptr,
+        ThreadPtr pThread = nullptr,
+        const HookFilter* filter = nullptr
+        );
 
     /// <summary>
     /// Hook function return
@@ -171,6 +298,67 @@ private:
     /// <param name="ptr">Hooked address</param>
     BLACKBONE_API void Restore( const HookData &hook, uint64_t ptr );
 
+    /// <summary>
+    /// Redirect hooked address to filtering trampoline
+    /// </summary>
+    /// <param name="ptr">Hooked address</param>
+    /// <param name="filter">Hit filter</param>
+    /// <returns>Status code</returns>
+    NTSTATUS InstallFilter( ptr_t ptr, const HookFilter& filter );
+
+    /// <summary>
+    /// Generate filter code.
+    /// Matching hits reach int 3, others jump to the end of generated code
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <param name="filter">Hit filter</param>
+    /// <param name="counter">Hit counter address</param>
+    /// <returns>int 3 offset in generated code</returns>
+    size_t GenFilter( IAsmHelper& a, const HookFilter& filter, ptr_t counter );
+
+    /// <summary>
+    /// Move threads stopped inside code replaced by trampoline jump into relocated copy of that code.
+    /// Process must be suspended
+    /// </summary>
+    /// <param name="ptr">Hooked address</param>
+    /// <param name="data">Filtering trampoline</param>
+    /// <returns>Status code</returns>
+    NTSTATUS EnterTrampoline( ptr_t ptr, const FilterData& data );
+
+    /// <summary>
+    /// Move threads stopped inside relocated code back to original code and free trampoline.
+    /// Process must be suspended
+    /// </summary>
+    /// <param name="ptr">Hooked address</param>
+    /// <param name="data">Filtering trampoline</param>
+    /// <returns>true if trampoline was freed, false if some thread is still inside filter code</returns>
+    bool LeaveTrampoline( ptr_t ptr, FilterData& data );
+
+    /// <summary>
+    /// Check if relocated instructions contain a call
+    /// </summary>
+    /// <param name="code">Original code</param>
+    /// <param name="offsets">Original and relocated instruction offsets</param>
+    /// <param name="x64">64 bit code</param>
+    /// <returns>true if call was found</returns>
+    static bool ContainsCall( const uint8_t* code, const std::vector<std::pair<size_t, size_t>>& offsets, bool x64 );
+
+    /// <summary>
+    /// Get thread instruction pointer
+    /// </summary>
+    /// <param name="thread">Thread</param>
+    /// <param name="ip">Instruction pointer</param>
+    /// <returns>Status code</returns>
+    NTSTATUS GetIP( Thread& thread, ptr_t& ip );
+
+    /// <summary>
+    /// Set thread instruction pointer
+    /// </summary>
+    /// <param name="thread">Thread</param>
+    /// <param name="ip">Instruction pointer</param>
+    /// <returns>Status code</returns>
+    NTSTATUS SetIP( Thread& thread, ptr_t ip );
+
     /// <summary>
     /// Debug selected process
     /// </summary>
@@ -232,8 +420,60 @@ private:
     /// <param name="thd">Stack owner</param>
     /// <param name="results">Stack frames</param>
     /// <param name="depth">Max frame count</param>
+    /// <param name="ctx">Thread context of x64 target, used for precise unwinding</param>
+    /// <returns>Frame count</returns>
+    DWORD StackBacktrace(
+        ptr_t ip,
+        ptr_t sp,
+        Thread& thd,
+        std::vector<std::pair<ptr_t, ptr_t>>& results,
+        int depth = 100,
+        const _CONTEXT64* ctx = nullptr
+        );
+
+    /// <summary>
+    /// Find return addresses by scanning stack for values pointing after 'call' instructions
+    /// </summary>
+    /// <param name="stack">Thread stack</param>
+    /// <param name="sp">Address to start scan from</param>
+    /// <param name="results">Stack frames</param>
+    /// <param name="depth">Max frame count</param>
     /// <returns>Frame count</returns>
-    DWORD StackBacktrace( ptr_t ip, ptr_t sp, Thread& thd, std::vector<std::pair<ptr_t, ptr_t>>& results, int depth = 100 );
+    DWORD ScanStack( StackView& stack, ptr_t sp, std::vector<std::pair<ptr_t, ptr_t>>& results, int depth );
+
+    /// <summary>
+    /// Unwind single x64 frame using image function table
+    /// </summary>
+    /// <param name="stack">Thread stack</param>
+    /// <param name="regs">General purpose registers in Rax..R15 order, updated only on success</param>
+    /// <param name="ip">Instruction pointer, replaced with return address</param>
+    /// <param name="caller">ip is a return address, so it may point past the end of calling function</param>
+    /// <param name="retSlot">Return address location</param>
+    /// <returns>false if frame can't be unwound precisely</returns>
+    bool UnwindFrame( StackView& stack, uint64_t* regs, ptr_t& ip, bool caller, ptr_t& retSlot );
+
+    /// <summary>
+    /// Read pointer-sized value from thread stack
+    /// </summary>
+    /// <param name="stack">Thread stack</param>
+    /// <param name="address">Value address</param>
+    /// <param name="value">Read value</param>
+    /// <returns>true on success</returns>
+    bool ReadStack( StackView& stack, ptr_t address, ptr_t& value );
+
+    /// <summary>
+    /// Get cached region containing address
+    /// </summary>
+    /// <param name="address">Address to query</param>
+    /// <returns>Region info, nullptr if address is invalid</returns>
+    const CodeRegion* QueryRegion( ptr_t address );
+
+    /// <summary>
+    /// Get cached function table of x64 image
+    /// </summary>
+    /// <param name="imageBase">Image base address</param>
+    /// <returns>Function table sorted by address, empty if not available</returns>
+    const std::vector<UnwindEntry>& UnwindTable( ptr_t imageBase );
 
     RemoteHook( const RemoteHook& ) = delete;
     RemoteHook& operator =( const RemoteHook& ) = delete;
@@ -251,6 +491,10 @@ private:
     mapHook      _hooks;                // Hooked callbacks
     setAddresses _repatch;              // Pending repatch addresses
     mapAddress   _retHooks;             // Hooked return addresses
+    mapRegions   _regions;              // Regions queried during stack walks
+    mapUnwindTables _unwindTables;      // Function tables of x64 images
+    mapFilters   _filters;              // Filtering trampolines
+    mapAddress   _filterBreaks;         // Trampoline breakpoints to hooked addresses
 };
 
 ENUM_OPS( RemoteHook::eHookFlags )
@@ -2,10 +2,21 @@
 
 #include "../Process.h"
 #include "../../Asm/LDasm.h"
+#include "../../Asm/CodeRelocator.h"
+#include "../../Misc/DynImport.h"
 
 namespace blackbone
 {
 
+#define LOG_HEAD_OFFSET     0x00    // Next ticket to reserve, written by hook code
+#define LOG_TAIL_OFFSET     0x40    // Next ticket to collect, written by host
+#define LOG_DROPPED_OFFSET  0x48    // Number of dropped records
+#define LOG_ENTRY_OFFSET    0x80    // Records
+
+#define LOG_HEADER_SIZE     FIELD_OFFSET( HookLogRecord, data )
+#define LOG_MAX_STACK       0x200
+#define LOG_SPIN_COUNT      0x400
+
 RemoteLocalHook::RemoteLocalHook( class Process& process )
     : _process( process )
 {
@@ -80,6 +91,9 @@ NTSTATUS RemoteLocalHook::SetHook64( ptr_t /*address*/, asmjit::Assembler& /*hoo
 
 NTSTATUS RemoteLocalHook::Restore()
 {
+    if (_logAddress != 0)
+        return RestoreLog();
+
     if (!_hooked)
         return STATUS_SUCCESS;
 
@@ -170,4 +184,480 @@ bool RemoteLocalHook::CopyOldCode( ptr_t address, bool x64 )
     return false;
 }
 
+/// <summary>
+/// Hook function for observation only.
+/// Each call is written into a ring buffer by hook code and execution continues without any host interaction.
+/// Records are collected by host thread and passed to callback in batches
+///
+/// Ring layout:
+/// ------------------------------------------------------------
+/// |  Head  |  Tail, dropped count  |  Records                |
+/// ------------------------------------------------------------
+/// |  0x40  |         0x40          |  capacity * record size |
+/// ------------------------------------------------------------
+/// </summary>
+/// <param name="address">Function address</param>
+/// <param name="config">Saved data</param>
+/// <param name="callback">Record batch callback, called from consumer thread</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteLocalHook::SetLogHook( ptr_t address, const HookLogConfig& config, LogCallback callback )
+{
+    bool x64 = !_process.core().isWow64();
+    uint8_t code[0x40] = { 0 };
+
+    if (_hooked || _logAddress != 0)
+        return STATUS_ALREADY_REGISTERED;
+
+    // Ticket is mapped to record by mask
+    if (config.capacity == 0 || (config.capacity & (config.capacity - 1)) != 0 || config.stackSize > LOG_MAX_STACK)
+        return STATUS_INVALID_PARAMETER;
+
+    if (!x64 && (config.registers & 0xFF00) != 0)
+        return STATUS_INVALID_PARAMETER;
+
+    size_t values = config.args;
+    for (auto mask = config.registers; mask != 0; mask &= mask - 1)
+        values++;
+
+    _logConfig = config;
+    _logCallback = std::move( callback );
+    _logRecordSize = static_cast<uint32_t>(Align( LOG_HEADER_SIZE + values * sizeof( uint64_t ) + Align( config.stackSize, sizeof( uint64_t ) ), 0x10 ));
+    _logTail = 0;
+
+    NTSTATUS status = _process.memory().Read( address, sizeof( code ), code, true );
+    if (NT_SUCCESS( status ))
+        status = CreateLogRing( LOG_ENTRY_OFFSET + static_cast<size_t>(config.capacity) * _logRecordSize );
+
+    auto a = AsmFactory::GetAssembler( !x64 );
+    if (NT_SUCCESS( status ))
+        status = GenLogHook( *a );
+
+    if (NT_SUCCESS( status ))
+    {
+        // Near block keeps hook jump short and RIP-relative code relocatable
+        auto block = _process.memory().AllocateNear( address, Align( (*a)->getCodeSize() + 0x100, _process.core().native()->pageSize() ) );
+        status = block.status;
+        if (block)
+            _logCode = std::move( block.result() );
+    }
+
+    // Original code is placed right after hook code
+    std::vector<uint8_t> relocated;
+    size_t moved = 0;
+    if (NT_SUCCESS( status ))
+    {
+        ptr_t origCode = _logCode.ptr() + (*a)->getCodeSize();
+        auto result = CodeRelocator::Relocate( code, sizeof( code ), address, origCode, CodeRelocator::JumpSize( address, _logCode.ptr(), x64 ), x64, relocated );
+        status = result.status;
+        moved = result.result( 0 );
+    }
+
+    if (NT_SUCCESS( status ))
+        status = _logCode.Write( 0, (*a)->getCodeSize(), (*a)->make() );
+    if (NT_SUCCESS( status ))
+        status = _logCode.Write( (*a)->getCodeSize(), relocated.size(), relocated.data() );
+
+    if (!NT_SUCCESS( status ))
+    {
+        _logCode.Free();
+        RestoreLog();
+        return status;
+    }
+
+    _logStop = false;
+    _logThread = std::thread( &RemoteLocalHook::LogConsumer, this );
+
+    std::vector<uint8_t> patch;
+    CodeRelocator::EmitJump( patch, address, _logCode.ptr(), x64 );
+    patch.resize( moved, 0x90 );
+    _logOriginal.assign( code, code + moved );
+
+    // Jump is not written atomically
+    auto& mem = _process.memory();
+    _process.Suspend();
+
+    DWORD flOld = 0;
+    mem.Protect( address, patch.size(), PAGE_EXECUTE_READWRITE, &flOld );
+    status = mem.Write( address, patch.size(), patch.data() );
+    mem.Protect( address, patch.size(), flOld );
+
+    _process.Resume();
+
+    if (NT_SUCCESS( status ))
+        _logAddress = address;
+    else
+        RestoreLog();
+
+    return status;
+}
+
+/// <summary>
+/// Allocate log ring, shared with target if possible
+/// </summary>
+/// <param name="size">Ring size</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteLocalHook::CreateLogRing( size_t size )
+{
+    // Records are collected from local view without any syscalls.
+    // Target view must be addressable by target code, so this requires same bitness
+    auto type = _process.barrier().type;
+    if (type == wow_32_32 || type == wow_64_64)
+    {
+        PVOID pRemote = nullptr;
+        SIZE_T viewSize = 0;
+
+        _hLogSection = CreateFileMappingW( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, static_cast<DWORD>(size), NULL );
+        if (_hLogSection)
+            _logLocal = static_cast<uint8_t*>(MapViewOfFile( _hLogSection, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size ));
+
+        if (_logLocal && NT_SUCCESS( SAFE_NATIVE_CALL(
+                NtMapViewOfSection, _hLogSection, _process.core().handle(), &pRemote,
+                0, 0, nullptr, &viewSize, 2 /*ViewUnmap*/, 0, PAGE_READWRITE
+            ) ))
+        {
+            _logRing = MemBlock( &_process.memory(), reinterpret_cast<ptr_t>(pRemote), size, PAGE_READWRITE, false );
+        }
+        else if (_hLogSection)
+        {
+            if (_logLocal)
+                UnmapViewOfFile( _logLocal );
+
+            CloseHandle( _hLogSection );
+            _hLogSection = NULL;
+            _logLocal = nullptr;
+        }
+    }
+
+    // Fallback to remote memory access
+    if (!_logRing.valid())
+    {
+        auto mem = _process.memory().Allocate( size, PAGE_READWRITE );
+        if (!mem)
+            return mem.status;
+
+        _logRing = std::move( mem.result() );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Generate logging hook code
+/// </summary>
+/// <param name="a">Target assembly helper</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteLocalHook::GenLogHook( IAsmHelper& a )
+{
+    using namespace asmjit::host;
+
+    bool x64 = a->getArch() == asmjit::kArchX64;
+    int32_t ws = x64 ? sizeof( uint64_t ) : sizeof( uint32_t );
+
+    // Saved flags, zax, zcx and zdx
+    const int32_t saved = 4 * ws;
+    const int32_t entrySp = saved;
+
+    asmjit::Label l_retry = a->newLabel();
+    asmjit::Label l_full = a->newLabel();
+    asmjit::Label l_done = a->newLabel();
+
+    // Store value of zdx into 8 byte record slot
+    auto store = [&]( int32_t offset )
+    {
+        a->mov( a->intptr_ptr( a->zcx, offset ), a->zdx );
+        if (!x64)
+            a->mov( dword_ptr( a->zcx, offset + sizeof( uint32_t ) ), 0 );
+    };
+
+    a->pushf();
+    a->push( a->zax );
+    a->push( a->zcx );
+    a->push( a->zdx );
+
+    // Reserve ticket
+    a->mov( a->zdx, _logRing.ptr() );
+    a->bind( l_retry );
+    a->mov( eax, dword_ptr( a->zdx, LOG_HEAD_OFFSET ) );
+    a->mov( ecx, eax );
+    a->sub( ecx, dword_ptr( a->zdx, LOG_TAIL_OFFSET ) );
+    a->cmp( ecx, _logConfig.capacity );
+    a->jae( l_full );
+    a->mov( ecx, eax );
+    a->inc( ecx );
+    a->lock().cmpxchg( dword_ptr( a->zdx, LOG_HEAD_OFFSET ), ecx );
+    a->jnz( l_retry );
+
+    // zcx = record
+    a->mov( ecx, eax );
+    a->and_( ecx, _logConfig.capacity - 1 );
+    a->imul( ecx, ecx, _logRecordSize );
+    a->lea( a->zcx, a->intptr_ptr( a->zdx, a->zcx, 0, LOG_ENTRY_OFFSET ) );
+
+    // Header
+    if (x64)
+        a->mov( edx, dword_ptr_abs( FIELD_OFFSET( _TEB64, ClientId.UniqueThread ) ).setSegment( gs ) );
+    else
+        a->mov( edx, dword_ptr_abs( FIELD_OFFSET( _TEB32, ClientId.UniqueThread ) ).setSegment( fs ) );
+
+    a->mov( dword_ptr( a->zcx, FIELD_OFFSET( HookLogRecord, threadId ) ), edx );
+    a->mov( a->zdx, a->intptr_ptr( a->zsp, entrySp ) );
+    store( FIELD_OFFSET( HookLogRecord, returnAddress ) );
+
+    int32_t offset = LOG_HEADER_SIZE;
+
+    // Registers on function entry
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        if (!(_logConfig.registers & (1 << i)))
+            continue;
+
+        switch (i)
+        {
+            case 0:
+                a->mov( a->zdx, a->intptr_ptr( a->zsp, 2 * ws ) );
+                break;
+
+            case 1:
+                a->mov( a->zdx, a->intptr_ptr( a->zsp, ws ) );
+                break;
+
+            case 2:
+                a->mov( a->zdx, a->intptr_ptr( a->zsp ) );
+                break;
+
+            case 4:
+                a->lea( a->zdx, a->intptr_ptr( a->zsp, entrySp ) );
+                break;
+
+            default:
+                a->mov( a->zdx, a->gpz( i ) );
+                break;
+        }
+
+        store( offset );
+        offset += sizeof( uint64_t );
+    }
+
+    // Integer arguments
+    for (int32_t i = 0; i < _logConfig.args; i++)
+    {
+        if (x64 && i == 0)
+            a->mov( a->zdx, a->intptr_ptr( a->zsp, ws ) );
+        else if (x64 && i == 1)
+            a->mov( a->zdx, a->intptr_ptr( a->zsp ) );
+        else if (x64 && i == 2)
+            a->mov( a->zdx, r8 );
+        else if (x64 && i == 3)
+            a->mov( a->zdx, r9 );
+        else
+            a->mov( a->zdx, a->intptr_ptr( a->zsp, entrySp + ws + i * ws ) );
+
+        store( offset );
+        offset += sizeof( uint64_t );
+    }
+
+    // Raw stack
+    for (int32_t i = 0; i < _logConfig.stackSize; i += ws)
+    {
+        a->mov( a->zdx, a->intptr_ptr( a->zsp, entrySp + i ) );
+        a->mov( a->intptr_ptr( a->zcx, offset + i ), a->zdx );
+    }
+
+    // Commit record
+    a->inc( eax );
+    a->mov( dword_ptr( a->zcx, FIELD_OFFSET( HookLogRecord, seq ) ), eax );
+    a->jmp( l_done );
+
+    a->bind( l_full );
+    a->lock().inc( dword_ptr( a->zdx, LOG_DROPPED_OFFSET ) );
+
+    a->bind( l_done );
+    a->pop( a->zdx );
+    a->pop( a->zcx );
+    a->pop( a->zax );
+    a->popf();
+
+    return STATUS_SUCCESS;
+}
+
+/// <summary>
+/// Remove logging hook and release ring
+/// </summary>
+/// <returns>Status code</returns>
+NTSTATUS RemoteLocalHook::RestoreLog()
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Threads may still execute hook code or return into relocated code,
+    // so hook code and target view of the ring are never freed once hook was installed
+    bool installed = _logAddress != 0;
+    if (installed)
+    {
+        DWORD flOld = 0;
+        auto& mem = _process.memory();
+
+        // Bytes are not written atomically
+        _process.Suspend();
+
+        mem.Protect( _logAddress, _logOriginal.size(), PAGE_EXECUTE_READWRITE, &flOld );
+        status = mem.Write( _logAddress, _logOriginal.size(), _logOriginal.data() );
+        mem.Protect( _logAddress, _logOriginal.size(), flOld );
+
+        _process.Resume();
+
+        if (!NT_SUCCESS( status ))
+            return status;
+
+        // Let threads inside hook code commit their records before final drain
+        Sleep( 100 );
+        _logAddress = 0;
+
+        _logCode.Release();
+        _logRing.Release();
+    }
+
+    // Consumer collects remaining records before exit
+    if (_logThread.joinable())
+    {
+        _logStop = true;
+        _logThread.join();
+    }
+
+    _logCode.Reset();
+    _logOriginal.clear();
+
+    // Target view keeps section alive after handle is closed
+    if (_hLogSection)
+    {
+        if (_logRing.valid() && !installed)
+            SAFE_NATIVE_CALL( NtUnmapViewOfSection, _process.core().handle(), reinterpret_cast<PVOID>(_logRing.ptr()) );
+        if (_logLocal)
+            UnmapViewOfFile( _logLocal );
+
+        CloseHandle( _hLogSection );
+        _hLogSection = NULL;
+        _logLocal = nullptr;
+    }
+
+    _logRing.Reset();
+    _logCallback = nullptr;
+
+    return status;
+}
+
+/// <summary>
+/// Collect committed records and pass them to callback
+/// </summary>
+/// <param name="buffer">Record buffer</param>
+/// <returns>Number of collected records</returns>
+size_t RemoteLocalHook::DrainLog( std::vector<uint8_t>& buffer )
+{
+    uint32_t head = 0, dropped = 0;
+    if (!NT_SUCCESS( LogRead( LOG_HEAD_OFFSET, sizeof( head ), &head ) ) || head == _logTail)
+        return 0;
+
+    uint32_t count = std::min<uint32_t>( head - _logTail, _logConfig.capacity );
+    uint32_t ready = 0;
+
+    buffer.resize( static_cast<size_t>(count) * _logRecordSize );
+
+    if (_logLocal)
+    {
+        // Record data is written before its commit marker
+        for (; ready < count; ready++)
+        {
+            auto record = _logLocal + LOG_ENTRY_OFFSET + ((_logTail + ready) & (_logConfig.capacity - 1)) * _logRecordSize;
+            if (reinterpret_cast<volatile HookLogRecord*>(record)->seq != _logTail + ready + 1)
+                break;
+
+            _ReadWriteBarrier();
+            memcpy( buffer.data() + ready * _logRecordSize, record, _logRecordSize );
+        }
+    }
+    else
+    {
+        // Records are read at once, wrapping around ring end
+        auto readRecords = [&]( uint32_t n )
+        {
+            uint32_t first = _logTail & (_logConfig.capacity - 1);
+            uint32_t chunk = std::min<uint32_t>( n, _logConfig.capacity - first );
+
+            _logRing.Read( LOG_ENTRY_OFFSET + first * _logRecordSize, chunk * _logRecordSize, buffer.data() );
+            if (chunk < n)
+                _logRing.Read( LOG_ENTRY_OFFSET, (n - chunk) * _logRecordSize, buffer.data() + chunk * _logRecordSize );
+        };
+
+        readRecords( count );
+        for (; ready < count; ready++)
+            if (reinterpret_cast<HookLogRecord*>(buffer.data() + ready * _logRecordSize)->seq != _logTail + ready + 1)
+                break;
+
+        // Copy order isn't defined, so committed records are read again
+        if (ready != 0)
+            readRecords( ready );
+    }
+
+    if (ready == 0)
+        return 0;
+
+    // Release slots before callback
+    _logTail += ready;
+    if (_logLocal)
+        InterlockedExchange( reinterpret_cast<volatile LONG*>(_logLocal + LOG_TAIL_OFFSET), static_cast<LONG>(_logTail) );
+    else
+        _logRing.Write( LOG_TAIL_OFFSET, _logTail );
+
+    LogRead( LOG_DROPPED_OFFSET, sizeof( dropped ), &dropped );
+
+    HookLogBatch batch;
+    batch.records = buffer.data();
+    batch.count = ready;
+    batch.stride = _logRecordSize;
+    batch.dropped = dropped;
+
+    if (_logCallback)
+        _logCallback( batch );
+
+    return ready;
+}
+
+/// <summary>
+/// Consumer thread routine
+/// </summary>
+void RemoteLocalHook::LogConsumer()
+{
+    std::vector<uint8_t> buffer;
+
+    for (uint32_t idle = 0; !_logStop;)
+    {
+        // Spin while records keep coming, then back off
+        if (DrainLog( buffer ) != 0)
+            idle = 0;
+        else if (++idle < LOG_SPIN_COUNT)
+            YieldProcessor();
+        else
+            Sleep( 1 );
+    }
+
+    while (DrainLog( buffer ) != 0);
+}
+
+/// <summary>
+/// Read ring data
+/// </summary>
+/// <param name="offset">Offset in ring</param>
+/// <param name="size">Data size</param>
+/// <param name="pResult">Output buffer</param>
+/// <returns>Status code</returns>
+NTSTATUS RemoteLocalHook::LogRead( uint32_t offset, size_t size, void* pResult )
+{
+    if (_logLocal)
+    {
+        memcpy( pResult, _logLocal + offset, size );
+        return STATUS_SUCCESS;
+    }
+
+    return _logRing.Read( offset, size, pResult );
+}
+
 }
@@ -5,6 +5,11 @@
 #include "../../Include/Types.h"
 #include "../MemBlock.h"
 
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+
 
 namespace blackbone
 {
@@ -45,6 +50,45 @@ union HookCtx
     HookCtx64 hook64;
 };
 
+/// <summary>
+/// Data saved by logging hook on each call
+/// </summary>
+struct HookLogConfig
+{
+    uint16_t registers = 0;         // Register mask, bit index is register encoding: 0 - zax, 1 - zcx ... 15 - r15
+    uint8_t  args = 0;              // Number of integer arguments to save
+    uint16_t stackSize = 0;         // Number of bytes to copy from stack on function entry, starting with return address
+    uint32_t capacity = 0x1000;     // Ring capacity in records, power of 2
+};
+
+/// <summary>
+/// Logged call. Values are stored in 8 byte slots:
+/// registers in ascending index order, then arguments, then raw stack bytes
+/// </summary>
+struct HookLogRecord
+{
+    uint32_t seq;                   // Commit marker
+    uint32_t threadId;              // Calling thread
+    uint64_t returnAddress;         // Function return address
+    uint64_t data[1];               // Saved values
+};
+
+/// <summary>
+/// Records delivered to logging callback
+/// </summary>
+struct HookLogBatch
+{
+    const uint8_t* records = nullptr;   // Record buffer, valid only during callback
+    size_t count = 0;                   // Record count
+    size_t stride = 0;                  // Record size
+    uint32_t dropped = 0;               // Total number of calls not logged because ring was full
+
+    inline const HookLogRecord& operator []( size_t idx ) const
+    {
+        return *reinterpret_cast<const HookLogRecord*>(records + idx * stride);
+    }
+};
+
 
 /// <summary>
 /// In-process remote hook
@@ -55,9 +99,22 @@ public:
     RemoteLocalHook( class Process& process );
     ~RemoteLocalHook();
 
+    using LogCallback = std::function<void( const HookLogBatch& )>;
+
     NTSTATUS SetHook( ptr_t address, asmjit::Assembler& hook );
     NTSTATUS Restore();
 
+    /// <summary>
+    /// Hook function for observation only.
+    /// Each call is written into a ring buffer by hook code and execution continues without any host interaction.
+    /// Records are collected by host thread and passed to callback in batches
+    /// </summary>
+    /// <param name="address">Function address</param>
+    /// <param name="config">Saved data</param>
+    /// <param name="callback">Record batch callback, called from consumer thread</param>
+    /// <returns>Status code</returns>
+    NTSTATUS SetLogHook( ptr_t address, const HookLogConfig& config, LogCallback callback );
+
 private:
     RemoteLocalHook( const RemoteLocalHook& ) = delete;
     RemoteLocalHook& operator = (const RemoteLocalHook&) = delete;
@@ -70,6 +127,47 @@ private:
 
     bool CopyOldCode( ptr_t address, bool x64 );
 
+    /// <summary>
+    /// Allocate log ring, shared with target if possible
+    /// </summary>
+    /// <param name="size">Ring size</param>
+    /// <returns>Status code</returns>
+    NTSTATUS CreateLogRing( size_t size );
+
+    /// <summary>
+    /// Generate logging hook code
+    /// </summary>
+    /// <param name="a">Target assembly helper</param>
+    /// <returns>Status code</returns>
+    NTSTATUS GenLogHook( IAsmHelper& a );
+
+    /// <summary>
+    /// Remove logging hook and release ring
+    /// </summary>
+    /// <returns>Status code</returns>
+    NTSTATUS RestoreLog();
+
+    /// <summary>
+    /// Collect committed records and pass them to callback
+    /// </summary>
+    /// <param name="buffer">Record buffer</param>
+    /// <returns>Number of collected records</returns>
+    size_t DrainLog( std::vector<uint8_t>& buffer );
+
+    /// <summary>
+    /// Consumer thread routine
+    /// </summary>
+    void LogConsumer();
+
+    /// <summary>
+    /// Read ring data
+    /// </summary>
+    /// <param name="offset">Offset in ring</param>
+    /// <param name="size">Data size</param>
+    /// <param name="pResult">Output buffer</param>
+    /// <returns>Status code</returns>
+    NTSTATUS LogRead( uint32_t offset, size_t size, void* pResult );
+
 private:
     class Process& _process;
     HookCtx _ctx;
@@ -80,6 +178,19 @@ private:
 
     bool _hooked = false;
     bool _hook64 = false;
+
+    HookLogConfig _logConfig;               // Saved data
+    LogCallback _logCallback;               // Record batch callback
+    MemBlock _logRing;                      // Record ring
+    MemBlock _logCode;                      // Hook code and relocated original code
+    HANDLE _hLogSection = NULL;             // Ring section
+    uint8_t* _logLocal = nullptr;           // Local view of ring section
+    ptr_t _logAddress = 0;                  // Hooked function
+    std::vector<uint8_t> _logOriginal;      // Original bytes replaced by jump
+    uint32_t _logRecordSize = 0;            // Record size
+    uint32_t _logTail = 0;                  // Next record to collect
+    std::thread _logThread;                 // Consumer thread
+    std::atomic<bool> _logStop{ false };    // Consumer exit request
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "RemoteHeap.h"
+#include "ProcessMemory.h"
+
+namespace blackbone
+{
+
+RemoteHeap::RemoteHeap( ProcessMemory& memory )
+    : _memory( memory )
+    , _arena( std::make_shared<RemoteHeapArena>() )
+{
+}
+
+/// <summary>
+/// Allocate memory block.
+/// Blocks larger than 4KB or with protection other than RW or executable get their own region.
+/// Sub-allocated blocks can't be reprotected or reallocated
+/// </summary>
+/// <param name="size">Block size</param>
+/// <param name="protection">Memory protection</param>
+/// <returns>Memory block, freed back into heap when released</returns>
+call_result_t<MemBlock> RemoteHeap::Allocate( size_t size, DWORD protection /*= PAGE_READWRITE*/ )
+{
+    auto sizeClass = SizeClass( size );
+    auto poolIdx = PoolIndex( protection );
+    if (size == 0 || sizeClass == RemoteHeapArena::classCount || poolIdx < 0)
+        return _memory.Allocate( size, protection );
+
+    auto slotSize = RemoteHeapArena::minSlot << sizeClass;
+
+    // Heap may be reset concurrently
+    std::shared_ptr<RemoteHeapArena> arena;
+    {
+        CSLock lck( _lock );
+        arena = _arena;
+    }
+
+    CSLock lck( arena->lock );
+
+    auto& pool = arena->pools[poolIdx];
+    auto& slab = pool.slabs[sizeClass];
+    ptr_t ptr = 0;
+
+    if (!slab.freeSlots.empty())
+    {
+        ptr = slab.freeSlots.back();
+        slab.freeSlots.pop_back();
+    }
+    else
+    {
+        // Chunk size is a multiple of every slot size, so nothing is wasted
+        if (slab.next == slab.end)
+        {
+            auto mem = _memory.Allocate( RemoteHeapArena::chunkSize, poolIdx ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE );
+            if (!mem)
+                return mem.status;
+
+            slab.next = mem->ptr();
+            slab.end = slab.next + RemoteHeapArena::chunkSize;
+            pool.chunks.emplace_back( std::move( mem.result() ) );
+        }
+
+        ptr = slab.next;
+        slab.next += slotSize;
+    }
+
+    MemBlock block( &_memory, ptr, slotSize, poolIdx ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE );
+    block._pImpl->_heap = arena;
+    block._pImpl->_heapSlot = true;
+
+    return block;
+}
+
+/// <summary>
+/// Release all chunks at once. Outstanding sub-allocated blocks become invalid
+/// </summary>
+void RemoteHeap::reset()
+{
+    auto arena = std::make_shared<RemoteHeapArena>();
+
+    // Old chunks are released outside of lock
+    CSLock lck( _lock );
+    _arena.swap( arena );
+}
+
+/// <summary>
+/// Return block into heap
+/// </summary>
+/// <param name="arena">Heap state</param>
+/// <param name="ptr">Block address</param>
+/// <param name="size">Block size</param>
+/// <param name="protection">Block protection</param>
+void RemoteHeap::Free( RemoteHeapArena& arena, ptr_t ptr, size_t size, DWORD protection )
+{
+    auto sizeClass = SizeClass( size );
+    auto poolIdx = PoolIndex( protection );
+    if (sizeClass == RemoteHeapArena::classCount || poolIdx < 0)
+        return;
+
+    CSLock lck( arena.lock );
+    arena.pools[poolIdx].slabs[sizeClass].freeSlots.emplace_back( ptr );
+}
+
+/// <summary>
+/// Get size class of block
+/// </summary>
+/// <param name="size">Block size</param>
+/// <returns>Size class, classCount if block is too large</returns>
+size_t RemoteHeap::SizeClass( size_t size )
+{
+    size_t sizeClass = 0;
+    while (sizeClass < RemoteHeapArena::classCount && (RemoteHeapArena::minSlot << sizeClass) < size)
+        sizeClass++;
+
+    return sizeClass;
+}
+
+/// <summary>
+/// Get pool index for protection
+/// </summary>
+/// <param name="protection">Memory protection</param>
+/// <returns>Pool index, -1 if protection can't be sub-allocated</returns>
+int RemoteHeap::PoolIndex( DWORD protection )
+{
+    switch (protection)
+    {
+        case PAGE_READWRITE:
+            return 0;
+
+        case PAGE_EXECUTE:
+        case PAGE_EXECUTE_READ:
+        case PAGE_EXECUTE_READWRITE:
+            return 1;
+
+        default:
+            return -1;
+    }
+}
+
+}
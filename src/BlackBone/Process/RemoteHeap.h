@@ -0,0 +1,103 @@
+#pragma once
+
+#include "MemBlock.h"
+#include "../Misc/Utils.h"
+
+#include <array>
+#include <vector>
+#include <memory>
+
+namespace blackbone
+{
+
+/// <summary>
+/// Remote heap state.
+/// Blocks handed out by heap keep weak reference to it, so blocks outliving heap reset don't touch released chunks
+/// </summary>
+struct RemoteHeapArena
+{
+    static constexpr size_t minSlot = 0x10;         // Smallest slot size
+    static constexpr size_t classCount = 9;         // Slot size classes, 16 to 4096 bytes
+    static constexpr size_t chunkSize = 0x10000;    // Chunk reservation size
+
+    /// <summary>
+    /// Slots of single size class
+    /// </summary>
+    struct Slab
+    {
+        std::vector<ptr_t> freeSlots;   // Released slots
+        ptr_t next = 0;                 // Next never used slot in current chunk
+        ptr_t end = 0;                  // Current chunk end
+    };
+
+    /// <summary>
+    /// Chunks of single protection class
+    /// </summary>
+    struct Pool
+    {
+        std::array<Slab, classCount> slabs;     // Slabs by size class
+        std::vector<MemBlock> chunks;           // Reserved chunks
+    };
+
+    CriticalSection lock;                       // Arena lock
+    std::array<Pool, 2> pools;                  // Data (RW) and code (RWX) pools
+};
+
+/// <summary>
+/// Sub-allocator of small remote blocks.
+/// Blocks are carved from 64KB chunks, so most allocations don't cost a syscall
+/// </summary>
+class RemoteHeap
+{
+public:
+    BLACKBONE_API RemoteHeap( class ProcessMemory& memory );
+
+    /// <summary>
+    /// Allocate memory block.
+    /// Blocks larger than 4KB or with protection other than RW or executable get their own region.
+    /// Sub-allocated blocks can't be reprotected or reallocated
+    /// </summary>
+    /// <param name="size">Block size</param>
+    /// <param name="protection">Memory protection</param>
+    /// <returns>Memory block, freed back into heap when released</returns>
+    BLACKBONE_API call_result_t<MemBlock> Allocate( size_t size, DWORD protection = PAGE_READWRITE );
+
+    /// <summary>
+    /// Release all chunks at once. Outstanding sub-allocated blocks become invalid
+    /// </summary>
+    BLACKBONE_API void reset();
+
+    /// <summary>
+    /// Return block into heap
+    /// </summary>
+    /// <param name="arena">Heap state</param>
+    /// <param name="ptr">Block address</param>
+    /// <param name="size">Block size</param>
+    /// <param name="protection">Block protection</param>
+    static void Free( RemoteHeapArena& arena, ptr_t ptr, size_t size, DWORD protection );
+
+private:
+    RemoteHeap( const RemoteHeap& ) = delete;
+    RemoteHeap& operator =( const RemoteHeap& ) = delete;
+
+    /// <summary>
+    /// Get size class of block
+    /// </summary>
+    /// <param name="size">Block size</param>
+    /// <returns>Size class, classCount if block is too large</returns>
+    static size_t SizeClass( size_t size );
+
+    /// <summary>
+    /// Get pool index for protection
+    /// </summary>
+    /// <param name="protection">Memory protection</param>
+    /// <returns>Pool index, -1 if protection can't be sub-allocated</returns>
+    static int PoolIndex( DWORD protection );
+
+private:
+    class ProcessMemory& _memory;               // Process memory routines
+    std::shared_ptr<RemoteHeapArena> _arena;    // Heap state
+    CriticalSection _lock;                      // Heap state pointer lock
+};
+
+}
@@ -1,6 +1,13 @@
 #define CATCH_CONFIG_FAST_COMPILE
 #include "Tests.h"
 #include "../BlackBone/localHook/VTableHook.hpp"
+#include "../BlackBone/localHook/HookRegistry.h"
+#include "../BlackBone/localHook/TrampolinePool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
 
 class TestClass
 {
@@ -149,4 +156,107 @@ TEST_CASE( "06. Local hooks" )
 
     CHECK( mh.handles() > 0 );
 #endif
-}
\ No newline at end of file
+}
+
+/*
+    Lock-free lookups while hooks are added and removed
+*/
+TEST_CASE( "18. Hook registry" )
+{
+    std::cout << "Hook registry test" << std::endl;
+
+    HookRegistry registry;
+    std::vector<uint8_t> code( 0x400 );
+    auto key = [&]( size_t i ) { return static_cast<void*>(&code[i]); };
+    auto value = [&]( size_t i ) { return reinterpret_cast<DetourBase*>(code.data() + i + 1); };
+
+    DetourBase* hook = nullptr;
+    CHECK( !registry.Lookup( key( 0 ), hook ) );
+    CHECK( hook == nullptr );
+
+    // Reader must never get instance of another address while table grows
+    std::atomic<bool> stop{ false };
+    std::atomic<int> mismatches{ 0 };
+    std::thread reader( [&]()
+    {
+        while (!stop)
+        {
+            for (size_t i = 0; i < code.size(); i++)
+            {
+                DetourBase* found = nullptr;
+                if (registry.Lookup( key( i ), found ) && found != nullptr && found != value( i ))
+                    mismatches++;
+            }
+        }
+    } );
+
+    for (size_t i = 0; i < code.size(); i++)
+        registry.Insert( key( i ), value( i ) );
+
+    for (size_t i = 0; i < code.size(); i += 2)
+        registry.Remove( key( i ) );
+
+    stop = true;
+    reader.join();
+    CHECK( mismatches == 0 );
+
+    // Removed address may stay known, but without instance
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        bool known = registry.Lookup( key( i ), hook );
+        if (i % 2)
+        {
+            CHECK( known );
+            CHECK( hook == value( i ) );
+        }
+        else
+            CHECK( hook == nullptr );
+    }
+
+    // Replace instance
+    registry.Insert( key( 1 ), value( 0 ) );
+    CHECK( registry.Lookup( key( 1 ), hook ) );
+    CHECK( hook == value( 0 ) );
+}
+
+/*
+    Trampoline slots near hooked code
+*/
+TEST_CASE( "19. Trampoline pool" )
+{
+    std::cout << "Trampoline pool test" << std::endl;
+
+    auto& pool = TrampolinePool::Instance();
+    auto target = reinterpret_cast<uint8_t*>(&TestFastcall);
+    auto zeroed = []( uint8_t* slot )
+    {
+        return std::all_of( slot, slot + TrampolinePool::SlotSize, []( uint8_t b ) { return b == 0; } );
+    };
+
+    // More slots than single slab holds
+    std::set<uint8_t*> slots;
+    for (size_t i = 0; i < TrampolinePool::SlabSize / TrampolinePool::SlotSize + 8; i++)
+    {
+        auto slot = pool.Allocate( target );
+        REQUIRE( slot != nullptr );
+        CHECK( zeroed( slot ) );
+        CHECK( slots.emplace( slot ).second );
+#ifdef USE64
+        auto distance = slot > target ? slot - target : target - slot;
+        CHECK( distance < 0x7FFF0000 );
+#endif
+        memset( slot, 0xCC, TrampolinePool::SlotSize );
+    }
+
+    uint8_t local = 0;
+    CHECK( !pool.Free( &local ) );
+
+    for (auto slot : slots)
+        CHECK( pool.Free( slot ) );
+
+    // Reused slot is zeroed again
+    auto slot = pool.Allocate( target );
+    REQUIRE( slot != nullptr );
+    CHECK( zeroed( slot ) );
+    CHECK( pool.Free( slot ) );
+}
@@ -96,3 +96,64 @@ void TestMMapFromMem()
 
     thisProc.mmap().UnmapAllModules();
 }
+
+/*
+    Find system library with TLS callbacks
+*/
+std::wstring FindTlsImage()
+{
+    const std::wstring dir = L"C:\\windows\\system32\\";
+    WIN32_FIND_DATAW fd = { 0 };
+    std::wstring found;
+
+    HANDLE hFind = FindFirstFileW( (dir + L"*.dll").c_str(), &fd );
+    if (hFind == INVALID_HANDLE_VALUE)
+        return found;
+
+    do
+    {
+        pe::PEImage image;
+        std::vector<ptr_t> callbacks;
+        if (NT_SUCCESS( image.Load( dir + fd.cFileName, true ) ) && image.GetTLSCallbacks( image.imageBase(), callbacks ) > 0)
+            found = dir + fd.cFileName;
+
+        image.Release();
+    } while (found.empty() && FindNextFileW( hFind, &fd ));
+
+    FindClose( hFind );
+    return found;
+}
+
+/*
+    Map image with TLS callbacks into ping.exe, initializing it in a single remote call
+*/
+TEST_CASE( "15. Batched image initialization" )
+{
+    std::wcout << L"Batched image initialization test" << std::endl;
+
+    auto path = FindTlsImage();
+    if (path.empty())
+    {
+        WARN( "No system library with TLS callbacks found" );
+        return;
+    }
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( CreateTestProcess( proc ) );
+
+    std::wcout << L"Mapping " << path << L" into ping.exe" << std::endl;
+
+    MapProfile profile;
+    auto image = proc.mmap().MapImage( path, BatchInit, nullptr, nullptr, nullptr, &profile );
+    CHECK_NT_SUCCESS( image.status );
+    if (image)
+    {
+        CHECK( image.result()->baseAddress != 0 );
+        CHECK( proc.modules().ValidateModule( image.result()->baseAddress ) );
+        CHECK( profile.images > 0 );
+        CHECK( profile.phases[Phase_Initializers].count > 0 );
+    }
+
+    proc.mmap().UnmapAllModules();
+    proc.Terminate();
+}
@@ -0,0 +1,285 @@
+#include "../BlackBone/Config.h"
+
+#ifdef COMPILER_MSVC
+#define CATCH_CONFIG_FAST_COMPILE
+#include "Tests.h"
+#include "../BlackBone/Process/RPC/RemoteFunction.hpp"
+#include "../BlackBone/Process/RPC/RemoteCallBatch.h"
+#include "../BlackBone/Process/RPC/RemoteExecPool.h"
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+struct TestPoint
+{
+    int32_t x, y, z;
+};
+
+using fnRtlNtStatusToDosError = ULONG( NTAPI* )(NTSTATUS);
+
+int __declspec(noinline) __stdcall RemoteSum( int a, int b, int c )
+{
+    return a + b + c;
+}
+
+int __declspec(noinline) __stdcall RemotePointSum( TestPoint pt, int scale )
+{
+    return (pt.x + pt.y + pt.z) * scale;
+}
+#endif
+
+/*
+    Calls through persistent worker command ring
+*/
+TEST_CASE( "10. Persistent worker" )
+{
+#ifdef COMPILER_MSVC
+    std::cout << "Persistent worker thread call test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( proc.Attach( GetCurrentProcessId() ) );
+    REQUIRE_NT_SUCCESS( proc.remote().CreateRPCEnvironment( Worker_Persistent, true ) );
+    REQUIRE( proc.remote().persistentWorker() );
+
+    auto worker = proc.remote().getWorker();
+    REQUIRE( worker );
+
+    RemoteFunction<decltype(&RemoteSum)> pSum( proc, reinterpret_cast<ptr_t>(&RemoteSum) );
+    RemoteFunction<decltype(&GetCurrentThreadId)> pTid( proc, reinterpret_cast<ptr_t>(&GetCurrentThreadId) );
+
+    for (int i = 1; i <= 16; i++)
+    {
+        auto result = pSum.Call( i, 2 * i, 3 * i, worker );
+        REQUIRE_NT_SUCCESS( result.status );
+        CHECK( result.result() == 6 * i );
+    }
+
+    auto tid = pTid.Call( worker );
+    REQUIRE_NT_SUCCESS( tid.status );
+    CHECK( tid.result() == worker->id() );
+    CHECK( proc.remote().pendingCommands() == 0 );
+
+    proc.remote().TerminateWorker();
+#endif
+}
+
+/*
+    Batched calls with structures passed by value
+*/
+TEST_CASE( "11. Remote call batch" )
+{
+#ifdef COMPILER_MSVC
+    std::cout << "Remote call batch test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( proc.Attach( GetCurrentProcessId() ) );
+
+    RemoteFunction<decltype(&RemotePointSum)> pPointSum( proc, reinterpret_cast<ptr_t>(&RemotePointSum) );
+    RemoteFunction<decltype(&RemoteSum)> pSum( proc, reinterpret_cast<ptr_t>(&RemoteSum) );
+
+    // Argument copies are owned by batch, temporaries are gone before execution
+    RemoteCallBatch batch( proc );
+    for (int i = 1; i <= 8; i++)
+    {
+        batch.Add( pPointSum, TestPoint{ i, 2 * i, 3 * i }, i );
+        batch.Add( pSum, i, i, i );
+    }
+
+    REQUIRE( batch.size() == 16 );
+    REQUIRE_NT_SUCCESS( batch.Execute() );
+
+    for (int i = 1; i <= 8; i++)
+    {
+        auto point = batch.result<int>( 2 * (i - 1) );
+        auto sum = batch.result<int>( 2 * (i - 1) + 1 );
+
+        CHECK_NT_SUCCESS( point.status );
+        CHECK_NT_SUCCESS( sum.status );
+        CHECK( point.result() == 6 * i * i );
+        CHECK( sum.result() == 3 * i );
+    }
+
+    batch.clear();
+    CHECK( batch.size() == 0 );
+
+    proc.remote().TerminateWorker();
+#endif
+}
+
+/*
+    Asynchronous calls, including call issued from completion routine
+*/
+TEST_CASE( "12. Asynchronous remote calls" )
+{
+#ifdef COMPILER_MSVC
+    std::cout << "Asynchronous remote call test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( proc.Attach( GetCurrentProcessId() ) );
+
+    RemoteFunction<decltype(&RemoteSum)> pSum( proc, reinterpret_cast<ptr_t>(&RemoteSum) );
+
+    // No command ring yet, call must not silently run synchronously
+    auto noRing = proc.remote().CallAsync( pSum.ptr(), { 1, 2, 3 }, pSum.conv(), rt_int32, []( call_result_t<uint64_t> ) {} );
+    CHECK( noRing == STATUS_NOT_SUPPORTED );
+
+    std::vector<std::future<call_result_t<int>>> futures;
+    for (int i = 0; i < 16; i++)
+        futures.emplace_back( pSum.CallAsync( i, i, i ) );
+
+    CHECK( proc.remote().asyncEvent() != NULL );
+
+    for (int i = 0; i < 16; i++)
+    {
+        REQUIRE( futures[i].wait_for( std::chrono::seconds( 30 ) ) == std::future_status::ready );
+
+        auto result = futures[i].get();
+        CHECK_NT_SUCCESS( result.status );
+        CHECK( result.result() == 3 * i );
+    }
+
+    // Completion routine starts another call
+    std::promise<call_result_t<uint64_t>> nested;
+    auto future = nested.get_future();
+
+    auto status = proc.remote().CallAsync( pSum.ptr(), { 1, 2, 3 }, pSum.conv(), rt_int32,
+        [&]( call_result_t<uint64_t> first )
+        {
+            if (!first.success())
+            {
+                nested.set_value( first );
+                return;
+            }
+
+            auto nestedStatus = proc.remote().CallAsync( pSum.ptr(), { static_cast<int>(first.result()), 4, 5 }, pSum.conv(), rt_int32,
+                [&]( call_result_t<uint64_t> second ) { nested.set_value( second ); } );
+
+            if (!NT_SUCCESS( nestedStatus ))
+                nested.set_value( call_result_t<uint64_t>( 0, nestedStatus ) );
+        } );
+
+    REQUIRE_NT_SUCCESS( status );
+    REQUIRE( future.wait_for( std::chrono::seconds( 30 ) ) == std::future_status::ready );
+
+    auto result = future.get();
+    CHECK_NT_SUCCESS( result.status );
+    CHECK( static_cast<int>(result.result()) == 15 );
+    CHECK( proc.remote().asyncPending() == 0 );
+
+    proc.remote().TerminateWorker();
+#endif
+}
+
+/*
+    Concurrent calls through worker pool, pool destroyed while calls are in progress
+*/
+TEST_CASE( "13. Remote worker pool" )
+{
+#ifdef COMPILER_MSVC
+    std::cout << "Remote worker pool test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( proc.Attach( GetCurrentProcessId() ) );
+
+    RemoteExecPool pool( proc );
+    REQUIRE_NT_SUCCESS( pool.Create( 2 ) );
+    CHECK( pool.size() == 2 );
+
+    RemoteFunction<decltype(&RemoteSum)> pSum( proc, reinterpret_cast<ptr_t>(&RemoteSum) );
+
+    std::atomic<int> failed{ 0 };
+    std::atomic<int> done{ 0 };
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back( [&, t]()
+        {
+            for (int i = 0; i < 32; i++)
+            {
+                auto result = pool.Call( pSum, t, i, 1 );
+                if (result.success() && result.result() == t + i + 1)
+                    done++;
+                else
+                    failed++;
+            }
+        } );
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK( failed == 0 );
+    CHECK( done == 4 * 32 );
+
+    // Callers get STATUS_NO_MORE_ENTRIES once workers are gone
+    threads.clear();
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back( [&, t]()
+        {
+            for (int i = 0;; i++)
+            {
+                auto result = pool.Call( pSum, t, i, 1 );
+                if (result.status == STATUS_NO_MORE_ENTRIES)
+                    break;
+
+                if (!result.success() || result.result() != t + i + 1)
+                    failed++;
+            }
+        } );
+    }
+
+    Sleep( 100 );
+    pool.Destroy();
+
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK( failed == 0 );
+    CHECK( pool.size() == 0 );
+#endif
+}
+
+/*
+    Calls through dispatcher parked in hijacked thread of ping.exe
+*/
+TEST_CASE( "14. Persistent hijack dispatcher" )
+{
+#ifdef COMPILER_MSVC
+    std::cout << "Persistent hijacked thread dispatcher test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( CreateTestProcess( proc ) );
+
+    auto pGetTid = proc.modules().GetExport( L"kernel32.dll", "GetCurrentThreadId" );
+    auto pConvert = proc.modules().GetNtdllExport( "RtlNtStatusToDosError" );
+    REQUIRE( pGetTid.success() );
+    REQUIRE( pConvert.success() );
+
+    REQUIRE_NT_SUCCESS( proc.remote().CreateRPCEnvironment( Worker_HijackPersistent, true ) );
+
+    auto thread = proc.remote().getExecThread();
+    REQUIRE( thread );
+
+    RemoteFunction<decltype(&GetCurrentThreadId)> pTid( proc, pGetTid->procAddress );
+    RemoteFunction<fnRtlNtStatusToDosError> pToDos( proc, pConvert->procAddress );
+
+    // First call installs dispatcher, the rest reuse it
+    for (int i = 0; i < 4; i++)
+    {
+        auto tid = pTid.Call( thread );
+        REQUIRE_NT_SUCCESS( tid.status );
+        CHECK( tid.result() == thread->id() );
+
+        auto error = pToDos.Call( STATUS_ACCESS_DENIED, thread );
+        REQUIRE_NT_SUCCESS( error.status );
+        CHECK( error.result() == ERROR_ACCESS_DENIED );
+    }
+
+    proc.remote().ReleaseDispatcher();
+    proc.remote().reset();
+    proc.Terminate();
+#endif
+}
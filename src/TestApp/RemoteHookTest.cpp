@@ -2,6 +2,45 @@
 #include "../BlackBone/Config.h"
 #include "Tests.h"
 
+#ifdef COMPILER_MSVC
+#include "../BlackBone/Process/RPC/RemoteFunction.hpp"
+
+#include <atomic>
+
+using fnEcho = uintptr_t( __stdcall* )(uintptr_t);
+
+/*
+    Write function returning its argument into target process.
+    Nops keep hook patch inside function
+*/
+call_result_t<MemBlock> WriteEchoFunction( Process& proc )
+{
+#ifdef USE64
+    // mov rax, rcx ... ret
+    const uint8_t prologue[] = { 0x48, 0x89, 0xC8 };
+    const uint8_t epilogue[] = { 0xC3 };
+#else
+    // mov eax, [esp + 4] ... ret 4
+    const uint8_t prologue[] = { 0x8B, 0x44, 0x24, 0x04 };
+    const uint8_t epilogue[] = { 0xC2, 0x04, 0x00 };
+#endif
+
+    std::vector<uint8_t> code( prologue, prologue + sizeof( prologue ) );
+    code.insert( code.end(), 32, 0x90 );
+    code.insert( code.end(), epilogue, epilogue + sizeof( epilogue ) );
+
+    auto mem = proc.memory().Allocate( 0x1000, PAGE_EXECUTE_READWRITE );
+    if (!mem)
+        return mem;
+
+    NTSTATUS status = mem->Write( 0, code.size(), code.data() );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    return mem;
+}
+#endif
+
 /*
     Prevent termination of current process in task manager.
 */
@@ -70,3 +109,109 @@ TEST_CASE( "07. Remote hooks" )
     }
 #endif
 }
+
+/*
+    Break only on calls with selected argument inside ping.exe
+*/
+TEST_CASE( "16. Filtered remote hook" )
+{
+#ifdef COMPILER_MSVC
+    struct HookClass
+    {
+        void HookFn( RemoteContext& context )
+        {
+            if (context.getArg( 0 ) == 0x1234)
+                hits++;
+            else
+                misses++;
+        }
+
+        std::atomic<int> hits{ 0 };
+        std::atomic<int> misses{ 0 };
+    };
+
+    std::wcout << L"Filtered remote hook test" << std::endl;
+
+    HookClass hclass;
+    Process proc;
+    REQUIRE_NT_SUCCESS( CreateTestProcess( proc ) );
+
+    auto echo = WriteEchoFunction( proc );
+    REQUIRE_NT_SUCCESS( echo.status );
+
+    auto address = echo->ptr();
+    RemoteFunction<fnEcho> pEcho( proc, address );
+
+    RemoteHook::HookFilter filter;
+    filter.conditions.push_back( { RemoteHook::HookFilter::arg, 0, RemoteHook::HookFilter::equal, 0x1234 } );
+
+    NTSTATUS status = proc.hooks().ApplyFiltered( address, filter, &HookClass::HookFn, hclass );
+    CHECK_NT_SUCCESS( status );
+    if (NT_SUCCESS( status ))
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            CHECK( pEcho.Call( 0x1234 ).result() == 0x1234 );
+            CHECK( pEcho.Call( 0x4321 ).result() == 0x4321 );
+        }
+
+        proc.hooks().Remove( address );
+
+        // Original code is back
+        CHECK( pEcho.Call( 0x1234 ).result() == 0x1234 );
+        CHECK( hclass.hits == 3 );
+        CHECK( hclass.misses == 0 );
+    }
+
+    proc.Terminate();
+#endif
+}
+
+/*
+    Log arguments of function called inside ping.exe
+*/
+TEST_CASE( "17. Remote logging hook" )
+{
+#ifdef COMPILER_MSVC
+    std::wcout << L"Remote logging hook test" << std::endl;
+
+    Process proc;
+    REQUIRE_NT_SUCCESS( CreateTestProcess( proc ) );
+
+    auto echo = WriteEchoFunction( proc );
+    REQUIRE_NT_SUCCESS( echo.status );
+
+    auto address = echo->ptr();
+    RemoteFunction<fnEcho> pEcho( proc, address );
+
+    CriticalSection lock;
+    std::vector<uint64_t> logged;
+
+    HookLogConfig config;
+    config.args = 1;
+    config.capacity = 0x100;
+
+    NTSTATUS status = proc.localHooks().SetLogHook( address, config, [&]( const HookLogBatch& batch )
+    {
+        CSLock lck( lock );
+        for (size_t i = 0; i < batch.count; i++)
+            logged.push_back( batch[i].data[0] );
+    } );
+
+    REQUIRE_NT_SUCCESS( status );
+
+    for (uintptr_t i = 1; i <= 16; i++)
+        CHECK( pEcho.Call( i ).result() == i );
+
+    // Remaining records are delivered before restore returns
+    CHECK_NT_SUCCESS( proc.localHooks().Restore() );
+    CHECK( pEcho.Call( 0x1234 ).result() == 0x1234 );
+
+    CSLock lck( lock );
+    REQUIRE( logged.size() == 16 );
+    for (size_t i = 0; i < logged.size(); i++)
+        CHECK( logged[i] == i + 1 );
+
+    proc.Terminate();
+#endif
+}
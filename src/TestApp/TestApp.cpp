@@ -71,6 +71,32 @@ TEST_CASE( "02. Invalid handle access" )
     CHECK( LastNtStatus() == STATUS_ACCESS_DENIED );
 }
 
+/*
+    Start ping.exe running long enough for remote tests, console output is discarded
+*/
+NTSTATUS CreateTestProcess( Process& proc )
+{
+    STARTUPINFOW si = { 0 };
+    si.cb = sizeof( si );
+    si.dwFlags = STARTF_USESTDHANDLES;
+
+    NTSTATUS status = proc.CreateAndAttach( L"C:\\windows\\system32\\ping.exe", false, true, L"ping.exe -n 600 127.0.0.1", nullptr, &si );
+    if (!NT_SUCCESS( status ))
+        return status;
+
+    // Wait for loader
+    for (int i = 0; i < 50 && !proc.modules().GetModule( L"kernel32.dll" ); i++)
+        Sleep( 100 );
+
+    if (!proc.modules().GetModule( L"kernel32.dll" ))
+    {
+        proc.Terminate();
+        return STATUS_NOT_FOUND;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 int main( int argc, char* argv[] )
 {
     Catch::Session session;
@@ -14,4 +14,5 @@ using namespace blackbone;
 #define REQUIRE_NT_SUCCESS(Status)  REQUIRE((NTSTATUS)(Status) >= 0)
 
 void TestMMap();
-void TestMMapFromMem();
\ No newline at end of file
+void TestMMapFromMem();
+NTSTATUS CreateTestProcess( Process& proc );
\ No newline at end of file